@@ -0,0 +1,75 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_BENCH_STUFF_H
+#define ESP8266_BLYNK_LIB_BENCH_STUFF_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BENCH_NS_PER_SEC                1000000000ULL
+#define BENCH_NS_PER_MS                 1000000ULL
+#define BENCH_NS_PER_USEC               1000ULL
+
+
+typedef struct {
+    uint64_t* values;
+    size_t count;
+    size_t capacity;
+} bench_samples_t;
+
+
+/**
+ * @brief Read the host monotonic clock.
+ *
+ * @return Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+uint64_t bench_now_ns(void);
+
+
+/**
+ * @brief Allocate storage for latency samples.
+ *
+ * Samples beyond the capacity are counted but not stored, so a report never
+ * reallocates on the measured path.
+ *
+ * @param samples Pointer to the samples structure to initialize.
+ * @param capacity Maximum number of samples that are kept.
+ */
+void bench_samples_init(bench_samples_t* samples, size_t capacity);
+
+
+/**
+ * @brief Record a single sample. Not thread-safe.
+ *
+ * @param samples Pointer to the samples structure.
+ * @param value Sample value, usually a latency in nanoseconds.
+ */
+void bench_samples_add(bench_samples_t* samples, uint64_t value);
+
+
+/**
+ * @brief Print p50/p99/p999/max of the recorded samples in microseconds.
+ *
+ * The samples are sorted in place.
+ *
+ * @param name Label printed in front of the statistics.
+ * @param samples Pointer to the samples structure.
+ */
+void bench_samples_report(const char* name, bench_samples_t* samples);
+
+
+/**
+ * @brief Release the storage of the samples structure.
+ *
+ * @param samples Pointer to the samples structure.
+ */
+void bench_samples_free(bench_samples_t* samples);
+
+#endif //ESP8266_BLYNK_LIB_BENCH_STUFF_H
@@ -0,0 +1,114 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_FAULT_PROXY_H
+#define ESP8266_BLYNK_LIB_FAULT_PROXY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct fault_proxy fault_proxy_t;
+typedef struct fault_proxy_stats fault_proxy_stats_t;
+typedef struct fault_proxy_config fault_proxy_config_t;
+
+
+struct fault_proxy_config {
+    uint16_t port;
+    uint16_t upstream_port;
+};
+
+
+struct fault_proxy_stats {
+    uint64_t accepted;
+    uint64_t resets;
+    uint64_t forwarded_bytes;
+    uint64_t dropped_bytes;
+};
+
+
+/**
+ * @brief Start an in-process TCP proxy on 127.0.0.1 that can degrade the link.
+ *
+ * Every accepted client gets its own connection to 127.0.0.1:upstream_port and
+ * bytes are relayed in both directions on the proxy thread. Faults are toggled
+ * at runtime with the setters below and apply to both directions.
+ *
+ * @param config Proxy configuration. A zero port picks a free one.
+ * @return Pointer to the running proxy, or NULL on failure.
+ */
+fault_proxy_t* fault_proxy_start(const fault_proxy_config_t* config);
+
+
+/**
+ * @brief Fill a "127.0.0.1:port" url suitable for update_server_url.
+ *
+ * @param proxy Pointer to the running proxy.
+ * @param url Output buffer.
+ * @param size Size of the output buffer.
+ */
+void fault_proxy_url(const fault_proxy_t* proxy, char* url, size_t size);
+
+
+/**
+ * @brief Hold every relayed chunk for a fixed time before forwarding it.
+ *
+ * @param proxy Pointer to the running proxy.
+ * @param latency_ms Added one-way latency, 0 disables it.
+ */
+void fault_proxy_set_latency(fault_proxy_t* proxy, uint32_t latency_ms);
+
+
+/**
+ * @brief Relay at most one byte per read and per write.
+ *
+ * Writes toward a peer are spaced about a millisecond apart, so the peer sees
+ * 1-byte reads. The proxy also shrinks its receive buffer, so a peer that
+ * writes faster than the relay drains gets short writes and EAGAIN.
+ *
+ * @param proxy Pointer to the running proxy.
+ * @param enabled Enable or disable partial transfers.
+ */
+void fault_proxy_set_partial(fault_proxy_t* proxy, bool enabled);
+
+
+/**
+ * @brief Silently discard everything in both directions while keeping connections open.
+ *
+ * @param proxy Pointer to the running proxy.
+ * @param enabled Enable or disable the blackhole.
+ */
+void fault_proxy_set_blackhole(fault_proxy_t* proxy, bool enabled);
+
+
+/**
+ * @brief Close every relayed connection with an RST on both sides.
+ *
+ * @param proxy Pointer to the running proxy.
+ */
+void fault_proxy_reset_connections(fault_proxy_t* proxy);
+
+
+/**
+ * @brief Take a consistent copy of the proxy counters.
+ *
+ * @param proxy Pointer to the running proxy.
+ * @param stats Output structure.
+ */
+void fault_proxy_get_stats(fault_proxy_t* proxy, fault_proxy_stats_t* stats);
+
+
+/**
+ * @brief Stop the proxy thread and release every resource.
+ *
+ * @param proxy Pointer to the running proxy.
+ */
+void fault_proxy_stop(fault_proxy_t* proxy);
+
+#endif //ESP8266_BLYNK_LIB_FAULT_PROXY_H
@@ -0,0 +1,134 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_MOCK_SERVER_H
+#define ESP8266_BLYNK_LIB_MOCK_SERVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+typedef struct mock_server mock_server_t;
+typedef struct mock_frame mock_frame_t;
+typedef struct mock_server_stats mock_server_stats_t;
+typedef struct mock_server_config mock_server_config_t;
+
+typedef void (* mock_frame_callback_t)(const mock_frame_t* frame, void* data);
+
+
+struct mock_frame {
+    int connection;
+    uint8_t command;
+    uint16_t id;
+    uint16_t length;
+    const uint8_t* payload;
+    uint64_t received_ns;
+};
+
+
+struct mock_server_config {
+    uint16_t port;
+    mock_frame_callback_t on_frame;
+    void* data;
+    uint32_t quota;
+};
+
+
+struct mock_server_stats {
+    uint64_t frames;
+    uint64_t bytes;
+    uint64_t reads;
+    uint64_t logins;
+    uint64_t pings;
+    uint64_t accepted;
+    uint64_t active;
+    uint64_t quota_exceeded;
+};
+
+
+/**
+ * @brief Start an in-process fake Blynk cloud on 127.0.0.1.
+ *
+ * The server runs on its own thread. It decodes the 5-byte Blynk header
+ * (command, id, length) written by compose_blynk_header, answers every
+ * BLYNK_CMD_LOGIN and BLYNK_CMD_PING with a BLYNK_CMD_RESPONSE carrying
+ * BLYNK_STATUS_SUCCESS and reports every decoded frame to the configured
+ * callback. The callback runs on the server thread.
+ *
+ * A non-zero quota polices every connection like the cloud message quota: up to
+ * quota messages per second, with bursts of up to one second worth of messages.
+ * Logins, pings and responses are free. A message over the quota is answered with
+ * BLYNK_STATUS_QUOTA_LIMIT_EXCEPTION and counted in quota_exceeded.
+ *
+ * @param config Server configuration. A zero port picks a free one.
+ * @return Pointer to the running server, or NULL on failure.
+ */
+mock_server_t* mock_server_start(const mock_server_config_t* config);
+
+
+/**
+ * @brief Get the port the server is listening on.
+ *
+ * @param server Pointer to the running server.
+ * @return TCP port in host byte order.
+ */
+uint16_t mock_server_port(const mock_server_t* server);
+
+
+/**
+ * @brief Fill a "127.0.0.1:port" url suitable for update_server_url.
+ *
+ * @param server Pointer to the running server.
+ * @param url Output buffer.
+ * @param size Size of the output buffer.
+ */
+void mock_server_url(const mock_server_t* server, char* url, size_t size);
+
+
+/**
+ * @brief Send a raw frame to one of the connected clients.
+ *
+ * @param server Pointer to the running server.
+ * @param connection Connection identifier from mock_frame_t.
+ * @param command Blynk command of the frame.
+ * @param id Message id of the frame.
+ * @param payload Payload bytes, may be NULL when length is a response status.
+ * @param length Payload length, or the status for BLYNK_CMD_RESPONSE.
+ * @return true if the whole frame was written.
+ */
+bool mock_server_send(mock_server_t* server, int connection, uint8_t command, uint16_t id,
+                      const uint8_t* payload, uint16_t length);
+
+
+/**
+ * @brief Close every accepted connection at once.
+ *
+ * @param server Pointer to the running server.
+ * @param reset Close with SO_LINGER 0 so the peers receive an RST instead of a FIN.
+ */
+void mock_server_drop_connections(mock_server_t* server, bool reset);
+
+
+/**
+ * @brief Take a consistent copy of the server counters.
+ *
+ * @param server Pointer to the running server.
+ * @param stats Output structure.
+ */
+void mock_server_get_stats(mock_server_t* server, mock_server_stats_t* stats);
+
+
+/**
+ * @brief Stop the server thread and release every resource.
+ *
+ * @param server Pointer to the running server.
+ */
+void mock_server_stop(mock_server_t* server);
+
+#endif //ESP8266_BLYNK_LIB_MOCK_SERVER_H
@@ -0,0 +1,102 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <time.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "bench_stuff.h"
+
+
+static int compare_samples(const void* lhs, const void* rhs);
+
+static uint64_t percentile(const bench_samples_t* samples, double fraction);
+
+
+uint64_t
+bench_now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * BENCH_NS_PER_SEC + (uint64_t) now.tv_nsec;
+}
+
+
+void
+bench_samples_init(bench_samples_t* samples, size_t capacity) {
+    samples->values = calloc(capacity, sizeof(uint64_t));
+    samples->capacity = samples->values ? capacity : 0;
+    samples->count = 0;
+}
+
+
+void
+bench_samples_add(bench_samples_t* samples, uint64_t value) {
+    if (samples->count < samples->capacity) {
+        samples->values[samples->count] = value;
+    }
+    samples->count++;
+}
+
+
+void
+bench_samples_report(const char* name, bench_samples_t* samples) {
+    size_t stored = samples->count < samples->capacity ? samples->count : samples->capacity;
+
+    if (!stored) {
+        printf("  %-28s no samples\n", name);
+        return;
+    }
+
+    qsort(samples->values, stored, sizeof(uint64_t), compare_samples);
+
+    printf("  %-28s n=%-8zu p50=%9.1fus p99=%9.1fus p999=%9.1fus max=%9.1fus\n", name, samples->count,
+           (double) percentile(samples, 0.50) / BENCH_NS_PER_USEC,
+           (double) percentile(samples, 0.99) / BENCH_NS_PER_USEC,
+           (double) percentile(samples, 0.999) / BENCH_NS_PER_USEC,
+           (double) samples->values[stored - 1] / BENCH_NS_PER_USEC);
+}
+
+
+void
+bench_samples_free(bench_samples_t* samples) {
+    free(samples->values);
+    memset(samples, 0, sizeof(bench_samples_t));
+}
+
+
+static int
+compare_samples(const void* lhs, const void* rhs) {
+    uint64_t a = *(const uint64_t*) lhs;
+    uint64_t b = *(const uint64_t*) rhs;
+    return (a > b) - (a < b);
+}
+
+
+static uint64_t
+percentile(const bench_samples_t* samples, double fraction) {
+    size_t stored = samples->count < samples->capacity ? samples->count : samples->capacity;
+    size_t index = (size_t) (fraction * (double) (stored - 1) + 0.5);
+    return samples->values[index];
+}
@@ -0,0 +1,517 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "bench_stuff.h"
+#include "fault_proxy.h"
+
+#define LISTEN_BACKLOG                  64
+#define READ_CHUNK_SIZE                 16384
+#define INITIAL_BUFFER_SIZE             1024
+#define INITIAL_SEGMENTS                16
+#define PARTIAL_INTERVAL_MS             1
+#define PARTIAL_RECEIVE_BUFFER          1
+#define CLIENT_SIDE                     0
+#define UPSTREAM_SIDE                   1
+#define LINK_SIDES                      2
+
+
+typedef struct {
+    uint64_t release_ns;
+    size_t length;
+} fault_segment_t;
+
+
+// Bytes read from one side and not yet written to the other, released segment by segment
+typedef struct {
+    uint8_t* buffer;
+    size_t head;
+    size_t size;
+    size_t capacity;
+    fault_segment_t* segments;
+    size_t segment_count;
+    size_t segment_capacity;
+    bool blocked;
+} fault_direction_t;
+
+
+typedef struct {
+    int fds[LINK_SIDES];
+    fault_direction_t directions[LINK_SIDES];
+} fault_link_t;
+
+
+struct fault_proxy {
+    int listener;
+    int wake_pipe[2];
+    uint16_t port;
+    uint16_t upstream_port;
+    pthread_t thread;
+    pthread_mutex_t mtx;
+
+    fault_link_t* links;
+    size_t link_count;
+    size_t link_capacity;
+
+    bool running;
+    bool reset_requested;
+    bool partial;
+    bool blackhole;
+    uint32_t latency_ms;
+
+    fault_proxy_stats_t stats;
+};
+
+
+static void* proxy_loop(void* arg);
+
+static void wake_proxy(fault_proxy_t* proxy);
+
+static void accept_links(fault_proxy_t* proxy, bool partial);
+
+static void close_link(fault_proxy_t* proxy, size_t index, bool reset);
+
+static void set_receive_buffer(int fd, bool partial);
+
+static bool read_side(fault_proxy_t* proxy, fault_link_t* link, int side, bool partial, bool blackhole,
+                      uint64_t release_ns);
+
+static bool flush_direction(fault_proxy_t* proxy, fault_direction_t* direction, int fd, bool partial, uint64_t now,
+                            int* timeout_ms);
+
+static bool append_segment(fault_direction_t* direction, const uint8_t* data, size_t length, uint64_t release_ns);
+
+
+fault_proxy_t*
+fault_proxy_start(const fault_proxy_config_t* config) {
+    fault_proxy_t* proxy = calloc(1, sizeof(fault_proxy_t));
+    if (!proxy) return NULL;
+
+    proxy->upstream_port = config->upstream_port;
+    pthread_mutex_init(&proxy->mtx, NULL);
+
+    proxy->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (proxy->listener < 0 || pipe(proxy->wake_pipe) < 0) goto fail;
+
+    int reuse = 1;
+    setsockopt(proxy->listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(config->port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+
+    if (bind(proxy->listener, (struct sockaddr*) &addr, len) < 0) goto fail;
+    if (listen(proxy->listener, LISTEN_BACKLOG) < 0) goto fail;
+    if (getsockname(proxy->listener, (struct sockaddr*) &addr, &len) < 0) goto fail;
+
+    proxy->port = ntohs(addr.sin_port);
+    fcntl(proxy->listener, F_SETFL, fcntl(proxy->listener, F_GETFL) | O_NONBLOCK);
+
+    proxy->running = true;
+    if (pthread_create(&proxy->thread, NULL, proxy_loop, proxy) != 0) goto fail;
+
+    return proxy;
+
+fail:
+    perror("fault_proxy_start");
+    if (proxy->listener >= 0) close(proxy->listener);
+    free(proxy);
+    return NULL;
+}
+
+
+void
+fault_proxy_url(const fault_proxy_t* proxy, char* url, size_t size) {
+    snprintf(url, size, "127.0.0.1:%u", proxy->port);
+}
+
+
+void
+fault_proxy_set_latency(fault_proxy_t* proxy, uint32_t latency_ms) {
+    pthread_mutex_lock(&proxy->mtx);
+    proxy->latency_ms = latency_ms;
+    pthread_mutex_unlock(&proxy->mtx);
+    wake_proxy(proxy);
+}
+
+
+void
+fault_proxy_set_partial(fault_proxy_t* proxy, bool enabled) {
+    pthread_mutex_lock(&proxy->mtx);
+    proxy->partial = enabled;
+    pthread_mutex_unlock(&proxy->mtx);
+    wake_proxy(proxy);
+}
+
+
+void
+fault_proxy_set_blackhole(fault_proxy_t* proxy, bool enabled) {
+    pthread_mutex_lock(&proxy->mtx);
+    proxy->blackhole = enabled;
+    pthread_mutex_unlock(&proxy->mtx);
+    wake_proxy(proxy);
+}
+
+
+void
+fault_proxy_reset_connections(fault_proxy_t* proxy) {
+    pthread_mutex_lock(&proxy->mtx);
+    proxy->reset_requested = true;
+    pthread_mutex_unlock(&proxy->mtx);
+    wake_proxy(proxy);
+}
+
+
+void
+fault_proxy_get_stats(fault_proxy_t* proxy, fault_proxy_stats_t* stats) {
+    pthread_mutex_lock(&proxy->mtx);
+    *stats = proxy->stats;
+    pthread_mutex_unlock(&proxy->mtx);
+}
+
+
+void
+fault_proxy_stop(fault_proxy_t* proxy) {
+    pthread_mutex_lock(&proxy->mtx);
+    proxy->running = false;
+    pthread_mutex_unlock(&proxy->mtx);
+
+    wake_proxy(proxy);
+    pthread_join(proxy->thread, NULL);
+
+    while (proxy->link_count) {
+        close_link(proxy, proxy->link_count - 1, false);
+    }
+
+    free(proxy->links);
+    close(proxy->listener);
+    close(proxy->wake_pipe[0]);
+    close(proxy->wake_pipe[1]);
+    pthread_mutex_destroy(&proxy->mtx);
+    free(proxy);
+}
+
+
+static void
+wake_proxy(fault_proxy_t* proxy) {
+    uint8_t wake = 0;
+    if (write(proxy->wake_pipe[1], &wake, sizeof(wake)) < 0) perror("fault proxy wake");
+}
+
+
+static void*
+proxy_loop(void* arg) {
+    fault_proxy_t* proxy = arg;
+    struct pollfd* fds = NULL;
+    size_t fds_capacity = 0;
+    bool partial_applied = false;
+
+    while (true) {
+        pthread_mutex_lock(&proxy->mtx);
+        bool running = proxy->running;
+        bool reset = proxy->reset_requested;
+        bool partial = proxy->partial;
+        bool blackhole = proxy->blackhole;
+        uint64_t latency_ns = (uint64_t) proxy->latency_ms * BENCH_NS_PER_MS;
+        proxy->reset_requested = false;
+        pthread_mutex_unlock(&proxy->mtx);
+
+        if (!running) break;
+
+        if (reset) {
+            while (proxy->link_count) {
+                close_link(proxy, proxy->link_count - 1, true);
+            }
+        }
+
+        if (partial != partial_applied) {
+            for (size_t i = 0; i < proxy->link_count; ++i) {
+                set_receive_buffer(proxy->links[i].fds[CLIENT_SIDE], partial);
+            }
+            partial_applied = partial;
+        }
+
+        // Write out everything whose release time has come, then sleep until the next release
+        int timeout_ms = -1;
+        uint64_t now = bench_now_ns();
+
+        for (size_t i = proxy->link_count; i-- > 0;) {
+            fault_link_t* link = &proxy->links[i];
+            for (int side = 0; side < LINK_SIDES; ++side) {
+                if (!flush_direction(proxy, &link->directions[side], link->fds[!side], partial, now, &timeout_ms)) {
+                    close_link(proxy, i, false);
+                    break;
+                }
+            }
+        }
+
+        size_t count = proxy->link_count * LINK_SIDES + 2;
+        if (count > fds_capacity) {
+            fds_capacity = count * 2;
+            fds = realloc(fds, fds_capacity * sizeof(struct pollfd));
+        }
+
+        fds[0] = (struct pollfd) {.fd = proxy->wake_pipe[0], .events = POLLIN};
+        fds[1] = (struct pollfd) {.fd = proxy->listener, .events = POLLIN};
+        for (size_t i = 0; i < proxy->link_count; ++i) {
+            for (int side = 0; side < LINK_SIDES; ++side) {
+                short events = POLLIN;
+                if (proxy->links[i].directions[!side].blocked) events |= POLLOUT;
+                fds[2 + i * LINK_SIDES + side] = (struct pollfd) {.fd = proxy->links[i].fds[side], .events = events};
+            }
+        }
+
+        if (poll(fds, count, timeout_ms) < 0) {
+            if (errno == EINTR) continue;
+            perror("fault proxy poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint8_t drain[64];
+            if (read(proxy->wake_pipe[0], drain, sizeof(drain)) < 0) perror("fault proxy wake");
+        }
+
+        // Walk backwards, close_link swaps the last link into the freed slot
+        uint64_t release_ns = bench_now_ns() + latency_ns;
+        for (size_t i = proxy->link_count; i-- > 0;) {
+            for (int side = 0; side < LINK_SIDES; ++side) {
+                const struct pollfd* polled = &fds[2 + i * LINK_SIDES + side];
+                if (!(polled->revents & (POLLIN | POLLHUP | POLLERR))) continue;
+
+                if (!read_side(proxy, &proxy->links[i], side, partial, blackhole, release_ns)) {
+                    close_link(proxy, i, false);
+                    break;
+                }
+            }
+        }
+
+        if (fds[1].revents & POLLIN) accept_links(proxy, partial);
+    }
+
+    free(fds);
+    return NULL;
+}
+
+
+static void
+accept_links(fault_proxy_t* proxy, bool partial) {
+    while (true) {
+        int client = accept(proxy->listener, NULL, NULL);
+        if (client < 0) return;
+
+        int upstream = socket(AF_INET, SOCK_STREAM, 0);
+        struct sockaddr_in addr = {
+                .sin_family = AF_INET,
+                .sin_port = htons(proxy->upstream_port),
+                .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+        };
+
+        if (upstream < 0 || connect(upstream, (struct sockaddr*) &addr, sizeof(addr)) < 0) {
+            perror("fault proxy upstream");
+            if (upstream >= 0) close(upstream);
+            close(client);
+            continue;
+        }
+
+        if (proxy->link_count == proxy->link_capacity) {
+            size_t capacity = proxy->link_capacity ? proxy->link_capacity * 2 : 16;
+            fault_link_t* links = realloc(proxy->links, capacity * sizeof(fault_link_t));
+            if (!links) {
+                close(client);
+                close(upstream);
+                return;
+            }
+            proxy->links = links;
+            proxy->link_capacity = capacity;
+        }
+
+        fault_link_t* link = &proxy->links[proxy->link_count++];
+        memset(link, 0, sizeof(fault_link_t));
+        link->fds[CLIENT_SIDE] = client;
+        link->fds[UPSTREAM_SIDE] = upstream;
+
+        for (int side = 0; side < LINK_SIDES; ++side) {
+            int nodelay = 1;
+            setsockopt(link->fds[side], IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+            fcntl(link->fds[side], F_SETFL, fcntl(link->fds[side], F_GETFL) | O_NONBLOCK);
+        }
+        if (partial) set_receive_buffer(client, true);
+
+        pthread_mutex_lock(&proxy->mtx);
+        proxy->stats.accepted++;
+        pthread_mutex_unlock(&proxy->mtx);
+    }
+}
+
+
+static void
+close_link(fault_proxy_t* proxy, size_t index, bool reset) {
+    fault_link_t* link = &proxy->links[index];
+
+    for (int side = 0; side < LINK_SIDES; ++side) {
+        if (reset) {
+            struct linger linger = {.l_onoff = 1, .l_linger = 0};
+            setsockopt(link->fds[side], SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+        }
+        close(link->fds[side]);
+        free(link->directions[side].buffer);
+        free(link->directions[side].segments);
+    }
+
+    proxy->links[index] = proxy->links[--proxy->link_count];
+
+    pthread_mutex_lock(&proxy->mtx);
+    proxy->stats.resets += reset;
+    pthread_mutex_unlock(&proxy->mtx);
+}
+
+
+static void
+set_receive_buffer(int fd, bool partial) {
+    // The kernel rounds the size up to its minimum, which is still small enough to push back on the peer
+    int size = partial ? PARTIAL_RECEIVE_BUFFER : READ_CHUNK_SIZE * 8;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+}
+
+
+static bool
+read_side(fault_proxy_t* proxy, fault_link_t* link, int side, bool partial, bool blackhole, uint64_t release_ns) {
+    uint8_t chunk[READ_CHUNK_SIZE];
+    ssize_t length = read(link->fds[side], chunk, partial ? 1 : sizeof(chunk));
+
+    if (length == 0) return false;
+    if (length < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+    if (blackhole) {
+        pthread_mutex_lock(&proxy->mtx);
+        proxy->stats.dropped_bytes += length;
+        pthread_mutex_unlock(&proxy->mtx);
+        return true;
+    }
+
+    return append_segment(&link->directions[side], chunk, length, release_ns);
+}
+
+
+static bool
+flush_direction(fault_proxy_t* proxy, fault_direction_t* direction, int fd, bool partial, uint64_t now,
+                int* timeout_ms) {
+    direction->blocked = false;
+
+    while (direction->segment_count) {
+        fault_segment_t* segment = &direction->segments[0];
+
+        if (segment->release_ns > now) {
+            int wait_ms = (int) ((segment->release_ns - now + BENCH_NS_PER_MS - 1) / BENCH_NS_PER_MS);
+            if (*timeout_ms < 0 || wait_ms < *timeout_ms) *timeout_ms = wait_ms;
+            return true;
+        }
+
+        ssize_t length = send(fd, direction->buffer + direction->head, partial ? 1 : segment->length, MSG_NOSIGNAL);
+        if (length < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return false;
+            direction->blocked = true;
+            return true;
+        }
+
+        direction->head += length;
+        segment->length -= length;
+
+        pthread_mutex_lock(&proxy->mtx);
+        proxy->stats.forwarded_bytes += length;
+        pthread_mutex_unlock(&proxy->mtx);
+
+        if (!segment->length) {
+            memmove(direction->segments, direction->segments + 1,
+                    --direction->segment_count * sizeof(fault_segment_t));
+        }
+
+        if (partial) {
+            if (direction->segment_count && (*timeout_ms < 0 || *timeout_ms > PARTIAL_INTERVAL_MS)) {
+                *timeout_ms = PARTIAL_INTERVAL_MS;
+            }
+            return true;
+        }
+    }
+
+    direction->head = direction->size = 0;
+    return true;
+}
+
+
+static bool
+append_segment(fault_direction_t* direction, const uint8_t* data, size_t length, uint64_t release_ns) {
+    if (direction->head && direction->head == direction->size) direction->head = direction->size = 0;
+
+    if (direction->capacity - direction->size < length) {
+        if (direction->head) {
+            memmove(direction->buffer, direction->buffer + direction->head, direction->size - direction->head);
+            direction->size -= direction->head;
+            direction->head = 0;
+        }
+
+        if (direction->capacity - direction->size < length) {
+            size_t capacity = direction->capacity ? direction->capacity : INITIAL_BUFFER_SIZE;
+            while (capacity - direction->size < length) capacity *= 2;
+
+            uint8_t* buffer = realloc(direction->buffer, capacity);
+            if (!buffer) return false;
+            direction->buffer = buffer;
+            direction->capacity = capacity;
+        }
+    }
+
+    if (direction->segment_count == direction->segment_capacity) {
+        size_t capacity = direction->segment_capacity ? direction->segment_capacity * 2 : INITIAL_SEGMENTS;
+        fault_segment_t* segments = realloc(direction->segments, capacity * sizeof(fault_segment_t));
+        if (!segments) return false;
+        direction->segments = segments;
+        direction->segment_capacity = capacity;
+    }
+
+    memcpy(direction->buffer + direction->size, data, length);
+    direction->size += length;
+    direction->segments[direction->segment_count++] = (fault_segment_t) {
+            .release_ns = release_ns,
+            .length = length,
+    };
+
+    return true;
+}
@@ -0,0 +1,430 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <poll.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#include "bench_stuff.h"
+#include "mock_server.h"
+#include "stuff/defines.h"
+#include "stuff/status_codes.h"
+
+#define INITIAL_BUFFER_SIZE             1024
+#define LISTEN_BACKLOG                  4096
+#define READ_CHUNK_SIZE                 16384
+
+
+typedef struct {
+    int fd;
+    uint8_t* buffer;
+    size_t size;
+    size_t capacity;
+    double allowance;
+    uint64_t allowance_ns;
+} mock_connection_t;
+
+
+struct mock_server {
+    int listener;
+    int wake_pipe[2];
+    uint16_t port;
+    pthread_t thread;
+    pthread_mutex_t mtx;
+    mock_server_config_t config;
+
+    mock_connection_t* connections;
+    size_t connection_count;
+    size_t connection_capacity;
+
+    bool running;
+    bool drop_requested;
+    bool drop_with_reset;
+
+    mock_server_stats_t stats;
+};
+
+
+static void* server_loop(void* arg);
+
+static void accept_connections(mock_server_t* server);
+
+static void close_connection(mock_server_t* server, size_t index, bool reset);
+
+static bool read_connection(mock_server_t* server, mock_connection_t* connection);
+
+static void decode_frames(mock_server_t* server, mock_connection_t* connection);
+
+static bool within_quota(mock_server_t* server, mock_connection_t* connection, const mock_frame_t* frame);
+
+static bool write_all(int fd, const uint8_t* data, size_t size);
+
+
+mock_server_t*
+mock_server_start(const mock_server_config_t* config) {
+    mock_server_t* server = calloc(1, sizeof(mock_server_t));
+    if (!server) return NULL;
+
+    server->config = *config;
+    pthread_mutex_init(&server->mtx, NULL);
+
+    server->listener = socket(AF_INET, SOCK_STREAM, 0);
+    if (server->listener < 0 || pipe(server->wake_pipe) < 0) goto fail;
+
+    int reuse = 1;
+    setsockopt(server->listener, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+    struct sockaddr_in addr = {
+            .sin_family = AF_INET,
+            .sin_port = htons(config->port),
+            .sin_addr.s_addr = htonl(INADDR_LOOPBACK),
+    };
+    socklen_t len = sizeof(addr);
+
+    if (bind(server->listener, (struct sockaddr*) &addr, len) < 0) goto fail;
+    if (listen(server->listener, LISTEN_BACKLOG) < 0) goto fail;
+    if (getsockname(server->listener, (struct sockaddr*) &addr, &len) < 0) goto fail;
+
+    server->port = ntohs(addr.sin_port);
+    fcntl(server->listener, F_SETFL, fcntl(server->listener, F_GETFL) | O_NONBLOCK);
+
+    server->running = true;
+    if (pthread_create(&server->thread, NULL, server_loop, server) != 0) goto fail;
+
+    return server;
+
+fail:
+    perror("mock_server_start");
+    if (server->listener >= 0) close(server->listener);
+    free(server);
+    return NULL;
+}
+
+
+uint16_t
+mock_server_port(const mock_server_t* server) {
+    return server->port;
+}
+
+
+void
+mock_server_url(const mock_server_t* server, char* url, size_t size) {
+    snprintf(url, size, "127.0.0.1:%u", server->port);
+}
+
+
+bool
+mock_server_send(mock_server_t* server, int connection, uint8_t command, uint16_t id,
+                 const uint8_t* payload, uint16_t length) {
+    uint8_t header[BLYNK_HEADER_SIZE] = {
+            command, id >> BYTE_SIZE, id & BYTE_MASK, length >> BYTE_SIZE, length & BYTE_MASK,
+    };
+
+    pthread_mutex_lock(&server->mtx);
+    bool sent = write_all(connection, header, sizeof(header));
+    if (sent && payload && length && command != BLYNK_CMD_RESPONSE) {
+        sent = write_all(connection, payload, length);
+    }
+    pthread_mutex_unlock(&server->mtx);
+
+    return sent;
+}
+
+
+void
+mock_server_drop_connections(mock_server_t* server, bool reset) {
+    pthread_mutex_lock(&server->mtx);
+    server->drop_requested = true;
+    server->drop_with_reset = reset;
+    pthread_mutex_unlock(&server->mtx);
+
+    uint8_t wake = 0;
+    if (write(server->wake_pipe[1], &wake, sizeof(wake)) < 0) perror("mock_server_drop_connections");
+}
+
+
+void
+mock_server_get_stats(mock_server_t* server, mock_server_stats_t* stats) {
+    pthread_mutex_lock(&server->mtx);
+    *stats = server->stats;
+    pthread_mutex_unlock(&server->mtx);
+}
+
+
+void
+mock_server_stop(mock_server_t* server) {
+    pthread_mutex_lock(&server->mtx);
+    server->running = false;
+    pthread_mutex_unlock(&server->mtx);
+
+    uint8_t wake = 0;
+    if (write(server->wake_pipe[1], &wake, sizeof(wake)) < 0) perror("mock_server_stop");
+    pthread_join(server->thread, NULL);
+
+    while (server->connection_count) {
+        close_connection(server, server->connection_count - 1, false);
+    }
+
+    free(server->connections);
+    close(server->listener);
+    close(server->wake_pipe[0]);
+    close(server->wake_pipe[1]);
+    pthread_mutex_destroy(&server->mtx);
+    free(server);
+}
+
+
+static void*
+server_loop(void* arg) {
+    mock_server_t* server = arg;
+    struct pollfd* fds = NULL;
+    size_t fds_capacity = 0;
+
+    while (true) {
+        pthread_mutex_lock(&server->mtx);
+        bool running = server->running;
+        bool drop = server->drop_requested;
+        bool reset = server->drop_with_reset;
+        server->drop_requested = false;
+        pthread_mutex_unlock(&server->mtx);
+
+        if (!running) break;
+
+        if (drop) {
+            while (server->connection_count) {
+                close_connection(server, server->connection_count - 1, reset);
+            }
+        }
+
+        size_t count = server->connection_count + 2;
+        if (count > fds_capacity) {
+            fds_capacity = count * 2;
+            fds = realloc(fds, fds_capacity * sizeof(struct pollfd));
+        }
+
+        fds[0] = (struct pollfd) {.fd = server->wake_pipe[0], .events = POLLIN};
+        fds[1] = (struct pollfd) {.fd = server->listener, .events = POLLIN};
+        for (size_t i = 0; i < server->connection_count; ++i) {
+            fds[i + 2] = (struct pollfd) {.fd = server->connections[i].fd, .events = POLLIN};
+        }
+
+        if (poll(fds, count, -1) < 0) {
+            if (errno == EINTR) continue;
+            perror("mock server poll");
+            break;
+        }
+
+        if (fds[0].revents & POLLIN) {
+            uint8_t drain[64];
+            if (read(server->wake_pipe[0], drain, sizeof(drain)) < 0) perror("mock server wake");
+        }
+
+        // Walk backwards, close_connection swaps the last connection into the freed slot
+        for (size_t i = count - 2; i-- > 0;) {
+            if (!fds[i + 2].revents) continue;
+            if (i >= server->connection_count || server->connections[i].fd != fds[i + 2].fd) continue;
+
+            if (!read_connection(server, &server->connections[i])) {
+                close_connection(server, i, false);
+            }
+        }
+
+        if (fds[1].revents & POLLIN) accept_connections(server);
+    }
+
+    free(fds);
+    return NULL;
+}
+
+
+static void
+accept_connections(mock_server_t* server) {
+    while (true) {
+        int fd = accept(server->listener, NULL, NULL);
+        if (fd < 0) return;
+
+        int nodelay = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        if (server->connection_count == server->connection_capacity) {
+            size_t capacity = server->connection_capacity ? server->connection_capacity * 2 : 16;
+            mock_connection_t* connections = realloc(server->connections, capacity * sizeof(mock_connection_t));
+            if (!connections) {
+                close(fd);
+                return;
+            }
+            server->connections = connections;
+            server->connection_capacity = capacity;
+        }
+
+        mock_connection_t* connection = &server->connections[server->connection_count++];
+        connection->fd = fd;
+        connection->size = 0;
+        connection->capacity = INITIAL_BUFFER_SIZE;
+        connection->buffer = malloc(INITIAL_BUFFER_SIZE);
+        connection->allowance = server->config.quota;
+        connection->allowance_ns = bench_now_ns();
+
+        pthread_mutex_lock(&server->mtx);
+        server->stats.accepted++;
+        server->stats.active = server->connection_count;
+        pthread_mutex_unlock(&server->mtx);
+    }
+}
+
+
+static void
+close_connection(mock_server_t* server, size_t index, bool reset) {
+    mock_connection_t* connection = &server->connections[index];
+
+    if (reset) {
+        struct linger linger = {.l_onoff = 1, .l_linger = 0};
+        setsockopt(connection->fd, SOL_SOCKET, SO_LINGER, &linger, sizeof(linger));
+    }
+
+    pthread_mutex_lock(&server->mtx);
+    close(connection->fd);
+    free(connection->buffer);
+    server->connections[index] = server->connections[--server->connection_count];
+    server->stats.active = server->connection_count;
+    pthread_mutex_unlock(&server->mtx);
+}
+
+
+static bool
+read_connection(mock_server_t* server, mock_connection_t* connection) {
+    while (true) {
+        if (connection->capacity - connection->size < READ_CHUNK_SIZE) {
+            size_t capacity = connection->size + READ_CHUNK_SIZE;
+            uint8_t* buffer = realloc(connection->buffer, capacity);
+            if (!buffer) return false;
+            connection->buffer = buffer;
+            connection->capacity = capacity;
+        }
+
+        ssize_t length = read(connection->fd, connection->buffer + connection->size,
+                              connection->capacity - connection->size);
+
+        if (length == 0) return false;
+        if (length < 0) return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+
+        connection->size += length;
+
+        pthread_mutex_lock(&server->mtx);
+        server->stats.bytes += length;
+        server->stats.reads++;
+        pthread_mutex_unlock(&server->mtx);
+
+        decode_frames(server, connection);
+    }
+}
+
+
+static void
+decode_frames(mock_server_t* server, mock_connection_t* connection) {
+    size_t offset = 0;
+    uint64_t now = bench_now_ns();
+
+    while (connection->size - offset >= BLYNK_HEADER_SIZE) {
+        const uint8_t* header = connection->buffer + offset;
+        mock_frame_t frame = {
+                .connection = connection->fd,
+                .command = header[0],
+                .id = (uint16_t) (header[1] << BYTE_SIZE | header[2]),
+                .length = (uint16_t) (header[3] << BYTE_SIZE | header[4]),
+                .payload = NULL,
+                .received_ns = now,
+        };
+
+        size_t payload_size = frame.command == BLYNK_CMD_RESPONSE ? 0 : frame.length;
+        if (connection->size - offset < BLYNK_HEADER_SIZE + payload_size) break;
+
+        if (payload_size) frame.payload = header + BLYNK_HEADER_SIZE;
+        offset += BLYNK_HEADER_SIZE + payload_size;
+
+        pthread_mutex_lock(&server->mtx);
+        server->stats.frames++;
+        server->stats.logins += frame.command == BLYNK_CMD_LOGIN;
+        server->stats.pings += frame.command == BLYNK_CMD_PING;
+        pthread_mutex_unlock(&server->mtx);
+
+        if (frame.command == BLYNK_CMD_LOGIN || frame.command == BLYNK_CMD_PING) {
+            mock_server_send(server, connection->fd, BLYNK_CMD_RESPONSE, frame.id, NULL, BLYNK_STATUS_SUCCESS);
+        } else if (!within_quota(server, connection, &frame)) {
+            mock_server_send(server, connection->fd, BLYNK_CMD_RESPONSE, frame.id, NULL,
+                             BLYNK_STATUS_QUOTA_LIMIT_EXCEPTION);
+        }
+
+        if (server->config.on_frame) server->config.on_frame(&frame, server->config.data);
+    }
+
+    memmove(connection->buffer, connection->buffer + offset, connection->size - offset);
+    connection->size -= offset;
+}
+
+
+static bool
+within_quota(mock_server_t* server, mock_connection_t* connection, const mock_frame_t* frame) {
+    if (!server->config.quota || frame->command == BLYNK_CMD_RESPONSE) return true;
+
+    double earned = (double) (frame->received_ns - connection->allowance_ns) / BENCH_NS_PER_SEC * server->config.quota;
+    connection->allowance += earned;
+    if (connection->allowance > server->config.quota) connection->allowance = server->config.quota;
+    connection->allowance_ns = frame->received_ns;
+
+    if (connection->allowance >= 1) {
+        connection->allowance -= 1;
+        return true;
+    }
+
+    pthread_mutex_lock(&server->mtx);
+    server->stats.quota_exceeded++;
+    pthread_mutex_unlock(&server->mtx);
+    return false;
+}
+
+
+static bool
+write_all(int fd, const uint8_t* data, size_t size) {
+    while (size) {
+        ssize_t length = send(fd, data, size, MSG_NOSIGNAL);
+        if (length < 0) {
+            if (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) continue;
+            return false;
+        }
+        data += length;
+        size -= length;
+    }
+    return true;
+}
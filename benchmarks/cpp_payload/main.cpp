@@ -0,0 +1,130 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include "blynk.hpp"
+
+extern "C" {
+#include "bench_stuff.h"
+#include "internal/dispatching.h"
+}
+
+#define BATCH                           1024
+#define MIN_RUN_NS                      (200 * BENCH_NS_PER_MS)
+
+
+static volatile uint16_t sink;
+static char long_text[BLYNK_MAX_PAYLOAD_LEN + 64];
+
+
+static uint16_t
+serialize(char* payload, const char* fmt, ...) {
+    uint16_t len = 0;
+    va_list ap;
+    va_start(ap, fmt);
+    construct_payload(payload, &len, BLYNK_MAX_PAYLOAD_LEN, fmt, ap);
+    va_end(ap);
+    return len;
+}
+
+
+template <typename Run>
+static double
+time_per_message(Run run) {
+    uint64_t messages = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed;
+
+    do {
+        for (int i = 0; i < BATCH; ++i) run();
+        messages += BATCH;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < MIN_RUN_NS);
+
+    return (double) elapsed / (double) messages;
+}
+
+
+// Builds the payload both ways, checks that the bytes match and reports the time of each
+template <typename... Args>
+static bool
+bench_case(const char* format, const Args& ... args) {
+    char expected[BLYNK_MAX_PAYLOAD_LEN];
+    uint16_t expected_len = serialize(expected, format, args...);
+
+    blynk::detail::payload_for<Args...> payload(args...);
+    bool match = payload.size() == expected_len && !memcmp(payload.data(), expected, expected_len);
+
+    double c_ns = time_per_message([&] {
+        char out[BLYNK_MAX_PAYLOAD_LEN];
+        sink = serialize(out, format, args...);
+    });
+    double cpp_ns = time_per_message([&] {
+        blynk::detail::payload_for<Args...> out(args...);
+        sink = out.size();
+    });
+
+    printf("  %-8s %7.1f ns/msg %7.1f ns/msg %4u bytes  %s\n", format, c_ns, cpp_ns, expected_len,
+           match ? "same bytes" : "MISMATCH");
+    return match;
+}
+
+
+int
+main() {
+    memset(long_text, 'x', sizeof(long_text) - 1);
+    const char* dynamic_text = "temperature";
+
+    printf("construct_payload vs blynk.hpp\n");
+    printf("  %-8s %14s %14s\n", "format", "format string", "typed");
+
+    bool ok = true;
+    ok &= bench_case("i", -123456789);
+    ok &= bench_case("Q", 12345678901234567890ULL);
+    ok &= bench_case("f", 23.456f);
+    ok &= bench_case("d", 1013.25);
+    ok &= bench_case("d", -1e300);
+    ok &= bench_case("?", true);
+    ok &= bench_case("c", 'x');
+    ok &= bench_case("s", "temperature");
+    ok &= bench_case("sHi", "vw", (uint16_t) 5, 1024);
+    ok &= bench_case("sHh", "vw", (uint16_t) 5, (int8_t) -5);
+    ok &= bench_case("sHf", "vw", (uint16_t) 5, 23.456f);
+    ok &= bench_case("sHd", "vw", (uint16_t) 5, 1013.25);
+    ok &= bench_case("sHiiii", "vw", (uint16_t) 5, 1, -20, 300, -4000);
+    ok &= bench_case("sHfff", "vw", (uint16_t) 5, 0.5f, -12.75f, 1e6f);
+    ok &= bench_case("sHs", "vw", (uint16_t) 5, dynamic_text);
+    ok &= bench_case("sHsi", "vw", (uint16_t) 5, (const char*) long_text, 1);
+
+    if (!ok) {
+        fprintf(stderr, "blynk.hpp payloads differ from construct_payload\n");
+        return EXIT_FAILURE;
+    }
+
+    return EXIT_SUCCESS;
+}
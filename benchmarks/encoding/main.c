@@ -0,0 +1,348 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <stdbool.h>
+#include <inttypes.h>
+
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "internal/value_encoding.h"
+
+#define DEFAULT_VALUES                  200000
+#define DEFAULT_STRIDE                  4099
+#define TEXT_SIZE                       64
+#define MIN_RUN_NS                      (200 * BENCH_NS_PER_MS)
+#define MAX_REPORTED_MISMATCHES         5
+
+
+typedef enum {
+    VALUES_INT32 = 0,
+    VALUES_UINT64,
+    VALUES_SENSOR_FLOAT,
+    VALUES_RANDOM_FLOAT,
+    VALUES_DOUBLE,
+} value_set_t;
+
+
+typedef uint8_t (* encode_case_t)(char* out, size_t index);
+
+typedef struct {
+    const char* name;
+    value_set_t set;
+    encode_case_t run;
+} bench_case_t;
+
+
+static int32_t* int32_values;
+static uint64_t* uint64_values;
+static float* sensor_values;
+static float* random_values;
+static double* double_values;
+static size_t value_count;
+static uint64_t rng_state = 0x9E3779B97F4A7C15ULL;
+static uint64_t mismatches;
+
+
+static uint64_t next_random(void);
+
+static void generate_values(size_t count);
+
+static void bench_case(const bench_case_t* bench);
+
+static void check(bool equal, const char* kernel, const char* got, const char* expected);
+
+static void verify_integers(void);
+
+static void verify_fixed(void);
+
+static void verify_shortest(uint64_t stride);
+
+
+static uint8_t printf_int32(char* o, size_t i) { return snprintf(o, TEXT_SIZE, "%" PRId32, int32_values[i]); }
+
+static uint8_t kernel_int32(char* o, size_t i) { return encode_int32(o, int32_values[i]); }
+
+static uint8_t printf_uint64(char* o, size_t i) { return snprintf(o, TEXT_SIZE, "%" PRIu64, uint64_values[i]); }
+
+static uint8_t kernel_uint64(char* o, size_t i) { return encode_uint64(o, uint64_values[i]); }
+
+static uint8_t printf_sensor(char* o, size_t i) { return snprintf(o, TEXT_SIZE, "%.7f", sensor_values[i]); }
+
+static uint8_t printf_sensor_2(char* o, size_t i) { return snprintf(o, TEXT_SIZE, "%.2f", sensor_values[i]); }
+
+static uint8_t kernel_sensor_2(char* o, size_t i) { return encode_float(o, sensor_values[i], 2); }
+
+static uint8_t shortest_sensor(char* o, size_t i) { return encode_float_shortest(o, sensor_values[i]); }
+
+static uint8_t printf_random(char* o, size_t i) { return snprintf(o, TEXT_SIZE, "%.7f", random_values[i]); }
+
+static uint8_t shortest_random(char* o, size_t i) { return encode_float_shortest(o, random_values[i]); }
+
+static uint8_t printf_double(char* o, size_t i) { return snprintf(o, TEXT_SIZE, "%.7f", double_values[i]); }
+
+static uint8_t kernel_double(char* o, size_t i) { return encode_double(o, double_values[i], 7); }
+
+
+static const bench_case_t cases[] = {
+        {"snprintf %d",                     VALUES_INT32,        printf_int32},
+        {"encode_int32",                    VALUES_INT32,        kernel_int32},
+        {"snprintf %llu",                   VALUES_UINT64,       printf_uint64},
+        {"encode_uint64",                   VALUES_UINT64,       kernel_uint64},
+        {"sensor snprintf %.7f",            VALUES_SENSOR_FLOAT, printf_sensor},
+        {"sensor encode_float_shortest",    VALUES_SENSOR_FLOAT, shortest_sensor},
+        {"sensor snprintf %.2f",            VALUES_SENSOR_FLOAT, printf_sensor_2},
+        {"sensor encode_float 2",           VALUES_SENSOR_FLOAT, kernel_sensor_2},
+        {"random snprintf %.7f",            VALUES_RANDOM_FLOAT, printf_random},
+        {"random encode_float_shortest",    VALUES_RANDOM_FLOAT, shortest_random},
+        {"double snprintf %.7f",            VALUES_DOUBLE,       printf_double},
+        {"double encode_double 7",          VALUES_DOUBLE,       kernel_double},
+};
+
+
+int
+main(int argc, char** argv) {
+    size_t count = DEFAULT_VALUES;
+    uint64_t stride = DEFAULT_STRIDE;
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                count = strtoul(optarg, NULL, 10);
+                break;
+            case 's':
+                stride = strtoull(optarg, NULL, 10);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n values per set] [-s float bit pattern stride]\n", argv[0]);
+                return EXIT_FAILURE;
+        }
+    }
+
+    if (!count || !stride) return EXIT_FAILURE;
+    generate_values(count);
+
+    printf("number-to-text kernels, %zu values per set\n", count);
+    for (size_t i = 0; i < ARRAY_SIZE(cases); ++i) {
+        bench_case(&cases[i]);
+    }
+
+    verify_integers();
+    verify_fixed();
+    verify_shortest(stride);
+
+    printf("mismatches=%" PRIu64 "\n", mismatches);
+    return mismatches ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+
+static uint64_t
+next_random(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+
+static void
+generate_values(size_t count) {
+    value_count = count;
+    int32_values = malloc(count * sizeof(*int32_values));
+    uint64_values = malloc(count * sizeof(*uint64_values));
+    sensor_values = malloc(count * sizeof(*sensor_values));
+    random_values = malloc(count * sizeof(*random_values));
+    double_values = malloc(count * sizeof(*double_values));
+
+    for (size_t i = 0; i < count; ++i) {
+        int32_values[i] = (int32_t) next_random() >> (next_random() % 32);
+        uint64_values[i] = next_random() >> (next_random() % 64);
+
+        // Readings with two decimals between -40 and 85, like a temperature sensor
+        sensor_values[i] = (float) ((int32_t) (next_random() % 12500) - 4000) / 100.0f;
+
+        uint32_t bits;
+        do {
+            bits = (uint32_t) next_random();
+            memcpy(&random_values[i], &bits, sizeof(bits));
+        } while (isnan(random_values[i]) || isinf(random_values[i]) || fabsf(random_values[i]) > 1e9f ||
+                 fabsf(random_values[i]) < 1e-5f);
+
+        double_values[i] = ((double) (next_random() % 2000000000) - 1e9) / pow(10, (double) (next_random() % 10));
+    }
+}
+
+
+static void
+bench_case(const bench_case_t* bench) {
+    char text[TEXT_SIZE];
+    uint64_t values = 0;
+    uint64_t bytes = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed;
+
+    do {
+        bytes = 0;
+        for (size_t i = 0; i < value_count; ++i) {
+            bytes += bench->run(text, i);
+        }
+        values += value_count;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < MIN_RUN_NS);
+
+    printf("  %-30s %7.1f ns/value %6.2f bytes/value\n", bench->name, (double) elapsed / (double) values,
+           (double) bytes / (double) value_count);
+}
+
+
+static void
+check(bool equal, const char* kernel, const char* got, const char* expected) {
+    if (equal) return;
+
+    if (mismatches++ < MAX_REPORTED_MISMATCHES) {
+        printf("  mismatch in %s: got \"%s\", expected \"%s\"\n", kernel, got, expected);
+    }
+}
+
+
+static void
+verify_integers(void) {
+    static const int64_t edges[] = {0, 1, -1, 9, 10, 99, 100, 101, INT32_MAX, INT32_MIN, INT64_MAX, INT64_MIN,
+                                    99999999, 100000000, 4294967295LL, 4294967296LL};
+    char got[TEXT_SIZE];
+    char expected[TEXT_SIZE];
+    uint64_t checked = 0;
+
+    for (size_t i = 0; i < ARRAY_SIZE(edges) + value_count; ++i) {
+        int64_t value = i < ARRAY_SIZE(edges) ? edges[i] : (int64_t) next_random() >> (next_random() % 64);
+
+        got[encode_int32(got, (int32_t) value)] = '\0';
+        snprintf(expected, sizeof(expected), "%" PRId32, (int32_t) value);
+        check(!strcmp(got, expected), "encode_int32", got, expected);
+
+        got[encode_uint32(got, (uint32_t) value)] = '\0';
+        snprintf(expected, sizeof(expected), "%" PRIu32, (uint32_t) value);
+        check(!strcmp(got, expected), "encode_uint32", got, expected);
+
+        got[encode_int64(got, value)] = '\0';
+        snprintf(expected, sizeof(expected), "%" PRId64, value);
+        check(!strcmp(got, expected), "encode_int64", got, expected);
+
+        got[encode_uint64(got, (uint64_t) value)] = '\0';
+        snprintf(expected, sizeof(expected), "%" PRIu64, (uint64_t) value);
+        check(!strcmp(got, expected), "encode_uint64", got, expected);
+
+        checked += 4;
+    }
+
+    printf("integers: %" PRIu64 " values compared with snprintf\n", checked);
+}
+
+
+static void
+verify_fixed(void) {
+    char got[ENCODED_FLOAT_MAX(BLYNK_MAX_FLOAT_PRECISION) + 1];
+    char expected[TEXT_SIZE];
+    uint64_t checked = 0;
+
+    for (size_t i = 0; i < 4 * value_count; ++i) {
+        uint8_t precision = i % (BLYNK_MAX_FLOAT_PRECISION + 1);
+
+        uint32_t bits = (uint32_t) next_random();
+        float value;
+        memcpy(&value, &bits, sizeof(bits));
+        if (i % 2) value = sensor_values[i % value_count] / (float) (1 << (i % 8));
+
+        if (!isnan(value)) {
+            got[encode_float(got, value, precision)] = '\0';
+            snprintf(expected, sizeof(expected), "%.*f", precision, (double) value);
+            check(!strcmp(got, expected), "encode_float", got, expected);
+            checked++;
+        }
+
+        // Random mantissas plus decimal ties, one unit in the last digit away from exact halves
+        double number = ldexp((double) (int64_t) (next_random() >> 11), -(int) (next_random() % 80));
+        if (i % 3 == 0) number = double_values[i % value_count];
+        if (i % 3 == 1) number = ((double) (next_random() % 2000000) - 1e6) / 1e7 + 0.5e-7 * (double) (i % 3);
+
+        uint8_t len = encode_double(got, number, precision);
+        if (len) {
+            got[len] = '\0';
+            snprintf(expected, sizeof(expected), "%.*f", precision, number);
+            check(!strcmp(got, expected), "encode_double", got, expected);
+            checked++;
+        }
+    }
+
+    printf("fixed precision: %" PRIu64 " values compared with snprintf %%.*f\n", checked);
+}
+
+
+static void
+verify_shortest(uint64_t stride) {
+    char got[ENCODED_FLOAT_SHORTEST_MAX + 1];
+    char expected[TEXT_SIZE];
+    uint64_t checked = 0;
+
+    // Every stride-th bit pattern must read back exactly and be no longer than the shortest %.*e that does
+    for (uint64_t pattern = 0; pattern <= UINT32_MAX; pattern += stride) {
+        uint32_t bits = (uint32_t) pattern;
+        float value;
+        memcpy(&value, &bits, sizeof(bits));
+        if (isnan(value) || isinf(value)) continue;
+
+        got[encode_float_shortest(got, value)] = '\0';
+
+        float back = strtof(got, NULL);
+        check(!memcmp(&back, &value, sizeof(value)) || value == 0, "encode_float_shortest", got, "a round trip");
+
+        int digits;
+        for (digits = 1; digits < 9; ++digits) {
+            snprintf(expected, sizeof(expected), "%.*e", digits - 1, (double) value);
+            if (strtof(expected, NULL) == value) break;
+        }
+
+        int produced = 0;
+        bool leading = true;
+        for (const char* c = got; *c && *c != 'e'; ++c) {
+            if (*c >= '1' && *c <= '9') leading = false;
+            if (*c >= '0' && *c <= '9' && !leading) produced++;
+        }
+
+        // Plain whole numbers such as 100000000 carry padding zeros that are not significant
+        if (!strchr(got, '.') && !strchr(got, 'e')) {
+            for (size_t len = strlen(got); len > 1 && got[len - 1] == '0'; --len) produced--;
+        }
+
+        check(value == 0 || produced <= digits, "encode_float_shortest", got, expected);
+        checked++;
+    }
+
+    printf("shortest: %" PRIu64 " float bit patterns checked for round trip and length\n", checked);
+}
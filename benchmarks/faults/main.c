@@ -0,0 +1,435 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "fault_proxy.h"
+#include "mock_server.h"
+
+#define DEFAULT_RATE                    100
+#define DEFAULT_DURATION_S              5
+#define DEFAULT_FAULTS                  5
+#define DEFAULT_INTERVAL_MS             2000
+#define DEFAULT_LATENCY_MS              50
+#define DEFAULT_HEARTBEAT_MS            1000
+#define DEFAULT_TIMEOUT_MS              2000
+#define DEFAULT_RECONNECT_MS            500
+#define RECOVERY_TIMEOUT_MS             30000
+#define QUIET_PERIOD_MS                 300
+#define POLL_INTERVAL_US                1000
+#define MAX_SAMPLES                     1000000
+#define URL_SIZE                        64
+#define JOURNAL_SIZE                    (256 * 1024)
+
+
+typedef enum {
+    FAULT_NONE,
+    FAULT_LATENCY,
+    FAULT_PARTIAL,
+    FAULT_RESET,
+    FAULT_BLACKHOLE,
+} fault_kind_t;
+
+
+typedef struct {
+    int rate;
+    int duration_s;
+    int faults;
+    int interval_ms;
+    int latency_ms;
+    int heartbeat_ms;
+    int timeout_ms;
+    int reconnect_ms;
+    int offline_bytes;
+    const char* journal_path;
+} fault_options_t;
+
+
+typedef struct {
+    blynk_device_t* device;
+    int rate;
+    atomic_bool running;
+    atomic_uint_fast64_t accepted;
+    atomic_uint_fast64_t refused;
+} producer_t;
+
+
+static const struct {
+    const char* name;
+    fault_kind_t kind;
+} scenarios[] = {
+        {"clean link", FAULT_NONE},
+        {"added latency", FAULT_LATENCY},
+        {"1-byte partial reads/writes", FAULT_PARTIAL},
+        {"connection resets", FAULT_RESET},
+        {"blackholes", FAULT_BLACKHOLE},
+};
+
+
+static pthread_mutex_t samples_mtx = PTHREAD_MUTEX_INITIALIZER;
+static bench_samples_t wire_latency;
+static atomic_uint_fast64_t hardware_frames;
+static atomic_uint_fast64_t disconnected_ns;
+static atomic_uint_fast64_t authenticated_ns;
+static atomic_uint_fast64_t disconnections;
+
+
+static void on_frame(const mock_frame_t* frame, void* data);
+
+static void* producer_task(void* arg);
+
+static void state_handler(blynk_device_t* device, const blynk_state_event_t* event, void* data);
+
+static void parse_options(int argc, char** argv, fault_options_t* options);
+
+static bool wait_for_event(atomic_uint_fast64_t* event_ns, uint64_t after, int timeout_ms);
+
+static void wait_for_quiet_link(int timeout_ms);
+
+static void apply_condition(fault_proxy_t* proxy, fault_kind_t kind, const fault_options_t* options, bool enabled);
+
+static void run_scenario(blynk_device_t* device, fault_proxy_t* proxy, const fault_options_t* options,
+                         const char* name, fault_kind_t kind);
+
+
+int
+main(int argc, char** argv) {
+    fault_options_t options;
+    parse_options(argc, argv, &options);
+    signal(SIGPIPE, SIG_IGN);
+
+    mock_server_config_t server_config = {.port = 0, .on_frame = on_frame, .data = NULL};
+    mock_server_t* server = mock_server_start(&server_config);
+    if (!server) return EXIT_FAILURE;
+
+    fault_proxy_config_t proxy_config = {.port = 0, .upstream_port = mock_server_port(server)};
+    fault_proxy_t* proxy = fault_proxy_start(&proxy_config);
+    if (!proxy) return EXIT_FAILURE;
+
+    char url[URL_SIZE];
+    fault_proxy_url(proxy, url, sizeof(url));
+
+    blynk_device_t* device = malloc(sizeof(blynk_device_t));
+    if (!device || blynk_begin(device, "fault-token") != BLYNK_EC_OK) return EXIT_FAILURE;
+
+    update_server_url(device, url);
+    update_heartbeat_interval(device, options.heartbeat_ms);
+    update_default_timeout(device, options.timeout_ms);
+    update_default_reconnection_delay(device, options.reconnect_ms);
+    update_default_state_handler(device, state_handler, NULL);
+
+    void* offline_buffer = options.offline_bytes ? malloc(options.offline_bytes) : NULL;
+    if (update_offline_buffer(device, offline_buffer, options.offline_bytes, BLYNK_OVERFLOW_DROP_OLDEST) != BLYNK_EC_OK) {
+        return EXIT_FAILURE;
+    }
+
+    static blynk_journal_storage_t journal;
+    if (options.journal_path) {
+        unlink(options.journal_path);
+        if (blynk_journal_file_storage(&journal, options.journal_path, JOURNAL_SIZE) != BLYNK_EC_OK ||
+            update_journal_storage(device, &journal) != BLYNK_EC_OK) {
+            return EXIT_FAILURE;
+        }
+    }
+
+    uint64_t start = bench_now_ns();
+    blynk_run(device);
+    if (!wait_for_event(&authenticated_ns, start, RECOVERY_TIMEOUT_MS)) {
+        fprintf(stderr, "device failed to authenticate through %s\n", url);
+        return EXIT_FAILURE;
+    }
+
+    printf("faults: rate=%d msgs/s heartbeat=%d ms timeout=%d ms reconnect delay=%d ms offline buffer=%d bytes "
+           "journal=%s\n", options.rate, options.heartbeat_ms, options.timeout_ms, options.reconnect_ms,
+           options.offline_bytes, options.journal_path ? options.journal_path : "off");
+
+    for (size_t i = 0; i < ARRAY_SIZE(scenarios); ++i) {
+        run_scenario(device, proxy, &options, scenarios[i].name, scenarios[i].kind);
+    }
+
+    fault_proxy_stats_t stats;
+    fault_proxy_get_stats(proxy, &stats);
+    printf("proxy: accepted=%llu resets=%llu forwarded=%llu dropped=%llu bytes\n",
+           (unsigned long long) stats.accepted, (unsigned long long) stats.resets,
+           (unsigned long long) stats.forwarded_bytes, (unsigned long long) stats.dropped_bytes);
+
+    // The Blynk task has no stop API, exiting the process tears it down
+    return EXIT_SUCCESS;
+}
+
+
+static void
+parse_options(int argc, char** argv, fault_options_t* options) {
+    *options = (fault_options_t) {
+            .rate = DEFAULT_RATE,
+            .duration_s = DEFAULT_DURATION_S,
+            .faults = DEFAULT_FAULTS,
+            .interval_ms = DEFAULT_INTERVAL_MS,
+            .latency_ms = DEFAULT_LATENCY_MS,
+            .heartbeat_ms = DEFAULT_HEARTBEAT_MS,
+            .timeout_ms = DEFAULT_TIMEOUT_MS,
+            .reconnect_ms = DEFAULT_RECONNECT_MS,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "r:d:k:i:l:h:t:c:o:j:")) != -1) {
+        switch (opt) {
+            case 'r':
+                options->rate = atoi(optarg);
+                break;
+            case 'd':
+                options->duration_s = atoi(optarg);
+                break;
+            case 'k':
+                options->faults = atoi(optarg);
+                break;
+            case 'i':
+                options->interval_ms = atoi(optarg);
+                break;
+            case 'l':
+                options->latency_ms = atoi(optarg);
+                break;
+            case 'h':
+                options->heartbeat_ms = atoi(optarg);
+                break;
+            case 't':
+                options->timeout_ms = atoi(optarg);
+                break;
+            case 'c':
+                options->reconnect_ms = atoi(optarg);
+                break;
+            case 'o':
+                options->offline_bytes = atoi(optarg);
+                break;
+            case 'j':
+                options->journal_path = optarg;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-r messages/s] [-d condition seconds] [-k faults] [-i ms between faults] "
+                                "[-l latency ms] [-h heartbeat ms] [-t timeout ms] [-c reconnect delay ms] "
+                                "[-o offline buffer bytes] [-j journal file]\n",
+                        argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->rate < 1) options->rate = 1;
+}
+
+
+static void
+run_scenario(blynk_device_t* device, fault_proxy_t* proxy, const fault_options_t* options, const char* name,
+             fault_kind_t kind) {
+    bool discrete = kind == FAULT_RESET || kind == FAULT_BLACKHOLE;
+    bench_samples_t detect;
+    bench_samples_t reconnect;
+    bench_samples_init(&detect, options->faults);
+    bench_samples_init(&reconnect, options->faults);
+
+    pthread_mutex_lock(&samples_mtx);
+    bench_samples_init(&wire_latency, MAX_SAMPLES);
+    pthread_mutex_unlock(&samples_mtx);
+
+    uint64_t received_before = atomic_load(&hardware_frames);
+    uint64_t disconnections_before = atomic_load(&disconnections);
+    uint32_t dropped_before = device->priv_data.offline.dropped + device->priv_data.journal.dropped;
+
+    producer_t producer = {.device = device, .rate = options->rate};
+    atomic_store(&producer.running, true);
+    pthread_t thread;
+    pthread_create(&thread, NULL, producer_task, &producer);
+
+    uint64_t start = bench_now_ns();
+    int unrecovered = 0;
+
+    if (discrete) {
+        for (int i = 0; i < options->faults; ++i) {
+            usleep((useconds_t) options->interval_ms * 1000);
+
+            uint64_t injected = bench_now_ns();
+            apply_condition(proxy, kind, options, true);
+
+            bool detected = wait_for_event(&disconnected_ns, injected, RECOVERY_TIMEOUT_MS);
+            apply_condition(proxy, kind, options, false);
+            bool recovered = detected && wait_for_event(&authenticated_ns, injected, RECOVERY_TIMEOUT_MS);
+
+            if (detected) bench_samples_add(&detect, atomic_load(&disconnected_ns) - injected);
+            if (recovered) bench_samples_add(&reconnect, atomic_load(&authenticated_ns) - injected);
+            if (!recovered) unrecovered++;
+        }
+    } else {
+        apply_condition(proxy, kind, options, true);
+        usleep((useconds_t) options->duration_s * 1000000);
+        apply_condition(proxy, kind, options, false);
+    }
+
+    atomic_store(&producer.running, false);
+    pthread_join(thread, NULL);
+    double seconds = (double) (bench_now_ns() - start) / BENCH_NS_PER_SEC;
+
+    // Anything still buffered in the device or the proxy gets a chance to arrive before it is counted as lost
+    wait_for_quiet_link(options->heartbeat_ms + QUIET_PERIOD_MS);
+
+    uint64_t accepted = atomic_load(&producer.accepted);
+    uint64_t received = atomic_load(&hardware_frames) - received_before;
+    uint64_t lost = accepted > received ? accepted - received : 0;
+    uint64_t duplicates = received > accepted ? received - accepted : 0;
+
+    printf("%s (%.1f s):\n", name, seconds);
+    printf("  accepted=%llu refused=%llu received=%llu lost=%llu duplicates=%llu disconnects=%llu drops=%u\n",
+           (unsigned long long) accepted, (unsigned long long) atomic_load(&producer.refused),
+           (unsigned long long) received, (unsigned long long) lost, (unsigned long long) duplicates,
+           (unsigned long long) (atomic_load(&disconnections) - disconnections_before),
+           device->priv_data.offline.dropped + device->priv_data.journal.dropped - dropped_before);
+
+    if (discrete) {
+        printf("  faults=%d unrecovered=%d lost per fault=%.1f\n", options->faults, unrecovered,
+               (double) lost / options->faults);
+        bench_samples_report("time-to-detect", &detect);
+        bench_samples_report("time-to-reconnect", &reconnect);
+    }
+
+    pthread_mutex_lock(&samples_mtx);
+    bench_samples_report("enqueue-to-wire", &wire_latency);
+    bench_samples_free(&wire_latency);
+    pthread_mutex_unlock(&samples_mtx);
+
+    bench_samples_free(&detect);
+    bench_samples_free(&reconnect);
+}
+
+
+static void
+apply_condition(fault_proxy_t* proxy, fault_kind_t kind, const fault_options_t* options, bool enabled) {
+    switch (kind) {
+        case FAULT_LATENCY:
+            fault_proxy_set_latency(proxy, enabled ? options->latency_ms : 0);
+            break;
+        case FAULT_PARTIAL:
+            fault_proxy_set_partial(proxy, enabled);
+            break;
+        case FAULT_RESET:
+            if (enabled) fault_proxy_reset_connections(proxy);
+            break;
+        case FAULT_BLACKHOLE:
+            fault_proxy_set_blackhole(proxy, enabled);
+            break;
+        case FAULT_NONE:
+            break;
+    }
+}
+
+
+static void*
+producer_task(void* arg) {
+    producer_t* producer = arg;
+    uint64_t period_ns = BENCH_NS_PER_SEC / producer->rate;
+    uint64_t next = bench_now_ns();
+
+    while (atomic_load(&producer->running)) {
+        unsigned long long stamp = bench_now_ns();
+        if (blynk_send(producer->device, BLYNK_CMD_HARDWARE, NO_WAITING, "siQ", "vw", 0, stamp) == BLYNK_EC_OK) {
+            atomic_fetch_add(&producer->accepted, 1);
+        } else {
+            atomic_fetch_add(&producer->refused, 1);
+        }
+
+        next += period_ns;
+        uint64_t now = bench_now_ns();
+        if (next > now) usleep((next - now) / BENCH_NS_PER_USEC);
+    }
+
+    return NULL;
+}
+
+
+static bool
+wait_for_event(atomic_uint_fast64_t* event_ns, uint64_t after, int timeout_ms) {
+    uint64_t deadline = bench_now_ns() + (uint64_t) timeout_ms * BENCH_NS_PER_MS;
+
+    while (atomic_load(event_ns) <= after) {
+        if (bench_now_ns() > deadline) return false;
+        usleep(POLL_INTERVAL_US);
+    }
+
+    return true;
+}
+
+
+static void
+wait_for_quiet_link(int timeout_ms) {
+    uint64_t deadline = bench_now_ns() + (uint64_t) timeout_ms * BENCH_NS_PER_MS;
+    uint64_t last = atomic_load(&hardware_frames);
+    uint64_t changed = bench_now_ns();
+
+    while (bench_now_ns() < deadline) {
+        usleep(POLL_INTERVAL_US * 10);
+
+        uint64_t current = atomic_load(&hardware_frames);
+        if (current != last) {
+            last = current;
+            changed = bench_now_ns();
+        } else if (bench_now_ns() - changed > (uint64_t) timeout_ms * BENCH_NS_PER_MS / 2) {
+            return;
+        }
+    }
+}
+
+
+static void
+state_handler(UNUSED blynk_device_t* device, const blynk_state_event_t* event, UNUSED void* data) {
+    if (event->conn_status == BLYNK_STATE_AUTHENTICATED) {
+        atomic_store(&authenticated_ns, bench_now_ns());
+    } else if (event->conn_status == BLYNK_STATE_DISCONNECTED && event->disconnected.reason != BLYNK_EC_OK) {
+        atomic_store(&disconnected_ns, bench_now_ns());
+        atomic_fetch_add(&disconnections, 1);
+    }
+}
+
+
+static void
+on_frame(const mock_frame_t* frame, UNUSED void* data) {
+    if (frame->command != BLYNK_CMD_HARDWARE || !frame->payload) return;
+
+    // Payload is "vw\0<pin>\0<stamp>", the stamp is the last argument
+    const uint8_t* stamp = frame->payload + frame->length;
+    while (stamp > frame->payload && stamp[-1] != '\0') stamp--;
+
+    char text[FORMAT_BUFFER_SIZE] = {0};
+    memcpy(text, stamp, MIN((size_t) (frame->payload + frame->length - stamp), sizeof(text) - 1));
+
+    pthread_mutex_lock(&samples_mtx);
+    bench_samples_add(&wire_latency, frame->received_ns - strtoull(text, NULL, 10));
+    pthread_mutex_unlock(&samples_mtx);
+    atomic_fetch_add(&hardware_frames, 1);
+}
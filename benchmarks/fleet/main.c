@@ -0,0 +1,446 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <stdatomic.h>
+#include <sys/resource.h>
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "mock_server.h"
+
+#define DEFAULT_DEVICES                 1000
+#define DEFAULT_RATE                    1
+#define DEFAULT_DURATION_S              10
+#define DEFAULT_STORMS                  2
+#define DEFAULT_RECONNECT_MS            1000
+#define DEFAULT_HEARTBEAT_MS            10000
+#define PHASE_TIMEOUT_MS                60000
+#define POLL_INTERVAL_US                1000
+#define SETTLE_MS                       500
+#define URL_SIZE                        64
+#define FDS_PER_DEVICE                  4
+#define ECHO_VALUE_SIZE                 300
+
+
+typedef struct {
+    int devices;
+    int rate;
+    int duration_s;
+    int storms;
+    int reconnect_ms;
+    int heartbeat_ms;
+} fleet_options_t;
+
+
+typedef struct {
+    blynk_device_t device;
+    int index;
+    uint64_t run_ns;
+    atomic_uint_fast64_t authenticated_ns;
+    atomic_uint_fast64_t disconnected_ns;
+    atomic_uint_fast32_t authentications;
+} fleet_device_t;
+
+
+static bench_samples_t wire_latency;
+static atomic_uint_fast64_t hardware_frames;
+static atomic_uint_fast64_t echoes_sent;
+static atomic_uint_fast64_t echoes_handled;
+static atomic_uint_fast64_t echoes_corrupt;
+static mock_server_t* fleet_server;
+
+
+static void on_frame(const mock_frame_t* frame, void* data);
+
+static void state_handler(blynk_device_t* device, const blynk_state_event_t* event, void* data);
+
+static void echo_handler(blynk_handler_params_t* params);
+
+static void parse_options(int argc, char** argv, fleet_options_t* options);
+
+static void raise_descriptor_limit(const fleet_options_t* options);
+
+static size_t resident_bytes(void);
+
+static int open_descriptors(void);
+
+static bool wait_for_authentications(fleet_device_t* fleet, int devices, uint32_t expected);
+
+static void report_connections(const char* name, fleet_device_t* fleet, int devices, uint64_t start);
+
+static void run_logins(fleet_device_t* fleet, const fleet_options_t* options, const char* url);
+
+static void run_telemetry(fleet_device_t* fleet, const fleet_options_t* options);
+
+static void run_reconnect_storm(fleet_device_t* fleet, const fleet_options_t* options, mock_server_t* server,
+                                int storm);
+
+
+int
+main(int argc, char** argv) {
+    fleet_options_t options;
+    parse_options(argc, argv, &options);
+    signal(SIGPIPE, SIG_IGN);
+    raise_descriptor_limit(&options);
+
+    mock_server_config_t config = {.port = 0, .on_frame = on_frame, .data = NULL};
+    mock_server_t* server = mock_server_start(&config);
+    if (!server) return EXIT_FAILURE;
+    fleet_server = server;
+
+    char url[URL_SIZE];
+    mock_server_url(server, url, sizeof(url));
+
+    fleet_device_t* fleet = calloc(options.devices, sizeof(fleet_device_t));
+    if (!fleet) return EXIT_FAILURE;
+
+    bench_samples_init(&wire_latency, (size_t) options.devices * options.rate * options.duration_s);
+
+    run_logins(fleet, &options, url);
+    run_telemetry(fleet, &options);
+
+    for (int storm = 1; storm <= options.storms; ++storm) {
+        run_reconnect_storm(fleet, &options, server, storm);
+    }
+
+    mock_server_stats_t stats;
+    mock_server_get_stats(server, &stats);
+    printf("server: frames=%llu logins=%llu pings=%llu accepted=%llu active=%llu\n",
+           (unsigned long long) stats.frames, (unsigned long long) stats.logins, (unsigned long long) stats.pings,
+           (unsigned long long) stats.accepted, (unsigned long long) stats.active);
+    printf("memory after storms: rss %.1f MiB\n", (double) resident_bytes() / (1024 * 1024));
+
+    // The Blynk tasks have no stop API, exiting the process tears them down
+    bench_samples_free(&wire_latency);
+    return EXIT_SUCCESS;
+}
+
+
+static void
+parse_options(int argc, char** argv, fleet_options_t* options) {
+    *options = (fleet_options_t) {
+            .devices = DEFAULT_DEVICES,
+            .rate = DEFAULT_RATE,
+            .duration_s = DEFAULT_DURATION_S,
+            .storms = DEFAULT_STORMS,
+            .reconnect_ms = DEFAULT_RECONNECT_MS,
+            .heartbeat_ms = DEFAULT_HEARTBEAT_MS,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:r:d:s:c:h:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options->devices = atoi(optarg);
+                break;
+            case 'r':
+                options->rate = atoi(optarg);
+                break;
+            case 'd':
+                options->duration_s = atoi(optarg);
+                break;
+            case 's':
+                options->storms = atoi(optarg);
+                break;
+            case 'c':
+                options->reconnect_ms = atoi(optarg);
+                break;
+            case 'h':
+                options->heartbeat_ms = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n devices] [-r messages/s per device] [-d telemetry seconds] "
+                                "[-s reconnect storms] [-c reconnect delay ms] [-h heartbeat ms]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->devices < 1) options->devices = 1;
+    if (options->rate < 1) options->rate = 1;
+}
+
+
+static void
+raise_descriptor_limit(const fleet_options_t* options) {
+    // Every device owns the ctl socket pair and a TCP connection, the server holds the other end
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit)) return;
+
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+
+    rlim_t needed = (rlim_t) options->devices * FDS_PER_DEVICE + 64;
+    if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < needed) {
+        fprintf(stderr, "warning: %d devices need about %llu descriptors, the limit is %llu\n", options->devices,
+                (unsigned long long) needed, (unsigned long long) limit.rlim_cur);
+    }
+}
+
+
+static void
+run_logins(fleet_device_t* fleet, const fleet_options_t* options, const char* url) {
+    size_t rss_before = resident_bytes();
+    int fds_before = open_descriptors();
+    int started = 0;
+
+    for (int i = 0; i < options->devices; ++i) {
+        fleet_device_t* member = &fleet[i];
+        member->index = i;
+
+        if (blynk_begin(&member->device, "fleet-token") != BLYNK_EC_OK) break;
+
+        update_server_url(&member->device, url);
+        update_heartbeat_interval(&member->device, options->heartbeat_ms);
+        update_default_reconnection_delay(&member->device, options->reconnect_ms);
+        update_default_state_handler(&member->device, state_handler, member);
+        blynk_register_cmd_handler(&member->device, "vw", echo_handler, member);
+        started++;
+    }
+
+    if (started != options->devices) {
+        fprintf(stderr, "only %d of %d devices could be initialised\n", started, options->devices);
+        exit(EXIT_FAILURE);
+    }
+
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < options->devices; ++i) {
+        fleet[i].run_ns = bench_now_ns();
+        if (blynk_run(&fleet[i].device) != BLYNK_EC_OK) {
+            fprintf(stderr, "device %d failed to start its Blynk task\n", i);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    bool complete = wait_for_authentications(fleet, options->devices, 1);
+
+    size_t rss_after = resident_bytes();
+    int fds_after = open_descriptors();
+
+    printf("fleet: devices=%d telemetry=%d msgs/s per device, reconnect delay=%d ms, heartbeat=%d ms\n",
+           options->devices, options->rate, options->reconnect_ms, options->heartbeat_ms);
+    printf("  per device: sizeof(blynk_device_t)=%zu B, outgoing rings=%zu B, rss=%.1f KiB, descriptors=%.1f\n",
+           sizeof(blynk_device_t), (size_t) (BLYNK_CONTROL_RING_SIZE + BLYNK_BULK_RING_SIZE),
+           (double) (rss_after - rss_before) / options->devices / 1024,
+           (double) (fds_after - fds_before) / options->devices);
+
+    report_connections(complete ? "login" : "login (incomplete)", fleet, options->devices, start);
+}
+
+
+static void
+run_telemetry(fleet_device_t* fleet, const fleet_options_t* options) {
+    // One producer walks the whole fleet, so every device sends at the requested rate
+    uint64_t period_ns = BENCH_NS_PER_SEC / options->rate;
+    uint64_t start = bench_now_ns();
+    uint64_t failures = 0;
+    uint64_t sent = 0;
+
+    for (int round = 0; round < options->rate * options->duration_s; ++round) {
+        uint64_t round_start = start + (uint64_t) round * period_ns;
+
+        for (int i = 0; i < options->devices; ++i) {
+            unsigned long long stamp = bench_now_ns();
+            if (blynk_send(&fleet[i].device, BLYNK_CMD_HARDWARE, NO_WAITING, "siQ", "vw", i, stamp) !=
+                BLYNK_EC_OK) {
+                failures++;
+            }
+            sent++;
+        }
+
+        uint64_t now = bench_now_ns();
+        if (now < round_start + period_ns) usleep((round_start + period_ns - now) / BENCH_NS_PER_USEC);
+    }
+
+    usleep(SETTLE_MS * 1000);
+
+    double seconds = (double) (bench_now_ns() - start) / BENCH_NS_PER_SEC;
+    uint64_t received = atomic_load(&hardware_frames);
+
+    printf("telemetry: sent=%llu failed=%llu received=%llu\n", (unsigned long long) sent,
+           (unsigned long long) failures, (unsigned long long) received);
+    printf("  %-28s %.0f msgs/s aggregate\n", "fleet -> server", (double) received / seconds);
+    printf("  %-28s sent=%llu handled=%llu corrupt=%llu\n", "server -> fleet echoes",
+           (unsigned long long) atomic_load(&echoes_sent), (unsigned long long) atomic_load(&echoes_handled),
+           (unsigned long long) atomic_load(&echoes_corrupt));
+    bench_samples_report("enqueue-to-wire", &wire_latency);
+}
+
+
+static void
+run_reconnect_storm(fleet_device_t* fleet, const fleet_options_t* options, mock_server_t* server, int storm) {
+    // Every device sees the reset at once and sleeps reconnection_interval_ms in blynk_run_task before the herd
+    // comes back
+    uint64_t start = bench_now_ns();
+    mock_server_drop_connections(server, true);
+
+    bool complete = wait_for_authentications(fleet, options->devices, storm + 1);
+
+    bench_samples_t detect;
+    bench_samples_init(&detect, options->devices);
+    for (int i = 0; i < options->devices; ++i) {
+        uint64_t disconnected = atomic_load(&fleet[i].disconnected_ns);
+        if (disconnected > start) bench_samples_add(&detect, disconnected - start);
+    }
+
+    char name[URL_SIZE];
+    snprintf(name, sizeof(name), "storm %d%s", storm, complete ? "" : " (incomplete)");
+    printf("reconnect %s:\n", name);
+    bench_samples_report("reset-to-disconnect", &detect);
+    report_connections("reset-to-login", fleet, options->devices, start);
+
+    bench_samples_free(&detect);
+}
+
+
+static bool
+wait_for_authentications(fleet_device_t* fleet, int devices, uint32_t expected) {
+    uint64_t deadline = bench_now_ns() + (uint64_t) PHASE_TIMEOUT_MS * BENCH_NS_PER_MS;
+
+    while (bench_now_ns() < deadline) {
+        int done = 0;
+        for (int i = 0; i < devices; ++i) {
+            if (atomic_load(&fleet[i].authentications) >= expected) done++;
+        }
+        if (done == devices) return true;
+        usleep(POLL_INTERVAL_US);
+    }
+
+    return false;
+}
+
+
+static void
+report_connections(const char* name, fleet_device_t* fleet, int devices, uint64_t start) {
+    bench_samples_t latency;
+    bench_samples_init(&latency, devices);
+
+    uint64_t first = UINT64_MAX;
+    uint64_t last = 0;
+
+    for (int i = 0; i < devices; ++i) {
+        uint64_t authenticated = atomic_load(&fleet[i].authenticated_ns);
+        if (authenticated <= start) continue;
+
+        uint64_t since = fleet[i].run_ns > start ? fleet[i].run_ns : start;
+        bench_samples_add(&latency, authenticated - since);
+        if (authenticated < first) first = authenticated;
+        if (authenticated > last) last = authenticated;
+    }
+
+    if (latency.count) {
+        double spread = (double) (last - first) / BENCH_NS_PER_SEC;
+        double total = (double) (last - start) / BENCH_NS_PER_SEC;
+        printf("  %-28s %zu/%d devices in %.3f s, %.0f connections/s, first-to-last %.3f s (%.0f/s)\n", name,
+               latency.count, devices, total, (double) latency.count / total, spread,
+               spread > 0 ? (double) latency.count / spread : 0.0);
+    }
+    bench_samples_report(name, &latency);
+
+    bench_samples_free(&latency);
+}
+
+
+static void
+state_handler(UNUSED blynk_device_t* device, const blynk_state_event_t* event, void* data) {
+    fleet_device_t* member = data;
+
+    if (event->conn_status == BLYNK_STATE_AUTHENTICATED) {
+        atomic_store(&member->authenticated_ns, bench_now_ns());
+        atomic_fetch_add(&member->authentications, 1);
+    } else if (event->conn_status == BLYNK_STATE_DISCONNECTED) {
+        atomic_store(&member->disconnected_ns, bench_now_ns());
+    }
+}
+
+
+static void
+echo_handler(blynk_handler_params_t* params) {
+    fleet_device_t* member = params->data;
+    bool intact = params->argc == 2 && atoi(params->argv[0]) == member->index &&
+                  strlen(params->argv[1]) == ECHO_VALUE_SIZE;
+
+    atomic_fetch_add(intact ? &echoes_handled : &echoes_corrupt, 1);
+}
+
+
+static void
+on_frame(const mock_frame_t* frame, UNUSED void* data) {
+    if (frame->command != BLYNK_CMD_HARDWARE || !frame->payload) return;
+
+    // Payload is "vw\0<device>\0<stamp>", the stamp is the last argument
+    const uint8_t* stamp = frame->payload + frame->length;
+    while (stamp > frame->payload && stamp[-1] != '\0') stamp--;
+
+    char text[FORMAT_BUFFER_SIZE] = {0};
+    memcpy(text, stamp, MIN((size_t) (frame->payload + frame->length - stamp), sizeof(text) - 1));
+
+    bench_samples_add(&wire_latency, frame->received_ns - strtoull(text, NULL, 10));
+    atomic_fetch_add(&hardware_frames, 1);
+
+    // Echo "vw\0<device>\0<value>" back; a frame this size is often cut by the device's reads, so the devices
+    // decode concurrently across read boundaries
+    uint8_t echo[FORMAT_BUFFER_SIZE + ECHO_VALUE_SIZE];
+    size_t prefix = stamp - frame->payload;
+    memcpy(echo, frame->payload, prefix);
+    memset(echo + prefix, 'x', ECHO_VALUE_SIZE);
+
+    if (mock_server_send(fleet_server, frame->connection, BLYNK_CMD_HARDWARE, frame->id, echo,
+                         prefix + ECHO_VALUE_SIZE)) {
+        atomic_fetch_add(&echoes_sent, 1);
+    }
+}
+
+
+static size_t
+resident_bytes(void) {
+    unsigned long size = 0;
+    unsigned long resident = 0;
+
+    FILE* statm = fopen("/proc/self/statm", "r");
+    if (!statm) return 0;
+    if (fscanf(statm, "%lu %lu", &size, &resident) != 2) resident = 0;
+    fclose(statm);
+
+    return (size_t) resident * (size_t) sysconf(_SC_PAGESIZE);
+}
+
+
+static int
+open_descriptors(void) {
+    DIR* directory = opendir("/proc/self/fd");
+    if (!directory) return 0;
+
+    int count = 0;
+    while (readdir(directory)) count++;
+    closedir(directory);
+
+    return count;
+}
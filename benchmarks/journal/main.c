@@ -0,0 +1,272 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
+#include <sys/wait.h>
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "mock_server.h"
+
+#define DEFAULT_WRITES                  20000
+#define DEFAULT_JOURNAL_SIZE            (1024 * 1024)
+#define DEFAULT_PATH                    "/tmp/blynk_bench_journal.bin"
+#define DEFAULT_CRASH_PERCENT           50
+#define PHASE_TIMEOUT_MS                60000
+#define POLL_INTERVAL_US                1000
+#define URL_SIZE                        64
+
+
+typedef struct {
+    int writes;
+    int journal_size;
+    const char* path;
+    int crash_percent;
+} journal_options_t;
+
+
+static atomic_uchar* seen;
+static int expected_writes;
+static atomic_uint_fast64_t distinct_frames;
+static atomic_uint_fast64_t duplicate_frames;
+static atomic_uint_fast64_t hardware_frames;
+
+
+static void on_frame(const mock_frame_t* frame, void* data);
+
+static void parse_options(int argc, char** argv, journal_options_t* options);
+
+static blynk_device_t* start_device(const journal_options_t* options, const char* url, uint64_t* recovery_ns);
+
+static void write_and_crash(const journal_options_t* options);
+
+static void replay_and_run(const journal_options_t* options, const char* url);
+
+static pid_t spawn(void (* body)(const journal_options_t*, const char*), const journal_options_t* options,
+                   const char* url);
+
+static bool wait_for_frames(uint64_t target, int timeout_ms);
+
+static void kill_device(pid_t pid);
+
+
+int
+main(int argc, char** argv) {
+    journal_options_t options;
+    parse_options(argc, argv, &options);
+    signal(SIGPIPE, SIG_IGN);
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    expected_writes = options.writes;
+    seen = calloc(options.writes, sizeof(*seen));
+    if (!seen) return EXIT_FAILURE;
+
+    printf("journal: writes=%d size=%d bytes file=%s crash after %d%% of the replay\n", options.writes,
+           options.journal_size, options.path, options.crash_percent);
+
+    // Every device lives in a child that is killed without warning, like a board losing power
+    unlink(options.path);
+    pid_t writer = fork();
+    if (!writer) write_and_crash(&options);
+    waitpid(writer, NULL, 0);
+
+    mock_server_config_t server_config = {.port = 0, .on_frame = on_frame, .data = NULL};
+    mock_server_t* server = mock_server_start(&server_config);
+    if (!server) return EXIT_FAILURE;
+
+    char url[URL_SIZE];
+    mock_server_url(server, url, sizeof(url));
+
+    uint64_t start = bench_now_ns();
+    pid_t first = spawn(replay_and_run, &options, url);
+    wait_for_frames((uint64_t) options.writes * options.crash_percent / 100, PHASE_TIMEOUT_MS);
+    kill_device(first);
+
+    uint64_t before_crash = atomic_load(&distinct_frames);
+    printf("replay until crash: received=%llu distinct=%llu in %.3f s\n",
+           (unsigned long long) atomic_load(&hardware_frames), (unsigned long long) before_crash,
+           (double) (bench_now_ns() - start) / BENCH_NS_PER_SEC);
+
+    start = bench_now_ns();
+    pid_t second = spawn(replay_and_run, &options, url);
+    bool complete = wait_for_frames(options.writes, PHASE_TIMEOUT_MS);
+    double seconds = (double) (bench_now_ns() - start) / BENCH_NS_PER_SEC;
+    kill_device(second);
+
+    uint64_t distinct = atomic_load(&distinct_frames);
+    printf("replay after crash: distinct=%llu in %.3f s (%.0f frames/s)\n",
+           (unsigned long long) (distinct - before_crash), seconds, (double) (distinct - before_crash) / seconds);
+    printf("total: written=%d received=%llu lost=%llu duplicates=%llu %s\n", options.writes,
+           (unsigned long long) atomic_load(&hardware_frames), (unsigned long long) (options.writes - distinct),
+           (unsigned long long) atomic_load(&duplicate_frames), complete ? "" : "(timed out)");
+
+    mock_server_stop(server);
+    unlink(options.path);
+    return complete ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+static void
+parse_options(int argc, char** argv, journal_options_t* options) {
+    *options = (journal_options_t) {
+            .writes = DEFAULT_WRITES,
+            .journal_size = DEFAULT_JOURNAL_SIZE,
+            .path = DEFAULT_PATH,
+            .crash_percent = DEFAULT_CRASH_PERCENT,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:f:c:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options->writes = atoi(optarg);
+                break;
+            case 's':
+                options->journal_size = atoi(optarg);
+                break;
+            case 'f':
+                options->path = optarg;
+                break;
+            case 'c':
+                options->crash_percent = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n writes] [-s journal bytes] [-f journal file] "
+                                "[-c crash after percent of the replay]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->writes < 1) options->writes = 1;
+    if (options->crash_percent < 0 || options->crash_percent > 100) options->crash_percent = DEFAULT_CRASH_PERCENT;
+}
+
+
+static blynk_device_t*
+start_device(const journal_options_t* options, const char* url, uint64_t* recovery_ns) {
+    static blynk_journal_storage_t storage;
+    blynk_device_t* device = malloc(sizeof(blynk_device_t));
+
+    if (!device || blynk_begin(device, "journal-token") != BLYNK_EC_OK ||
+        blynk_journal_file_storage(&storage, options->path, options->journal_size) != BLYNK_EC_OK) {
+        exit(EXIT_FAILURE);
+    }
+
+    if (url) update_server_url(device, url);
+
+    uint64_t start = bench_now_ns();
+    if (update_journal_storage(device, &storage) != BLYNK_EC_OK) exit(EXIT_FAILURE);
+    *recovery_ns = bench_now_ns() - start;
+
+    return device;
+}
+
+
+static void
+write_and_crash(const journal_options_t* options) {
+    uint64_t recovery_ns;
+    blynk_device_t* device = start_device(options, NULL, &recovery_ns);
+    int refused = 0;
+
+    // The device never connects, every write stays in the journal
+    uint64_t start = bench_now_ns();
+    for (int i = 0; i < options->writes; ++i) {
+        if (blynk_send(device, BLYNK_CMD_HARDWARE, NO_WAITING, "sii", "vw", 1, i) != BLYNK_EC_OK) refused++;
+    }
+    double seconds = (double) (bench_now_ns() - start) / BENCH_NS_PER_SEC;
+
+    printf("append: %d writes in %.3f s (%.0f writes/s) refused=%d journal drops=%u\n", options->writes, seconds,
+           options->writes / seconds, refused, device->priv_data.journal.dropped);
+
+    raise(SIGKILL);
+}
+
+
+static void
+replay_and_run(const journal_options_t* options, const char* url) {
+    uint64_t recovery_ns;
+    blynk_device_t* device = start_device(options, url, &recovery_ns);
+
+    printf("recovery scan of %d bytes: %.3f ms\n", options->journal_size, (double) recovery_ns / BENCH_NS_PER_MS);
+    blynk_run(device);
+
+    // The parent kills this process, there is no clean shutdown
+    while (true) pause();
+}
+
+
+static pid_t
+spawn(void (* body)(const journal_options_t*, const char*), const journal_options_t* options, const char* url) {
+    pid_t pid = fork();
+    if (!pid) body(options, url);
+
+    return pid;
+}
+
+
+static bool
+wait_for_frames(uint64_t target, int timeout_ms) {
+    uint64_t deadline = bench_now_ns() + (uint64_t) timeout_ms * BENCH_NS_PER_MS;
+
+    while (atomic_load(&distinct_frames) < target) {
+        if (bench_now_ns() > deadline) return false;
+        usleep(POLL_INTERVAL_US);
+    }
+
+    return true;
+}
+
+
+static void
+kill_device(pid_t pid) {
+    kill(pid, SIGKILL);
+    waitpid(pid, NULL, 0);
+}
+
+
+static void
+on_frame(const mock_frame_t* frame, UNUSED void* data) {
+    if (frame->command != BLYNK_CMD_HARDWARE) return;
+
+    // | "vw" | '\0' | "1" | '\0' | index |
+    uint32_t index = 0;
+    uint16_t i = frame->length;
+    while (i && frame->payload[i - 1]) i--;
+    for (; i < frame->length; ++i) index = index * 10 + (frame->payload[i] - '0');
+
+    atomic_fetch_add(&hardware_frames, 1);
+    if (index >= (uint32_t) expected_writes) return;
+
+    if (atomic_exchange(&seen[index], 1)) {
+        atomic_fetch_add(&duplicate_frames, 1);
+    } else {
+        atomic_fetch_add(&distinct_frames, 1);
+    }
+}
@@ -0,0 +1,292 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "internal/packet_handler.h"
+#include "internal/protocol_parser.h"
+
+#define STREAM_SIZE                     (256 * 1024)
+#define MIN_RUN_NS                      (300 * BENCH_NS_PER_MS)
+#define CHUNKED_VALUE_SIZE              (60 * 1024)
+
+
+typedef struct {
+    const char* name;
+    uint8_t* data;
+    size_t size;
+    size_t frames;
+} bench_stream_t;
+
+
+static const size_t chunk_sizes[] = {1, 5, 16, 64, BLYNK_MAX_PAYLOAD_LEN};
+
+static const char* actions[] = {"vr", "dw", "dr", "aw", "ar", "vw"};
+
+static uint64_t handled_commands;
+static uint64_t chunked_bytes;
+static atomic_bool churn_running;
+static atomic_uint_fast64_t churn_updates;
+
+
+static void count_handler(blynk_handler_params_t* params);
+
+static void count_chunk_handler(const blynk_chunk_params_t* params);
+
+static size_t put_frame(uint8_t* out, uint8_t cmd, uint16_t id, const uint8_t* payload, uint16_t length);
+
+static void build_stream(bench_stream_t* stream, const char* name, uint8_t cmd, const uint8_t* payload,
+                         uint16_t length);
+
+static bool load_stream(bench_stream_t* stream, const char* path);
+
+static void feed_chunk(blynk_device_t* device, const uint8_t* data, size_t size);
+
+static void bench_parser(blynk_device_t* device, const bench_stream_t* stream, size_t chunk_size);
+
+static void bench_dispatch(blynk_device_t* device, uint8_t cmd, const uint8_t* payload, uint16_t length,
+                           const char* name);
+
+static void* churn_task(void* arg);
+
+
+int
+main(int argc, char** argv) {
+    blynk_device_t* device = malloc(sizeof(blynk_device_t));
+    if (!device || blynk_begin(device, "benchmark-token") != BLYNK_EC_OK) return EXIT_FAILURE;
+
+    for (size_t i = 0; i < ARRAY_SIZE(actions); ++i) {
+        blynk_register_cmd_handler(device, actions[i], count_handler, NULL);
+    }
+    blynk_register_chunk_handler(device, "tm", count_chunk_handler, NULL);
+
+    static const uint8_t small_vw[] = "vw\0" "5\0" "1";
+    uint8_t max_vw[BLYNK_MAX_PAYLOAD_LEN];
+    memcpy(max_vw, "vw\0" "7", 4);
+    for (size_t i = 4; i < sizeof(max_vw); ++i) {
+        max_vw[i] = i % 16 ? '0' + i % 10 : '\0';
+    }
+
+    uint8_t* large_tm = malloc(CHUNKED_VALUE_SIZE);
+    memcpy(large_tm, "tm", 3);
+    memset(large_tm + 3, 'x', CHUNKED_VALUE_SIZE - 3);
+
+    bench_stream_t streams[5];
+    size_t stream_count = 0;
+    build_stream(&streams[stream_count++], "RESPONSE", BLYNK_CMD_RESPONSE, NULL, BLYNK_STATUS_SUCCESS);
+    build_stream(&streams[stream_count++], "HARDWARE vw small", BLYNK_CMD_HARDWARE, small_vw, sizeof(small_vw) - 1);
+    build_stream(&streams[stream_count++], "HARDWARE vw 512B", BLYNK_CMD_HARDWARE, max_vw, sizeof(max_vw));
+    build_stream(&streams[stream_count++], "HARDWARE tm 60KiB", BLYNK_CMD_HARDWARE, large_tm, CHUNKED_VALUE_SIZE);
+
+    if (argc > 1) {
+        if (!load_stream(&streams[stream_count], argv[1])) {
+            fprintf(stderr, "cannot load recorded stream %s\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        stream_count++;
+    }
+
+    printf("parse + dispatch (decode_blynk_frames per read, reads of chunk bytes)\n");
+    for (size_t s = 0; s < stream_count; ++s) {
+        for (size_t c = 0; c < ARRAY_SIZE(chunk_sizes); ++c) {
+            bench_parser(device, &streams[s], chunk_sizes[c]);
+        }
+    }
+
+    printf("dispatch only (handle_message_packet on a decoded message)\n");
+    bench_dispatch(device, BLYNK_CMD_RESPONSE, NULL, BLYNK_STATUS_SUCCESS, "RESPONSE");
+    bench_dispatch(device, BLYNK_CMD_HARDWARE, small_vw, sizeof(small_vw) - 1, "HARDWARE vw small");
+    bench_dispatch(device, BLYNK_CMD_HARDWARE, max_vw, sizeof(max_vw), "HARDWARE vw 512B");
+
+    printf("dispatch while another thread registers and deregisters a handler\n");
+    pthread_t churn;
+    atomic_store(&churn_running, true);
+    pthread_create(&churn, NULL, churn_task, device);
+    uint64_t churn_start = bench_now_ns();
+    bench_dispatch(device, BLYNK_CMD_HARDWARE, small_vw, sizeof(small_vw) - 1, "HARDWARE vw small");
+    atomic_store(&churn_running, false);
+    pthread_join(churn, NULL);
+    printf("  %-20s %9.0f updates/s\n", "registrations",
+           (double) atomic_load(&churn_updates) * BENCH_NS_PER_SEC / (double) (bench_now_ns() - churn_start));
+
+    printf("handled commands: %llu, chunked bytes: %llu\n", (unsigned long long) handled_commands,
+           (unsigned long long) chunked_bytes);
+    return EXIT_SUCCESS;
+}
+
+
+static void
+count_handler(UNUSED blynk_handler_params_t* params) {
+    handled_commands++;
+}
+
+
+static void*
+churn_task(void* arg) {
+    blynk_device_t* device = arg;
+
+    while (atomic_load(&churn_running)) {
+        blynk_register_cmd_handler(device, "pm", count_handler, NULL);
+        blynk_deregister_cmd_handler(device, "pm");
+        atomic_fetch_add(&churn_updates, 2);
+    }
+
+    return NULL;
+}
+
+
+static void
+count_chunk_handler(const blynk_chunk_params_t* params) {
+    chunked_bytes += params->len;
+}
+
+
+static size_t
+put_frame(uint8_t* out, uint8_t cmd, uint16_t id, const uint8_t* payload, uint16_t length) {
+    out[0] = cmd;
+    out[1] = id >> BYTE_SIZE;
+    out[2] = id & BYTE_MASK;
+    out[3] = length >> BYTE_SIZE;
+    out[4] = length & BYTE_MASK;
+
+    if (cmd == BLYNK_CMD_RESPONSE) return BLYNK_HEADER_SIZE;
+
+    memcpy(out + BLYNK_HEADER_SIZE, payload, length);
+    return BLYNK_HEADER_SIZE + length;
+}
+
+
+static void
+build_stream(bench_stream_t* stream, const char* name, uint8_t cmd, const uint8_t* payload, uint16_t length) {
+    stream->name = name;
+    stream->data = malloc(STREAM_SIZE);
+    stream->size = 0;
+    stream->frames = 0;
+
+    uint16_t id = 1;
+    size_t frame_size = BLYNK_HEADER_SIZE + (cmd == BLYNK_CMD_RESPONSE ? 0 : length);
+    while (stream->size + frame_size <= STREAM_SIZE) {
+        stream->size += put_frame(stream->data + stream->size, cmd, id++, payload, length);
+        stream->frames++;
+    }
+}
+
+
+static bool
+load_stream(bench_stream_t* stream, const char* path) {
+    FILE* file = fopen(path, "rb");
+    if (!file) return false;
+
+    stream->name = "recorded";
+    stream->data = malloc(STREAM_SIZE);
+    stream->size = fread(stream->data, 1, STREAM_SIZE, file);
+    fclose(file);
+
+    // Count complete frames so ns/frame stays meaningful for captured traffic
+    stream->frames = 0;
+    size_t offset = 0;
+    while (stream->size - offset >= BLYNK_HEADER_SIZE) {
+        const uint8_t* header = stream->data + offset;
+        uint16_t length = header[3] << BYTE_SIZE | header[4];
+        size_t frame = BLYNK_HEADER_SIZE + (header[0] == BLYNK_CMD_RESPONSE ? 0 : length);
+        if (stream->size - offset < frame) break;
+        offset += frame;
+        stream->frames++;
+    }
+    stream->size = offset;
+
+    return stream->frames > 0;
+}
+
+
+static void
+feed_chunk(blynk_device_t* device, const uint8_t* data, size_t size) {
+    // Mirrors handle_read_from_main_socket: a read into the decoder space, then one decoder call per read
+    while (size) {
+        size_t room;
+        uint8_t* space = get_blynk_decoder_space(device, &room);
+        size_t count = MIN(room, size);
+
+        memcpy(space, data, count);
+        decode_blynk_frames(device, count);
+        data += count;
+        size -= count;
+    }
+}
+
+
+static void
+bench_parser(blynk_device_t* device, const bench_stream_t* stream, size_t chunk_size) {
+    if (chunk_size > sizeof(device->priv_data.read_buffer)) chunk_size = sizeof(device->priv_data.read_buffer);
+
+    uint64_t passes = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed;
+
+    do {
+        for (size_t offset = 0; offset < stream->size; offset += chunk_size) {
+            feed_chunk(device, stream->data + offset, MIN(chunk_size, stream->size - offset));
+        }
+        passes++;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < MIN_RUN_NS);
+
+    double bytes = (double) passes * stream->size;
+    double frames = (double) passes * stream->frames;
+
+    printf("  %-20s chunk=%-5zu %8.2f ns/byte %9.1f ns/frame %8.1f MB/s\n", stream->name, chunk_size,
+           (double) elapsed / bytes, (double) elapsed / frames, bytes * 1e3 / (double) elapsed);
+}
+
+
+static void
+bench_dispatch(blynk_device_t* device, uint8_t cmd, const uint8_t* payload, uint16_t length, const char* name) {
+    blynk_message_t* message = &device->priv_data.message;
+    uint8_t buffer[BLYNK_MAX_PAYLOAD_LEN + 1];
+    uint64_t frames = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed;
+
+    do {
+        for (int i = 0; i < 1024; ++i) {
+            message->command = cmd;
+            message->id = (uint16_t) i;
+            message->length = length;
+            if (payload) memcpy(buffer, payload, length);
+            handle_message_packet(device, payload ? buffer : NULL, payload ? length : 0);
+        }
+        frames += 1024;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < MIN_RUN_NS);
+
+    printf("  %-20s %9.1f ns/frame\n", name, (double) elapsed / (double) frames);
+}
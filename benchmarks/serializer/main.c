@@ -0,0 +1,224 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLE_COUNTER              1
+#endif
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "internal/dispatching.h"
+
+#define BATCH                           1024
+#define MIN_RUN_NS                      (200 * BENCH_NS_PER_MS)
+
+
+typedef void (* serialize_case_t)(char* payload, uint16_t* len);
+
+typedef struct {
+    const char* format;
+    serialize_case_t run;
+} bench_case_t;
+
+
+static void serialize(char* payload, uint16_t* len, const char* fmt, ...);
+
+static void encode_typed(char* payload, uint16_t* len, virtual_value_kind_t kind, const void* values, size_t count);
+
+static uint64_t read_cycles(void);
+
+static void bench_case(const bench_case_t* bench);
+
+
+static void case_i(char* p, uint16_t* l) { serialize(p, l, "i", -123456789); }
+
+static void case_I(char* p, uint16_t* l) { serialize(p, l, "I", 3000000000u); }
+
+static void case_l(char* p, uint16_t* l) { serialize(p, l, "l", -1234567890L); }
+
+static void case_L(char* p, uint16_t* l) { serialize(p, l, "L", 4000000000UL); }
+
+static void case_q(char* p, uint16_t* l) { serialize(p, l, "q", -1234567890123456789LL); }
+
+static void case_Q(char* p, uint16_t* l) { serialize(p, l, "Q", 12345678901234567890ULL); }
+
+static void case_f(char* p, uint16_t* l) { serialize(p, l, "f", 23.456f); }
+
+static void case_d(char* p, uint16_t* l) { serialize(p, l, "d", 1013.25); }
+
+static void case_bool(char* p, uint16_t* l) { serialize(p, l, "?", true); }
+
+static void case_s(char* p, uint16_t* l) { serialize(p, l, "s", "temperature"); }
+
+static void case_c(char* p, uint16_t* l) { serialize(p, l, "c", 'x'); }
+
+static void case_sii(char* p, uint16_t* l) { serialize(p, l, "sii", "vw", 5, 1024); }
+
+static void case_sif(char* p, uint16_t* l) { serialize(p, l, "sif", "vw", 5, 23.456f); }
+
+static void case_sid(char* p, uint16_t* l) { serialize(p, l, "sid", "vw", 5, 1013.25); }
+
+static void case_siQ(char* p, uint16_t* l) { serialize(p, l, "siQ", "vw", 5, 1700000000123456789ULL); }
+
+static void case_siiiii(char* p, uint16_t* l) { serialize(p, l, "siiiii", "vw", 5, 1, -20, 300, -4000); }
+
+static void case_sifff(char* p, uint16_t* l) { serialize(p, l, "sifff", "vw", 5, 0.5f, -12.75f, 1e6f); }
+
+static void typed_sii(char* p, uint16_t* l) { encode_typed(p, l, VIRTUAL_VALUE_INT, (int32_t[]) {1024}, 1); }
+
+static void typed_sif(char* p, uint16_t* l) { encode_typed(p, l, VIRTUAL_VALUE_FLOAT, (float[]) {23.456f}, 1); }
+
+static void typed_siiiii(char* p, uint16_t* l) {
+    encode_typed(p, l, VIRTUAL_VALUE_INT, (int32_t[]) {1, -20, 300, -4000}, 4);
+}
+
+static void typed_sifff(char* p, uint16_t* l) {
+    encode_typed(p, l, VIRTUAL_VALUE_FLOAT, (float[]) {0.5f, -12.75f, 1e6f}, 3);
+}
+
+
+static const bench_case_t cases[] = {
+        {"i",     case_i},
+        {"I",     case_I},
+        {"l",     case_l},
+        {"L",     case_L},
+        {"q",     case_q},
+        {"Q",     case_Q},
+        {"f",     case_f},
+        {"d",     case_d},
+        {"?",     case_bool},
+        {"s",     case_s},
+        {"c",     case_c},
+        {"sii",   case_sii},
+        {"sif",   case_sif},
+        {"sid",   case_sid},
+        {"siQ",   case_siQ},
+        {"siiiii", case_siiiii},
+        {"sifff", case_sifff},
+};
+
+
+// Same payloads through the typed blynk_virtual_write_* path, labelled with the equivalent format
+static const bench_case_t typed_cases[] = {
+        {"sii",    typed_sii},
+        {"sif",    typed_sif},
+        {"siiiii", typed_siiiii},
+        {"sifff",  typed_sifff},
+};
+
+
+int
+main(void) {
+#if HAVE_CYCLE_COUNTER
+    printf("construct_payload, cycles from the time stamp counter\n");
+#else
+    printf("construct_payload, no cycle counter on this host, cycles are reported as 0\n");
+#endif
+
+    for (size_t i = 0; i < ARRAY_SIZE(cases); ++i) {
+        bench_case(&cases[i]);
+    }
+
+    printf("encode_virtual_write, typed values with %d decimals\n", BLYNK_MAX_FLOAT_PRECISION);
+    for (size_t i = 0; i < ARRAY_SIZE(typed_cases); ++i) {
+        bench_case(&typed_cases[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static void
+serialize(char* payload, uint16_t* len, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    construct_payload(payload, len, BLYNK_MAX_PAYLOAD_LEN, fmt, ap);
+    va_end(ap);
+}
+
+
+static void
+encode_typed(char* payload, uint16_t* len, virtual_value_kind_t kind, const void* values, size_t count) {
+    virtual_values_t list = {.kind = kind, .values = values, .count = count, .precision = BLYNK_MAX_FLOAT_PRECISION};
+    *len = encode_virtual_write(payload, BLYNK_MAX_PAYLOAD_LEN, 5, &list);
+}
+
+
+static uint64_t
+read_cycles(void) {
+#if HAVE_CYCLE_COUNTER
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+static void
+bench_case(const bench_case_t* bench) {
+    char payload[BLYNK_MAX_PAYLOAD_LEN];
+    uint16_t len = 0;
+    uint64_t messages = 0;
+    uint64_t cycles = 0;
+    uint64_t start = bench_now_ns();
+    uint64_t elapsed;
+
+    do {
+        uint64_t first = read_cycles();
+        for (int i = 0; i < BATCH; ++i) {
+            len = 0;
+            bench->run(payload, &len);
+        }
+        cycles += read_cycles() - first;
+        messages += BATCH;
+        elapsed = bench_now_ns() - start;
+    } while (elapsed < MIN_RUN_NS);
+
+    size_t args = strlen(bench->format);
+    double cycles_per_message = (double) cycles / (double) messages;
+
+    // Render the payload with the separators visible
+    char shown[2 * BLYNK_MAX_PAYLOAD_LEN];
+    size_t pos = 0;
+    for (uint16_t i = 0; i < len && pos + 3 < sizeof(shown); ++i) {
+        if (payload[i]) {
+            shown[pos++] = payload[i];
+        } else {
+            shown[pos++] = '\\';
+            shown[pos++] = '0';
+        }
+    }
+    shown[pos] = '\0';
+
+    printf("  %-6s %7.1f ns/msg %8.1f cycles/msg %7.1f cycles/arg %4u bytes  \"%s\"\n", bench->format,
+           (double) elapsed / (double) messages, cycles_per_message, cycles_per_message / (double) args, len,
+           shown);
+}
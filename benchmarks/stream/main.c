@@ -0,0 +1,265 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <stdatomic.h>
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "mock_server.h"
+
+#define DEFAULT_MESSAGES                200
+#define DEFAULT_SIZE                    (32 * 1024)
+#define IOV_SEGMENTS                    4
+#define SEND_WAIT_MS                    1000
+#define CONNECT_TIMEOUT_MS              5000
+#define PHASE_TIMEOUT_MS                30000
+#define POLL_INTERVAL_US                100
+#define URL_SIZE                        64
+
+
+typedef enum {
+    SEND_PAYLOAD = 0,
+    SEND_STREAM,
+    SEND_IOVEC,
+} send_mode_t;
+
+
+typedef struct {
+    int messages;
+    int size;
+} stream_options_t;
+
+
+static const char* mode_names[] = {"blynk_send_payload", "blynk_send_stream", "blynk_send_iovec"};
+
+static atomic_uint_fast64_t received_frames;
+static atomic_uint_fast64_t received_bytes;
+static atomic_uint_fast64_t corrupt_frames;
+static atomic_uint_fast64_t completed_streams;
+
+
+static void on_frame(const mock_frame_t* frame, void* data);
+
+static void parse_options(int argc, char** argv, stream_options_t* options);
+
+static uint8_t pattern_byte(size_t offset);
+
+static size_t produce_pattern(void* context, size_t offset, uint8_t* out, size_t room);
+
+static void stream_done(blynk_device_t* device, blynk_err_t status, void* context);
+
+static void run_mode(blynk_device_t* device, const stream_options_t* options, send_mode_t mode,
+                     const uint8_t* payload);
+
+static bool wait_for(atomic_uint_fast64_t* counter, uint64_t target, int timeout_ms);
+
+static bool wait_for_state(blynk_device_t* device, blynk_state_t state, int timeout_ms);
+
+
+int
+main(int argc, char** argv) {
+    stream_options_t options;
+    parse_options(argc, argv, &options);
+    signal(SIGPIPE, SIG_IGN);
+
+    mock_server_config_t server_config = {.port = 0, .on_frame = on_frame, .data = NULL};
+    mock_server_t* server = mock_server_start(&server_config);
+    if (!server) return EXIT_FAILURE;
+
+    char url[URL_SIZE];
+    mock_server_url(server, url, sizeof(url));
+
+    blynk_device_t* device = malloc(sizeof(blynk_device_t));
+    if (!device || blynk_begin(device, "stream-token") != BLYNK_EC_OK) return EXIT_FAILURE;
+
+    update_server_url(device, url);
+    blynk_run(device);
+
+    if (!wait_for_state(device, BLYNK_STATE_AUTHENTICATED, CONNECT_TIMEOUT_MS)) {
+        fprintf(stderr, "device failed to authenticate against %s\n", url);
+        return EXIT_FAILURE;
+    }
+
+    // The reference payload, the producer computes the same bytes on the fly
+    uint8_t* payload = malloc(options.size);
+    if (!payload) return EXIT_FAILURE;
+    for (int i = 0; i < options.size; ++i) payload[i] = pattern_byte(i);
+
+    printf("stream: messages=%d payload=%d bytes chunk=%d bytes\n", options.messages, options.size,
+           BLYNK_STREAM_CHUNK_SIZE);
+
+    run_mode(device, &options, SEND_PAYLOAD, payload);
+    run_mode(device, &options, SEND_STREAM, payload);
+    run_mode(device, &options, SEND_IOVEC, payload);
+
+    free(payload);
+    mock_server_stop(server);
+
+    // The Blynk task has no stop API, exiting the process tears it down
+    return EXIT_SUCCESS;
+}
+
+
+static void
+parse_options(int argc, char** argv, stream_options_t* options) {
+    *options = (stream_options_t) {
+            .messages = DEFAULT_MESSAGES,
+            .size = DEFAULT_SIZE,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+        switch (opt) {
+            case 'n':
+                options->messages = atoi(optarg);
+                break;
+            case 's':
+                options->size = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-n messages] [-s payload bytes]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+
+    if (options->messages < 1) options->messages = 1;
+    if (options->size < 1 || options->size > BLYNK_MAX_STREAM_LEN) options->size = DEFAULT_SIZE;
+}
+
+
+static void
+run_mode(blynk_device_t* device, const stream_options_t* options, send_mode_t mode, const uint8_t* payload) {
+    uint64_t frames_before = atomic_load(&received_frames);
+    uint64_t bytes_before = atomic_load(&received_bytes);
+    uint64_t corrupt_before = atomic_load(&corrupt_frames);
+    uint64_t done_before = atomic_load(&completed_streams);
+    uint64_t failed = 0;
+
+    size_t segment = (options->size + IOV_SEGMENTS - 1) / IOV_SEGMENTS;
+    blynk_iovec_t iov[IOV_SEGMENTS];
+    size_t count = 0;
+    for (size_t offset = 0; offset < (size_t) options->size; offset += segment) {
+        iov[count++] = (blynk_iovec_t) {payload + offset, MIN(segment, options->size - offset)};
+    }
+
+    uint64_t start = bench_now_ns();
+
+    for (int i = 0; i < options->messages; ++i) {
+        blynk_err_t err;
+
+        switch (mode) {
+            case SEND_PAYLOAD:
+                err = blynk_send_payload(device, BLYNK_CMD_HARDWARE, BLYNK_PRIORITY_BULK, payload,
+                                         (uint16_t) options->size, SEND_WAIT_MS);
+                break;
+            case SEND_STREAM:
+                err = blynk_send_stream(device, BLYNK_CMD_HARDWARE, BLYNK_PRIORITY_BULK, options->size,
+                                        produce_pattern, stream_done, NULL, SEND_WAIT_MS);
+                break;
+            case SEND_IOVEC:
+            default:
+                err = blynk_send_iovec(device, BLYNK_CMD_HARDWARE, BLYNK_PRIORITY_BULK, iov, count, stream_done,
+                                       NULL, SEND_WAIT_MS);
+                break;
+        }
+
+        if (err != BLYNK_EC_OK) failed++;
+    }
+
+    bool complete = wait_for(&received_frames, frames_before + options->messages - failed, PHASE_TIMEOUT_MS);
+    double seconds = (double) (bench_now_ns() - start) / BENCH_NS_PER_SEC;
+    uint64_t bytes = atomic_load(&received_bytes) - bytes_before;
+
+    printf("  %-20s sent=%d failed=%llu payload bytes received=%llu (%.1f%% of sent) corrupt=%llu done=%llu "
+           "%.1f MB/s%s\n", mode_names[mode], options->messages, (unsigned long long) failed,
+           (unsigned long long) bytes, 100.0 * bytes / ((double) options->size * options->messages),
+           (unsigned long long) (atomic_load(&corrupt_frames) - corrupt_before),
+           (unsigned long long) (atomic_load(&completed_streams) - done_before),
+           bytes / seconds / (1024 * 1024), complete ? "" : " (timed out)");
+}
+
+
+static uint8_t
+pattern_byte(size_t offset) {
+    return (uint8_t) (offset * 31 + (offset >> 8));
+}
+
+
+static size_t
+produce_pattern(UNUSED void* context, size_t offset, uint8_t* out, size_t room) {
+    for (size_t i = 0; i < room; ++i) out[i] = pattern_byte(offset + i);
+    return room;
+}
+
+
+static void
+stream_done(UNUSED blynk_device_t* device, blynk_err_t status, UNUSED void* context) {
+    if (status == BLYNK_EC_OK) atomic_fetch_add(&completed_streams, 1);
+}
+
+
+static bool
+wait_for(atomic_uint_fast64_t* counter, uint64_t target, int timeout_ms) {
+    uint64_t deadline = bench_now_ns() + (uint64_t) timeout_ms * BENCH_NS_PER_MS;
+
+    while (atomic_load(counter) < target) {
+        if (bench_now_ns() > deadline) return false;
+        usleep(POLL_INTERVAL_US);
+    }
+
+    return true;
+}
+
+
+static void
+on_frame(const mock_frame_t* frame, UNUSED void* data) {
+    if (frame->command != BLYNK_CMD_HARDWARE) return;
+
+    bool intact = true;
+    for (uint16_t i = 0; i < frame->length && intact; ++i) intact = frame->payload[i] == pattern_byte(i);
+
+    atomic_fetch_add(&received_bytes, frame->length);
+    if (!intact) atomic_fetch_add(&corrupt_frames, 1);
+    atomic_fetch_add(&received_frames, 1);
+}
+
+
+
+static bool
+wait_for_state(blynk_device_t* device, blynk_state_t state, int timeout_ms) {
+    uint64_t deadline = bench_now_ns() + (uint64_t) timeout_ms * BENCH_NS_PER_MS;
+
+    while (blynk_get_device_state(device) != state) {
+        if (bench_now_ns() > deadline) return false;
+        usleep(POLL_INTERVAL_US);
+    }
+
+    return true;
+}
@@ -0,0 +1,419 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "mock_server.h"
+
+#define DEFAULT_PRODUCERS               4
+#define DEFAULT_MESSAGES                20000
+#define DEFAULT_ROUND_TRIPS             5000
+#define DEFAULT_WAIT_MS                 1000
+#define MAX_IN_FLIGHT                   16
+#define CONNECT_TIMEOUT_MS              5000
+#define DRAIN_TIMEOUT_MS                60000
+#define DRAIN_IDLE_MS                   500
+#define POLL_INTERVAL_US                1000
+#define URL_SIZE                        64
+#define BATCH_FRAME_SIZE                48
+
+
+typedef struct {
+    int producers;
+    int messages;
+    int round_trips;
+    int wait_ms;
+    bool coalesce;
+    int quota;
+    int rate;
+    int burst;
+    int batch;
+    bool typed;
+} bench_options_t;
+
+
+typedef struct {
+    blynk_device_t* device;
+    int pin;
+    int messages;
+    int wait_ms;
+    int batch;
+    uint64_t failures;
+    uint64_t last_stamp;
+} producer_t;
+
+
+static bench_samples_t wire_latency;
+static bench_samples_t response_latency;
+static atomic_uint_fast64_t hardware_frames;
+static atomic_uint_fast64_t hardware_bytes;
+static atomic_uint_fast64_t last_frame_ns;
+static atomic_uint_fast64_t responses;
+static atomic_uint_fast64_t* pin_stamps;
+static uint64_t stamp_origin_ns;
+static uint64_t stamp_unit_ns = 1;
+static int pin_count;
+static sem_t in_flight;
+
+
+static void on_frame(const mock_frame_t* frame, void* data);
+
+static void* producer_task(void* arg);
+
+static void* batch_producer_task(void* arg);
+
+static void* typed_producer_task(void* arg);
+
+static void ping_handler(blynk_device_t* device, blynk_status_t status, void* data);
+
+static bool wait_for_state(blynk_device_t* device, blynk_state_t state, int timeout_ms);
+
+static void parse_options(int argc, char** argv, bench_options_t* options);
+
+static void run_throughput(blynk_device_t* device, const bench_options_t* options);
+
+static void run_round_trips(blynk_device_t* device, const bench_options_t* options);
+
+
+int
+main(int argc, char** argv) {
+    bench_options_t options;
+    parse_options(argc, argv, &options);
+    signal(SIGPIPE, SIG_IGN);
+
+    mock_server_config_t config = {.port = 0, .on_frame = on_frame, .data = NULL, .quota = options.quota};
+    mock_server_t* server = mock_server_start(&config);
+    if (!server) return EXIT_FAILURE;
+
+    char url[URL_SIZE];
+    mock_server_url(server, url, sizeof(url));
+
+    blynk_device_t* device = malloc(sizeof(blynk_device_t));
+    if (!device || blynk_begin(device, "benchmark-token") != BLYNK_EC_OK) return EXIT_FAILURE;
+
+    update_server_url(device, url);
+    update_virtual_write_coalescing(device, options.coalesce);
+    update_rate_limit(device, options.rate, options.burst);
+    blynk_run(device);
+
+    if (!wait_for_state(device, BLYNK_STATE_AUTHENTICATED, CONNECT_TIMEOUT_MS)) {
+        fprintf(stderr, "device failed to authenticate against %s\n", url);
+        return EXIT_FAILURE;
+    }
+
+    pin_count = options.producers;
+    pin_stamps = calloc(pin_count, sizeof(*pin_stamps));
+    bench_samples_init(&wire_latency, (size_t) options.producers * options.messages);
+    bench_samples_init(&response_latency, options.round_trips);
+
+    run_throughput(device, &options);
+    run_round_trips(device, &options);
+
+    mock_server_stats_t stats;
+    mock_server_get_stats(server, &stats);
+    printf("server: frames=%llu bytes=%llu reads=%llu (%.1f frames per read) logins=%llu pings=%llu "
+           "over quota=%llu\n",
+           (unsigned long long) stats.frames, (unsigned long long) stats.bytes, (unsigned long long) stats.reads,
+           stats.reads ? (double) stats.frames / stats.reads : 0.0,
+           (unsigned long long) stats.logins, (unsigned long long) stats.pings,
+           (unsigned long long) stats.quota_exceeded);
+
+    // The Blynk task has no stop API, exiting the process tears it down
+    bench_samples_free(&wire_latency);
+    bench_samples_free(&response_latency);
+    free(pin_stamps);
+    return EXIT_SUCCESS;
+}
+
+
+static void
+parse_options(int argc, char** argv, bench_options_t* options) {
+    *options = (bench_options_t) {
+            .producers = DEFAULT_PRODUCERS,
+            .messages = DEFAULT_MESSAGES,
+            .round_trips = DEFAULT_ROUND_TRIPS,
+            .wait_ms = DEFAULT_WAIT_MS,
+            .coalesce = false,
+            .quota = 0,
+            .rate = 0,
+            .burst = 1,
+            .batch = 0,
+            .typed = false,
+    };
+
+    int opt;
+    while ((opt = getopt(argc, argv, "p:n:r:w:cq:l:b:B:t")) != -1) {
+        switch (opt) {
+            case 'p':
+                options->producers = atoi(optarg);
+                break;
+            case 'n':
+                options->messages = atoi(optarg);
+                break;
+            case 'r':
+                options->round_trips = atoi(optarg);
+                break;
+            case 'w':
+                options->wait_ms = atoi(optarg);
+                break;
+            case 'c':
+                options->coalesce = true;
+                break;
+            case 'q':
+                options->quota = atoi(optarg);
+                break;
+            case 'l':
+                options->rate = atoi(optarg);
+                break;
+            case 'b':
+                options->burst = atoi(optarg);
+                break;
+            case 'B':
+                options->batch = atoi(optarg);
+                break;
+            case 't':
+                options->typed = true;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-p producers] [-n messages per producer] [-r round trips] "
+                                "[-w queue wait ms] [-c] [-q server quota msgs/s] [-l rate limit msgs/s] [-b burst] "
+                                "[-B frames per batch] [-t]\n", argv[0]);
+                exit(EXIT_FAILURE);
+        }
+    }
+}
+
+
+static void
+run_throughput(blynk_device_t* device, const bench_options_t* options) {
+    pthread_t threads[options->producers];
+    producer_t producers[options->producers];
+
+    uint64_t expected = (uint64_t) options->producers * options->messages;
+    uint64_t start = bench_now_ns();
+
+    if (options->typed) {
+        stamp_origin_ns = start;
+        stamp_unit_ns = BENCH_NS_PER_USEC;
+    }
+
+    for (int i = 0; i < options->producers; ++i) {
+        producers[i] = (producer_t) {
+                .device = device,
+                .pin = i,
+                .messages = options->messages,
+                .wait_ms = options->wait_ms,
+                .batch = options->batch,
+        };
+        pthread_create(&threads[i], NULL, options->typed ? typed_producer_task :
+                                          options->batch > 0 ? batch_producer_task : producer_task, &producers[i]);
+    }
+
+    uint64_t failures = 0;
+    for (int i = 0; i < options->producers; ++i) {
+        pthread_join(threads[i], NULL);
+        failures += producers[i].failures;
+    }
+    uint64_t enqueued = bench_now_ns();
+
+    // Coalesced writes never arrive, so with coalescing the drain ends once the server goes quiet
+    while (atomic_load(&hardware_frames) < expected - failures &&
+           bench_now_ns() - enqueued < (uint64_t) DRAIN_TIMEOUT_MS * BENCH_NS_PER_MS) {
+        uint64_t quiet_since = atomic_load(&last_frame_ns);
+        if (quiet_since < enqueued) quiet_since = enqueued;
+        if (options->coalesce && bench_now_ns() - quiet_since > (uint64_t) DRAIN_IDLE_MS * BENCH_NS_PER_MS) break;
+        usleep(POLL_INTERVAL_US);
+    }
+
+    uint64_t received = atomic_load(&hardware_frames);
+    uint64_t end = received ? atomic_load(&last_frame_ns) : bench_now_ns();
+    double seconds = (double) (end - start) / BENCH_NS_PER_SEC;
+
+    int fresh = 0;
+    for (int i = 0; i < options->producers; ++i) {
+        fresh += atomic_load(&pin_stamps[i]) == producers[i].last_stamp;
+    }
+
+    printf("throughput: producers=%d messages=%llu failed=%llu received=%llu coalescing=%s batch=%d api=%s\n",
+           options->producers, (unsigned long long) expected, (unsigned long long) failures,
+           (unsigned long long) received, options->coalesce ? "on" : "off", options->batch,
+           options->typed ? "blynk_virtual_write_int" : "blynk_send");
+    if (options->coalesce) {
+        printf("  coalesced %llu writes, latest value delivered on %d/%d pins\n",
+               (unsigned long long) (expected - failures - received), fresh, options->producers);
+    }
+    printf("  %-28s %.0f msgs/s, %.0f bytes/s on the wire (%.3f s)\n", "blynk_send -> server",
+           (double) received / seconds, (double) atomic_load(&hardware_bytes) / seconds, seconds);
+    bench_samples_report("enqueue-to-wire", &wire_latency);
+}
+
+
+static void*
+producer_task(void* arg) {
+    producer_t* producer = arg;
+
+    for (int i = 0; i < producer->messages; ++i) {
+        unsigned long long stamp = bench_now_ns();
+        if (blynk_send(producer->device, BLYNK_CMD_HARDWARE, producer->wait_ms, "siQ", "vw", producer->pin,
+                       stamp) != BLYNK_EC_OK) {
+            producer->failures++;
+        } else {
+            producer->last_stamp = stamp;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void*
+batch_producer_task(void* arg) {
+    producer_t* producer = arg;
+    uint8_t buffer[producer->batch * BATCH_FRAME_SIZE];
+    blynk_batch_t batch;
+
+    for (int i = 0; i < producer->messages; i += producer->batch) {
+        int frames = MIN(producer->batch, producer->messages - i);
+        unsigned long long stamp = 0;
+
+        blynk_batch_begin(&batch, producer->device, buffer, sizeof(buffer));
+        for (int j = 0; j < frames; ++j) {
+            stamp = bench_now_ns();
+            blynk_batch_add(&batch, "siQ", "vw", producer->pin, stamp);
+        }
+
+        if (blynk_batch_commit(&batch, producer->wait_ms) != BLYNK_EC_OK) {
+            producer->failures += frames;
+        } else {
+            producer->last_stamp = stamp;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void*
+typed_producer_task(void* arg) {
+    producer_t* producer = arg;
+
+    // The stamp has to fit in an int32_t, so it is sent in microseconds since the start of the run
+    for (int i = 0; i < producer->messages; ++i) {
+        int32_t stamp = (int32_t) ((bench_now_ns() - stamp_origin_ns) / stamp_unit_ns);
+        if (blynk_virtual_write_int(producer->device, producer->pin, stamp, producer->wait_ms) != BLYNK_EC_OK) {
+            producer->failures++;
+        } else {
+            producer->last_stamp = stamp_origin_ns + (uint64_t) stamp * stamp_unit_ns;
+        }
+    }
+
+    return NULL;
+}
+
+
+static void
+run_round_trips(blynk_device_t* device, const bench_options_t* options) {
+    sem_init(&in_flight, 0, MAX_IN_FLIGHT);
+    uint64_t* stamps = calloc(options->round_trips, sizeof(uint64_t));
+    uint64_t failures = 0;
+    uint64_t start = bench_now_ns();
+
+    for (int i = 0; i < options->round_trips; ++i) {
+        sem_wait(&in_flight);
+        stamps[i] = bench_now_ns();
+        if (blynk_send_with_callback(device, BLYNK_CMD_PING, ping_handler, &stamps[i], options->wait_ms,
+                                     "") != BLYNK_EC_OK) {
+            sem_post(&in_flight);
+            failures++;
+        }
+    }
+
+    for (int i = 0; i < MAX_IN_FLIGHT; ++i) {
+        sem_wait(&in_flight);
+    }
+
+    double seconds = (double) (bench_now_ns() - start) / BENCH_NS_PER_SEC;
+
+    printf("round trips: requests=%d failed=%llu answered=%llu in-flight<=%d\n", options->round_trips,
+           (unsigned long long) failures, (unsigned long long) atomic_load(&responses), MAX_IN_FLIGHT);
+    printf("  %-28s %.0f req/s\n", "ping -> response", (double) atomic_load(&responses) / seconds);
+    bench_samples_report("request-to-response", &response_latency);
+
+    free(stamps);
+}
+
+
+static void
+ping_handler(UNUSED blynk_device_t* device, blynk_status_t status, void* data) {
+    if (status == BLYNK_STATUS_SUCCESS) {
+        bench_samples_add(&response_latency, bench_now_ns() - *(uint64_t*) data);
+        atomic_fetch_add(&responses, 1);
+    }
+    sem_post(&in_flight);
+}
+
+
+static void
+on_frame(const mock_frame_t* frame, UNUSED void* data) {
+    if (frame->command != BLYNK_CMD_HARDWARE || !frame->payload) return;
+
+    // Payload is "vw\0<pin>\0<stamp>", the stamp is the last argument
+    const uint8_t* stamp = frame->payload + frame->length;
+    while (stamp > frame->payload && stamp[-1] != '\0') stamp--;
+
+    char text[FORMAT_BUFFER_SIZE] = {0};
+    memcpy(text, stamp, MIN((size_t) (frame->payload + frame->length - stamp), sizeof(text) - 1));
+    uint64_t sent_ns = stamp_origin_ns + strtoull(text, NULL, 10) * stamp_unit_ns;
+
+    int pin = atoi((const char*) frame->payload + sizeof("vw"));
+    if (pin >= 0 && pin < pin_count) atomic_store(&pin_stamps[pin], sent_ns);
+
+    bench_samples_add(&wire_latency, frame->received_ns - sent_ns);
+    atomic_fetch_add(&hardware_bytes, BLYNK_HEADER_SIZE + frame->length);
+    atomic_store(&last_frame_ns, frame->received_ns);
+    atomic_fetch_add(&hardware_frames, 1);
+}
+
+
+static bool
+wait_for_state(blynk_device_t* device, blynk_state_t state, int timeout_ms) {
+    uint64_t deadline = bench_now_ns() + (uint64_t) timeout_ms * BENCH_NS_PER_MS;
+
+    while (blynk_get_device_state(device) != state) {
+        if (bench_now_ns() > deadline) return false;
+        usleep(POLL_INTERVAL_US);
+    }
+
+    return true;
+}
@@ -0,0 +1,366 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+
+#include "blynk.h"
+#include "stuff/util.h"
+#include "bench_stuff.h"
+#include "internal/deadlines.h"
+#include "internal/message_ring.h"
+#include "internal/internal_comm.h"
+#include "internal/protocol_stuff.h"
+#include "internal/protocol_parser.h"
+
+#define MAX_PENDING_RESPONSES           4096
+#define TICKS_PER_SECOND                (1000 / custom_port_tick_max_rate)
+#define TICKS_PER_DAY                   (86400ULL * TICKS_PER_SECOND)
+#define USER_SLOTS                      (BLYNK_MAX_AWAITING - 1)
+
+
+typedef struct {
+    const char* name;
+    tick_t start;
+    uint64_t duration;
+    uint32_t heartbeat_ms;
+    uint32_t timeout_ms;
+    tick_t rtt;
+    int outstanding;
+} scenario_t;
+
+
+typedef struct {
+    tick_t due;
+    uint16_t id;
+} pending_response_t;
+
+
+typedef struct {
+    uint64_t wakeups;
+    uint64_t heartbeats;
+    uint64_t responses;
+    uint64_t timeouts;
+    uint64_t issued;
+    uint64_t disconnects;
+    uint64_t no_memory;
+    uint64_t unanswered;
+    int wanted;
+    uint64_t fired;
+    uint64_t late;
+    uint64_t max_late;
+    uint64_t max_heartbeat_gap;
+    bool have_heartbeat;
+    tick_t last_heartbeat;
+} sim_stats_t;
+
+
+static tick_t virtual_now;
+static sim_stats_t stats;
+static pending_response_t pending[MAX_PENDING_RESPONSES];
+static size_t pending_head;
+static size_t pending_count;
+static bool disconnected;
+static const scenario_t* current;
+
+
+static const scenario_t scenarios[] = {
+        {
+                .name = "49.7 days uptime across tick wraparound",
+                .start = 0,
+                .duration = (1ULL << 32) + 3600ULL * 1000,
+                .heartbeat_ms = 2000, .timeout_ms = 5000, .rtt = 20, .outstanding = 0,
+        },
+        {
+                .name = "heartbeat deadline landing on tick 0",
+                .start = (tick_t) (0 - 5 * 2000),
+                .duration = 60 * 1000,
+                .heartbeat_ms = 2000, .timeout_ms = 5000, .rtt = 20, .outstanding = 0,
+        },
+        {
+                .name = "31 awaiting slots timing out around the wrap",
+                .start = (tick_t) (0 - 10 * 1000),
+                .duration = 10 * 60 * 1000,
+                .heartbeat_ms = 2000, .timeout_ms = 5000, .rtt = 20, .outstanding = USER_SLOTS,
+        },
+        {
+                .name = "heartbeat storm, 10 ms interval, 200 ms rtt",
+                .start = 1000,
+                .duration = 10 * 1000,
+                .heartbeat_ms = 10, .timeout_ms = 5000, .rtt = 200, .outstanding = 0,
+        },
+        {
+                .name = "heartbeat storm, 10 ms interval, 400 ms rtt",
+                .start = 1000,
+                .duration = 10 * 1000,
+                .heartbeat_ms = 10, .timeout_ms = 5000, .rtt = 400, .outstanding = 0,
+        },
+};
+
+
+static tick_t virtual_clock(void);
+
+static void run_scenario(blynk_device_t* device, const scenario_t* scenario);
+
+static void start_connection(blynk_device_t* device, const scenario_t* scenario);
+
+static void issue_requests(blynk_device_t* device);
+
+static void transmit_queued(blynk_device_t* device);
+
+static void deliver_due_responses(blynk_device_t* device);
+
+static void account_expired_deadlines(blynk_device_t* device);
+
+static void request_handler(UNUSED blynk_device_t* device, blynk_status_t status, UNUSED void* data);
+
+static void state_handler(blynk_device_t* device, const blynk_state_event_t* event, void* data);
+
+
+int
+main(void) {
+    set_tick_source(virtual_clock);
+
+    blynk_device_t* device = malloc(sizeof(blynk_device_t));
+    if (!device || blynk_begin(device, "simulation-token") != BLYNK_EC_OK) return EXIT_FAILURE;
+    update_default_state_handler(device, state_handler, NULL);
+
+    for (size_t i = 0; i < ARRAY_SIZE(scenarios); ++i) {
+        run_scenario(device, &scenarios[i]);
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+static tick_t
+virtual_clock(void) {
+    return virtual_now;
+}
+
+
+static void
+run_scenario(blynk_device_t* device, const scenario_t* scenario) {
+    memset(&stats, 0, sizeof(stats));
+    current = scenario;
+    virtual_now = scenario->start;
+
+    update_heartbeat_interval(device, scenario->heartbeat_ms);
+    update_default_timeout(device, scenario->timeout_ms);
+    start_connection(device, scenario);
+
+    uint64_t elapsed = 0;
+    uint64_t wall_start = bench_now_ns();
+
+    while (elapsed < scenario->duration) {
+        issue_requests(device);
+        transmit_queued(device);
+
+        if (disconnected) {
+            stats.disconnects++;
+            start_connection(device, scenario);
+            continue;
+        }
+
+        // The network loop sleeps in select() until the closest deadline or incoming data
+        tick_t sleep = 0;
+        bool has_deadline = determined_closest_deadline(device, &sleep);
+
+        if (pending_count) {
+            tick_t until_response = pending[pending_head].due - virtual_now;
+            if (!has_deadline || until_response < sleep) sleep = until_response;
+            has_deadline = true;
+        }
+
+        if (!has_deadline) break;
+
+        virtual_now += sleep;
+        elapsed += sleep;
+        stats.wakeups++;
+
+        deliver_due_responses(device);
+        account_expired_deadlines(device);
+
+        blynk_err_t status = manage_communication_deadlines(device);
+        if (status != BLYNK_EC_OK) disconnect_device(device, status, 0);
+    }
+
+    double wall = (double) (bench_now_ns() - wall_start) / BENCH_NS_PER_SEC;
+    double days = (double) elapsed / TICKS_PER_DAY;
+
+    printf("%s\n", scenario->name);
+    printf("  simulated %.3f days (ticks %u -> %u) in %.2f s wall, x%.0f\n", days, scenario->start, virtual_now,
+           wall, (double) elapsed / TICKS_PER_SECOND / wall);
+    printf("  wakeups=%llu heartbeats=%llu responses=%llu issued=%llu timeouts=%llu\n",
+           (unsigned long long) stats.wakeups, (unsigned long long) stats.heartbeats,
+           (unsigned long long) stats.responses, (unsigned long long) stats.issued,
+           (unsigned long long) stats.timeouts);
+    printf("  disconnects=%llu (out of slots or queue space=%llu, heartbeat timeout=%llu)\n",
+           (unsigned long long) stats.disconnects, (unsigned long long) stats.no_memory,
+           (unsigned long long) stats.unanswered);
+    printf("  timers fired=%llu late=%llu max lateness=%llu ticks, max heartbeat gap=%llu ticks (interval %u)\n",
+           (unsigned long long) stats.fired, (unsigned long long) stats.late, (unsigned long long) stats.max_late,
+           (unsigned long long) stats.max_heartbeat_gap, scenario->heartbeat_ms / custom_port_tick_max_rate);
+}
+
+
+static void
+start_connection(blynk_device_t* device, const scenario_t* scenario) {
+    // Same reset as prepare_device_communication on a fresh socket
+    memset(device->priv_data.awaiting, 0, sizeof(device->priv_data.awaiting));
+    for (uint8_t lane = 0; lane < BLYNK_PRIORITY_LANES; ++lane) {
+        message_ring_reset(&device->priv_data.lanes[lane].ring);
+        device->priv_data.lanes[lane].last_prepared = NULL;
+    }
+    reset_blynk_decoder(device);
+    device->priv_data.request_id = 1;
+    device->priv_data.bytes_written = 0;
+    pending_head = pending_count = 0;
+    disconnected = false;
+    stats.have_heartbeat = false;
+
+    update_device_communication_state(device, BLYNK_STATE_AUTHENTICATED);
+    update_heartbeat_deadline(device);
+
+    stats.wanted = scenario->outstanding;
+}
+
+
+static void
+issue_requests(blynk_device_t* device) {
+    // The simulated server never answers HARDWARE_SYNC, so every request runs into its timeout.
+    while (stats.wanted > 0 && !disconnected) {
+        if (blynk_send_with_callback(device, BLYNK_CMD_HARDWARE_SYNC, request_handler, NULL, NO_WAITING, "") !=
+            BLYNK_EC_OK) {
+            break;
+        }
+
+        stats.wanted--;
+        stats.issued++;
+        transmit_queued(device);
+    }
+}
+
+
+static void
+transmit_queued(blynk_device_t* device) {
+    // Control lane first, like the network task
+    for (uint8_t lane = 0; lane < BLYNK_PRIORITY_LANES; ++lane) {
+        blynk_queued_packet_t* packet;
+
+        for (; (packet = blynk_first_packet(device, lane)); blynk_release_packets(device, lane, 1)) {
+            uint16_t id = packet->frame[1] << BYTE_SIZE | packet->frame[2];
+
+            if (!id) {
+                id = allocate_request_id(device, packet->deadline, packet->handler, packet->data);
+                if (!id) {
+                    disconnect_device(device, BLYNK_EC_MEM, 0);
+                    return;
+                }
+            }
+
+            if (packet->frame[0] != BLYNK_CMD_PING) continue;
+
+            uint64_t gap = (tick_t) (virtual_now - stats.last_heartbeat);
+            if (stats.have_heartbeat && gap > stats.max_heartbeat_gap) stats.max_heartbeat_gap = gap;
+            stats.last_heartbeat = virtual_now;
+            stats.have_heartbeat = true;
+            stats.heartbeats++;
+
+            if (pending_count < MAX_PENDING_RESPONSES) {
+                pending[(pending_head + pending_count++) % MAX_PENDING_RESPONSES] = (pending_response_t) {
+                        .due = virtual_now + current->rtt,
+                        .id = id,
+                };
+            }
+        }
+    }
+
+    // Drain the wakeup datagrams blynk_notify_packet_ready writes for the network task
+    uint8_t drain[64];
+    while (recv(device->priv_data.ctl_sockets[READ_SOCK_ID], drain, sizeof(drain), MSG_DONTWAIT) > 0);
+}
+
+
+static void
+deliver_due_responses(blynk_device_t* device) {
+    while (pending_count && (int32_t) (pending[pending_head].due - virtual_now) <= 0) {
+        pending_response_t* response = &pending[pending_head];
+        const uint8_t frame[BLYNK_HEADER_SIZE] = {
+                BLYNK_CMD_RESPONSE, response->id >> BYTE_SIZE, response->id & BYTE_MASK,
+                BLYNK_STATUS_SUCCESS >> BYTE_SIZE, BLYNK_STATUS_SUCCESS & BYTE_MASK,
+        };
+
+        size_t room;
+        memcpy(get_blynk_decoder_space(device, &room), frame, sizeof(frame));
+        decode_blynk_frames(device, sizeof(frame));
+
+        pending_head = (pending_head + 1) % MAX_PENDING_RESPONSES;
+        pending_count--;
+        stats.responses++;
+    }
+}
+
+
+static void
+account_expired_deadlines(blynk_device_t* device) {
+    const blynk_private_data_t* priv_data = &device->priv_data;
+    tick_t deadlines[BLYNK_MAX_AWAITING + 1];
+    size_t count = 0;
+
+    for (size_t i = 0; i < BLYNK_MAX_AWAITING; ++i) {
+        if (priv_data->awaiting[i].id && priv_data->awaiting[i].deadline) {
+            deadlines[count++] = priv_data->awaiting[i].deadline;
+        }
+    }
+    if (priv_data->heartbit_deadline) deadlines[count++] = priv_data->heartbit_deadline;
+
+    for (size_t i = 0; i < count; ++i) {
+        int32_t lateness = (int32_t) (virtual_now - deadlines[i]);
+        if (lateness < 0) continue;
+
+        stats.fired++;
+        if (lateness > 0) stats.late++;
+        if ((uint64_t) lateness > stats.max_late) stats.max_late = lateness;
+    }
+}
+
+
+static void
+request_handler(UNUSED blynk_device_t* device, blynk_status_t status, UNUSED void* data) {
+    if (status == BLYNK_STATUS_TIMEOUT) stats.timeouts++;
+    stats.wanted++;
+}
+
+
+static void
+state_handler(UNUSED blynk_device_t* device, const blynk_state_event_t* event, UNUSED void* data) {
+    if (event->conn_status != BLYNK_STATE_DISCONNECTED) return;
+
+    disconnected = true;
+    if (event->disconnected.reason == BLYNK_EC_MEM) stats.no_memory++;
+    if (event->disconnected.reason == BLYNK_EC_TIMEOUT) stats.unanswered++;
+}
@@ -13,6 +13,9 @@
 #include "stuff/types.h"
 #include "stuff/exceptions.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /**
  * Initializes a Blynk device using the provided authentication token.
@@ -66,6 +69,233 @@ blynk_err_t blynk_send_with_callback(blynk_device_t* device, uint8_t cmd, blynk_
 blynk_err_t blynk_send(blynk_device_t* device, blynk_cmd_t cmd, tick_t wait, const char* fmt, ...);
 
 
+/**
+ * Sends a Blynk request with a formatted payload in the given priority lane.
+ *
+ * Frames in the BLYNK_PRIORITY_CONTROL lane are always written before frames in the
+ * BLYNK_PRIORITY_BULK lane. Heartbeat pings and responses use the control lane, while
+ * blynk_send and blynk_send_with_callback queue in the bulk lane. Control writes never go
+ * through the journal or the offline buffer, so they fail with BLYNK_EC_NOT_CONNECTED or
+ * BLYNK_EC_NOT_AUTHENTICATED while the device is offline.
+ *
+ * @param device Pointer to the device structure.
+ * @param cmd Command code for the Blynk request.
+ * @param priority Lane to queue the request in.
+ * @param wait Duration to wait for.
+ * @param fmt Format string for the payload.
+ * @param ... Additional arguments for formatting the payload.
+ *
+ * @return Status code indicating the result of the operation.
+ */
+blynk_err_t blynk_send_with_priority(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, tick_t wait,
+                                     const char* fmt, ...);
+
+
+/**
+ * Sends a Blynk request whose payload is already serialized.
+ *
+ * The payload holds the values separated by '\0', as blynk_send would build them, and is
+ * copied into the outgoing ring without being parsed. It is clamped to BLYNK_MAX_PAYLOAD_LEN bytes.
+ *
+ * @param device Pointer to the device structure.
+ * @param cmd Command code for the Blynk request.
+ * @param priority Lane to queue the request in.
+ * @param payload Serialized payload, may be NULL when len is 0.
+ * @param len Payload length.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_send_payload(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, const void* payload,
+                               uint16_t len, tick_t wait);
+
+
+/**
+ * Sends a Blynk request with a payload of up to BLYNK_MAX_STREAM_LEN bytes, produced while it is written.
+ *
+ * Only the header and a small descriptor are queued. The network task asks the producer for
+ * the payload in chunks of at most BLYNK_STREAM_CHUNK_SIZE bytes and writes each chunk to the
+ * socket, so no buffer of the full payload size is needed. The producer fills out with the
+ * payload bytes starting at offset and returns how many it wrote, at least one. It may be asked
+ * for the same offset again after a short write. Other requests in the same lane wait until the
+ * stream is done. Streams are neither clamped nor kept by the journal or the offline buffer.
+ *
+ * All callbacks are executed from the Blynk client task.
+ *
+ * @param device Pointer to the device structure.
+ * @param cmd Command code for the Blynk request.
+ * @param priority Lane to queue the request in.
+ * @param len Payload length, from 1 to BLYNK_MAX_STREAM_LEN.
+ * @param producer Writes the payload piece by piece.
+ * @param done Called with BLYNK_EC_OK once the payload is on the wire, or with
+ *             BLYNK_EC_DEVICE_DISCONNECT if the connection broke first. May be NULL.
+ * @param context Data passed to producer and done.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_send_stream(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, size_t len,
+                              blynk_stream_producer_t producer, blynk_stream_done_t done, void* context,
+                              tick_t wait);
+
+
+/**
+ * Sends a Blynk request whose payload is gathered from several buffers, without copying them.
+ *
+ * Works like blynk_send_stream, with the buffers written straight to the socket. The buffers
+ * and the iov array must stay unchanged until done is called.
+ *
+ * @param device Pointer to the device structure.
+ * @param cmd Command code for the Blynk request.
+ * @param priority Lane to queue the request in.
+ * @param iov Buffers of the payload, in order, BLYNK_MAX_STREAM_LEN bytes at most in total.
+ * @param count Number of buffers.
+ * @param done Called like the one of blynk_send_stream, may be NULL.
+ * @param context Data passed to done.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_send_iovec(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority,
+                             const blynk_iovec_t* iov, size_t count, blynk_stream_done_t done, void* context,
+                             tick_t wait);
+
+
+/**
+ * Writes an integer to a virtual pin.
+ *
+ * Same frame as blynk_send(device, BLYNK_CMD_HARDWARE, wait, "sii", "vw", pin, value), but the
+ * payload is encoded straight into the outgoing ring without a format string or snprintf.
+ *
+ * @param device Pointer to the device structure.
+ * @param pin Virtual pin number.
+ * @param value Value to write.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_virtual_write_int(blynk_device_t* device, uint16_t pin, int32_t value, tick_t wait);
+
+
+/**
+ * Writes a float with a fixed number of decimals to a virtual pin.
+ *
+ * @param device Pointer to the device structure.
+ * @param pin Virtual pin number.
+ * @param value Value to write.
+ * @param precision Number of decimals, at most BLYNK_MAX_FLOAT_PRECISION, or BLYNK_FLOAT_SHORTEST for the
+ *                  fewest digits that read back as the same float.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_virtual_write_float(blynk_device_t* device, uint16_t pin, float value, uint8_t precision,
+                                      tick_t wait);
+
+
+/**
+ * Writes a string to a virtual pin.
+ *
+ * @param device Pointer to the device structure.
+ * @param pin Virtual pin number.
+ * @param value Null-terminated string to write.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_virtual_write_str(blynk_device_t* device, uint16_t pin, const char* value, tick_t wait);
+
+
+/**
+ * Writes several integers to one virtual pin in a single frame, e.g. for a multi-value widget.
+ *
+ * @param device Pointer to the device structure.
+ * @param pin Virtual pin number.
+ * @param values Values to write.
+ * @param count Number of values.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_virtual_write_ints(blynk_device_t* device, uint16_t pin, const int32_t* values, size_t count,
+                                     tick_t wait);
+
+
+/**
+ * Writes several floats to one virtual pin in a single frame.
+ *
+ * @param device Pointer to the device structure.
+ * @param pin Virtual pin number.
+ * @param values Values to write.
+ * @param count Number of values.
+ * @param precision Number of decimals of every value, at most BLYNK_MAX_FLOAT_PRECISION, or BLYNK_FLOAT_SHORTEST.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_virtual_write_floats(blynk_device_t* device, uint16_t pin, const float* values, size_t count,
+                                       uint8_t precision, tick_t wait);
+
+
+/**
+ * Writes several strings to one virtual pin in a single frame.
+ *
+ * @param device Pointer to the device structure.
+ * @param pin Virtual pin number.
+ * @param values Null-terminated strings to write.
+ * @param count Number of values.
+ * @param wait Duration to wait for.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_virtual_write_strs(blynk_device_t* device, uint16_t pin, const char* const* values, size_t count,
+                                     tick_t wait);
+
+
+/**
+ * Starts a batch of hardware writes that are queued together.
+ *
+ * The frames are serialized into the caller's buffer by blynk_batch_add and handed to
+ * the network task by blynk_batch_commit with a single ring reservation and a single
+ * wakeup. A multi-pin snapshot therefore costs about as much as one blynk_send.
+ *
+ * @param batch Pointer to the batch to initialize.
+ * @param device Pointer to the device structure.
+ * @param buffer Memory for the serialized frames, must outlive the batch.
+ * @param size Size of the buffer in bytes.
+ *
+ * @return BLYNK_EC_OK on success, else appropriate error code.
+ */
+blynk_err_t blynk_batch_begin(blynk_batch_t* batch, blynk_device_t* device, void* buffer, size_t size);
+
+
+/**
+ * Adds a BLYNK_CMD_HARDWARE frame, e.g. a "vw" write, to a batch.
+ *
+ * @param batch Pointer to the batch.
+ * @param fmt Format string for the payload.
+ * @param ... Additional arguments for formatting the payload.
+ *
+ * @return BLYNK_EC_OK on success, or BLYNK_EC_MEM if the buffer has no room left for the frame.
+ */
+blynk_err_t blynk_batch_add(blynk_batch_t* batch, const char* fmt, ...);
+
+
+/**
+ * Queues every frame of a batch at once.
+ *
+ * The frames reach the network task together, in the order they were added, or not at
+ * all. On success the batch is empty and can be filled again. The queued batch must fit
+ * in the bulk lane, whose ring is BLYNK_BULK_RING_SIZE bytes.
+ *
+ * @param batch Pointer to the batch.
+ * @param wait Duration to wait for free space in the outgoing ring.
+ *
+ * @return BLYNK_EC_OK on successful dispatch, else appropriate error code.
+ */
+blynk_err_t blynk_batch_commit(blynk_batch_t* batch, tick_t wait);
+
+
 /**
  * Sends a response packet to Blynk.
  *
@@ -112,6 +342,117 @@ blynk_err_t update_heartbeat_interval(blynk_device_t* device, tick_t heartbit_in
 blynk_err_t update_default_reconnection_delay(blynk_device_t* device, tick_t heartbit_interval);
 
 
+/**
+ * Updates the address of the Blynk server the device connects to.
+ *
+ * @param device Pointer to the device structure.
+ * @param server_url Server address in the format "hostname:port".
+ *
+ * @return BLYNK_EC_OK on successful update, else appropriate error code.
+ */
+blynk_err_t update_server_url(blynk_device_t* device, const char* server_url);
+
+
+/**
+ * Enables or disables last-value-wins coalescing of virtual pin writes.
+ *
+ * While enabled, a "vw" write that is still waiting for the socket is dropped when a newer
+ * write to the same pin is queued, so only the freshest value goes on the wire. That includes
+ * writes held back by update_rate_limit, a replaced write does not use up a token. Writes sent
+ * with a response handler are never coalesced.
+ *
+ * @param device Pointer to the device structure.
+ * @param enabled true to coalesce, false to send every write (default).
+ *
+ * @return BLYNK_EC_OK on successful update, else appropriate error code.
+ */
+blynk_err_t update_virtual_write_coalescing(blynk_device_t* device, bool enabled);
+
+
+/**
+ * Limits the rate of outgoing messages to stay under the server message quota.
+ *
+ * A token bucket holds up to burst messages and refills at messages_per_second. A message
+ * that finds the bucket empty waits in the outgoing queue until a token is available, so
+ * it is delayed rather than dropped. Logins, pings and responses are never limited.
+ *
+ * @param device Pointer to the device structure.
+ * @param messages_per_second Sustained rate, 0 turns the limiter off (default).
+ * @param burst Number of messages that may be sent back to back, from 1 to BLYNK_MAX_RATE_BURST.
+ *
+ * @return BLYNK_EC_OK on successful update, else appropriate error code.
+ */
+blynk_err_t update_rate_limit(blynk_device_t* device, uint32_t messages_per_second, uint32_t burst);
+
+
+/**
+ * Gives the device a buffer that keeps hardware writes while it is offline.
+ *
+ * While the device is not authenticated, BLYNK_CMD_HARDWARE requests without a response
+ * handler in the bulk lane are stored in the buffer instead of being rejected, and so are the
+ * ones a broken connection left unsent. After the next login they are sent in order, before any newer
+ * write, in bursts of at most half the bulk lane that pass through the rate limiter.
+ *
+ * @param device Pointer to the device structure.
+ * @param buffer Memory for the stored frames, must outlive the device. NULL turns the buffer off (default).
+ * @param size Size of the buffer in bytes, at least BLYNK_MAX_FRAME_SIZE.
+ * @param policy BLYNK_OVERFLOW_DROP_OLDEST to make room by dropping the oldest stored writes,
+ *               BLYNK_OVERFLOW_DROP_NEWEST to reject new writes with BLYNK_EC_MEM when it is full.
+ *
+ * @return BLYNK_EC_OK on successful update, else appropriate error code.
+ */
+blynk_err_t update_offline_buffer(blynk_device_t* device, void* buffer, size_t size, blynk_overflow_policy_t policy);
+
+
+/**
+ * Gives the device a journal that keeps hardware writes across disconnects and reboots.
+ *
+ * While a journal is attached, every BLYNK_CMD_HARDWARE request without a response handler
+ * in the bulk lane is appended to it as a CRC-checked record, whatever the state of the device.
+ * Requests queued with BLYNK_PRIORITY_CONTROL skip the journal and go straight to their lane. The network
+ * task sends the records in order once the device is authenticated, and checkpoints them
+ * after a ping that follows them was answered, so writes the server may not have read
+ * are sent again after a reconnect or a reboot. Attaching scans the storage and resumes
+ * behind the last checkpoint. When the journal is full, its oldest sector is recycled.
+ * The journal takes precedence over the offline buffer.
+ *
+ * @param device Pointer to the device structure.
+ * @param storage Storage prepared by blynk_journal_file_storage, blynk_journal_partition_storage
+ *                or the application, must outlive the device. NULL detaches the journal (default).
+ *
+ * @return BLYNK_EC_OK on successful update, BLYNK_EC_INVALID_OPTION if the storage has fewer
+ *         than two sectors of at least BLYNK_JOURNAL_MIN_SECTOR_SIZE bytes, else the error of the storage.
+ */
+blynk_err_t update_journal_storage(blynk_device_t* device, blynk_journal_storage_t* storage);
+
+
+/**
+ * Prepares a journal storage backed by a data partition of the flash (ESP8266 only).
+ *
+ * @param storage Storage to fill in.
+ * @param label Label of the data partition in the partition table.
+ *
+ * @return BLYNK_EC_OK on success, BLYNK_EC_INVALID_OPTION if there is no such partition.
+ */
+blynk_err_t blynk_journal_partition_storage(blynk_journal_storage_t* storage, const char* label);
+
+
+/**
+ * Prepares a journal storage backed by a file (POSIX only).
+ *
+ * The file is created if needed and grown to size bytes, rounded down to whole sectors of
+ * BLYNK_JOURNAL_FILE_SECTOR_SIZE bytes. It is synced to disk at every checkpoint and stays
+ * open for the lifetime of the process.
+ *
+ * @param storage Storage to fill in.
+ * @param path Path of the file.
+ * @param size Size of the journal in bytes.
+ *
+ * @return BLYNK_EC_OK on success, else appropriate error code.
+ */
+blynk_err_t blynk_journal_file_storage(blynk_journal_storage_t* storage, const char* path, size_t size);
+
+
 /**
  * @brief Updates the default state handler for the Blynk device.
  *
@@ -141,6 +482,27 @@ blynk_err_t blynk_register_cmd_handler(blynk_device_t* device, const char* actio
                                        void* data);
 
 
+/**
+ * Registers a chunk handler for a specific Blynk action, for commands of any size.
+ *
+ * The handler gets the payload behind the action as it arrives, in chunks that cover total_len
+ * bytes from offset 0. A command that fits the receive buffer comes as one chunk, a larger one
+ * in as many as its reads take, without ever being held whole. The last chunk ends at total_len,
+ * a connection lost before that drops the rest. Chunks point into the receive buffer and are valid
+ * only until the handler returns. A later registration for the action replaces the handler, of
+ * either kind.
+ *
+ * @param device Pointer to the device structure.
+ * @param action Blynk action string.
+ * @param handler Callback function to handle the chunks.
+ * @param data Additional data for the handler.
+ *
+ * @return BLYNK_EC_OK on successful registration, else appropriate error code.
+ */
+blynk_err_t blynk_register_chunk_handler(blynk_device_t* device, const char* action, blynk_chunk_handler_t handler,
+                                         void* data);
+
+
 /**
  * Deregisters an existing command handler for a specific Blynk action.
  *
@@ -162,4 +524,8 @@ blynk_err_t blynk_deregister_cmd_handler(blynk_device_t* device, const char* act
  */
 blynk_err_t blynk_run(blynk_device_t* device);
 
+#ifdef __cplusplus
+}
+#endif
+
 #endif // ESP8266_BLYNK_LIB_H
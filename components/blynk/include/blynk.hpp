@@ -0,0 +1,458 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_HPP
+#define ESP8266_BLYNK_LIB_HPP
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+
+#include "blynk.h"
+#include "internal/value_encoding.h"
+
+
+/*
+ * Header-only C++17 layer over blynk_device_t.
+ *
+ * The payload of send and virtualWrite is serialized by code generated for the argument
+ * types, with no format string to walk and no varargs. It is byte for byte the payload
+ * blynk_send builds for the matching format:
+ *
+ *   - bool:                        '?'
+ *   - char:                        'c'
+ *   - signed integers:             'b', 'h', 'i', 'l', 'q', written as numbers
+ *   - unsigned integers:           'B', 'H', 'I', 'L', 'Q', written as numbers
+ *   - float:                       'f'
+ *   - double:                      'd'
+ *   - const char*, char arrays,
+ *     std::string, std::string_view: 's'
+ *
+ * Unlike blynk_send, signed char and unsigned char (int8_t and uint8_t) are written as
+ * numbers, only char is written as a character.
+ */
+namespace blynk {
+
+namespace detail {
+
+inline constexpr size_t DYNAMIC_SIZE = SIZE_MAX;
+
+template <typename T>
+inline constexpr bool dependent_false = false;
+
+
+// Numbers are encoded in place and take at most `size` bytes, texts are copied from a view
+template <typename T, typename = void>
+struct encoder {
+    static_assert(dependent_false<T>, "blynk: no payload encoding for this argument type");
+};
+
+
+template <>
+struct encoder<bool> {
+    static constexpr bool text = false;
+    static constexpr size_t size = 5;
+
+    static uint8_t encode(char* out, bool value) {
+        if (!value) {
+            std::memcpy(out, "false", 5);
+            return 5;
+        }
+
+        std::memcpy(out, "true", 4);
+        return 4;
+    }
+};
+
+
+template <>
+struct encoder<char> {
+    static constexpr bool text = false;
+    static constexpr size_t size = 1;
+
+    static uint8_t encode(char* out, char value) {
+        out[0] = value;
+        return value ? 1 : 0;
+    }
+};
+
+
+template <typename T>
+struct encoder<T, std::enable_if_t<std::is_integral_v<T> && std::is_signed_v<T>>> {
+    static constexpr bool text = false;
+    static constexpr size_t size = sizeof(T) <= sizeof(int32_t) ? ENCODED_INT32_MAX : ENCODED_INT64_MAX;
+
+    static uint8_t encode(char* out, T value) {
+        if constexpr (sizeof(T) <= sizeof(int32_t)) return encode_int32(out, value);
+        else return encode_int64(out, value);
+    }
+};
+
+
+template <typename T>
+struct encoder<T, std::enable_if_t<std::is_integral_v<T> && std::is_unsigned_v<T>>> {
+    static constexpr bool text = false;
+    static constexpr size_t size = sizeof(T) <= sizeof(uint32_t) ? ENCODED_UINT32_MAX : ENCODED_UINT64_MAX;
+
+    static uint8_t encode(char* out, T value) {
+        if constexpr (sizeof(T) <= sizeof(uint32_t)) return encode_uint32(out, value);
+        else return encode_uint64(out, value);
+    }
+};
+
+
+template <>
+struct encoder<float> {
+    static constexpr bool text = false;
+    static constexpr size_t size = ENCODED_FLOAT_SHORTEST_MAX;
+
+    static uint8_t encode(char* out, float value) {
+        return encode_float_shortest(out, value);
+    }
+};
+
+
+template <>
+struct encoder<double> {
+    static constexpr bool text = false;
+    static constexpr size_t size = ENCODED_DOUBLE_COMPACT_MAX;
+
+    static uint8_t encode(char* out, double value) {
+        return encode_double_compact(out, value);
+    }
+};
+
+
+template <>
+struct encoder<const char*> {
+    static constexpr bool text = true;
+    static constexpr size_t size = DYNAMIC_SIZE;
+
+    static std::string_view view(const char* value) {
+        return value ? std::string_view(value) : std::string_view();
+    }
+};
+
+
+template <>
+struct encoder<char*> : encoder<const char*> {
+};
+
+
+template <size_t N>
+struct encoder<char[N]> {
+    static constexpr bool text = true;
+    static constexpr size_t size = N - 1;
+
+    static std::string_view view(const char (& value)[N]) {
+        return std::string_view(value, std::find(value, value + N, '\0') - value);
+    }
+};
+
+
+template <>
+struct encoder<std::string_view> {
+    static constexpr bool text = true;
+    static constexpr size_t size = DYNAMIC_SIZE;
+
+    static std::string_view view(std::string_view value) {
+        return value;
+    }
+};
+
+
+template <>
+struct encoder<std::string> {
+    static constexpr bool text = true;
+    static constexpr size_t size = DYNAMIC_SIZE;
+
+    static std::string_view view(const std::string& value) {
+        return value;
+    }
+};
+
+
+template <typename T>
+using encoder_for = encoder<std::remove_cv_t<T>>;
+
+
+template <typename... Args>
+inline constexpr bool all_sized = ((encoder_for<Args>::size != DYNAMIC_SIZE) && ...);
+
+
+// Separators plus the widest text of every argument sized at compile time
+template <typename... Args>
+constexpr size_t known_size() {
+    size_t size = sizeof...(Args) ? sizeof...(Args) - 1 : 0;
+    ((size += encoder_for<Args>::size == DYNAMIC_SIZE ? 0 : encoder_for<Args>::size), ...);
+    return size;
+}
+
+
+/*
+ * A payload built from typed arguments.
+ *
+ * When every argument is sized at compile time the buffer holds the widest payload they can
+ * make and nothing is checked while writing. Otherwise it holds BLYNK_MAX_PAYLOAD_LEN bytes
+ * and the output is clamped exactly like construct_payload does.
+ */
+template <size_t Capacity, bool Clamped>
+class payload {
+public:
+    template <typename... Args>
+    explicit payload(const Args& ... args) {
+        size_t index = 0;
+
+        if constexpr (Clamped) {
+            (void) (put_clamped(args, ++index == sizeof...(Args)) && ...);
+        } else {
+            (put(args, ++index == sizeof...(Args)), ...);
+        }
+    }
+
+    const char* data() const {
+        return buffer_.data();
+    }
+
+    uint16_t size() const {
+        return len_;
+    }
+
+private:
+    template <typename T>
+    void put(const T& value, bool last) {
+        if constexpr (encoder_for<T>::text) {
+            std::string_view text = encoder_for<T>::view(value);
+            std::memcpy(buffer_.data() + len_, text.data(), text.size());
+            len_ += text.size();
+        } else {
+            len_ += encoder_for<T>::encode(buffer_.data() + len_, value);
+        }
+
+        if (!last) buffer_[len_++] = 0;
+    }
+
+    template <typename T>
+    bool put_clamped(const T& value, bool last) {
+        if (len_ == Capacity) return false;
+
+        size_t room = Capacity - len_;
+        size_t len;
+        size_t copied;
+
+        if constexpr (encoder_for<T>::text) {
+            std::string_view text = encoder_for<T>::view(value);
+            len = text.size();
+            copied = std::min(len, room);
+            std::memcpy(buffer_.data() + len_, text.data(), copied);
+        } else if (room >= encoder_for<T>::size) {
+            len = copied = encoder_for<T>::encode(buffer_.data() + len_, value);
+        } else {
+            char text[encoder_for<T>::size];
+            len = encoder_for<T>::encode(text, value);
+            copied = std::min(len, room);
+            std::memcpy(buffer_.data() + len_, text, copied);
+        }
+
+        len_ += copied;
+        if (copied < len) return false;
+
+        if (!last) {
+            if (len_ == Capacity) return false;
+            buffer_[len_++] = 0;
+        }
+
+        return true;
+    }
+
+    std::array<char, Capacity ? Capacity : 1> buffer_;
+    uint16_t len_ = 0;
+};
+
+
+template <typename... Args>
+using payload_for = payload<all_sized<Args...> ? known_size<Args...>() : BLYNK_MAX_PAYLOAD_LEN, !all_sized<Args...>>;
+
+} // namespace detail
+
+
+/*
+ * Registration of a command handler that lasts as long as the object.
+ *
+ * The callback is kept on the heap, so the object may be moved freely. Only one handler
+ * per action is kept by the device: a later registration replaces an earlier one, and
+ * releasing either of them removes the action. The handler runs on the Blynk client task,
+ * so release it from that task or once the device is stopped.
+ */
+class CommandHandler {
+public:
+    using Callback = std::function<void(blynk_handler_params_t&)>;
+
+    CommandHandler() = default;
+
+    CommandHandler(blynk_device_t* device, const char* action, Callback callback)
+            : callback_(std::make_unique<Callback>(std::move(callback))) {
+        status_ = blynk_register_cmd_handler(device, action, dispatch, callback_.get());
+        if (status_ != BLYNK_EC_OK) {
+            callback_.reset();
+            return;
+        }
+
+        device_ = device;
+        std::strncpy(action_, action, BLYNK_ACTION_SIZE - 1);
+    }
+
+    CommandHandler(const CommandHandler&) = delete;
+
+    CommandHandler& operator=(const CommandHandler&) = delete;
+
+    CommandHandler(CommandHandler&& other) noexcept {
+        *this = std::move(other);
+    }
+
+    CommandHandler& operator=(CommandHandler&& other) noexcept {
+        if (this != &other) {
+            reset();
+            device_ = std::exchange(other.device_, nullptr);
+            callback_ = std::move(other.callback_);
+            status_ = other.status_;
+            std::memcpy(action_, other.action_, BLYNK_ACTION_SIZE);
+        }
+
+        return *this;
+    }
+
+    ~CommandHandler() {
+        reset();
+    }
+
+    /**
+     * Deregisters the handler, if it is registered.
+     */
+    void reset() {
+        if (device_) blynk_deregister_cmd_handler(device_, action_);
+
+        device_ = nullptr;
+        callback_.reset();
+    }
+
+    /**
+     * @return Status of the registration, BLYNK_EC_OK once registered.
+     */
+    blynk_err_t status() const {
+        return status_;
+    }
+
+    explicit operator bool() const {
+        return device_ != nullptr;
+    }
+
+private:
+    static void dispatch(blynk_handler_params_t* params) {
+        (*static_cast<Callback*>(params->data))(*params);
+    }
+
+    blynk_device_t* device_ = nullptr;
+    char action_[BLYNK_ACTION_SIZE] = {};
+    std::unique_ptr<Callback> callback_;
+    blynk_err_t status_ = BLYNK_EC_OK;
+};
+
+
+/*
+ * Non-owning handle to a blynk_device_t.
+ *
+ * Every request is queued with the same wait, given at construction or by setWait.
+ */
+class Device {
+public:
+    explicit Device(blynk_device_t* device, tick_t wait = 0) : device_(device), wait_(wait) {
+    }
+
+    blynk_device_t* native() const {
+        return device_;
+    }
+
+    tick_t wait() const {
+        return wait_;
+    }
+
+    void setWait(tick_t wait) {
+        wait_ = wait;
+    }
+
+    blynk_err_t begin(const char* authentication_token) const {
+        return blynk_begin(device_, authentication_token);
+    }
+
+    blynk_err_t run() const {
+        return blynk_run(device_);
+    }
+
+    blynk_state_t state() const {
+        return blynk_get_device_state(device_);
+    }
+
+    /**
+     * Sends a request in the given lane with the arguments as its payload.
+     *
+     * Arguments sized at compile time have to fit in BLYNK_MAX_PAYLOAD_LEN even at their
+     * widest, otherwise the call does not compile. Strings make the payload clamped at run
+     * time like blynk_send does.
+     */
+    template <typename... Args>
+    blynk_err_t send(blynk_priority_t priority, blynk_cmd_t cmd, const Args& ... args) const {
+        static_assert(detail::known_size<Args...>() <= BLYNK_MAX_PAYLOAD_LEN,
+                      "blynk: the payload can outgrow BLYNK_MAX_PAYLOAD_LEN");
+
+        detail::payload_for<Args...> payload(args...);
+        return blynk_send_payload(device_, cmd, priority, payload.data(), payload.size(), wait_);
+    }
+
+    /**
+     * Sends a request in the bulk lane with the arguments as its payload.
+     */
+    template <typename... Args>
+    blynk_err_t send(blynk_cmd_t cmd, const Args& ... args) const {
+        return send(BLYNK_PRIORITY_BULK, cmd, args...);
+    }
+
+    /**
+     * Writes the arguments to a virtual pin, the same frame as
+     * blynk_send(device, BLYNK_CMD_HARDWARE, wait, "sH...", "vw", pin, ...).
+     */
+    template <typename... Args>
+    blynk_err_t virtualWrite(uint16_t pin, const Args& ... args) const {
+        return send(BLYNK_CMD_HARDWARE, "vw", pin, args...);
+    }
+
+    /**
+     * Registers a handler for a hardware command, e.g. "vw" or "vr".
+     *
+     * @return Registration that deregisters the handler when it is destroyed.
+     */
+    CommandHandler onCommand(const char* action, CommandHandler::Callback callback) const {
+        return CommandHandler(device_, action, std::move(callback));
+    }
+
+private:
+    blynk_device_t* device_;
+    tick_t wait_;
+};
+
+} // namespace blynk
+
+#endif //ESP8266_BLYNK_LIB_HPP
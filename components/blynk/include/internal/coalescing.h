@@ -0,0 +1,49 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_COALESCING_H
+#define ESP8266_BLYNK_LIB_COALESCING_H
+
+#include "stuff/types.h"
+
+
+/**
+ * @brief Check whether last-value-wins coalescing of virtual pin writes is enabled.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @return true if enabled with update_virtual_write_coalescing.
+ */
+bool virtual_write_coalescing_enabled(blynk_device_t* device);
+
+
+/**
+ * @brief Let a newly queued "vw" packet replace an older one for the same pin.
+ *
+ * If a write to the same virtual pin is still waiting in a priority lane, whether held back
+ * by the rate limiter or waiting for the socket, and none of its bytes are on the wire, its
+ * frame is emptied so the network task skips it. Packets with a response handler and anything
+ * but "vw" writes are left alone. Called by the network task only, before rate limiting.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param lane Priority lane of the packet.
+ * @param packet The packet that was just queued.
+ * @return The older packet that was dropped, or NULL.
+ */
+blynk_queued_packet_t* coalesce_virtual_write(blynk_device_t* device, uint8_t lane, blynk_queued_packet_t* packet);
+
+
+/**
+ * @brief Stop tracking a packet that is about to be released from its lane.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param packet The packet being released.
+ */
+void forget_coalesced_write(blynk_device_t* device, const blynk_queued_packet_t* packet);
+
+#endif //ESP8266_BLYNK_LIB_COALESCING_H
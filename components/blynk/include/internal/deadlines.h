@@ -0,0 +1,64 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_DEADLINES_H
+#define ESP8266_BLYNK_LIB_DEADLINES_H
+
+#include "stuff/types.h"
+#include "stuff/exceptions.h"
+
+
+/**
+ * @brief Compute an absolute deadline a number of ticks from now.
+ *
+ * A zero deadline means "no deadline" for awaiting slots and the heartbeat, so a
+ * deadline that lands exactly on tick 0 after a tick counter wraparound is moved
+ * one tick later instead of silently disabling the timer.
+ *
+ * @param ticks Number of ticks from the current tick count.
+ * @return The absolute deadline, never 0.
+ */
+tick_t deadline_after(tick_t ticks);
+
+
+/**
+ * @brief Find the closest pending deadline of a Blynk device.
+ *
+ * Walks the awaiting response slots, the heartbeat deadline and the next rate limiter token
+ * and returns the number of ticks until the earliest of them. The network loop uses it as
+ * the socket wait timeout.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param deadline Output: ticks left until the closest deadline, 0 if one already passed.
+ * @return true if any deadline is pending, false if the loop may sleep indefinitely.
+ */
+bool determined_closest_deadline(blynk_device_t* device, tick_t* deadline);
+
+
+/**
+ * @brief Fire every expired deadline of a Blynk device.
+ *
+ * Awaiting response slots whose deadline passed are released and their handlers are
+ * called with BLYNK_STATUS_TIMEOUT. When the heartbeat deadline passed a ping is queued
+ * and the next heartbeat deadline is scheduled.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @return BLYNK_EC_OK, or the error of queueing the heartbeat ping.
+ */
+blynk_err_t manage_communication_deadlines(blynk_device_t* device);
+
+
+/**
+ * @brief Schedule the next heartbeat one heartbeat interval from now.
+ *
+ * @param device Pointer to the Blynk device structure.
+ */
+void update_heartbeat_deadline(blynk_device_t* device);
+
+#endif //ESP8266_BLYNK_LIB_DEADLINES_H
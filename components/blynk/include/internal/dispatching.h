@@ -10,6 +10,8 @@
 #ifndef ESP8266_BLYNK_LIB_DISPATCHING_H
 #define ESP8266_BLYNK_LIB_DISPATCHING_H
 
+#include <stdarg.h>
+
 #include "stuff/types.h"
 #include "stuff/blynk_freertos_port.h"
 
@@ -35,14 +37,15 @@
  *   - L:    unsigned long
  *   - q:    long long
  *   - Q:    unsigned long long
- *   - f:    float
- *   - d:    double
+ *   - f:    float, shortest text that reads back as the same float
+ *   - d:    double, up to 7 decimals without trailing zeros
  *   - s,p:  char*
  *
  * All callback functions are executed from the Blynk client task.
  *
  * @param device Pointer to the Blynk device structure.
  * @param command Blynk command to be executed.
+ * @param priority Lane the request is queued in.
  * @param handler Callback function to be triggered in response to the request.
  * @param data User-specific data to be passed to the callback function.
  * @param wait The duration to wait for the request to be processed.
@@ -50,7 +53,132 @@
  * @param args Variadic arguments corresponding to the format string.
  * @return Returns an error code indicating the result of the operation.
  */
-blynk_err_t dispatch_blynk_request(blynk_device_t* device, blynk_cmd_t command, blynk_response_handler_t handler,
-                                   void* data, tick_t wait, const char* format, va_list args);
+blynk_err_t dispatch_blynk_request(blynk_device_t* device, blynk_cmd_t command, blynk_priority_t priority,
+                                   blynk_response_handler_t handler, void* data, tick_t wait, const char* format,
+                                   va_list args);
+
+
+/**
+ * @brief Queue a request whose payload is already serialized.
+ *
+ * The payload is copied into the ring of the lane as it is and clamped to
+ * BLYNK_MAX_PAYLOAD_LEN bytes.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param command Blynk command to be executed.
+ * @param priority Lane the request is queued in.
+ * @param payload Serialized payload, values separated by '\0'.
+ * @param len Payload length.
+ * @param wait The duration to wait for free space in the outgoing ring.
+ * @return Returns an error code indicating the result of the operation.
+ */
+blynk_err_t dispatch_blynk_payload(blynk_device_t* device, blynk_cmd_t command, blynk_priority_t priority,
+                                   const void* payload, uint16_t len, tick_t wait);
+
+
+/**
+ * @brief Queue a request whose payload is written to the socket in chunks.
+ *
+ * Unlike the other requests the payload is not clamped to BLYNK_MAX_PAYLOAD_LEN and never
+ * held in one piece. Streams are not kept by the journal or the offline store.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param command Blynk command to be executed.
+ * @param priority Lane the request is queued in.
+ * @param len Payload length, from 1 to BLYNK_MAX_STREAM_LEN.
+ * @param stream Source of the payload and completion callback.
+ * @param wait The duration to wait for free space in the outgoing ring.
+ * @return Returns an error code indicating the result of the operation.
+ */
+blynk_err_t dispatch_blynk_stream(blynk_device_t* device, blynk_cmd_t command, blynk_priority_t priority,
+                                  size_t len, const blynk_stream_t* stream, tick_t wait);
+
+
+typedef enum {
+    VIRTUAL_VALUE_INT = 0,
+    VIRTUAL_VALUE_FLOAT,
+    VIRTUAL_VALUE_STR,
+} virtual_value_kind_t;
+
+
+typedef struct {
+    virtual_value_kind_t kind;
+    const void* values;
+    size_t count;
+    uint8_t precision;
+} virtual_values_t;
+
+
+/**
+ * @brief Queue a "vw" write of typed values without a format string.
+ *
+ * The payload "vw\0<pin>\0<value>..." is encoded straight into the outgoing ring, and the
+ * reservation is sized for the values at hand instead of BLYNK_MAX_PAYLOAD_LEN. Output is
+ * clamped to BLYNK_MAX_PAYLOAD_LEN bytes like construct_payload does.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param pin Virtual pin number.
+ * @param values Array of int32_t, float or const char* values, as given by its kind.
+ * @param wait The duration to wait for free space in the outgoing ring.
+ * @return Returns an error code indicating the result of the operation.
+ */
+blynk_err_t dispatch_virtual_write(blynk_device_t* device, uint16_t pin, const virtual_values_t* values,
+                                   tick_t wait);
+
+
+/**
+ * @brief Encode the payload of a typed "vw" write.
+ *
+ * @param payload Output buffer of at least room bytes, and at least 16 bytes for the pin.
+ * @param room Largest payload length.
+ * @param pin Virtual pin number.
+ * @param values Values to encode.
+ * @return Payload length, at most room once the pin is written.
+ */
+uint16_t encode_virtual_write(char* payload, uint16_t room, uint16_t pin, const virtual_values_t* values);
+
+
+/**
+ * @brief Serialize a frame into a batch buffer.
+ *
+ * The frame gets message id 0 and is given a real one by the network task.
+ *
+ * @param batch Pointer to a batch prepared with blynk_batch_begin.
+ * @param command Blynk command of the frame, anything but BLYNK_CMD_RESPONSE.
+ * @param format A format string for the payload.
+ * @param args Variadic arguments corresponding to the format string.
+ * @return BLYNK_EC_OK, or BLYNK_EC_MEM if the frame does not fit in the rest of the buffer.
+ */
+blynk_err_t append_blynk_frame(blynk_batch_t* batch, blynk_cmd_t command, const char* format, va_list args);
+
+
+/**
+ * @brief Hand every frame of a batch to the network task at once.
+ *
+ * The device state is checked once for the whole batch. The batch is emptied on success
+ * and kept as it is otherwise, so the caller may try again.
+ *
+ * @param batch Pointer to the batch.
+ * @param wait The duration to wait for free space in the outgoing ring.
+ * @return Returns an error code indicating the result of the operation.
+ */
+blynk_err_t dispatch_blynk_batch(blynk_batch_t* batch, tick_t wait);
+
+
+/**
+ * @brief Serialize variadic arguments into a Blynk payload.
+ *
+ * Every argument is formatted according to its character in the format string (see
+ * dispatch_blynk_request for the format guide) and the values are separated by '\0'.
+ * Output is clamped to the given limit.
+ *
+ * @param payload Output buffer of at least limit bytes.
+ * @param len In/out payload length, must be zero-initialized by the caller.
+ * @param limit Largest payload length, at most BLYNK_MAX_PAYLOAD_LEN.
+ * @param fmt A format string for the payload.
+ * @param ap Variadic arguments corresponding to the format string.
+ * @return true if every argument fit, false if the payload was clamped.
+ */
+bool construct_payload(char* payload, uint16_t* len, uint16_t limit, const char* fmt, va_list ap);
 
 #endif //ESP8266_BLYNK_LIB_DISPATCHING_H
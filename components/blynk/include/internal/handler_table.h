@@ -0,0 +1,51 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_HANDLER_TABLE_H
+#define ESP8266_BLYNK_LIB_HANDLER_TABLE_H
+
+#include "stuff/types.h"
+
+
+/**
+ * @brief Pack a command like "vw" into the integer tag the handler table is keyed by.
+ *
+ * @param command Command bytes, terminated by '\0'.
+ * @param size Number of bytes that may be read.
+ * @return The tag, or 0 if the command is empty, longer than BLYNK_ACTION_SIZE - 1 or not
+ *         terminated within size bytes.
+ */
+uint32_t command_tag(const uint8_t* command, size_t size);
+
+
+/**
+ * @brief Add, replace or remove the handler of a tag.
+ *
+ * The change is made in the copy of the table readers do not use and then published as a whole,
+ * so it never waits for handler_table_find. Calls have to be serialized by the caller.
+ *
+ * @param table Pointer to the handler table.
+ * @param tag Tag from command_tag.
+ * @param entry The new handler, or NULL to remove the current one.
+ * @return BLYNK_EC_OK, or BLYNK_EC_MEM when BLYNK_MAX_HANDLERS handlers are registered already.
+ */
+blynk_err_t handler_table_update(blynk_handler_table_t* table, uint32_t tag, const blynk_handler_data_t* entry);
+
+
+/**
+ * @brief Look up the handler of a tag without taking a lock.
+ *
+ * @param table Pointer to the handler table.
+ * @param tag Tag from command_tag.
+ * @param found Set to a copy of the handler when there is one.
+ * @return true if a handler is registered for the tag.
+ */
+bool handler_table_find(const blynk_handler_table_t* table, uint32_t tag, blynk_handler_data_t* found);
+
+#endif //ESP8266_BLYNK_LIB_HANDLER_TABLE_H
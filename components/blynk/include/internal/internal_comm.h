@@ -10,18 +10,111 @@
 #ifndef ESP8266_BLYNK_LIB_INTERNAL_COMM_H
 #define ESP8266_BLYNK_LIB_INTERNAL_COMM_H
 
+#include <stddef.h>
+
 #include "stuff/types.h"
 #include "stuff/exceptions.h"
 
+#define PACKET_RECORD_SIZE(frame_size)  (offsetof(blynk_queued_packet_t, frame) + (frame_size))
+
+
+/**
+ * @brief Reserve room for a packet in the ring of its priority lane.
+ *
+ * Space is reserved for a frame with packet->len payload bytes in the ring selected by
+ * packet->priority, and packet->payload is
+ * pointed at the payload area inside the ring, so the caller can serialize straight into
+ * the memory the network task will write to the socket. Every successful call must be
+ * followed by blynk_commit_packet, without blocking in between.
+ *
+ * @param packet Pointer to the packet, packet->wait bounds the wait for free space.
+ * @return BLYNK_EC_OK on success or BLYNK_EC_MEM if the ring stayed full.
+ */
+blynk_err_t blynk_reserve_packet(blynk_packet_t* packet);
+
+
+/**
+ * @brief Publish a packet reserved with blynk_reserve_packet.
+ *
+ * Writes the frame header in front of the payload, which must already be in place, and
+ * sends a notification message to the device's control socket to notify that a new packet
+ * is ready.
+ *
+ * @param packet Pointer to the packet, packet->len holds the final payload length.
+ * @return BLYNK_EC_OK if the notification was successful or an error code indicating the
+ *         type of error that occurred.
+ */
+blynk_err_t blynk_commit_packet(blynk_packet_t* packet);
+
+
+/**
+ * @brief Queue a packet whose payload is produced while it is written.
+ *
+ * Only the header and the stream descriptor go into the ring of the lane. The network
+ * task writes the payload in chunks straight from the caller's memory or producer, and
+ * calls stream->done once the last byte is on the wire or the packet was dropped.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param cmd Blynk command of the packet.
+ * @param priority Lane the packet is queued in.
+ * @param len Payload length, from 1 to BLYNK_MAX_STREAM_LEN.
+ * @param stream Source of the payload, copied into the ring.
+ * @param wait Duration to wait for free space in the ring.
+ * @return BLYNK_EC_OK on success, BLYNK_EC_MEM if the ring stayed full or an error code
+ *         indicating the type of error that occurred.
+ */
+blynk_err_t blynk_notify_stream_ready(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority,
+                                      uint16_t len, const blynk_stream_t* stream, tick_t wait);
+
+
+/**
+ * @brief Get the stream descriptor of a queued packet.
+ *
+ * @param packet Packet in one of the lanes.
+ * @return The descriptor, or NULL if the packet holds its whole payload.
+ */
+blynk_stream_t* blynk_packet_stream(const blynk_queued_packet_t* packet);
+
+
+/**
+ * @brief Number of bytes a queued packet puts on the wire, header included.
+ *
+ * @param packet Packet in one of the lanes.
+ * @return frame_size, or the header plus the full payload of a streamed packet.
+ */
+size_t blynk_packet_wire_size(const blynk_queued_packet_t* packet);
+
+
+/**
+ * @brief Wake the network task, so it looks at its lanes and at stored frames again.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @return BLYNK_EC_OK if the notification was sent, BLYNK_EC_ERRNO otherwise.
+ */
+blynk_err_t blynk_wake_network_task(blynk_device_t* device);
+
+
+/**
+ * @brief Queue a run of serialized frames in the bulk lane with a single notification.
+ *
+ * All frames are copied into one ring reservation and become visible to the network
+ * task at once. None of them expects a response.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param frames Frames laid out back to back, each with a header from compose_blynk_header.
+ * @param size Total size of the frames in bytes.
+ * @param wait Duration to wait for free space in the ring.
+ * @return BLYNK_EC_OK on success, BLYNK_EC_MEM if the ring stayed full or an error code
+ *         of the notification.
+ */
+blynk_err_t blynk_commit_frames(blynk_device_t* device, const uint8_t* frames, size_t size, tick_t wait);
+
 
 /**
  * @brief Notify that a packet is ready for processing.
  *
- * This function prepares a request information structure based on the provided packet
- * and then sends this structure to a control queue for further processing. If the packet
- * contains a payload, it copies the payload into the request information structure. After
- * the structure is sent to the control queue, the function sends a notification message
- * to the device's control socket to notify that a new packet is ready.
+ * Copies a packet whose payload lives in the caller's memory into the device's control
+ * ring with blynk_reserve_packet and blynk_commit_packet.
  *
  * @param packet Pointer to the packet that is ready for processing.
  * @return BLYNK_EC_OK if the notification was successful or an error code indicating the
@@ -29,4 +122,37 @@
  */
 blynk_err_t blynk_notify_packet_ready(blynk_packet_t* packet);
 
+
+/**
+ * @brief Get the oldest packet of a priority lane without removing it.
+ *
+ * Called by the network task only. It never blocks.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param lane Priority lane, a blynk_priority_t value.
+ * @return Pointer to the packet, or NULL if the lane is empty.
+ */
+blynk_queued_packet_t* blynk_first_packet(blynk_device_t* device, uint8_t lane);
+
+
+/**
+ * @brief Get the packet queued after the given one in the same lane.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param lane Priority lane of the packet.
+ * @param packet A packet that has not been released yet.
+ * @return Pointer to the next packet, or NULL if there is none yet.
+ */
+blynk_queued_packet_t* blynk_next_packet(blynk_device_t* device, uint8_t lane, const blynk_queued_packet_t* packet);
+
+
+/**
+ * @brief Remove the oldest packets of a lane once their frames are on the wire.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param lane Priority lane of the packets.
+ * @param count Number of packets to remove.
+ */
+void blynk_release_packets(blynk_device_t* device, uint8_t lane, size_t count);
+
 #endif //ESP8266_BLYNK_LIB_INTERNAL_COMM_H
@@ -0,0 +1,92 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_JOURNAL_H
+#define ESP8266_BLYNK_LIB_JOURNAL_H
+
+#include "stuff/types.h"
+#include "internal/offline_store.h"
+
+
+/**
+ * @brief Create the lock of the journal, which starts out detached.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @return true on success, false if the lock could not be created.
+ */
+bool journal_init(blynk_device_t* device);
+
+
+/**
+ * @brief Attach a storage to the journal and recover what an earlier run left in it.
+ *
+ * Every sector is scanned once. Writing resumes behind the newest intact record, or in a
+ * fresh sector if the last one was torn by a power loss, and replay resumes behind the last
+ * checkpoint. A storage without a single intact record is formatted. A NULL storage
+ * detaches the journal.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param storage Storage for the journal, must outlive the device.
+ * @return BLYNK_EC_OK, or the error of the storage if it could not be read or erased.
+ */
+blynk_err_t journal_attach(blynk_device_t* device, blynk_journal_storage_t* storage);
+
+
+/**
+ * @brief Append a hardware frame to the journal.
+ *
+ * Every hardware write without a response handler goes to the journal while one is
+ * attached, whatever the state of the device. The network task sends it from there.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param encode Serializes the frame, it is given BLYNK_MAX_FRAME_SIZE bytes.
+ * @param context Data passed to encode.
+ * @param status Set when the frame was taken: BLYNK_EC_OK once written, BLYNK_EC_MEM if it
+ *               did not encode, BLYNK_EC_FAILED_TO_WRITE if the storage failed.
+ * @return true if the frame was taken by the journal, false if the caller has to queue it.
+ */
+bool journal_capture(blynk_device_t* device, offline_frame_encoder_t encode, void* context, blynk_err_t* status);
+
+
+/**
+ * @brief Append frames laid out back to back, one record each, without letting other
+ *        writers in between.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param frames Frames, each with a header from compose_blynk_header.
+ * @param size Total size of the frames in bytes.
+ * @param status Set when the frames were taken, like journal_capture does.
+ * @return true if the frames were taken by the journal, false if the caller has to queue them.
+ */
+bool journal_capture_frames(blynk_device_t* device, const uint8_t* frames, size_t size, blynk_err_t* status);
+
+
+/**
+ * @brief Send the next burst of journaled frames.
+ *
+ * A burst is read with one sequential read and handed over only when the bulk lane is
+ * empty. A ping in the control lane follows every burst once it is on the wire, and its
+ * response checkpoints the burst as delivered. Called by the network task while the device
+ * is authenticated.
+ *
+ * @param device Pointer to the Blynk device structure.
+ */
+void journal_replay(blynk_device_t* device);
+
+
+/**
+ * @brief Go back to the last checkpoint, so frames a broken connection may have lost are
+ *        sent again. Called by the network task before the lanes are reset.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @return true if a journal is attached, false otherwise.
+ */
+bool journal_rewind(blynk_device_t* device);
+
+#endif //ESP8266_BLYNK_LIB_JOURNAL_H
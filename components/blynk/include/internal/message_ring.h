@@ -0,0 +1,128 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_MESSAGE_RING_H
+#define ESP8266_BLYNK_LIB_MESSAGE_RING_H
+
+#include "stuff/types.h"
+
+
+/**
+ * @brief Prepare a ring of variable-length records on top of caller-provided storage.
+ *
+ * Every record is stored contiguously behind a length prefix and only takes as much
+ * room as it needs. A record that does not fit before the end of the storage starts
+ * over at the beginning, so producers and the consumer always work on plain memory.
+ *
+ * @param ring Pointer to the ring to initialize.
+ * @param storage Backing memory aligned for size_t, must outlive the ring.
+ * @param capacity Size of the backing memory in bytes, a multiple of sizeof(size_t).
+ * @return true on success, false if the synchronization primitives could not be created.
+ */
+bool message_ring_init(message_ring_t* ring, uint8_t* storage, size_t capacity);
+
+
+/**
+ * @brief Reserve contiguous space for the next record.
+ *
+ * Blocks up to the given number of ticks while the ring does not have room for the record.
+ * On success the caller owns the ring for writing until message_ring_commit, so the record
+ * must be filled in without blocking on anything else.
+ *
+ * @param ring Pointer to the ring.
+ * @param size Largest number of bytes the record may take.
+ * @param wait Ticks to wait for free space, NO_WAITING to fail immediately.
+ * @return Pointer to the reserved bytes, or NULL on timeout.
+ */
+void* message_ring_reserve(message_ring_t* ring, size_t size, tick_t wait);
+
+
+/**
+ * @brief Get the number of ring bytes a record takes, including its length prefix.
+ *
+ * @param size Size of the record in bytes.
+ * @return Footprint of the record, a multiple of sizeof(size_t).
+ */
+size_t message_ring_footprint(size_t size);
+
+
+/**
+ * @brief Reserve contiguous space for several records that are published together.
+ *
+ * Works like message_ring_reserve. The records are laid out one behind the other with
+ * message_ring_split, and message_ring_commit publishes all of them at once.
+ *
+ * @param ring Pointer to the ring.
+ * @param footprint Sum of message_ring_footprint over the records.
+ * @param wait Ticks to wait for free space, NO_WAITING to fail immediately.
+ * @return Pointer to the first record, or NULL on timeout.
+ */
+void* message_ring_reserve_span(message_ring_t* ring, size_t footprint, tick_t wait);
+
+
+/**
+ * @brief Close the record being filled in and start the next one in the same reservation.
+ *
+ * @param ring Pointer to the ring.
+ * @param size Bytes used by the closed record.
+ * @return Pointer to the next record.
+ */
+void* message_ring_split(message_ring_t* ring, size_t size);
+
+
+/**
+ * @brief Publish the records prepared by message_ring_reserve.
+ *
+ * The records are dropped if the ring was reset in the meantime.
+ *
+ * @param ring Pointer to the ring.
+ * @param size Bytes actually used by the last record, at most the reserved size. 0 drops
+ *             the last record, and the whole reservation if it was never split.
+ */
+void message_ring_commit(message_ring_t* ring, size_t size);
+
+
+/**
+ * @brief Get the oldest record without removing it.
+ *
+ * @param ring Pointer to the ring.
+ * @return Pointer to the record, or NULL if the ring is empty.
+ */
+void* message_ring_front(message_ring_t* ring);
+
+
+/**
+ * @brief Get the record published after the given one.
+ *
+ * @param ring Pointer to the ring.
+ * @param record A record returned by message_ring_front or message_ring_next and not released yet.
+ * @return Pointer to the next record, or NULL if there is none yet.
+ */
+void* message_ring_next(message_ring_t* ring, const void* record);
+
+
+/**
+ * @brief Remove the oldest records and wake writers waiting for space.
+ *
+ * Pointers to the removed records must not be used afterwards.
+ *
+ * @param ring Pointer to the ring.
+ * @param count Number of records to remove.
+ */
+void message_ring_release(message_ring_t* ring, size_t count);
+
+
+/**
+ * @brief Drop every stored record and wake writers waiting for space.
+ *
+ * @param ring Pointer to the ring.
+ */
+void message_ring_reset(message_ring_t* ring);
+
+#endif //ESP8266_BLYNK_LIB_MESSAGE_RING_H
@@ -0,0 +1,93 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_OFFLINE_STORE_H
+#define ESP8266_BLYNK_LIB_OFFLINE_STORE_H
+
+#include "stuff/types.h"
+
+
+/**
+ * @brief Serialize one frame for the offline store.
+ *
+ * @param frame Where the frame goes, header included. The id field is left at 0.
+ * @param room Bytes available at frame.
+ * @param context Data of the caller.
+ * @return Size of the frame, or 0 if it does not fit in room.
+ */
+typedef size_t (* offline_frame_encoder_t)(uint8_t* frame, size_t room, void* context);
+
+
+/**
+ * @brief Create the lock of the offline store, which starts out disabled.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @return true on success, false if the lock could not be created.
+ */
+bool offline_store_init(blynk_device_t* device);
+
+
+/**
+ * @brief Give the offline store its memory and overflow policy.
+ *
+ * Frames stored in the previous buffer are dropped. A NULL buffer or a size of 0 disables
+ * the store, any other buffer has to hold at least BLYNK_MAX_FRAME_SIZE bytes.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param buffer Memory for the frames, must outlive the device.
+ * @param size Size of the buffer in bytes.
+ * @param policy What to drop when a frame does not fit.
+ */
+void offline_store_configure(blynk_device_t* device, void* buffer, size_t size, blynk_overflow_policy_t policy);
+
+
+/**
+ * @brief Keep a hardware frame in the offline store if it cannot go out right away.
+ *
+ * The frame is stored while the device is not authenticated, and also while older frames
+ * are still waiting in the store, so the cloud gets them in order. Otherwise the caller
+ * queues the frame as usual.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param encode Serializes the frame into the store.
+ * @param context Data passed to encode.
+ * @param largest Upper bound of the frame size. Older frames are only dropped for a frame
+ *                that can fit in the whole store.
+ * @param status Set when the frame was taken: BLYNK_EC_OK once stored, BLYNK_EC_MEM if the
+ *               overflow policy dropped it.
+ * @return true if the frame was taken by the store, false if the caller has to queue it.
+ */
+bool offline_store_capture(blynk_device_t* device, offline_frame_encoder_t encode, void* context, size_t largest,
+                           blynk_err_t* status);
+
+
+/**
+ * @brief Move the next burst of stored frames into the bulk lane.
+ *
+ * A burst is handed over only when the bulk lane is empty, and holds at most
+ * BLYNK_OFFLINE_FLUSH_BURST ring bytes, so the rate limiter and the live traffic are not
+ * flooded. Called by the network task while the device is authenticated.
+ *
+ * @param device Pointer to the Blynk device structure.
+ */
+void offline_store_flush(blynk_device_t* device);
+
+
+/**
+ * @brief Save the hardware frames a broken connection left unsent in the bulk lane.
+ *
+ * The frames are put in front of the stored ones, since they were queued earlier, and get
+ * a new request id once they are flushed. Called by the network task before the lanes are
+ * reset for a new connection.
+ *
+ * @param device Pointer to the Blynk device structure.
+ */
+void offline_store_salvage(blynk_device_t* device);
+
+#endif //ESP8266_BLYNK_LIB_OFFLINE_STORE_H
@@ -19,7 +19,32 @@
  * the packet to the appropriate handler based on the command type.
  *
  * @param device Pointer to the Blynk device structure containing the packet to be processed.
+ * @param payload Payload of the message, NULL when it has none. The byte past the payload must be
+ *                writable, it terminates the last argument while the handler runs.
+ * @param length Number of payload bytes.
  */
-void handle_message_packet(blynk_device_t* device);
+void handle_message_packet(blynk_device_t* device, uint8_t* payload, uint16_t length);
+
+
+/**
+ * @brief Start handing a hardware command too large for the receive buffer to its chunk handler.
+ *
+ * @param device Pointer to the Blynk device structure, its message holds the decoded header.
+ * @param payload Payload bytes received so far.
+ * @param available Number of payload bytes received so far.
+ * @return true if the command has a chunk handler and the received bytes were delivered, false if
+ *         its action is not complete yet or it has no chunk handler.
+ */
+bool begin_inbound_stream(blynk_device_t* device, const uint8_t* payload, size_t available);
+
+
+/**
+ * @brief Hand the next bytes of a command started by begin_inbound_stream to its chunk handler.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param chunk Next payload bytes.
+ * @param len Number of bytes.
+ */
+void continue_inbound_stream(blynk_device_t* device, const uint8_t* chunk, uint16_t len);
 
 #endif //ESP8266_BLYNK_LIB_PACKET_HANDLER_H
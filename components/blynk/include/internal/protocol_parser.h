@@ -14,14 +14,35 @@
 
 
 /**
- * @brief Main message parser for Blynk messages.
+ * @brief Forget any frame the previous connection left half decoded.
  *
- * This function dispatches a message frame to the appropriate parser function based on the
- * current state of the message parsing process.
+ * @param device Pointer to the Blynk device structure.
+ */
+void reset_blynk_decoder(blynk_device_t* device);
+
+
+/**
+ * @brief Get the part of the receive buffer the next read goes to.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param room Set to the number of bytes that fit.
+ * @return Pointer right behind the bytes of a frame cut by the previous read.
+ */
+uint8_t* get_blynk_decoder_space(blynk_device_t* device, size_t* room);
+
+
+/**
+ * @brief Decode Blynk frames from the bytes just read into the decoder space.
+ *
+ * Every frame that is whole in the receive buffer is handed to handle_message_packet in place,
+ * its payload is never copied. The bytes of a frame cut by the end of the read are moved to the
+ * front of the buffer and decoded once the next read completes them. All decoder state lives in
+ * the device, so every device decodes on its own task.
  *
  * @param device Pointer to the Blynk device structure containing the message.
- * @param message_frame The current byte/frame of the message to be parsed.
+ * @param size Number of bytes read into the space returned by get_blynk_decoder_space.
+ * @return BLYNK_EC_OK, or BLYNK_EC_DEVICE_DISCONNECT when a handler disconnected the device.
  */
-void message_payload_parser(blynk_device_t* device, uint8_t message_frame);
+blynk_err_t decode_blynk_frames(blynk_device_t* device, size_t size);
 
 #endif //ESP8266_BLYNK_LIB_PROTOCOL_PARSER_H
@@ -40,17 +40,17 @@ void disconnect_device(blynk_device_t* device, blynk_err_t reason, int code);
 
 
 /**
- * @brief Compose a Blynk protocol message.
+ * @brief Compose a Blynk protocol header.
  *
- * This function serializes a given Blynk message structure into a byte buffer
- * suitable for transmission over the network.
+ * This function serializes the 5-byte frame header in network byte order. The payload,
+ * if any, is expected right behind it.
  *
- * @param output_buffer A buffer where the serialized message should be stored.
- * @param max_size The maximum size of the output_buffer.
- * @param message Pointer to the Blynk message structure to be serialized.
- * @return The size in bytes of the serialized message.
+ * @param output_buffer A buffer of at least BLYNK_HEADER_SIZE bytes.
+ * @param command Blynk command of the frame.
+ * @param id Message id of the frame.
+ * @param length Payload length, or the status for BLYNK_CMD_RESPONSE.
  */
-uint64_t compose_blynk_message(uint8_t* output_buffer, uint64_t max_size, const blynk_message_t* message);
+void compose_blynk_header(uint8_t* output_buffer, uint8_t command, uint16_t id, uint16_t length);
 
 
 /**
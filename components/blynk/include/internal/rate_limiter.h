@@ -0,0 +1,53 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_RATE_LIMITER_H
+#define ESP8266_BLYNK_LIB_RATE_LIMITER_H
+
+#include "stuff/types.h"
+
+
+/**
+ * @brief Start a connection with a full token bucket.
+ *
+ * @param device Pointer to the Blynk device structure.
+ */
+void rate_limiter_reset(blynk_device_t* device);
+
+
+/**
+ * @brief Pick up the configured rate and add the tokens earned since the last refill.
+ *
+ * @param device Pointer to the Blynk device structure.
+ */
+void rate_limiter_refill(blynk_device_t* device);
+
+
+/**
+ * @brief Decide whether a packet may go on the wire now.
+ *
+ * Logins, pings and responses are never held back and cost nothing. Every other packet
+ * takes one token. Without a token the packet has to wait, and the time the next token
+ * becomes available is stored as a deadline for determined_closest_deadline.
+ *
+ * @param device Pointer to the Blynk device structure.
+ * @param packet The packet about to be prepared for writing.
+ * @return true if the packet may be written.
+ */
+bool rate_limiter_admit(blynk_device_t* device, const blynk_queued_packet_t* packet);
+
+
+/**
+ * @brief Give back the token of a packet that was dropped before it was written.
+ *
+ * @param device Pointer to the Blynk device structure.
+ */
+void rate_limiter_refund(blynk_device_t* device);
+
+#endif //ESP8266_BLYNK_LIB_RATE_LIMITER_H
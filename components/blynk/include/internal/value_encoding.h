@@ -0,0 +1,138 @@
+/*
+ * MIT License - CaCuCkA (2023)
+ *
+ * Permission to use, copy, modify, and distribute this software for any purpose with or without fee
+ * is hereby granted, provided the above copyright notice and this permission notice appear in all copies.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS" WITHOUT ANY WARRANTY. See the full MIT License for details.
+ */
+
+#ifndef ESP8266_BLYNK_LIB_VALUE_ENCODING_H
+#define ESP8266_BLYNK_LIB_VALUE_ENCODING_H
+
+#include <stdint.h>
+
+#include "stuff/defines.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define ENCODED_UINT32_MAX              10
+#define ENCODED_INT32_MAX               11
+#define ENCODED_UINT64_MAX              20
+#define ENCODED_INT64_MAX               20
+#define ENCODED_FLOAT_MAX(precision)    (41 + (precision))
+#define ENCODED_DOUBLE_MAX(precision)   (22 + (precision))
+#define ENCODED_FLOAT_SHORTEST_MAX      16
+#define ENCODED_DOUBLE_COMPACT_MAX      ENCODED_DOUBLE_MAX(BLYNK_MAX_FLOAT_PRECISION)
+
+
+/**
+ * @brief Write the decimal text of an unsigned integer.
+ *
+ * Digits are produced two at a time from a table of digit pairs.
+ *
+ * @param out Output buffer of at least ENCODED_UINT32_MAX bytes. No terminator is written.
+ * @param value Value to encode.
+ * @return Number of characters written.
+ */
+uint8_t encode_uint32(char* out, uint32_t value);
+
+
+/**
+ * @brief Write the decimal text of a signed integer.
+ *
+ * @param out Output buffer of at least ENCODED_INT32_MAX bytes. No terminator is written.
+ * @param value Value to encode.
+ * @return Number of characters written.
+ */
+uint8_t encode_int32(char* out, int32_t value);
+
+
+/**
+ * @brief Write the decimal text of an unsigned 64-bit integer.
+ *
+ * @param out Output buffer of at least ENCODED_UINT64_MAX bytes. No terminator is written.
+ * @param value Value to encode.
+ * @return Number of characters written.
+ */
+uint8_t encode_uint64(char* out, uint64_t value);
+
+
+/**
+ * @brief Write the decimal text of a signed 64-bit integer.
+ *
+ * @param out Output buffer of at least ENCODED_INT64_MAX bytes. No terminator is written.
+ * @param value Value to encode.
+ * @return Number of characters written.
+ */
+uint8_t encode_int64(char* out, int64_t value);
+
+
+/**
+ * @brief Write a float with a fixed number of decimals, exactly like "%.*f" does.
+ *
+ * @param out Output buffer of at least ENCODED_FLOAT_MAX(precision) bytes. No terminator is written.
+ * @param value Value to encode.
+ * @param precision Number of decimals, clamped to BLYNK_MAX_FLOAT_PRECISION.
+ * @return Number of characters written.
+ */
+uint8_t encode_float(char* out, float value, uint8_t precision);
+
+
+/**
+ * @brief Write a double with a fixed number of decimals, exactly like "%.*f" does.
+ *
+ * Only integer arithmetic and exact double operations are used, so the result does not
+ * depend on the printf of the platform.
+ *
+ * @param out Output buffer of at least ENCODED_DOUBLE_MAX(precision) bytes. No terminator is written.
+ * @param value Value to encode, its magnitude must be below 2^64.
+ * @param precision Number of decimals, clamped to BLYNK_MAX_FLOAT_PRECISION.
+ * @return Number of characters written, or 0 if the value is out of range.
+ */
+uint8_t encode_double(char* out, double value, uint8_t precision);
+
+
+/**
+ * @brief Write the shortest text that reads back as the same float.
+ *
+ * Uses the Ryu algorithm, so the digits are the shortest ones that round-trip and the
+ * closest to the exact value among those. Magnitudes from 1e-5 up to 1e9 are written in
+ * plain notation, e.g. "23.456", anything else as "1.5e-10".
+ *
+ * @param out Output buffer of at least ENCODED_FLOAT_SHORTEST_MAX bytes. No terminator is written.
+ * @param value Value to encode.
+ * @return Number of characters written.
+ */
+uint8_t encode_float_shortest(char* out, float value);
+
+
+/**
+ * @brief Write a double with up to BLYNK_MAX_FLOAT_PRECISION decimals and no trailing zeros.
+ *
+ * This is the text construct_payload writes for the 'd' format. Magnitudes of 2^64 and
+ * above fall back to "%.17g".
+ *
+ * @param out Output buffer of at least ENCODED_DOUBLE_COMPACT_MAX bytes. No terminator is written.
+ * @param value Value to encode.
+ * @return Number of characters written.
+ */
+uint8_t encode_double_compact(char* out, double value);
+
+
+/**
+ * @brief Drop the trailing zeros of a fixed-point number, and the point if nothing is left after it.
+ *
+ * @param text Text written by encode_float or encode_double.
+ * @param len Length of the text.
+ * @return Length of the trimmed text.
+ */
+uint8_t trim_decimal_zeros(const char* text, uint8_t len);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif //ESP8266_BLYNK_LIB_VALUE_ENCODING_H
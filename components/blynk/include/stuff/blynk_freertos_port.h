@@ -10,27 +10,40 @@
 #ifndef ESP8266_BLYNK_LIB_FREERTOS_PORT_H
 #define ESP8266_BLYNK_LIB_FREERTOS_PORT_H
 
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
 #if FREERTOS
 
 #include <freertos/FreeRTOS.h>
 #include <freertos/semphr.h>
+#include <freertos/queue.h>
 #include <freertos/task.h>
 
+#elif POSIX
+
+#include <pthread.h>
+
 #endif
 
 // FreeRTOS's system types
 typedef void* queue_t;
+typedef void* signal_t;
 typedef uint32_t tick_t;
 typedef void* task_handle_t;
 typedef void* semaphore_handle_t;
 
 typedef void (* task_func_t)(void*);
 
+typedef tick_t (* tick_source_t)(void);
 
-#if FREERTOS
+
+// Milliseconds per port tick
 extern const tick_t custom_port_tick_max_rate;
-#else
-// Replace with your non-FreeRTOS implementation
+
+#if POSIX && !HAVE_STRLCPY
+size_t strlcpy(char* dst, const char* src, size_t size);
 #endif
 
 typedef enum {
@@ -53,10 +66,14 @@ typedef struct {
 
 tick_t get_tick_count(void);
 
+// Replace the system tick counter, e.g. with a simulated clock. NULL restores the system one.
+void set_tick_source(tick_source_t source);
+
 void task_delay(tick_t ticks);
 
 bool queue_reset(queue_t queue);
 
+// CURRENT_TASK_HANDLE ends the calling task. A handle from create_task is released by passing it here once.
 void task_delete(task_handle_t task);
 
 tick_t ms_to_ticks(uint32_t milliseconds);
@@ -69,6 +86,13 @@ bool mutex_wrapper_give(mutex_wrap_t* wrap);
 
 queue_t create_queue(size_t queue_length, size_t element_size);
 
+// Binary signal: notify sets it, wait blocks until it is set and clears it
+signal_t create_signal(void);
+
+bool signal_wait(signal_t signal, tick_t ticks);
+
+void signal_notify(signal_t signal);
+
 bool queue_receive(queue_t queue, void* item, tick_t timeout_ms);
 
 bool queue_send(queue_t queue, const void* item, tick_t timeout_ms);
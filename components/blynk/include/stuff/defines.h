@@ -14,10 +14,19 @@
 #define BLYNK_MAX_ARGS                  32
 #define BLYNK_ACTION_SIZE               5
 #define BLYNK_MAX_URL_SIZE              2048
+#ifndef BLYNK_MAX_HANDLERS
 #define BLYNK_MAX_HANDLERS              8
+#endif
+#define BLYNK_HANDLER_SLOTS             (2 * BLYNK_MAX_HANDLERS)
 #define BLYNK_MAX_AWAITING              32
 #define BLYNK_AUTH_TOKEN_SIZE           64
 #define BLYNK_MAX_PAYLOAD_LEN           512
+#define BLYNK_MAX_FRAME_SIZE            (BLYNK_HEADER_SIZE + BLYNK_MAX_PAYLOAD_LEN)
+#define BLYNK_WRITE_IOV_COUNT           32
+#define BLYNK_STREAM_CHUNK_SIZE         256
+#define BLYNK_MAX_STREAM_LEN            UINT16_MAX
+#define BLYNK_MAX_COALESCED_PINS        16
+#define BLYNK_MAX_RATE_BURST            100000
 
 
 // connection.h
@@ -54,13 +63,16 @@
 // dispatching.c
 #define BLYNK_HEADER_SIZE               5
 #define FORMAT_BUFFER_SIZE              32
+#define BLYNK_MAX_FLOAT_PRECISION       7
+#define BLYNK_FLOAT_SHORTEST            0xFF
 #define BLYNK_DEVICE_IS_VALID(device_ptr) ((device_ptr) && (device_ptr)->valid)
 
 
 // blynk.c
-#define QUEUE_SIZE                      5
-#define NO_ACTION                       '\0'
-#define NO_HANDLERS                     NULL
+#define BLYNK_CONTROL_RING_SIZE         1024
+#define BLYNK_BULK_RING_SIZE            2048
+#define BLYNK_PRIORITY_LANES            2
+#define BLYNK_OFFLINE_FLUSH_BURST       (BLYNK_BULK_RING_SIZE / 2)
 #define DEFAULT_TIMEOUT                 5000
 #define BLYNK_STACK_SIZE                8000
 #define DEFAULT_CLOUD_PORT              "8080"
@@ -68,7 +80,20 @@
 #define DEFAULT_HEARTBEAT_INTERVAL      2000
 #define DEFAULT_RECONNECT_DELAY         5000
 
+// journal.c
+#define BLYNK_JOURNAL_RECORD_HEADER_SIZE 12
+// Holds the largest record, padded to a multiple of sizeof(size_t)
+#define BLYNK_JOURNAL_BUFFER_SIZE       ((BLYNK_JOURNAL_RECORD_HEADER_SIZE + BLYNK_MAX_FRAME_SIZE + 7) & ~7)
+#define BLYNK_JOURNAL_MAX_ACKS          4
+#define BLYNK_JOURNAL_MIN_SECTOR_SIZE   2048
+#define BLYNK_JOURNAL_FILE_SECTOR_SIZE  4096
+
 // blynk_freertos_port.c
 #define BLYNK_TASK_PRIORITY             4
+#define POSIX_TICK_RATE_HZ              1000
+#define POSIX_MAX_DELAY                 UINT32_MAX
+#define POSIX_MIN_STACK_SIZE            (256 * 1024)
+#define NSEC_TO_MS                      1000000
+#define NSEC_PER_SEC                    1000000000L
 
 #endif //ESP8266_BLYNK_LIB_DEFINES_H
@@ -20,6 +20,7 @@ typedef struct {
     const char* format;
     const char* file_name;
     struct tm* timestamp;
+    struct tm time;
     void* userdata;
     int32_t line_num;
     int32_t log_level;
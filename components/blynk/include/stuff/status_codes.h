@@ -69,4 +69,23 @@ typedef enum {
     BLYNK_CMD_EVENT_CLEAR    = 65
 } blynk_cmd_t;
 
+
+typedef enum {
+    BLYNK_PRIORITY_CONTROL = 0,
+    BLYNK_PRIORITY_BULK,
+} blynk_priority_t;
+
+
+typedef enum {
+    BLYNK_OVERFLOW_DROP_OLDEST = 0,
+    BLYNK_OVERFLOW_DROP_NEWEST,
+} blynk_overflow_policy_t;
+
+
+typedef enum {
+    BLYNK_PARSE_FRAME = 0,
+    BLYNK_PARSE_STREAM,
+    BLYNK_PARSE_DISCARD,
+} blynk_parser_state_t;
+
 #endif //ESP8266_BLYNK_LIB_STATUS_CODES_H
@@ -10,10 +10,6 @@
 #ifndef ESP8266_BLYNK_LIB_TYPES_H
 #define ESP8266_BLYNK_LIB_TYPES_H
 
-#include <freertos/FreeRTOS.h>
-#include <freertos/semphr.h>
-#include <freertos/queue.h>
-#include <freertos/task.h>
 #include <stdbool.h>
 #include <stdint.h>
 
@@ -23,6 +19,7 @@
 #include "blynk_freertos_port.h"
 
 
+typedef struct message_ring message_ring_t;
 typedef struct blynk_device blynk_device_t;
 typedef struct blynk_config blynk_config_t;
 typedef struct blynk_packet blynk_packet_t;
@@ -32,13 +29,27 @@ typedef struct blynk_awaiting blynk_awaiting_t;
 typedef struct blynk_state_event blynk_state_event_t;
 typedef struct blynk_private_data blynk_private_data_t;
 typedef struct blynk_handler_data blynk_handler_data_t;
-typedef struct blynk_request_info blynk_request_info_t;
+typedef struct blynk_handler_table blynk_handler_table_t;
+typedef struct blynk_handler_snapshot blynk_handler_snapshot_t;
+typedef struct blynk_queued_packet blynk_queued_packet_t;
+typedef struct blynk_coalesced_write blynk_coalesced_write_t;
+typedef struct blynk_rate_limiter blynk_rate_limiter_t;
+typedef struct blynk_lane blynk_lane_t;
+typedef struct blynk_offline_store blynk_offline_store_t;
+typedef struct blynk_journal_storage blynk_journal_storage_t;
+typedef struct blynk_journal_ack blynk_journal_ack_t;
+typedef struct blynk_journal blynk_journal_t;
+typedef struct blynk_batch blynk_batch_t;
+typedef struct blynk_arg blynk_arg_t;
+typedef struct blynk_chunk_params blynk_chunk_params_t;
+typedef struct blynk_inbound_stream blynk_inbound_stream_t;
+typedef struct blynk_iovec blynk_iovec_t;
+typedef struct blynk_stream blynk_stream_t;
 typedef struct blynk_server_config blynk_server_config_t;
 typedef struct blynk_handler_params blynk_handler_params_t;
 typedef struct blynk_connection_settings blynk_connection_settings_t;
 
 // Function pointers
-typedef void (* blynk_command_parser_t)(blynk_device_t*, uint8_t);
 
 typedef void (* blynk_response_handler_t)(blynk_device_t*, blynk_status_t, void*);
 
@@ -46,18 +57,55 @@ typedef void (* blynk_state_handler_t)(blynk_device_t*, const blynk_state_event_
 
 typedef void (* blynk_cmd_handler_t)(blynk_handler_params_t* params);
 
+typedef void (* blynk_chunk_handler_t)(const blynk_chunk_params_t* params);
+
+typedef size_t (* blynk_stream_producer_t)(void* context, size_t offset, uint8_t* out, size_t room);
+
+typedef void (* blynk_stream_done_t)(blynk_device_t*, blynk_err_t, void*);
+
 
 struct blynk_message {
     uint8_t command;
     uint16_t length;
     uint16_t id;
-    uint8_t payload[BLYNK_MAX_PAYLOAD_LEN];
+};
+
+
+struct blynk_batch {
+    blynk_device_t* device;
+    uint8_t* buffer;
+    size_t capacity;
+    size_t used;
 };
 
 
 struct blynk_handler_data {
-    char action[BLYNK_ACTION_SIZE];
+    uint32_t tag;
     blynk_cmd_handler_t handler;
+    blynk_chunk_handler_t chunk_handler;
+    void* data;
+};
+
+
+struct blynk_handler_snapshot {
+    uint32_t sequence;
+    uint16_t count;
+    blynk_handler_data_t slots[BLYNK_HANDLER_SLOTS];
+};
+
+
+struct blynk_handler_table {
+    uint8_t active;
+    blynk_handler_snapshot_t snapshots[2];
+};
+
+
+struct blynk_inbound_stream {
+    char command[BLYNK_ACTION_SIZE];
+    uint16_t id;
+    uint16_t offset;
+    uint16_t total_len;
+    blynk_chunk_handler_t handler;
     void* data;
 };
 
@@ -72,6 +120,9 @@ struct blynk_connection_settings {
     uint32_t connection_timeout_ms;
     uint32_t heartbeat_interval_ms;
     uint32_t reconnection_interval_ms;
+    bool coalesce_virtual_writes;
+    uint32_t rate_limit;
+    uint32_t rate_burst;
 };
 
 
@@ -98,22 +149,138 @@ struct blynk_state_event {
 };
 
 
+struct message_ring {
+    semaphore_handle_t mtx;
+    semaphore_handle_t writer;
+    signal_t space;
+    uint8_t* storage;
+    size_t capacity;
+    size_t head;
+    size_t used;
+    size_t reserved_at;
+    size_t reserved_skip;
+    size_t reserved_split;
+    uint32_t generation;
+    uint32_t reserved_generation;
+    uint16_t waiters;
+    uint16_t wakeups;
+};
+
+
+struct blynk_queued_packet {
+    tick_t deadline;
+    blynk_response_handler_t handler;
+    void* data;
+    uint16_t frame_size;
+    uint8_t frame[];
+};
+
+
+struct blynk_iovec {
+    const void* base;
+    size_t len;
+};
+
+
+struct blynk_stream {
+    blynk_stream_producer_t producer;
+    const blynk_iovec_t* iov;
+    size_t iov_count;
+    blynk_stream_done_t done;
+    void* context;
+};
+
+
+struct blynk_coalesced_write {
+    uint16_t pin;
+    uint8_t lane;
+    blynk_queued_packet_t* packet;
+};
+
+
+struct blynk_rate_limiter {
+    uint32_t rate;
+    uint32_t burst;
+    uint32_t tokens;
+    tick_t refilled_at;
+    tick_t next_token;
+};
+
+
+struct blynk_lane {
+    message_ring_t ring;
+    blynk_queued_packet_t* last_prepared;
+    blynk_queued_packet_t* last_seen;
+};
+
+
+struct blynk_offline_store {
+    semaphore_handle_t mtx;
+    uint8_t* buffer;
+    size_t capacity;
+    size_t head;
+    size_t used;
+    blynk_overflow_policy_t policy;
+    uint32_t dropped;
+};
+
+
+struct blynk_journal_storage {
+    void* context;
+    size_t size;
+    size_t sector_size;
+    blynk_err_t (* read)(void* context, size_t offset, void* buffer, size_t size);
+    blynk_err_t (* write)(void* context, size_t offset, const void* data, size_t size);
+    blynk_err_t (* erase)(void* context, size_t offset, size_t size);
+    blynk_err_t (* sync)(void* context);
+};
+
+
+struct blynk_journal_ack {
+    uint32_t seq;
+    size_t offset;
+};
+
+
+struct blynk_journal {
+    semaphore_handle_t mtx;
+    blynk_journal_storage_t* storage;
+    size_t head_sector;
+    size_t head;
+    uint32_t next_seq;
+    size_t read_offset;
+    uint32_t sent_seq;
+    uint32_t requested_seq;
+    uint32_t acked_seq;
+    size_t acked_offset;
+    blynk_journal_ack_t pending[BLYNK_JOURNAL_MAX_ACKS];
+    uint8_t pending_count;
+    uint32_t dropped;
+    size_t buffer[BLYNK_JOURNAL_BUFFER_SIZE / sizeof(size_t)];
+};
+
+
 struct blynk_private_data {
     int ctl_sockets[2];
-    queue_t ctl_queue;
+    blynk_lane_t lanes[BLYNK_PRIORITY_LANES];
+    size_t lane_storage[(BLYNK_CONTROL_RING_SIZE + BLYNK_BULK_RING_SIZE) / sizeof(size_t)];
+    uint8_t partial_lane;
+    size_t bytes_written;
+    blynk_coalesced_write_t coalesced[BLYNK_MAX_COALESCED_PINS];
+    uint8_t coalesced_count;
+    blynk_rate_limiter_t limiter;
+    blynk_offline_store_t offline;
+    blynk_journal_t journal;
     uint16_t request_id;
+    blynk_parser_state_t parser_state;
     uint16_t byte_count;
-
-    blynk_command_parser_t parser;
-
+    uint16_t held_bytes;
     blynk_message_t message;
+    blynk_inbound_stream_t inbound;
     blynk_awaiting_t awaiting[BLYNK_MAX_AWAITING];
     tick_t heartbit_deadline;
-    uint8_t read_buffer[BLYNK_MAX_PAYLOAD_LEN];
-    uint8_t write_buffer[BLYNK_MAX_PAYLOAD_LEN];
-
-    uint64_t buf_size;
-    uint64_t total_byte_send;
+    uint8_t read_buffer[BLYNK_MAX_FRAME_SIZE + 1];
+    uint8_t stream_chunk[BLYNK_STREAM_CHUNK_SIZE];
 };
 
 
@@ -124,7 +291,7 @@ struct blynk_control {
     blynk_config_t connection_config;
     blynk_state_handler_t on_state_change;
     void* callback_user_data;
-    blynk_handler_data_t handlers[BLYNK_MAX_HANDLERS];
+    blynk_handler_table_t handlers;
 };
 
 
@@ -135,14 +302,6 @@ struct blynk_device {
 };
 
 
-struct blynk_request_info {
-    blynk_message_t message;
-    tick_t deadline;
-    blynk_response_handler_t handler;
-    void* data;
-};
-
-
 struct blynk_packet {
     blynk_device_t* device;
     uint8_t cmd;
@@ -152,6 +311,13 @@ struct blynk_packet {
     blynk_response_handler_t handler;
     void* data;
     tick_t wait;
+    blynk_priority_t priority;
+};
+
+
+struct blynk_arg {
+    const char* data;
+    uint16_t len;
 };
 
 
@@ -161,6 +327,19 @@ struct blynk_handler_params {
     const char* command;
     int argc;
     char** argv;
+    const blynk_arg_t* args;
+    void* data;
+};
+
+
+struct blynk_chunk_params {
+    blynk_device_t* device;
+    uint16_t id;
+    const char* command;
+    uint16_t offset;
+    const uint8_t* chunk;
+    uint16_t len;
+    uint16_t total_len;
     void* data;
 };
 
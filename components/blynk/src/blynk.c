@@ -30,7 +30,11 @@
 #include "internal/protocol.h"
 #include "stuff/communication.h"
 #include "internal/dispatching.h"
+#include "internal/handler_table.h"
+#include "internal/message_ring.h"
 #include "internal/internal_comm.h"
+#include "internal/journal.h"
+#include "internal/offline_store.h"
 
 #define TAG "[BLYNK]"
 
@@ -43,6 +47,8 @@ static void state_handler(UNUSED blynk_device_t* device, const blynk_state_event
 
 static blynk_err_t blynk_set_state_handler(blynk_device_t* device, blynk_state_handler_t handler, void* data);
 
+static blynk_err_t register_handler(blynk_device_t* device, const char* action, const blynk_handler_data_t* entry);
+
 
 blynk_err_t
 blynk_begin(blynk_device_t* device, const char* authentication_token) {
@@ -55,9 +61,22 @@ blynk_begin(blynk_device_t* device, const char* authentication_token) {
         return BLYNK_EC_MEM;
     }
 
-    device->priv_data.ctl_queue = create_queue(QUEUE_SIZE, sizeof(blynk_request_info_t));
-    if (device->priv_data.ctl_queue == NULL) {
-        log_error("%s: Function %s unable to create communication queue", TAG, __func__);
+    // Both lanes share one block of storage, the control lane takes the front of it
+    uint8_t* storage = (uint8_t*) device->priv_data.lane_storage;
+    if (!message_ring_init(&device->priv_data.lanes[BLYNK_PRIORITY_CONTROL].ring, storage, BLYNK_CONTROL_RING_SIZE) ||
+        !message_ring_init(&device->priv_data.lanes[BLYNK_PRIORITY_BULK].ring, storage + BLYNK_CONTROL_RING_SIZE,
+                           BLYNK_BULK_RING_SIZE)) {
+        log_error("%s: Function %s unable to create communication rings", TAG, __func__);
+        return BLYNK_EC_MEM;
+    }
+
+    if (!offline_store_init(device)) {
+        log_error("%s: Function %s failed to create the offline store", TAG, __func__);
+        return BLYNK_EC_MEM;
+    }
+
+    if (!journal_init(device)) {
+        log_error("%s: Function %s failed to create the journal", TAG, __func__);
         return BLYNK_EC_MEM;
     }
 
@@ -159,7 +178,7 @@ blynk_send_with_callback(blynk_device_t* device,
                          ...) {
     va_list ap;
     va_start(ap, fmt);
-    blynk_err_t ret = dispatch_blynk_request(device, cmd, handler, data, wait, fmt, ap);
+    blynk_err_t ret = dispatch_blynk_request(device, cmd, BLYNK_PRIORITY_BULK, handler, data, wait, fmt, ap);
     va_end(ap);
     return ret;
 }
@@ -169,12 +188,146 @@ blynk_err_t
 blynk_send(blynk_device_t* device, blynk_cmd_t cmd, tick_t wait, const char* fmt, ...) {
     va_list ap;
     va_start(ap, fmt);
-    blynk_err_t status_code = dispatch_blynk_request(device, cmd, NULL, NULL, wait, fmt, ap);
+    blynk_err_t status_code = dispatch_blynk_request(device, cmd, BLYNK_PRIORITY_BULK, NULL, NULL, wait, fmt, ap);
     va_end(ap);
     return status_code;
 }
 
 
+blynk_err_t
+blynk_send_with_priority(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, tick_t wait,
+                         const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    blynk_err_t status_code = dispatch_blynk_request(device, cmd, priority, NULL, NULL, wait, fmt, ap);
+    va_end(ap);
+    return status_code;
+}
+
+
+blynk_err_t
+blynk_send_payload(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, const void* payload,
+                   uint16_t len, tick_t wait) {
+    if (len && !payload) {
+        return BLYNK_EC_NULL_PTR;
+    }
+
+    return dispatch_blynk_payload(device, cmd, priority, payload, len, wait);
+}
+
+
+blynk_err_t
+blynk_send_stream(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, size_t len,
+                  blynk_stream_producer_t producer, blynk_stream_done_t done, void* context, tick_t wait) {
+    if (!producer) {
+        return BLYNK_EC_NULL_PTR;
+    }
+
+    blynk_stream_t stream = {.producer = producer, .done = done, .context = context};
+    return dispatch_blynk_stream(device, cmd, priority, len, &stream, wait);
+}
+
+
+blynk_err_t
+blynk_send_iovec(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, const blynk_iovec_t* iov,
+                 size_t count, blynk_stream_done_t done, void* context, tick_t wait) {
+    size_t len = 0;
+
+    for (size_t i = 0; i < count; ++i) {
+        if (!iov || (!iov[i].base && iov[i].len)) {
+            return BLYNK_EC_NULL_PTR;
+        }
+
+        len += iov[i].len;
+    }
+
+    blynk_stream_t stream = {.iov = iov, .iov_count = count, .done = done, .context = context};
+    return dispatch_blynk_stream(device, cmd, priority, len, &stream, wait);
+}
+
+
+blynk_err_t
+blynk_virtual_write_int(blynk_device_t* device, uint16_t pin, int32_t value, tick_t wait) {
+    return blynk_virtual_write_ints(device, pin, &value, 1, wait);
+}
+
+
+blynk_err_t
+blynk_virtual_write_float(blynk_device_t* device, uint16_t pin, float value, uint8_t precision, tick_t wait) {
+    return blynk_virtual_write_floats(device, pin, &value, 1, precision, wait);
+}
+
+
+blynk_err_t
+blynk_virtual_write_str(blynk_device_t* device, uint16_t pin, const char* value, tick_t wait) {
+    return blynk_virtual_write_strs(device, pin, &value, 1, wait);
+}
+
+
+blynk_err_t
+blynk_virtual_write_ints(blynk_device_t* device, uint16_t pin, const int32_t* values, size_t count, tick_t wait) {
+    virtual_values_t list = {.kind = VIRTUAL_VALUE_INT, .values = values, .count = count};
+    return dispatch_virtual_write(device, pin, &list, wait);
+}
+
+
+blynk_err_t
+blynk_virtual_write_floats(blynk_device_t* device, uint16_t pin, const float* values, size_t count,
+                           uint8_t precision, tick_t wait) {
+    virtual_values_t list = {.kind = VIRTUAL_VALUE_FLOAT, .values = values, .count = count, .precision = precision};
+    return dispatch_virtual_write(device, pin, &list, wait);
+}
+
+
+blynk_err_t
+blynk_virtual_write_strs(blynk_device_t* device, uint16_t pin, const char* const* values, size_t count,
+                         tick_t wait) {
+    for (size_t i = 0; i < count; ++i) {
+        if (!values[i]) return BLYNK_EC_NULL_PTR;
+    }
+
+    virtual_values_t list = {.kind = VIRTUAL_VALUE_STR, .values = values, .count = count};
+    return dispatch_virtual_write(device, pin, &list, wait);
+}
+
+
+blynk_err_t
+blynk_batch_begin(blynk_batch_t* batch, blynk_device_t* device, void* buffer, size_t size) {
+    if (!batch || !buffer) {
+        return BLYNK_EC_NULL_PTR;
+    }
+
+    if (!BLYNK_DEVICE_IS_VALID(device)) {
+        return BLYNK_EC_NOT_INITIALIZED;
+    }
+
+    *batch = (blynk_batch_t) {
+            .device = device,
+            .buffer = buffer,
+            .capacity = size,
+            .used = 0,
+    };
+
+    return BLYNK_EC_OK;
+}
+
+
+blynk_err_t
+blynk_batch_add(blynk_batch_t* batch, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    blynk_err_t status_code = append_blynk_frame(batch, BLYNK_CMD_HARDWARE, fmt, ap);
+    va_end(ap);
+    return status_code;
+}
+
+
+blynk_err_t
+blynk_batch_commit(blynk_batch_t* batch, tick_t wait) {
+    return dispatch_blynk_batch(batch, wait);
+}
+
+
 blynk_err_t
 blynk_send_response(blynk_device_t* device, uint16_t id, uint16_t status, tick_t wait) {
     if (!BLYNK_DEVICE_IS_VALID(device)) {
@@ -192,6 +345,7 @@ blynk_send_response(blynk_device_t* device, uint16_t id, uint16_t status, tick_t
             .handler = NULL,
             .data = NULL,
             .wait = wait,
+            .priority = BLYNK_PRIORITY_CONTROL,
     };
 
     return blynk_notify_packet_ready(&packet);
@@ -240,61 +394,180 @@ update_default_reconnection_delay(blynk_device_t* device, tick_t reconnection_de
 }
 
 
-static void
-update_device_config(blynk_device_t* device, tick_t value, tick_t* config_field) {
+blynk_err_t
+update_server_url(blynk_device_t* device, const char* server_url) {
+    if (!BLYNK_DEVICE_IS_VALID(device)) {
+        log_error("%s: Function %s. Device is not valid. Failed to update server url", TAG, __func__);
+        return BLYNK_EC_NOT_INITIALIZED;
+    }
+
+    if (CHECK_PTR(TAG, server_url)) return BLYNK_EC_NULL_PTR;
+
+    if (!strchr(server_url, URL_DELIMITER)) {
+        log_error("%s: Function %s expects url in the format \"hostname:port\"", TAG, __func__);
+        return BLYNK_EC_INVALID_OPTION;
+    }
+
     mutex_wrap_t wrap = {
             .type = MUTEX_TYPE_FREERTOS,
             .mutex = {device->control.mtx},
     };
 
     mutex_wrapper_take(&wrap);
-    *config_field = value;
+    strlcpy(device->control.connection_config.server.server_url, server_url, BLYNK_MAX_URL_SIZE);
     mutex_wrapper_give(&wrap);
+
+    return BLYNK_EC_OK;
 }
 
 
 blynk_err_t
-update_default_state_handler(blynk_device_t* device, blynk_state_handler_t handler, void* user_data) {
-    return blynk_set_state_handler(device, handler, user_data);
+update_virtual_write_coalescing(blynk_device_t* device, bool enabled) {
+    if (!BLYNK_DEVICE_IS_VALID(device)) {
+        log_error("%s: Function %s. Device is not valid. Failed to update write coalescing", TAG, __func__);
+        return BLYNK_EC_NOT_INITIALIZED;
+    }
+
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    device->control.connection_config.connection.coalesce_virtual_writes = enabled;
+    mutex_wrapper_give(&wrap);
+
+    return BLYNK_EC_OK;
 }
 
 
 blynk_err_t
-blynk_register_cmd_handler(blynk_device_t* device, const char* action, blynk_cmd_handler_t handler, void* data) {
+update_rate_limit(blynk_device_t* device, uint32_t messages_per_second, uint32_t burst) {
     if (!BLYNK_DEVICE_IS_VALID(device)) {
-        log_error("[BLYNK]: Device is not valid. Failed to register command handler for action: %s", action);
+        log_error("%s: Function %s. Device is not valid. Failed to update rate limit", TAG, __func__);
         return BLYNK_EC_NOT_INITIALIZED;
     }
 
+    if (messages_per_second && (!burst || burst > BLYNK_MAX_RATE_BURST)) {
+        log_error("%s: Function %s expects a burst from 1 to %d", TAG, __func__, BLYNK_MAX_RATE_BURST);
+        return BLYNK_EC_INVALID_OPTION;
+    }
+
     mutex_wrap_t wrap = {
             .type = MUTEX_TYPE_FREERTOS,
             .mutex = {device->control.mtx},
     };
 
     mutex_wrapper_take(&wrap);
+    device->control.connection_config.connection.rate_limit = messages_per_second;
+    device->control.connection_config.connection.rate_burst = burst;
+    mutex_wrapper_give(&wrap);
 
-    for (uint8_t i = 0; i < BLYNK_MAX_HANDLERS; ++i) {
-        if (!strncmp(device->control.handlers[i].action, action, BLYNK_ACTION_SIZE)) {
-            device->control.handlers[i].handler = handler;
-            device->control.handlers[i].data = data;
-            mutex_wrapper_give(&wrap);
-            return BLYNK_EC_OK;
-        }
+    return BLYNK_EC_OK;
+}
+
+
+blynk_err_t
+update_offline_buffer(blynk_device_t* device, void* buffer, size_t size, blynk_overflow_policy_t policy) {
+    if (!BLYNK_DEVICE_IS_VALID(device)) {
+        log_error("%s: Function %s. Device is not valid. Failed to update offline buffer", TAG, __func__);
+        return BLYNK_EC_NOT_INITIALIZED;
     }
 
-    for (uint8_t i = 0; i < BLYNK_MAX_HANDLERS; ++i) {
-        if (!device->control.handlers[i].action[0]) {
-            strlcpy(device->control.handlers[i].action, action, BLYNK_ACTION_SIZE);
-            device->control.handlers[i].handler = handler;
-            device->control.handlers[i].data = data;
-            mutex_wrapper_give(&wrap);
-            return BLYNK_EC_OK;
-        }
+    if ((buffer && size && size < BLYNK_MAX_FRAME_SIZE) ||
+        (policy != BLYNK_OVERFLOW_DROP_OLDEST && policy != BLYNK_OVERFLOW_DROP_NEWEST)) {
+        log_error("%s: Function %s expects a buffer of at least %d bytes and a known policy", TAG, __func__,
+                  BLYNK_MAX_FRAME_SIZE);
+        return BLYNK_EC_INVALID_OPTION;
+    }
+
+    offline_store_configure(device, size ? buffer : NULL, size, policy);
+    return BLYNK_EC_OK;
+}
+
+
+blynk_err_t
+update_journal_storage(blynk_device_t* device, blynk_journal_storage_t* storage) {
+    if (!BLYNK_DEVICE_IS_VALID(device)) {
+        log_error("%s: Function %s. Device is not valid. Failed to update journal storage", TAG, __func__);
+        return BLYNK_EC_NOT_INITIALIZED;
+    }
+
+    if (storage && (!storage->read || !storage->write || !storage->erase || storage->sector_size % 4 ||
+                    storage->sector_size < BLYNK_JOURNAL_MIN_SECTOR_SIZE ||
+                    storage->size / storage->sector_size < 2)) {
+        log_error("%s: Function %s expects two sectors of at least %d bytes", TAG, __func__,
+                  BLYNK_JOURNAL_MIN_SECTOR_SIZE);
+        return BLYNK_EC_INVALID_OPTION;
     }
 
-    log_error("[BLYNK]: Failed to register handler for action %s. No available slots.", action);
+    return journal_attach(device, storage);
+}
+
+
+static blynk_err_t
+register_handler(blynk_device_t* device, const char* action, const blynk_handler_data_t* entry) {
+    if (!BLYNK_DEVICE_IS_VALID(device)) {
+        log_error("[BLYNK]: Device is not valid. Failed to register command handler for action: %s", action);
+        return BLYNK_EC_NOT_INITIALIZED;
+    }
+
+    if (CHECK_PTR(TAG, action)) return BLYNK_EC_NULL_PTR;
+
+    uint32_t tag = command_tag((const uint8_t*) action, strlen(action) + 1);
+    if (!tag) {
+        log_error("[BLYNK]: Action %s is empty or longer than %d characters", action, BLYNK_ACTION_SIZE - 1);
+        return BLYNK_EC_INVALID_OPTION;
+    }
+
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    blynk_err_t status = handler_table_update(&device->control.handlers, tag, entry);
+    mutex_wrapper_give(&wrap);
+
+    if (status != BLYNK_EC_OK) {
+        log_error("[BLYNK]: Failed to register handler for action %s. No available slots.", action);
+    }
+
+    return status;
+}
+
+
+static void
+update_device_config(blynk_device_t* device, tick_t value, tick_t* config_field) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    *config_field = value;
     mutex_wrapper_give(&wrap);
-    return BLYNK_EC_MEM;
+}
+
+
+blynk_err_t
+update_default_state_handler(blynk_device_t* device, blynk_state_handler_t handler, void* user_data) {
+    return blynk_set_state_handler(device, handler, user_data);
+}
+
+
+blynk_err_t
+blynk_register_cmd_handler(blynk_device_t* device, const char* action, blynk_cmd_handler_t handler, void* data) {
+    blynk_handler_data_t entry = {.handler = handler, .chunk_handler = NULL, .data = data};
+    return register_handler(device, action, &entry);
+}
+
+
+blynk_err_t
+blynk_register_chunk_handler(blynk_device_t* device, const char* action, blynk_chunk_handler_t handler,
+                             void* data) {
+    blynk_handler_data_t entry = {.handler = NULL, .chunk_handler = handler, .data = data};
+    return register_handler(device, action, &entry);
 }
 
 
@@ -305,20 +578,18 @@ blynk_deregister_cmd_handler(blynk_device_t* device, const char* action) {
         return BLYNK_EC_NOT_INITIALIZED;
     }
 
+    if (CHECK_PTR(TAG, action)) return BLYNK_EC_NULL_PTR;
+
+    uint32_t tag = command_tag((const uint8_t*) action, strlen(action) + 1);
+    if (!tag) return BLYNK_EC_OK;
+
     mutex_wrap_t wrap = {
             .type = MUTEX_TYPE_FREERTOS,
             .mutex = {device->control.mtx},
     };
 
     mutex_wrapper_take(&wrap);
-    for (uint8_t i = 0; i < BLYNK_MAX_HANDLERS; ++i) {
-        if (!strncmp(device->control.handlers[i].action, action, BLYNK_ACTION_SIZE)) {
-            device->control.handlers[i].handler = NO_HANDLERS;
-            device->control.handlers[i].data = NO_CALLBACK_DATA;
-            device->control.handlers[i].action[0] = NO_ACTION;
-            break;
-        }
-    }
+    handler_table_update(&device->control.handlers, tag, NULL);
     mutex_wrapper_give(&wrap);
 
     return BLYNK_EC_OK;
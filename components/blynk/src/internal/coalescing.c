@@ -0,0 +1,124 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal/coalescing.h"
+#include "internal/internal_comm.h"
+#include "stuff/blynk_freertos_port.h"
+
+#define VIRTUAL_WRITE_PREFIX_SIZE       3
+
+
+static bool parse_virtual_write_pin(const blynk_queued_packet_t* packet, uint16_t* pin);
+
+
+bool
+virtual_write_coalescing_enabled(blynk_device_t* device) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    bool enabled = device->control.connection_config.connection.coalesce_virtual_writes;
+    mutex_wrapper_give(&wrap);
+
+    return enabled;
+}
+
+
+blynk_queued_packet_t*
+coalesce_virtual_write(blynk_device_t* device, uint8_t lane, blynk_queued_packet_t* packet) {
+    blynk_private_data_t* device_data = &device->priv_data;
+    uint16_t pin;
+
+    if (packet->handler || !parse_virtual_write_pin(packet, &pin)) return NULL;
+
+    for (uint8_t i = 0; i < device_data->coalesced_count; ++i) {
+        if (device_data->coalesced[i].pin != pin) continue;
+
+        // A packet that is partly written has to go out whole
+        blynk_coalesced_write_t* entry = &device_data->coalesced[i];
+        blynk_queued_packet_t* dropped = NULL;
+
+        if (!device_data->bytes_written || entry->lane != device_data->partial_lane ||
+            entry->packet != blynk_first_packet(device, entry->lane)) {
+            dropped = entry->packet;
+            dropped->frame_size = 0;
+        }
+
+        entry->lane = lane;
+        entry->packet = packet;
+        return dropped;
+    }
+
+    if (device_data->coalesced_count < BLYNK_MAX_COALESCED_PINS) {
+        device_data->coalesced[device_data->coalesced_count++] = (blynk_coalesced_write_t) {
+                .pin = pin,
+                .lane = lane,
+                .packet = packet,
+        };
+    }
+
+    return NULL;
+}
+
+
+void
+forget_coalesced_write(blynk_device_t* device, const blynk_queued_packet_t* packet) {
+    blynk_private_data_t* device_data = &device->priv_data;
+
+    for (uint8_t i = 0; i < device_data->coalesced_count; ++i) {
+        if (device_data->coalesced[i].packet == packet) {
+            device_data->coalesced[i] = device_data->coalesced[--device_data->coalesced_count];
+            return;
+        }
+    }
+}
+
+
+static bool
+parse_virtual_write_pin(const blynk_queued_packet_t* packet, uint16_t* pin) {
+    // | "vw" | '\0' | pin digits | '\0' | value ... |
+    const uint8_t* payload = packet->frame + BLYNK_HEADER_SIZE;
+    const uint8_t* end = packet->frame + packet->frame_size;
+
+    if (packet->frame[0] != BLYNK_CMD_HARDWARE || end - payload <= VIRTUAL_WRITE_PREFIX_SIZE ||
+        payload[0] != 'v' || payload[1] != 'w' || payload[2] != '\0') {
+        return false;
+    }
+
+    const uint8_t* digit = payload + VIRTUAL_WRITE_PREFIX_SIZE;
+    uint32_t value = 0;
+
+    for (; digit < end && *digit >= '0' && *digit <= '9'; ++digit) {
+        value = value * 10 + (*digit - '0');
+        if (value > UINT16_MAX) return false;
+    }
+
+    // At least one digit, terminated by the separator in front of the value
+    if (digit == payload + VIRTUAL_WRITE_PREFIX_SIZE || digit >= end || *digit != '\0') return false;
+
+    *pin = (uint16_t) value;
+    return true;
+}
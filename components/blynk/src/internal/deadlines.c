@@ -0,0 +1,183 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "stuff/util.h"
+#include "internal/deadlines.h"
+#include "internal/internal_comm.h"
+#include "internal/protocol_stuff.h"
+#include "stuff/blynk_freertos_port.h"
+
+#define TAG "[DEADLINES]"
+
+
+static blynk_err_t send_heartbit(blynk_device_t* device);
+
+static inline bool has_deadline_passed(tick_t deadline, tick_t current_time);
+
+static void heartbit_callback(blynk_device_t* device, blynk_status_t status, UNUSED void* data);
+
+static void handle_awaiting_timer(blynk_device_t* device, tick_t now, blynk_awaiting_t* awaiting);
+
+
+tick_t
+deadline_after(tick_t ticks) {
+    tick_t deadline = get_tick_count() + ticks;
+    return deadline ? deadline : 1;
+}
+
+
+bool
+determined_closest_deadline(blynk_device_t* device, tick_t* deadline) {
+    bool deadline_found = false;
+    tick_t closest_deadline = 0;
+    tick_t current_time = get_tick_count();
+
+    for (uint16_t i = 0; i < BLYNK_MAX_AWAITING; ++i) {
+        if (!device->priv_data.awaiting[i].id || !device->priv_data.awaiting[i].deadline) continue;
+
+        if (has_deadline_passed(device->priv_data.awaiting[i].deadline, current_time)) {
+            *deadline = 0;
+            return true;
+        }
+
+        tick_t time_left = device->priv_data.awaiting[i].deadline - current_time;
+        if (!deadline_found || time_left < closest_deadline) {
+            closest_deadline = time_left;
+            deadline_found = true;
+        }
+    }
+
+    if (device->priv_data.heartbit_deadline) {
+        if (has_deadline_passed(device->priv_data.heartbit_deadline, current_time)) {
+            *deadline = 0;
+            return true;
+        }
+
+        tick_t time_left_for_sending_heartbit = device->priv_data.heartbit_deadline - current_time;
+        if (!deadline_found || time_left_for_sending_heartbit < closest_deadline) {
+            closest_deadline = time_left_for_sending_heartbit;
+            deadline_found = true;
+        }
+    }
+
+    // Packets held back by the rate limiter are prepared again once the next token is earned
+    if (device->priv_data.limiter.next_token) {
+        if (has_deadline_passed(device->priv_data.limiter.next_token, current_time)) {
+            *deadline = 0;
+            return true;
+        }
+
+        tick_t time_left_for_next_token = device->priv_data.limiter.next_token - current_time;
+        if (!deadline_found || time_left_for_next_token < closest_deadline) {
+            closest_deadline = time_left_for_next_token;
+            deadline_found = true;
+        }
+    }
+
+
+    if (deadline_found) *deadline = closest_deadline;
+
+    return deadline_found;
+}
+
+
+blynk_err_t
+manage_communication_deadlines(blynk_device_t* device) {
+    tick_t current_time = get_tick_count();
+
+    for (uint16_t i = 0; i < BLYNK_MAX_AWAITING; ++i) {
+        handle_awaiting_timer(device, current_time, &device->priv_data.awaiting[i]);
+    }
+
+    if (device->priv_data.heartbit_deadline && has_deadline_passed(device->priv_data.heartbit_deadline, current_time)) {
+        update_heartbeat_deadline(device);
+        return send_heartbit(device);
+    }
+
+    return BLYNK_EC_OK;
+}
+
+
+void
+update_heartbeat_deadline(blynk_device_t* device) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    tick_t heartbeat_interval_ticks = device->control.connection_config.connection.heartbeat_interval_ms;
+    mutex_wrapper_give(&wrap);
+
+    device->priv_data.heartbit_deadline = deadline_after(heartbeat_interval_ticks / custom_port_tick_max_rate);
+}
+
+
+static void
+handle_awaiting_timer(blynk_device_t* device, tick_t now, blynk_awaiting_t* awaiting) {
+    if (!awaiting->id || !awaiting->deadline) return;
+
+    if (has_deadline_passed(awaiting->deadline, now)) {
+        if (awaiting->handler) {
+            awaiting->handler(device, BLYNK_STATUS_TIMEOUT, awaiting->data);
+        }
+        awaiting->id = 0;
+    }
+}
+
+
+static blynk_err_t
+send_heartbit(blynk_device_t* device) {
+    blynk_packet_t heartbit_packet = {
+            .device = device,
+            .cmd = BLYNK_CMD_PING,
+            .id = 0,
+            .len = 0,
+            .payload = NULL,
+            .handler = heartbit_callback,
+            .data = NO_CALLBACK_DATA,
+            .wait = NO_WAITING,
+            .priority = BLYNK_PRIORITY_CONTROL,
+    };
+
+    return blynk_notify_packet_ready(&heartbit_packet);
+}
+
+
+static inline bool
+has_deadline_passed(tick_t deadline, tick_t current_time) {
+    return (int32_t) ((uint32_t) deadline - (uint32_t) current_time) <= 0;
+}
+
+
+static void
+heartbit_callback(blynk_device_t* device, blynk_status_t status, UNUSED void* data) {
+    if (status != BLYNK_STATUS_SUCCESS) {
+        if (status == BLYNK_STATUS_TIMEOUT) {
+            disconnect_device(device, BLYNK_EC_TIMEOUT, 0);
+        } else {
+            disconnect_device(device, BLYNK_EC_STATUS, status);
+        }
+    }
+}
@@ -22,44 +22,325 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "stuff/util.h"
 #include "stuff/defines.h"
 #include "stuff/exceptions.h"
+#include "internal/journal.h"
 #include "internal/dispatching.h"
 #include "internal/internal_comm.h"
+#include "internal/offline_store.h"
+#include "internal/protocol_stuff.h"
+#include "internal/value_encoding.h"
+
+#define VIRTUAL_WRITE_PREFIX            "vw"
+#define ENCODED_FLOAT_WIDTH(precision)  ((precision) == BLYNK_FLOAT_SHORTEST ? ENCODED_FLOAT_SHORTEST_MAX \
+                                                                             : ENCODED_FLOAT_MAX(MIN(precision, BLYNK_MAX_FLOAT_PRECISION)))
+
+
+typedef struct {
+    blynk_cmd_t cmd;
+    const char* fmt;
+    va_list args;
+} format_frame_t;
+
+
+typedef struct {
+    uint16_t pin;
+    const virtual_values_t* values;
+} virtual_frame_t;
+
+
+typedef struct {
+    blynk_cmd_t cmd;
+    const void* payload;
+    uint16_t len;
+} payload_frame_t;
 
 
 static blynk_state_t blynk_get_state(blynk_device_t* device);
 
+static bool capture_offline(blynk_device_t* device, offline_frame_encoder_t encode, void* context, size_t largest,
+                            blynk_err_t* err);
+
+static size_t serialize_frame(uint8_t* frame, size_t room, blynk_cmd_t cmd, const char* fmt, va_list ap);
+
+static size_t encode_format_frame(uint8_t* frame, size_t room, void* context);
+
+static size_t encode_virtual_frame(uint8_t* frame, size_t room, void* context);
+
+static size_t encode_payload_frame(uint8_t* frame, size_t room, void* context);
+
+static size_t encode_batch_frames(uint8_t* frame, size_t room, void* context);
+
 static blynk_err_t check_device_state(blynk_device_t* device, blynk_cmd_t cmd);
 
-static void construct_payload(char* payload, uint16_t* len, const char* fmt, va_list ap);
+static uint16_t format_payload_size(const char* fmt, va_list ap);
+
+static uint16_t virtual_write_size(const virtual_values_t* values);
+
+static uint8_t encode_virtual_float(char* out, float value, uint8_t precision);
+
+static uint16_t encode_virtual_value(char* out, uint16_t room, const virtual_values_t* values, size_t index);
 
 static void initialize_package(blynk_packet_t* package, blynk_device_t* device, blynk_cmd_t cmd,
                                uint16_t len, char* payload, blynk_response_handler_t handler,
-                               void* data, TickType_t wait);
+                               void* data, tick_t wait, blynk_priority_t priority);
 
 
-blynk_err_t dispatch_blynk_request(blynk_device_t* device, blynk_cmd_t cmd,
+blynk_err_t dispatch_blynk_request(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority,
                                    blynk_response_handler_t handler, void* data,
-                                   TickType_t wait, const char* fmt, va_list ap) {
+                                   tick_t wait, const char* fmt, va_list ap) {
+    blynk_err_t err;
+
+    // Hardware writes without a callback go to the journal, or to the offline store while the device is away.
+    // Both are replayed through the bulk lane, so control writes bypass them to keep their precedence.
+    if (cmd == BLYNK_CMD_HARDWARE && !handler && priority != BLYNK_PRIORITY_CONTROL) {
+        format_frame_t frame = {.cmd = cmd, .fmt = fmt};
+        va_copy(frame.args, ap);
+        bool captured = capture_offline(device, encode_format_frame, &frame, BLYNK_MAX_FRAME_SIZE, &err);
+        va_end(frame.args);
+
+        if (captured) return err;
+    }
 
-    blynk_err_t err = check_device_state(device, cmd);
+    err = check_device_state(device, cmd);
+    if (err != BLYNK_EC_OK) {
+        return err;
+    }
+
+    // The payload is serialized straight into the ring of its lane, right behind the frame header
+    va_list args;
+    va_copy(args, ap);
+    uint16_t size = format_payload_size(fmt, args);
+    va_end(args);
+
+    blynk_packet_t package;
+    initialize_package(&package, device, cmd, size, NULL, handler, data, wait, priority);
+
+    err = blynk_reserve_packet(&package);
     if (err != BLYNK_EC_OK) {
         return err;
     }
 
-    char payload[BLYNK_MAX_PAYLOAD_LEN];
     uint16_t len = 0;
-    construct_payload(payload, &len, fmt, ap);
+    construct_payload((char*) package.payload, &len, size, fmt, ap);
+    package.len = len;
+
+    return blynk_commit_packet(&package);
+}
+
+
+blynk_err_t
+dispatch_blynk_payload(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, const void* payload,
+                       uint16_t len, tick_t wait) {
+    blynk_err_t err;
+    payload_frame_t frame = {.cmd = cmd, .payload = payload, .len = MIN(len, BLYNK_MAX_PAYLOAD_LEN)};
+
+    if (cmd == BLYNK_CMD_HARDWARE && priority != BLYNK_PRIORITY_CONTROL &&
+        capture_offline(device, encode_payload_frame, &frame, BLYNK_HEADER_SIZE + frame.len, &err)) {
+        return err;
+    }
+
+    err = check_device_state(device, cmd);
+    if (err != BLYNK_EC_OK) {
+        return err;
+    }
 
     blynk_packet_t package;
-    initialize_package(&package, device, cmd, len, payload, handler, data, wait);
+    initialize_package(&package, device, cmd, len, (char*) payload, NULL, NULL, wait, priority);
 
     return blynk_notify_packet_ready(&package);
 }
 
 
+blynk_err_t
+dispatch_blynk_stream(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, size_t len,
+                      const blynk_stream_t* stream, tick_t wait) {
+    blynk_err_t err = check_device_state(device, cmd);
+    if (err != BLYNK_EC_OK) {
+        return err;
+    }
+
+    if (!len || len > BLYNK_MAX_STREAM_LEN) {
+        return BLYNK_EC_INVALID_OPTION;
+    }
+
+    return blynk_notify_stream_ready(device, cmd, priority, (uint16_t) len, stream, wait);
+}
+
+
+blynk_err_t
+dispatch_virtual_write(blynk_device_t* device, uint16_t pin, const virtual_values_t* values, tick_t wait) {
+    blynk_err_t err;
+    virtual_frame_t frame = {.pin = pin, .values = values};
+
+    if (capture_offline(device, encode_virtual_frame, &frame, BLYNK_HEADER_SIZE + virtual_write_size(values), &err)) {
+        return err;
+    }
+
+    err = check_device_state(device, BLYNK_CMD_HARDWARE);
+    if (err != BLYNK_EC_OK) {
+        return err;
+    }
+
+    blynk_packet_t package;
+    initialize_package(&package, device, BLYNK_CMD_HARDWARE, virtual_write_size(values), NULL, NULL, NULL,
+                       wait, BLYNK_PRIORITY_BULK);
+
+    err = blynk_reserve_packet(&package);
+    if (err != BLYNK_EC_OK) {
+        return err;
+    }
+
+    package.len = encode_virtual_write((char*) package.payload, package.len, pin, values);
+    return blynk_commit_packet(&package);
+}
+
+
+uint16_t
+encode_virtual_write(char* payload, uint16_t room, uint16_t pin, const virtual_values_t* values) {
+    uint16_t len = sizeof(VIRTUAL_WRITE_PREFIX);
+
+    memcpy(payload, VIRTUAL_WRITE_PREFIX, sizeof(VIRTUAL_WRITE_PREFIX));
+    len += encode_uint32(payload + len, pin);
+
+    for (size_t i = 0; i < values->count && len < room; ++i) {
+        payload[len++] = 0;
+        len += encode_virtual_value(payload + len, room - len, values, i);
+    }
+
+    return len;
+}
+
+
+blynk_err_t
+append_blynk_frame(blynk_batch_t* batch, blynk_cmd_t cmd, const char* fmt, va_list ap) {
+    if (cmd == BLYNK_CMD_RESPONSE) {
+        return BLYNK_EC_INVALID_OPTION;
+    }
+
+    size_t size = serialize_frame(batch->buffer + batch->used, batch->capacity - batch->used, cmd, fmt, ap);
+    if (!size) {
+        return BLYNK_EC_MEM;
+    }
+
+    batch->used += size;
+    return BLYNK_EC_OK;
+}
+
+
+blynk_err_t
+dispatch_blynk_batch(blynk_batch_t* batch, tick_t wait) {
+    blynk_err_t err;
+
+    // A batch is stored whole or not at all, like it is queued
+    if (batch->used && BLYNK_DEVICE_IS_VALID(batch->device) &&
+        (journal_capture_frames(batch->device, batch->buffer, batch->used, &err) ||
+         offline_store_capture(batch->device, encode_batch_frames, batch, batch->used, &err))) {
+        if (err == BLYNK_EC_OK) batch->used = 0;
+        return err;
+    }
+
+    err = check_device_state(batch->device, BLYNK_CMD_HARDWARE);
+    if (err != BLYNK_EC_OK) {
+        return err;
+    }
+
+    err = blynk_commit_frames(batch->device, batch->buffer, batch->used, wait);
+    if (err == BLYNK_EC_OK) {
+        batch->used = 0;
+    }
+
+    return err;
+}
+
+
+static bool
+capture_offline(blynk_device_t* device, offline_frame_encoder_t encode, void* context, size_t largest,
+                blynk_err_t* err) {
+    return BLYNK_DEVICE_IS_VALID(device) && (journal_capture(device, encode, context, err) ||
+                                             offline_store_capture(device, encode, context, largest, err));
+}
+
+
+static size_t
+serialize_frame(uint8_t* frame, size_t room, blynk_cmd_t cmd, const char* fmt, va_list ap) {
+    if (room <= BLYNK_HEADER_SIZE) {
+        return 0;
+    }
+
+    uint16_t limit = MIN(room - BLYNK_HEADER_SIZE, BLYNK_MAX_PAYLOAD_LEN);
+    uint16_t len = 0;
+
+    // A frame cut short by the end of the buffer is left out, a full-sized one is clamped like blynk_send does
+    if (!construct_payload((char*) frame + BLYNK_HEADER_SIZE, &len, limit, fmt, ap) &&
+        limit < BLYNK_MAX_PAYLOAD_LEN) {
+        return 0;
+    }
+
+    compose_blynk_header(frame, cmd, 0, len);
+    return BLYNK_HEADER_SIZE + len;
+}
+
+
+static size_t
+encode_format_frame(uint8_t* frame, size_t room, void* context) {
+    format_frame_t* request = context;
+    va_list args;
+
+    // Every attempt reads the arguments from the start
+    va_copy(args, request->args);
+    size_t size = serialize_frame(frame, room, request->cmd, request->fmt, args);
+    va_end(args);
+
+    return size;
+}
+
+
+static size_t
+encode_virtual_frame(uint8_t* frame, size_t room, void* context) {
+    const virtual_frame_t* request = context;
+    uint16_t size = virtual_write_size(request->values);
+
+    if (room < (size_t) BLYNK_HEADER_SIZE + size) {
+        return 0;
+    }
+
+    uint16_t len = encode_virtual_write((char*) frame + BLYNK_HEADER_SIZE, size, request->pin, request->values);
+    compose_blynk_header(frame, BLYNK_CMD_HARDWARE, 0, len);
+    return BLYNK_HEADER_SIZE + len;
+}
+
+
+static size_t
+encode_payload_frame(uint8_t* frame, size_t room, void* context) {
+    const payload_frame_t* request = context;
+
+    if (room < (size_t) BLYNK_HEADER_SIZE + request->len) {
+        return 0;
+    }
+
+    if (request->len) memcpy(frame + BLYNK_HEADER_SIZE, request->payload, request->len);
+    compose_blynk_header(frame, request->cmd, 0, request->len);
+    return BLYNK_HEADER_SIZE + request->len;
+}
+
+
+static size_t
+encode_batch_frames(uint8_t* frame, size_t room, void* context) {
+    const blynk_batch_t* batch = context;
+
+    if (room < batch->used) {
+        return 0;
+    }
+
+    memcpy(frame, batch->buffer, batch->used);
+    return batch->used;
+}
+
+
 static blynk_err_t
 check_device_state(blynk_device_t* device, blynk_cmd_t cmd) {
     if (!BLYNK_DEVICE_IS_VALID(device)) {
@@ -81,78 +362,238 @@ check_device_state(blynk_device_t* device, blynk_cmd_t cmd) {
 }
 
 
-static void
-construct_payload(char* payload, uint16_t* len, const char* fmt, va_list ap) {
+bool
+construct_payload(char* payload, uint16_t* len, uint16_t limit, const char* fmt, va_list ap) {
     char* payload_ptr = payload;
 
-    for (; *fmt && *len < BLYNK_MAX_PAYLOAD_LEN; fmt++) {
+    for (; *fmt && *len < limit; fmt++) {
         char format_buffer[FORMAT_BUFFER_SIZE];
-        const char* arg;
-
-        if (*fmt == 's' || *fmt == 'p') {
-            arg = va_arg(ap, const char*);
-        } else {
-            switch (*fmt) {
-                case 'c':
-                case 'b':
-                            FALLTHROUGH;
-                case 'B':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%c", va_arg(ap, int));
-                    break;
-
-                case '?':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%s", va_arg(ap, bool) ? "true" : "false");
-                    break;
-
-                case 'h':
-                case 'H':
-                            FALLTHROUGH;
-                case 'i':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%d", va_arg(ap, int));
-                    break;
-
-                case 'I':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%u", va_arg(ap, unsigned int));
-                    break;
-
-                case 'l':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%ld", va_arg(ap, long));
-                    break;
-
-                case 'L':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%lu", va_arg(ap, unsigned long));
-                    break;
-
-                case 'q':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%lld", va_arg(ap, long long));
-                    break;
-
-                case 'Q':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%llu", va_arg(ap, unsigned long long));
-                    break;
-
-                case 'f':
-                            FALLTHROUGH;
-                case 'd':
-                    snprintf(format_buffer, FORMAT_BUFFER_SIZE, "%.7f", va_arg(ap, double));
-                    break;
-
-                default:
-                    continue;
-            }
-            arg = format_buffer;
+        const char* arg = format_buffer;
+        size_t arg_len;
+
+        switch (*fmt) {
+            case 's':
+                    FALLTHROUGH;
+            case 'p':
+                arg = va_arg(ap, const char*);
+                arg_len = strlen(arg);
+                break;
+
+            case 'c':
+            case 'b':
+                    FALLTHROUGH;
+            case 'B':
+                format_buffer[0] = (char) va_arg(ap, int);
+                arg_len = format_buffer[0] ? 1 : 0;
+                break;
+
+            case '?':
+                arg = va_arg(ap, int) ? "true" : "false";
+                arg_len = strlen(arg);
+                break;
+
+            case 'h':
+            case 'H':
+                    FALLTHROUGH;
+            case 'i':
+                arg_len = encode_int32(format_buffer, va_arg(ap, int));
+                break;
+
+            case 'I':
+                arg_len = encode_uint32(format_buffer, va_arg(ap, unsigned int));
+                break;
+
+            case 'l':
+                arg_len = encode_int64(format_buffer, va_arg(ap, long));
+                break;
+
+            case 'L':
+                arg_len = encode_uint64(format_buffer, va_arg(ap, unsigned long));
+                break;
+
+            case 'q':
+                arg_len = encode_int64(format_buffer, va_arg(ap, long long));
+                break;
+
+            case 'Q':
+                arg_len = encode_uint64(format_buffer, va_arg(ap, unsigned long long));
+                break;
+
+            case 'f':
+                arg_len = encode_float_shortest(format_buffer, (float) va_arg(ap, double));
+                break;
+
+            case 'd':
+                arg_len = encode_double_compact(format_buffer, va_arg(ap, double));
+                break;
+
+            default:
+                continue;
         }
 
-        while (*arg && *len < BLYNK_MAX_PAYLOAD_LEN) {
-            *(payload_ptr++) = *(arg++);
-            (*len)++;
-        }
+        size_t copied = MIN(arg_len, (size_t) (limit - *len));
+        memcpy(payload_ptr, arg, copied);
+        payload_ptr += copied;
+        *len += copied;
+
+        if (copied < arg_len) return false;
 
-        if (*len < BLYNK_MAX_PAYLOAD_LEN && *(fmt + 1)) {
+        if (*(fmt + 1)) {
+            if (*len == limit) return false;
             *(payload_ptr++) = 0;
             (*len)++;
         }
     }
+
+    return !*fmt;
+}
+
+
+static uint8_t
+encode_virtual_float(char* out, float value, uint8_t precision) {
+    if (precision == BLYNK_FLOAT_SHORTEST) return encode_float_shortest(out, value);
+
+    return encode_float(out, value, precision);
+}
+
+
+static uint16_t
+format_payload_size(const char* fmt, va_list ap) {
+    // Bounds what construct_payload writes, so the reservation fits the request instead of BLYNK_MAX_PAYLOAD_LEN
+    size_t size = 0;
+
+    for (; *fmt && size < BLYNK_MAX_PAYLOAD_LEN; fmt++) {
+        switch (*fmt) {
+            case 's':
+                    FALLTHROUGH;
+            case 'p':
+                size += strlen(va_arg(ap, const char*));
+                break;
+
+            case 'c':
+            case 'b':
+                    FALLTHROUGH;
+            case 'B':
+                (void) va_arg(ap, int);
+                size += 1;
+                break;
+
+            case '?':
+                (void) va_arg(ap, int);
+                size += sizeof("false") - 1;
+                break;
+
+            case 'h':
+            case 'H':
+                    FALLTHROUGH;
+            case 'i':
+                (void) va_arg(ap, int);
+                size += ENCODED_INT32_MAX;
+                break;
+
+            case 'I':
+                (void) va_arg(ap, unsigned int);
+                size += ENCODED_UINT32_MAX;
+                break;
+
+            case 'l':
+                (void) va_arg(ap, long);
+                size += ENCODED_INT64_MAX;
+                break;
+
+            case 'L':
+                (void) va_arg(ap, unsigned long);
+                size += ENCODED_UINT64_MAX;
+                break;
+
+            case 'q':
+                (void) va_arg(ap, long long);
+                size += ENCODED_INT64_MAX;
+                break;
+
+            case 'Q':
+                (void) va_arg(ap, unsigned long long);
+                size += ENCODED_UINT64_MAX;
+                break;
+
+            case 'f':
+                (void) va_arg(ap, double);
+                size += ENCODED_FLOAT_SHORTEST_MAX;
+                break;
+
+            case 'd':
+                (void) va_arg(ap, double);
+                size += ENCODED_DOUBLE_COMPACT_MAX;
+                break;
+
+            default:
+                continue;
+        }
+
+        // Separator
+        size++;
+    }
+
+    return MIN(size, BLYNK_MAX_PAYLOAD_LEN);
+}
+
+
+static uint16_t
+virtual_write_size(const virtual_values_t* values) {
+    size_t size = sizeof(VIRTUAL_WRITE_PREFIX) + ENCODED_UINT32_MAX;
+
+    for (size_t i = 0; i < values->count && size < BLYNK_MAX_PAYLOAD_LEN; ++i) {
+        switch (values->kind) {
+            case VIRTUAL_VALUE_INT:
+                size += 1 + ENCODED_INT32_MAX;
+                break;
+
+            case VIRTUAL_VALUE_FLOAT:
+                size += 1 + ENCODED_FLOAT_WIDTH(values->precision);
+                break;
+
+            case VIRTUAL_VALUE_STR:
+                size += 1 + strlen(((const char* const*) values->values)[i]);
+                break;
+        }
+    }
+
+    return MIN(size, BLYNK_MAX_PAYLOAD_LEN);
+}
+
+
+static uint16_t
+encode_virtual_value(char* out, uint16_t room, const virtual_values_t* values, size_t index) {
+    char text[ENCODED_FLOAT_MAX(BLYNK_MAX_FLOAT_PRECISION)];
+    const char* value = text;
+    uint16_t len;
+
+    // Numbers are encoded in place unless they may run past the end of the payload
+    switch (values->kind) {
+        case VIRTUAL_VALUE_INT:
+            if (room >= ENCODED_INT32_MAX) {
+                return encode_int32(out, ((const int32_t*) values->values)[index]);
+            }
+            len = encode_int32(text, ((const int32_t*) values->values)[index]);
+            break;
+
+        case VIRTUAL_VALUE_FLOAT:
+            if (room >= ENCODED_FLOAT_WIDTH(values->precision)) {
+                return encode_virtual_float(out, ((const float*) values->values)[index], values->precision);
+            }
+            len = encode_virtual_float(text, ((const float*) values->values)[index], values->precision);
+            break;
+
+        case VIRTUAL_VALUE_STR:
+        default:
+            value = ((const char* const*) values->values)[index];
+            len = strlen(value);
+            break;
+    }
+
+    len = MIN(len, room);
+    memcpy(out, value, len);
+    return len;
 }
 
 
@@ -174,7 +615,7 @@ blynk_get_state(blynk_device_t* device) {
 static void
 initialize_package(blynk_packet_t* package, blynk_device_t* device, blynk_cmd_t cmd,
                    uint16_t len, char* payload, blynk_response_handler_t handler,
-                   void* data, TickType_t wait) {
+                   void* data, tick_t wait, blynk_priority_t priority) {
     package->device = device;
     package->cmd = cmd;
     package->id = 0;
@@ -183,4 +624,5 @@ initialize_package(blynk_packet_t* package, blynk_device_t* device, blynk_cmd_t
     package->handler = handler;
     package->data = data;
     package->wait = wait;
+    package->priority = priority;
 }
@@ -0,0 +1,163 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "stuff/defines.h"
+#include "internal/handler_table.h"
+
+// Fibonacci hashing spreads the few short tags over the slots
+#define TAG_HASH_MULTIPLIER             0x9E3779B1u
+#define NO_SLOT                         BLYNK_HANDLER_SLOTS
+
+#if BLYNK_ACTION_SIZE > 5
+#error "A command tag packs at most 4 characters"
+#endif
+
+// A free slot is always left, so an insert finds one and a miss ends at it
+_Static_assert(BLYNK_HANDLER_SLOTS > BLYNK_MAX_HANDLERS, "BLYNK_HANDLER_SLOTS must exceed BLYNK_MAX_HANDLERS");
+
+
+static uint16_t home_slot(uint32_t tag);
+
+static uint16_t next_slot(uint16_t slot);
+
+static bool probe(const blynk_handler_snapshot_t* snapshot, uint32_t tag, uint16_t* slot);
+
+static void remove_slot(blynk_handler_snapshot_t* snapshot, uint16_t slot);
+
+
+uint32_t
+command_tag(const uint8_t* command, size_t size) {
+    uint32_t tag = 0;
+
+    for (size_t i = 0; i < size && i < BLYNK_ACTION_SIZE; ++i) {
+        if (command[i] == '\0') return tag;
+        tag |= (uint32_t) command[i] << (i * BYTE_SIZE);
+    }
+
+    return 0;
+}
+
+
+blynk_err_t
+handler_table_update(blynk_handler_table_t* table, uint32_t tag, const blynk_handler_data_t* entry) {
+    // Writers are serialized, so only they change the active index and it can be read plainly here
+    uint8_t next = !table->active;
+    const blynk_handler_snapshot_t* current = &table->snapshots[table->active];
+    blynk_handler_snapshot_t* snapshot = &table->snapshots[next];
+    uint16_t slot;
+    bool present = probe(current, tag, &slot);
+
+    if (entry && !present && (current->count >= BLYNK_MAX_HANDLERS || slot == NO_SLOT)) return BLYNK_EC_MEM;
+    if (!entry && !present) return BLYNK_EC_OK;
+
+    // A reader still holding the old index sees the odd sequence and retries on the published copy
+    uint32_t sequence = snapshot->sequence;
+    __atomic_store_n(&snapshot->sequence, sequence + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    memcpy(snapshot->slots, current->slots, sizeof(snapshot->slots));
+    snapshot->count = current->count;
+
+    if (!entry) {
+        remove_slot(snapshot, slot);
+        snapshot->count--;
+    } else {
+        if (!present) snapshot->count++;
+        snapshot->slots[slot] = *entry;
+        snapshot->slots[slot].tag = tag;
+    }
+
+    __atomic_store_n(&snapshot->sequence, sequence + 2, __ATOMIC_RELEASE);
+    __atomic_store_n(&table->active, next, __ATOMIC_RELEASE);
+
+    return BLYNK_EC_OK;
+}
+
+
+bool
+handler_table_find(const blynk_handler_table_t* table, uint32_t tag, blynk_handler_data_t* found) {
+    while (true) {
+        const blynk_handler_snapshot_t* snapshot = &table->snapshots[__atomic_load_n(&table->active,
+                                                                                     __ATOMIC_ACQUIRE)];
+        uint32_t sequence = __atomic_load_n(&snapshot->sequence, __ATOMIC_ACQUIRE);
+        if (sequence & 1) continue;
+
+        uint16_t slot;
+        bool present = probe(snapshot, tag, &slot);
+        if (present) *found = snapshot->slots[slot];
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&snapshot->sequence, __ATOMIC_RELAXED) == sequence) return present;
+    }
+}
+
+
+static uint16_t
+home_slot(uint32_t tag) {
+    return (uint16_t) (((uint64_t) (uint32_t) (tag * TAG_HASH_MULTIPLIER) * BLYNK_HANDLER_SLOTS) >> 32);
+}
+
+
+static uint16_t
+next_slot(uint16_t slot) {
+    return slot + 1 < BLYNK_HANDLER_SLOTS ? slot + 1 : 0;
+}
+
+
+static bool
+probe(const blynk_handler_snapshot_t* snapshot, uint32_t tag, uint16_t* slot) {
+    uint16_t index = home_slot(tag);
+
+    // Bounded, so a copy torn by a concurrent writer still ends the scan
+    for (uint16_t i = 0; i < BLYNK_HANDLER_SLOTS; ++i, index = next_slot(index)) {
+        uint32_t stored = snapshot->slots[index].tag;
+
+        if (stored == tag || !stored) {
+            *slot = index;
+            return stored == tag;
+        }
+    }
+
+    *slot = NO_SLOT;
+    return false;
+}
+
+
+static void
+remove_slot(blynk_handler_snapshot_t* snapshot, uint16_t slot) {
+    // Later entries of the probe sequence move back, so no lookup stops early at the hole
+    for (uint16_t index = next_slot(slot); snapshot->slots[index].tag; index = next_slot(index)) {
+        uint16_t home = home_slot(snapshot->slots[index].tag);
+        bool reachable = slot <= index ? (home > slot && home <= index) : (home > slot || home <= index);
+
+        if (!reachable) {
+            snapshot->slots[slot] = snapshot->slots[index];
+            slot = index;
+        }
+    }
+
+    memset(&snapshot->slots[slot], 0, sizeof(snapshot->slots[slot]));
+}
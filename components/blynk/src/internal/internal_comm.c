@@ -24,42 +24,195 @@
 
 #include <sys/unistd.h>
 #include <memory.h>
+#include <stddef.h>
 
 #include "stuff/log.h"
+#include "internal/deadlines.h"
+#include "internal/message_ring.h"
 #include "internal/internal_comm.h"
+#include "internal/protocol_stuff.h"
 #include "stuff/blynk_freertos_port.h"
 
 #define TAG "[INTERNAL COMMUNICATION]"
 
+// A streamed packet keeps only its header in the ring, followed by its descriptor
+#define STREAM_OFFSET                   ((offsetof(blynk_queued_packet_t, frame) + BLYNK_HEADER_SIZE + \
+                                          sizeof(void*) - 1) / sizeof(void*) * sizeof(void*))
+#define STREAM_RECORD_SIZE              (STREAM_OFFSET + sizeof(blynk_stream_t))
+
+// Every lane takes a frame of any size, a record adds a length prefix and at most sizeof(size_t) - 1 bytes of padding
+_Static_assert(PACKET_RECORD_SIZE(BLYNK_MAX_FRAME_SIZE) + 2 * sizeof(size_t) <= BLYNK_CONTROL_RING_SIZE,
+               "BLYNK_CONTROL_RING_SIZE cannot hold a frame of BLYNK_MAX_FRAME_SIZE bytes");
+_Static_assert(PACKET_RECORD_SIZE(BLYNK_MAX_FRAME_SIZE) + 2 * sizeof(size_t) <= BLYNK_BULK_RING_SIZE,
+               "BLYNK_BULK_RING_SIZE cannot hold a frame of BLYNK_MAX_FRAME_SIZE bytes");
+
 
 static tick_t get_timeout(blynk_device_t* device);
 
+static uint16_t frame_payload_size(const blynk_packet_t* packet);
+
+static message_ring_t* packet_ring(const blynk_packet_t* packet);
+
+static message_ring_t* lane_ring(blynk_device_t* device, blynk_priority_t priority);
+
+static uint16_t frame_size_at(const uint8_t* frame);
+
+static uint16_t payload_length_at(const uint8_t* frame);
+
 
 blynk_err_t
-blynk_notify_packet_ready(blynk_packet_t* packet) {
-    blynk_request_info_t req_info;
-
-    req_info.message.command = packet->cmd;
-    req_info.message.id = packet->id;
-    req_info.message.length = packet->len;
-    req_info.deadline = packet->handler ? get_timeout(packet->device) + get_tick_count() : 0;
-    req_info.handler = packet->handler;
-    req_info.data = packet->data;
-
-    if (packet->cmd != BLYNK_CMD_RESPONSE && packet->len && packet->payload) {
-        if (packet->len > sizeof(req_info.message.payload)) {
-            packet->len = req_info.message.length = sizeof(req_info.message.payload);
-        }
-        memcpy(req_info.message.payload, packet->payload, packet->len);
+blynk_reserve_packet(blynk_packet_t* packet) {
+    blynk_queued_packet_t* queued = message_ring_reserve(packet_ring(packet),
+                                                         PACKET_RECORD_SIZE(BLYNK_HEADER_SIZE +
+                                                                            frame_payload_size(packet)),
+                                                         ms_to_ticks(packet->wait));
+    if (!queued) {
+        log_error("%s: Function %s cannot reserve space in the outgoing ring", TAG, __func__);
+        return BLYNK_EC_MEM;
+    }
+
+    packet->payload = queued->frame + BLYNK_HEADER_SIZE;
+    return BLYNK_EC_OK;
+}
+
+
+blynk_err_t
+blynk_commit_packet(blynk_packet_t* packet) {
+    blynk_queued_packet_t* queued = (blynk_queued_packet_t*) (packet->payload - BLYNK_HEADER_SIZE -
+                                                              offsetof(blynk_queued_packet_t, frame));
+
+    if (packet->cmd != BLYNK_CMD_RESPONSE && packet->len > BLYNK_MAX_PAYLOAD_LEN) {
+        packet->len = BLYNK_MAX_PAYLOAD_LEN;
     }
 
-    if (!queue_send(packet->device->priv_data.ctl_queue, &req_info, ms_to_ticks(packet->wait))) {
-        log_error("%s: Function %s cannot send payload by queue", TAG, __func__);
+    queued->deadline = packet->handler ? deadline_after(get_timeout(packet->device)) : 0;
+    queued->handler = packet->handler;
+    queued->data = packet->data;
+    queued->frame_size = BLYNK_HEADER_SIZE + frame_payload_size(packet);
+    compose_blynk_header(queued->frame, packet->cmd, packet->id, packet->len);
+
+    message_ring_commit(packet_ring(packet), PACKET_RECORD_SIZE(queued->frame_size));
+
+    return blynk_wake_network_task(packet->device);
+}
+
+
+blynk_err_t
+blynk_commit_frames(blynk_device_t* device, const uint8_t* frames, size_t size, tick_t wait) {
+    message_ring_t* ring = &device->priv_data.lanes[BLYNK_PRIORITY_BULK].ring;
+    size_t footprint = 0;
+
+    for (size_t offset = 0; offset < size; offset += frame_size_at(frames + offset)) {
+        footprint += message_ring_footprint(PACKET_RECORD_SIZE(frame_size_at(frames + offset)));
+    }
+
+    if (!footprint) return BLYNK_EC_OK;
+
+    blynk_queued_packet_t* queued = message_ring_reserve_span(ring, footprint, ms_to_ticks(wait));
+    if (!queued) {
+        log_error("%s: Function %s cannot reserve space in the outgoing ring", TAG, __func__);
+        return BLYNK_EC_MEM;
+    }
+
+    // One reservation, one commit and one wakeup for the whole batch
+    for (size_t offset = 0;;) {
+        uint16_t frame_size = frame_size_at(frames + offset);
+
+        queued->deadline = 0;
+        queued->handler = NULL;
+        queued->data = NULL;
+        queued->frame_size = frame_size;
+        memcpy(queued->frame, frames + offset, frame_size);
+
+        offset += frame_size;
+        if (offset >= size) break;
+
+        queued = message_ring_split(ring, PACKET_RECORD_SIZE(frame_size));
+    }
+
+    message_ring_commit(ring, PACKET_RECORD_SIZE(queued->frame_size));
+
+    return blynk_wake_network_task(device);
+}
+
+
+blynk_err_t
+blynk_notify_packet_ready(blynk_packet_t* packet) {
+    const uint8_t* payload = packet->payload;
+    if (!payload && packet->cmd != BLYNK_CMD_RESPONSE) packet->len = 0;
+
+    blynk_err_t status = blynk_reserve_packet(packet);
+    if (status != BLYNK_EC_OK) return status;
+
+    if (payload) memcpy(packet->payload, payload, frame_payload_size(packet));
+    return blynk_commit_packet(packet);
+}
+
+
+blynk_err_t
+blynk_notify_stream_ready(blynk_device_t* device, blynk_cmd_t cmd, blynk_priority_t priority, uint16_t len,
+                          const blynk_stream_t* stream, tick_t wait) {
+    message_ring_t* ring = lane_ring(device, priority);
+    blynk_queued_packet_t* queued = message_ring_reserve(ring, STREAM_RECORD_SIZE, ms_to_ticks(wait));
+    if (!queued) {
+        log_error("%s: Function %s cannot reserve space in the outgoing ring", TAG, __func__);
         return BLYNK_EC_MEM;
     }
 
+    queued->deadline = 0;
+    queued->handler = NULL;
+    queued->data = NULL;
+    queued->frame_size = BLYNK_HEADER_SIZE;
+    compose_blynk_header(queued->frame, cmd, 0, len);
+    *(blynk_stream_t*) ((uint8_t*) queued + STREAM_OFFSET) = *stream;
+
+    message_ring_commit(ring, STREAM_RECORD_SIZE);
+
+    return blynk_wake_network_task(device);
+}
+
+
+blynk_stream_t*
+blynk_packet_stream(const blynk_queued_packet_t* packet) {
+    // Any other frame holds its whole payload, a coalesced one has a size of 0
+    if (packet->frame_size != BLYNK_HEADER_SIZE || packet->frame[0] == BLYNK_CMD_RESPONSE ||
+        !payload_length_at(packet->frame)) {
+        return NULL;
+    }
+
+    return (blynk_stream_t*) ((uint8_t*) packet + STREAM_OFFSET);
+}
+
+
+size_t
+blynk_packet_wire_size(const blynk_queued_packet_t* packet) {
+    return blynk_packet_stream(packet) ? BLYNK_HEADER_SIZE + (size_t) payload_length_at(packet->frame)
+                                       : packet->frame_size;
+}
+
+
+blynk_queued_packet_t*
+blynk_first_packet(blynk_device_t* device, uint8_t lane) {
+    return message_ring_front(&device->priv_data.lanes[lane].ring);
+}
+
+
+blynk_queued_packet_t*
+blynk_next_packet(blynk_device_t* device, uint8_t lane, const blynk_queued_packet_t* packet) {
+    return message_ring_next(&device->priv_data.lanes[lane].ring, packet);
+}
+
+
+void
+blynk_release_packets(blynk_device_t* device, uint8_t lane, size_t count) {
+    message_ring_release(&device->priv_data.lanes[lane].ring, count);
+}
+
+
+blynk_err_t
+blynk_wake_network_task(blynk_device_t* device) {
     uint8_t dummy = 0;
-    int fd = packet->device->priv_data.ctl_sockets[WRITE_SOCK];
+    int fd = device->priv_data.ctl_sockets[WRITE_SOCK];
     ssize_t write_status = write(fd, &dummy, sizeof(dummy));
 
     if (SYSCALL_FAILED(write_status)) {
@@ -71,6 +224,40 @@ blynk_notify_packet_ready(blynk_packet_t* packet) {
 }
 
 
+static uint16_t
+frame_payload_size(const blynk_packet_t* packet) {
+    // A response carries its status in the length field and has no payload
+    if (packet->cmd == BLYNK_CMD_RESPONSE) return 0;
+
+    return MIN(packet->len, BLYNK_MAX_PAYLOAD_LEN);
+}
+
+
+static uint16_t
+frame_size_at(const uint8_t* frame) {
+    return BLYNK_HEADER_SIZE + payload_length_at(frame);
+}
+
+
+static uint16_t
+payload_length_at(const uint8_t* frame) {
+    return frame[3] << BYTE_SIZE | frame[4];
+}
+
+
+static message_ring_t*
+packet_ring(const blynk_packet_t* packet) {
+    return lane_ring(packet->device, packet->priority);
+}
+
+
+static message_ring_t*
+lane_ring(blynk_device_t* device, blynk_priority_t priority) {
+    uint8_t lane = priority < BLYNK_PRIORITY_LANES ? priority : BLYNK_PRIORITY_BULK;
+    return &device->priv_data.lanes[lane].ring;
+}
+
+
 static tick_t
 get_timeout(blynk_device_t* device) {
     mutex_wrap_t wrap = {
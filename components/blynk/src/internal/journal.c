@@ -0,0 +1,721 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "stuff/log.h"
+#include "stuff/defines.h"
+#include "internal/journal.h"
+#include "internal/message_ring.h"
+#include "internal/internal_comm.h"
+#include "stuff/blynk_freertos_port.h"
+
+#define TAG "[JOURNAL]"
+
+#define RECORD_FRAME                    0xA5
+#define RECORD_CHECKPOINT               0x5C
+#define RECORD_ERASED_BYTE              0xFF
+#define RECORD_HEADER_SIZE              BLYNK_JOURNAL_RECORD_HEADER_SIZE
+#define RECORD_CHECKSUMMED_HEADER       8
+#define RECORD_SIZE(len)                (RECORD_HEADER_SIZE + (((size_t) (len) + 3) & ~(size_t) 3))
+#define CHECKPOINT_LEN                  4
+
+// A record is staged and every record is scanned in one piece
+_Static_assert(RECORD_SIZE(BLYNK_MAX_FRAME_SIZE) <= BLYNK_JOURNAL_BUFFER_SIZE,
+               "BLYNK_JOURNAL_BUFFER_SIZE cannot hold a record of the largest frame");
+
+
+typedef enum {
+    RECORD_VALID = 0,
+    RECORD_INCOMPLETE,
+    RECORD_ERASED,
+    RECORD_CORRUPT,
+} record_status_t;
+
+
+typedef struct {
+    uint8_t kind;
+    uint16_t len;
+    uint32_t seq;
+    const uint8_t* data;
+    size_t size;
+} journal_record_t;
+
+
+typedef struct {
+    bool found;
+    uint32_t seq;
+    size_t sector;
+    size_t end;
+    bool torn;
+    uint32_t acked;
+} journal_scan_t;
+
+
+static void journal_ack_callback(blynk_device_t* device, blynk_status_t status, void* data);
+
+static void acknowledge(blynk_journal_t* journal, uint32_t seq);
+
+static void forget_ack(blynk_journal_t* journal, uint32_t seq);
+
+static blynk_err_t send_ack_request(blynk_device_t* device, uint32_t seq);
+
+static blynk_err_t append_record(blynk_journal_t* journal, uint8_t* record, uint8_t kind, uint16_t len);
+
+static blynk_err_t append_checkpoint(blynk_journal_t* journal);
+
+static blynk_err_t advance_sector(blynk_journal_t* journal);
+
+static void count_lost_frames(blynk_journal_t* journal, size_t start);
+
+static blynk_err_t scan_sector(blynk_journal_t* journal, size_t sector, journal_scan_t* scan);
+
+static blynk_err_t recover(blynk_journal_t* journal);
+
+static blynk_err_t format(blynk_journal_t* journal);
+
+static record_status_t parse_record(const uint8_t* bytes, size_t available, size_t room, journal_record_t* record);
+
+static size_t sector_end(const blynk_journal_t* journal, size_t offset);
+
+static size_t read_limit(const blynk_journal_t* journal, size_t offset);
+
+static size_t wrap_offset(const blynk_journal_t* journal, size_t offset);
+
+static bool device_authenticated(blynk_device_t* device);
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* data, size_t size);
+
+static void put_le16(uint8_t* out, uint16_t value);
+
+static void put_le32(uint8_t* out, uint32_t value);
+
+static uint16_t get_le16(const uint8_t* in);
+
+static uint32_t get_le32(const uint8_t* in);
+
+
+bool
+journal_init(blynk_device_t* device) {
+    blynk_journal_t* journal = &device->priv_data.journal;
+
+    memset(journal, 0, offsetof(blynk_journal_t, buffer));
+    journal->mtx = create_semaphore();
+
+    return journal->mtx != NULL;
+}
+
+
+blynk_err_t
+journal_attach(blynk_device_t* device, blynk_journal_storage_t* storage) {
+    blynk_journal_t* journal = &device->priv_data.journal;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {journal->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    journal->storage = storage;
+    blynk_err_t err = storage ? recover(journal) : BLYNK_EC_OK;
+    if (err != BLYNK_EC_OK) journal->storage = NULL;
+
+    mutex_wrapper_give(&wrap);
+    return err;
+}
+
+
+bool
+journal_capture(blynk_device_t* device, offline_frame_encoder_t encode, void* context, blynk_err_t* status) {
+    blynk_journal_t* journal = &device->priv_data.journal;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {journal->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    if (!journal->storage) {
+        mutex_wrapper_give(&wrap);
+        return false;
+    }
+
+    // The frame is encoded right behind the room for its record header
+    uint8_t* record = (uint8_t*) journal->buffer;
+    size_t size = encode(record + RECORD_HEADER_SIZE, BLYNK_MAX_FRAME_SIZE, context);
+    *status = size ? append_record(journal, record, RECORD_FRAME, size) : BLYNK_EC_MEM;
+
+    mutex_wrapper_give(&wrap);
+
+    if (*status == BLYNK_EC_OK && device_authenticated(device)) blynk_wake_network_task(device);
+    return true;
+}
+
+
+bool
+journal_capture_frames(blynk_device_t* device, const uint8_t* frames, size_t size, blynk_err_t* status) {
+    blynk_journal_t* journal = &device->priv_data.journal;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {journal->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    if (!journal->storage) {
+        mutex_wrapper_give(&wrap);
+        return false;
+    }
+
+    uint8_t* record = (uint8_t*) journal->buffer;
+    *status = BLYNK_EC_OK;
+
+    for (size_t offset = 0; offset < size && *status == BLYNK_EC_OK;) {
+        uint16_t frame_size = BLYNK_HEADER_SIZE + (frames[offset + 3] << BYTE_SIZE | frames[offset + 4]);
+
+        memcpy(record + RECORD_HEADER_SIZE, frames + offset, frame_size);
+        *status = append_record(journal, record, RECORD_FRAME, frame_size);
+        offset += frame_size;
+    }
+
+    mutex_wrapper_give(&wrap);
+
+    if (*status == BLYNK_EC_OK && device_authenticated(device)) blynk_wake_network_task(device);
+    return true;
+}
+
+
+void
+journal_replay(blynk_device_t* device) {
+    blynk_journal_t* journal = &device->priv_data.journal;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {journal->mtx},
+    };
+
+    // The next burst waits until the previous one is on the wire
+    if (blynk_first_packet(device, BLYNK_PRIORITY_BULK)) return;
+
+    mutex_wrapper_take(&wrap);
+
+    if (!journal->storage) {
+        mutex_wrapper_give(&wrap);
+        return;
+    }
+
+    // The ping goes out behind the burst, so its response means the server has read every frame of it
+    if (journal->requested_seq != journal->sent_seq && journal->pending_count < BLYNK_JOURNAL_MAX_ACKS &&
+        send_ack_request(device, journal->sent_seq) == BLYNK_EC_OK) {
+        journal->pending[journal->pending_count++] = (blynk_journal_ack_t) {
+                .seq = journal->sent_seq,
+                .offset = journal->read_offset,
+        };
+        journal->requested_seq = journal->sent_seq;
+    }
+
+    uint8_t* buffer = (uint8_t*) journal->buffer;
+    size_t burst = 0;
+
+    while (!burst && journal->read_offset != journal->head && journal->pending_count < BLYNK_JOURNAL_MAX_ACKS) {
+        size_t offset = journal->read_offset;
+        size_t limit = read_limit(journal, offset);
+        size_t length = MIN(BLYNK_JOURNAL_BUFFER_SIZE, limit - offset);
+
+        if (journal->storage->read(journal->storage->context, offset, buffer, length) != BLYNK_EC_OK) {
+            log_error("%s: Function %s cannot read the journal at %u", TAG, __func__, (unsigned) offset);
+            break;
+        }
+
+        // Frames are moved to the front of the buffer over the records they came from
+        size_t consumed = 0;
+        size_t footprint = 0;
+        uint32_t last_seq = journal->sent_seq;
+        journal_record_t record;
+        record_status_t status;
+
+        while ((status = parse_record(buffer + consumed, length - consumed, limit - offset - consumed, &record)) ==
+               RECORD_VALID) {
+            if (record.kind == RECORD_FRAME && record.seq > journal->sent_seq) {
+                size_t record_footprint = message_ring_footprint(PACKET_RECORD_SIZE(record.len));
+                if (burst && footprint + record_footprint > BLYNK_OFFLINE_FLUSH_BURST) break;
+
+                memmove(buffer + burst, record.data, record.len);
+                burst += record.len;
+                footprint += record_footprint;
+                last_seq = record.seq;
+            }
+
+            consumed += record.size;
+        }
+
+        size_t next = offset + consumed;
+        if (status == RECORD_ERASED || status == RECORD_CORRUPT || (status == RECORD_INCOMPLETE && !consumed)) {
+            // Nothing readable is left in this sector
+            next = limit == journal->head ? journal->head : limit;
+        }
+
+        next = wrap_offset(journal, next);
+
+        if (burst && blynk_commit_frames(device, buffer, burst, NO_WAITING) != BLYNK_EC_OK) break;
+
+        journal->read_offset = next;
+        journal->sent_seq = last_seq;
+    }
+
+    mutex_wrapper_give(&wrap);
+}
+
+
+bool
+journal_rewind(blynk_device_t* device) {
+    blynk_journal_t* journal = &device->priv_data.journal;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {journal->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    bool attached = journal->storage != NULL;
+    journal->read_offset = journal->acked_offset;
+    journal->sent_seq = journal->acked_seq;
+    journal->requested_seq = journal->acked_seq;
+    journal->pending_count = 0;
+
+    mutex_wrapper_give(&wrap);
+    return attached;
+}
+
+
+static void
+journal_ack_callback(blynk_device_t* device, blynk_status_t status, void* data) {
+    blynk_journal_t* journal = &device->priv_data.journal;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {journal->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    if (journal->storage) {
+        // A lost response only delays the checkpoint, the burst is asked about again
+        if (status == BLYNK_STATUS_SUCCESS) {
+            acknowledge(journal, (uint32_t) (uintptr_t) data);
+        } else {
+            forget_ack(journal, (uint32_t) (uintptr_t) data);
+        }
+    }
+
+    mutex_wrapper_give(&wrap);
+}
+
+
+static void
+acknowledge(blynk_journal_t* journal, uint32_t seq) {
+    uint8_t count = 0;
+
+    while (count < journal->pending_count && journal->pending[count].seq <= seq) {
+        journal->acked_seq = journal->pending[count].seq;
+        journal->acked_offset = journal->pending[count].offset;
+        count++;
+    }
+
+    if (!count) return;
+
+    journal->pending_count -= count;
+    memmove(journal->pending, journal->pending + count, journal->pending_count * sizeof(*journal->pending));
+
+    // A checkpoint lost to a crash only costs duplicates, so the storage is synced once replay caught up
+    bool caught_up = !journal->pending_count && journal->read_offset == journal->head;
+    if (append_checkpoint(journal) == BLYNK_EC_OK && caught_up && journal->storage->sync) {
+        journal->storage->sync(journal->storage->context);
+    }
+}
+
+
+static void
+forget_ack(blynk_journal_t* journal, uint32_t seq) {
+    uint8_t kept = 0;
+
+    for (uint8_t i = 0; i < journal->pending_count; ++i) {
+        if (journal->pending[i].seq != seq) journal->pending[kept++] = journal->pending[i];
+    }
+
+    journal->pending_count = kept;
+    journal->requested_seq = kept ? journal->pending[kept - 1].seq : journal->acked_seq;
+}
+
+
+static blynk_err_t
+send_ack_request(blynk_device_t* device, uint32_t seq) {
+    blynk_packet_t ack_packet = {
+            .device = device,
+            .cmd = BLYNK_CMD_PING,
+            .id = 0,
+            .len = 0,
+            .payload = NULL,
+            .handler = journal_ack_callback,
+            .data = (void*) (uintptr_t) seq,
+            .wait = NO_WAITING,
+            .priority = BLYNK_PRIORITY_CONTROL,
+    };
+
+    return blynk_notify_packet_ready(&ack_packet);
+}
+
+
+static blynk_err_t
+append_record(blynk_journal_t* journal, uint8_t* record, uint8_t kind, uint16_t len) {
+    size_t size = RECORD_SIZE(len);
+
+    // Records never straddle sectors, so a sector can be recycled on its own
+    if (journal->head + size > sector_end(journal, journal->head)) {
+        blynk_err_t err = advance_sector(journal);
+        if (err != BLYNK_EC_OK) return err;
+    }
+
+    record[0] = kind;
+    record[1] = 0;
+    put_le16(record + 2, len);
+    put_le32(record + 4, journal->next_seq);
+    memset(record + RECORD_HEADER_SIZE + len, RECORD_ERASED_BYTE, size - RECORD_HEADER_SIZE - len);
+    put_le32(record + 8, crc32_update(crc32_update(0, record, RECORD_CHECKSUMMED_HEADER),
+                                      record + RECORD_HEADER_SIZE, len));
+
+    blynk_err_t err = journal->storage->write(journal->storage->context, journal->head, record, size);
+    if (err != BLYNK_EC_OK) {
+        // Whatever part of the record made it cannot be written over, the sector is given up
+        log_error("%s: Function %s cannot write the journal at %u", TAG, __func__, (unsigned) journal->head);
+        if (kind == RECORD_FRAME) advance_sector(journal);
+        return BLYNK_EC_FAILED_TO_WRITE;
+    }
+
+    journal->next_seq++;
+    journal->head += size;
+
+    // The head never rests on a sector boundary, where it would look like the start of the oldest sector
+    if (journal->head == sector_end(journal, journal->head - 1)) advance_sector(journal);
+
+    return BLYNK_EC_OK;
+}
+
+
+static blynk_err_t
+append_checkpoint(blynk_journal_t* journal) {
+    uint8_t record[RECORD_SIZE(CHECKPOINT_LEN)];
+
+    put_le32(record + RECORD_HEADER_SIZE, journal->acked_seq);
+    return append_record(journal, record, RECORD_CHECKPOINT, CHECKPOINT_LEN);
+}
+
+
+static blynk_err_t
+advance_sector(blynk_journal_t* journal) {
+    blynk_journal_storage_t* storage = journal->storage;
+    size_t sectors = storage->size / storage->sector_size;
+    size_t start = (journal->head_sector + 1) % sectors * storage->sector_size;
+    size_t following = wrap_offset(journal, start + storage->sector_size);
+
+    count_lost_frames(journal, start);
+
+    blynk_err_t err = storage->erase(storage->context, start, storage->sector_size);
+    if (err != BLYNK_EC_OK) {
+        log_error("%s: Function %s cannot erase the journal at %u", TAG, __func__, (unsigned) start);
+        return err;
+    }
+
+    // Cursors that caught up with the head follow it, cursors in the recycled sector skip to the oldest one left
+    size_t* cursors[2 + BLYNK_JOURNAL_MAX_ACKS] = {&journal->read_offset, &journal->acked_offset};
+    for (uint8_t i = 0; i < journal->pending_count; ++i) cursors[2 + i] = &journal->pending[i].offset;
+
+    for (uint8_t i = 0; i < 2 + journal->pending_count; ++i) {
+        if (*cursors[i] == journal->head) {
+            *cursors[i] = start;
+        } else if (*cursors[i] >= start && *cursors[i] < start + storage->sector_size) {
+            *cursors[i] = following;
+        }
+    }
+
+    journal->head_sector = start / storage->sector_size;
+    journal->head = start;
+
+    // Every sector opens with a checkpoint, so the last one survives the sector that held it
+    return append_checkpoint(journal);
+}
+
+
+static void
+count_lost_frames(blynk_journal_t* journal, size_t start) {
+    blynk_journal_storage_t* storage = journal->storage;
+    size_t end = start + storage->sector_size;
+
+    if (journal->acked_offset < start || journal->acked_offset >= end || journal->acked_offset == journal->head) return;
+
+    // Only the headers are read, the rest of the buffer may hold a record that is being written
+    uint8_t header[RECORD_HEADER_SIZE];
+    for (size_t offset = journal->acked_offset; end - offset >= RECORD_HEADER_SIZE;) {
+        if (storage->read(storage->context, offset, header, sizeof(header)) != BLYNK_EC_OK ||
+            header[0] == RECORD_ERASED_BYTE) {
+            break;
+        }
+
+        if (header[0] == RECORD_FRAME && get_le32(header + 4) > journal->acked_seq) journal->dropped++;
+        offset += RECORD_SIZE(get_le16(header + 2));
+    }
+}
+
+
+static blynk_err_t
+recover(blynk_journal_t* journal) {
+    blynk_journal_storage_t* storage = journal->storage;
+    size_t sectors = storage->size / storage->sector_size;
+    journal_scan_t newest = {0};
+
+    for (size_t sector = 0; sector < sectors; ++sector) {
+        blynk_err_t err = scan_sector(journal, sector, &newest);
+        if (err != BLYNK_EC_OK) return err;
+    }
+
+    journal->pending_count = 0;
+    journal->dropped = 0;
+
+    if (!newest.found) return format(journal);
+
+    journal->head_sector = newest.sector;
+    journal->head = newest.end;
+    journal->next_seq = newest.seq + 1;
+    journal->acked_seq = newest.acked;
+    journal->sent_seq = newest.acked;
+    journal->requested_seq = newest.acked;
+
+    // Replay starts at the oldest sector, the sectors after the head that hold no record are skipped
+    journal->read_offset = newest.sector * storage->sector_size;
+    uint8_t* buffer = (uint8_t*) journal->buffer;
+
+    for (size_t i = 1; i < sectors; ++i) {
+        size_t start = (newest.sector + i) % sectors * storage->sector_size;
+        size_t length = MIN(BLYNK_JOURNAL_BUFFER_SIZE, storage->sector_size);
+        journal_record_t record;
+
+        blynk_err_t err = storage->read(storage->context, start, buffer, length);
+        if (err != BLYNK_EC_OK) return err;
+
+        if (parse_record(buffer, length, storage->sector_size, &record) == RECORD_VALID) {
+            journal->read_offset = start;
+            break;
+        }
+    }
+
+    journal->acked_offset = journal->read_offset;
+
+    // A record torn by a power loss is never written over, and neither is a full sector
+    if (newest.torn || journal->head == sector_end(journal, journal->head - 1)) return advance_sector(journal);
+
+    return BLYNK_EC_OK;
+}
+
+
+static blynk_err_t
+scan_sector(blynk_journal_t* journal, size_t sector, journal_scan_t* scan) {
+    blynk_journal_storage_t* storage = journal->storage;
+    uint8_t* buffer = (uint8_t*) journal->buffer;
+    size_t offset = sector * storage->sector_size;
+    size_t end = offset + storage->sector_size;
+    bool newest = false;
+    record_status_t status = RECORD_ERASED;
+
+    while (offset < end) {
+        size_t length = MIN(BLYNK_JOURNAL_BUFFER_SIZE, end - offset);
+        size_t consumed = 0;
+        journal_record_t record;
+
+        blynk_err_t err = storage->read(storage->context, offset, buffer, length);
+        if (err != BLYNK_EC_OK) return err;
+
+        while ((status = parse_record(buffer + consumed, length - consumed, end - offset - consumed, &record)) ==
+               RECORD_VALID) {
+            if (!scan->found || record.seq > scan->seq) {
+                scan->found = true;
+                scan->seq = record.seq;
+                scan->sector = sector;
+                newest = true;
+            }
+
+            if (record.kind == RECORD_CHECKPOINT && get_le32(record.data) > scan->acked) {
+                scan->acked = get_le32(record.data);
+            }
+
+            consumed += record.size;
+        }
+
+        offset += consumed;
+        if (status != RECORD_INCOMPLETE || !consumed) break;
+    }
+
+    if (newest) {
+        scan->end = offset;
+        scan->torn = offset < end && status != RECORD_ERASED;
+    }
+
+    return BLYNK_EC_OK;
+}
+
+
+static blynk_err_t
+format(blynk_journal_t* journal) {
+    blynk_journal_storage_t* storage = journal->storage;
+
+    log_info("%s: No journal found, formatting the storage", TAG);
+
+    blynk_err_t err = storage->erase(storage->context, 0, storage->size / storage->sector_size * storage->sector_size);
+    if (err != BLYNK_EC_OK) return err;
+
+    journal->head_sector = 0;
+    journal->head = 0;
+    journal->next_seq = 1;
+    journal->read_offset = 0;
+    journal->sent_seq = 0;
+    journal->requested_seq = 0;
+    journal->acked_seq = 0;
+    journal->acked_offset = 0;
+
+    return append_checkpoint(journal);
+}
+
+
+static record_status_t
+parse_record(const uint8_t* bytes, size_t available, size_t room, journal_record_t* record) {
+    // | kind | 0 | len (LE16) | seq (LE32) | crc32 (LE32) | len bytes | 0xFF up to 4-byte alignment |
+    if (room < RECORD_HEADER_SIZE) return RECORD_ERASED;
+    if (available < RECORD_HEADER_SIZE) return RECORD_INCOMPLETE;
+
+    bool erased = true;
+    for (uint8_t i = 0; i < RECORD_HEADER_SIZE && erased; ++i) erased = bytes[i] == RECORD_ERASED_BYTE;
+    if (erased) return RECORD_ERASED;
+
+    uint16_t len = get_le16(bytes + 2);
+    bool known = (bytes[0] == RECORD_FRAME && len >= BLYNK_HEADER_SIZE && len <= BLYNK_MAX_FRAME_SIZE) ||
+                 (bytes[0] == RECORD_CHECKPOINT && len == CHECKPOINT_LEN);
+
+    if (!known || bytes[1] || RECORD_SIZE(len) > room) return RECORD_CORRUPT;
+    if (RECORD_SIZE(len) > available) return RECORD_INCOMPLETE;
+
+    const uint8_t* data = bytes + RECORD_HEADER_SIZE;
+    uint32_t crc = crc32_update(crc32_update(0, bytes, RECORD_CHECKSUMMED_HEADER), data, len);
+
+    if (crc != get_le32(bytes + 8) ||
+        (bytes[0] == RECORD_FRAME && len != BLYNK_HEADER_SIZE + (data[3] << BYTE_SIZE | data[4]))) {
+        return RECORD_CORRUPT;
+    }
+
+    *record = (journal_record_t) {
+            .kind = bytes[0],
+            .len = len,
+            .seq = get_le32(bytes + 4),
+            .data = data,
+            .size = RECORD_SIZE(len),
+    };
+
+    return RECORD_VALID;
+}
+
+
+static size_t
+sector_end(const blynk_journal_t* journal, size_t offset) {
+    size_t sector_size = journal->storage->sector_size;
+    return (offset / sector_size + 1) * sector_size;
+}
+
+
+static size_t
+read_limit(const blynk_journal_t* journal, size_t offset) {
+    return offset / journal->storage->sector_size == journal->head_sector ? journal->head
+                                                                           : sector_end(journal, offset);
+}
+
+
+static size_t
+wrap_offset(const blynk_journal_t* journal, size_t offset) {
+    size_t sectors = journal->storage->size / journal->storage->sector_size;
+    return offset % (sectors * journal->storage->sector_size);
+}
+
+
+static bool
+device_authenticated(blynk_device_t* device) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    bool authenticated = device->control.state == BLYNK_STATE_AUTHENTICATED;
+    mutex_wrapper_give(&wrap);
+
+    return authenticated;
+}
+
+
+static uint32_t
+crc32_update(uint32_t crc, const uint8_t* data, size_t size) {
+    // CRC-32 of zlib with a half-byte table, 64 bytes instead of 1 KB
+    static const uint32_t table[16] = {
+            0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+            0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C,
+    };
+
+    crc = ~crc;
+    for (size_t i = 0; i < size; ++i) {
+        crc = table[(crc ^ data[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (data[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+
+    return ~crc;
+}
+
+
+static void
+put_le16(uint8_t* out, uint16_t value) {
+    out[0] = (uint8_t) value;
+    out[1] = (uint8_t) (value >> BYTE_SIZE);
+}
+
+
+static void
+put_le32(uint8_t* out, uint32_t value) {
+    put_le16(out, (uint16_t) value);
+    put_le16(out + 2, (uint16_t) (value >> 16));
+}
+
+
+static uint16_t
+get_le16(const uint8_t* in) {
+    return (uint16_t) (in[0] | in[1] << BYTE_SIZE);
+}
+
+
+static uint32_t
+get_le32(const uint8_t* in) {
+    return get_le16(in) | (uint32_t) get_le16(in + 2) << 16;
+}
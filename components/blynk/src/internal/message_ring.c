@@ -0,0 +1,310 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "stuff/log.h"
+#include "stuff/util.h"
+#include "internal/message_ring.h"
+#include "stuff/blynk_freertos_port.h"
+
+#define TAG "[MESSAGE RING]"
+
+#define RECORD_PREFIX_SIZE              sizeof(size_t)
+#define RECORD_SKIP                     SIZE_MAX
+#define RECORD_FOOTPRINT(size)          (RECORD_PREFIX_SIZE + (((size) + sizeof(size_t) - 1) & ~(sizeof(size_t) - 1)))
+
+
+static bool find_free_space(message_ring_t* ring, size_t needed);
+
+static bool wait_for_space(message_ring_t* ring, tick_t ticks);
+
+static void wake_writers(message_ring_t* ring);
+
+static size_t record_offset(const message_ring_t* ring, size_t offset);
+
+static size_t* record_prefix(const message_ring_t* ring, size_t offset);
+
+
+bool
+message_ring_init(message_ring_t* ring, uint8_t* storage, size_t capacity) {
+    *ring = (message_ring_t) {
+            .storage = storage,
+            .capacity = capacity,
+    };
+
+    if ((uintptr_t) storage % sizeof(size_t) || capacity % sizeof(size_t)) {
+        log_error("%s: Function %s got misaligned storage", TAG, __func__);
+        return false;
+    }
+
+    if (!(ring->mtx = create_semaphore()) || !(ring->writer = create_semaphore()) ||
+        !(ring->space = create_signal())) {
+        log_error("%s: Function %s failed to create synchronization primitives", TAG, __func__);
+        return false;
+    }
+
+    return true;
+}
+
+
+void*
+message_ring_reserve(message_ring_t* ring, size_t size, tick_t wait) {
+    return message_ring_reserve_span(ring, RECORD_FOOTPRINT(size), wait);
+}
+
+
+size_t
+message_ring_footprint(size_t size) {
+    return RECORD_FOOTPRINT(size);
+}
+
+
+void*
+message_ring_reserve_span(message_ring_t* ring, size_t needed, tick_t wait) {
+    if (needed < RECORD_PREFIX_SIZE || needed % sizeof(size_t) || needed > ring->capacity) {
+        log_error("%s: Function %s got a span of %u bytes that can never fit", TAG, __func__, (unsigned) needed);
+        return NULL;
+    }
+
+    mutex_wrap_t writer = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->writer},
+    };
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->mtx},
+    };
+
+    tick_t started = get_tick_count();
+
+    while (true) {
+        mutex_wrapper_take(&writer);
+
+        // Space behind the tail is only touched by the writer, so it is filled in without holding the ring lock
+        mutex_wrapper_take(&wrap);
+        bool found = find_free_space(ring, needed);
+        // Counted in the same critical section, so a release right after it cannot be missed
+        if (!found && wait != NO_WAITING) ring->waiters++;
+        mutex_wrapper_give(&wrap);
+
+        if (found) {
+            if (ring->reserved_skip) {
+                *record_prefix(ring, ring->capacity - ring->reserved_skip) = RECORD_SKIP;
+            }
+            return ring->storage + ring->reserved_at + RECORD_PREFIX_SIZE;
+        }
+
+        mutex_wrapper_give(&writer);
+
+        if (wait == NO_WAITING) return NULL;
+
+        tick_t elapsed = get_tick_count() - started;
+        if (!wait_for_space(ring, elapsed < wait ? wait - elapsed : NO_WAITING)) return NULL;
+    }
+}
+
+
+void
+message_ring_commit(message_ring_t* ring, size_t size) {
+    mutex_wrap_t writer = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->writer},
+    };
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->mtx},
+    };
+
+    size_t span = ring->reserved_split;
+    if (size) {
+        *record_prefix(ring, ring->reserved_at + span) = size;
+        span += RECORD_FOOTPRINT(size);
+    }
+
+    mutex_wrapper_take(&wrap);
+    if (span && ring->reserved_generation == ring->generation) {
+        ring->used += ring->reserved_skip + span;
+    }
+    mutex_wrapper_give(&wrap);
+
+    mutex_wrapper_give(&writer);
+}
+
+
+void*
+message_ring_split(message_ring_t* ring, size_t size) {
+    size_t offset = ring->reserved_at + ring->reserved_split;
+
+    *record_prefix(ring, offset) = size;
+    ring->reserved_split += RECORD_FOOTPRINT(size);
+
+    return ring->storage + offset + RECORD_FOOTPRINT(size) + RECORD_PREFIX_SIZE;
+}
+
+
+void*
+message_ring_front(message_ring_t* ring) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    size_t head = ring->head;
+    size_t used = ring->used;
+    mutex_wrapper_give(&wrap);
+
+    if (!used) return NULL;
+
+    return ring->storage + record_offset(ring, head) + RECORD_PREFIX_SIZE;
+}
+
+
+void*
+message_ring_next(message_ring_t* ring, const void* record) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->mtx},
+    };
+
+    size_t offset = (const uint8_t*) record - ring->storage - RECORD_PREFIX_SIZE;
+    size_t next = (offset + RECORD_FOOTPRINT(*record_prefix(ring, offset))) % ring->capacity;
+
+    mutex_wrapper_take(&wrap);
+    size_t tail = (ring->head + ring->used) % ring->capacity;
+    mutex_wrapper_give(&wrap);
+
+    if (next == tail) return NULL;
+
+    return ring->storage + record_offset(ring, next) + RECORD_PREFIX_SIZE;
+}
+
+
+void
+message_ring_release(message_ring_t* ring, size_t count) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    while (count-- && ring->used) {
+        size_t offset = record_offset(ring, ring->head);
+        size_t footprint = RECORD_FOOTPRINT(*record_prefix(ring, offset));
+
+        ring->used -= footprint + (offset != ring->head ? ring->capacity - ring->head : 0);
+        ring->head = (offset + footprint) % ring->capacity;
+    }
+
+    wake_writers(ring);
+    mutex_wrapper_give(&wrap);
+}
+
+
+void
+message_ring_reset(message_ring_t* ring) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->mtx},
+    };
+
+    // A writer holding a reservation keeps filling it in, the generation makes its commit a no-op
+    mutex_wrapper_take(&wrap);
+    ring->head = 0;
+    ring->used = 0;
+    ring->generation++;
+    wake_writers(ring);
+    mutex_wrapper_give(&wrap);
+}
+
+
+static bool
+find_free_space(message_ring_t* ring, size_t needed) {
+    if (!ring->used) ring->head = 0;
+
+    size_t tail = ring->head + ring->used;
+
+    ring->reserved_skip = 0;
+    ring->reserved_split = 0;
+    ring->reserved_generation = ring->generation;
+
+    if (tail >= ring->capacity) {
+        // Wrapped: the free space lies between the tail and the head
+        ring->reserved_at = tail - ring->capacity;
+        return ring->head - ring->reserved_at >= needed;
+    }
+
+    if (ring->capacity - tail >= needed) {
+        ring->reserved_at = tail;
+        return true;
+    }
+
+    // Not enough room before the end, skip it and start over at the beginning
+    ring->reserved_at = 0;
+    ring->reserved_skip = ring->capacity - tail;
+    return ring->head >= needed;
+}
+
+
+static bool
+wait_for_space(message_ring_t* ring, tick_t ticks) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {ring->mtx},
+    };
+
+    // The caller already counted itself in ring->waiters
+    bool woken = ticks != NO_WAITING && signal_wait(ring->space, ticks);
+
+    // The signal wakes one writer at a time, each one passes it on until every writer waiting at release was woken
+    mutex_wrapper_take(&wrap);
+    ring->waiters--;
+    if (woken && ring->wakeups) ring->wakeups--;
+    if (ring->wakeups > ring->waiters) ring->wakeups = ring->waiters;
+    bool pass_on = ring->wakeups;
+    mutex_wrapper_give(&wrap);
+
+    if (pass_on) signal_notify(ring->space);
+    return woken;
+}
+
+
+static void
+wake_writers(message_ring_t* ring) {
+    // Called with the ring lock held
+    ring->wakeups = ring->waiters;
+    if (ring->wakeups) signal_notify(ring->space);
+}
+
+
+static size_t
+record_offset(const message_ring_t* ring, size_t offset) {
+    return *record_prefix(ring, offset) == RECORD_SKIP ? 0 : offset;
+}
+
+
+static size_t*
+record_prefix(const message_ring_t* ring, size_t offset) {
+    return (size_t*) (ring->storage + offset);
+}
@@ -0,0 +1,274 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <string.h>
+
+#include "stuff/log.h"
+#include "stuff/defines.h"
+#include "internal/message_ring.h"
+#include "internal/internal_comm.h"
+#include "internal/offline_store.h"
+#include "stuff/blynk_freertos_port.h"
+
+#define TAG "[OFFLINE STORE]"
+
+
+static bool device_authenticated(blynk_device_t* device);
+
+static bool salvageable(const blynk_queued_packet_t* packet);
+
+static size_t stored_frame_size(const uint8_t* frame);
+
+static void compact(blynk_offline_store_t* store);
+
+static void drop_oldest(blynk_offline_store_t* store);
+
+
+bool
+offline_store_init(blynk_device_t* device) {
+    device->priv_data.offline = (blynk_offline_store_t) {
+            .mtx = create_semaphore(),
+    };
+
+    return device->priv_data.offline.mtx != NULL;
+}
+
+
+void
+offline_store_configure(blynk_device_t* device, void* buffer, size_t size, blynk_overflow_policy_t policy) {
+    blynk_offline_store_t* store = &device->priv_data.offline;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {store->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    store->buffer = buffer;
+    store->capacity = buffer ? size : 0;
+    store->head = 0;
+    store->used = 0;
+    store->policy = policy;
+    store->dropped = 0;
+    mutex_wrapper_give(&wrap);
+}
+
+
+bool
+offline_store_capture(blynk_device_t* device, offline_frame_encoder_t encode, void* context, size_t largest,
+                      blynk_err_t* status) {
+    blynk_offline_store_t* store = &device->priv_data.offline;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {store->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    if (!store->capacity || (!store->used && device_authenticated(device))) {
+        mutex_wrapper_give(&wrap);
+        return false;
+    }
+
+    // Frames are kept back to back from head on, free space in front of them is reclaimed only when needed
+    while (true) {
+        uint8_t* tail = store->buffer + store->head + store->used;
+        size_t size = encode(tail, store->capacity - store->head - store->used, context);
+
+        if (size) {
+            store->used += size;
+            *status = BLYNK_EC_OK;
+            break;
+        }
+
+        if (store->head) {
+            compact(store);
+        } else if (store->policy == BLYNK_OVERFLOW_DROP_OLDEST && store->used && largest <= store->capacity) {
+            drop_oldest(store);
+        } else {
+            store->dropped++;
+            *status = BLYNK_EC_MEM;
+            break;
+        }
+    }
+
+    mutex_wrapper_give(&wrap);
+    return true;
+}
+
+
+void
+offline_store_flush(blynk_device_t* device) {
+    blynk_offline_store_t* store = &device->priv_data.offline;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {store->mtx},
+    };
+
+    // The next burst waits until the previous one is on the wire
+    if (blynk_first_packet(device, BLYNK_PRIORITY_BULK)) return;
+
+    mutex_wrapper_take(&wrap);
+
+    size_t burst = 0;
+    size_t footprint = 0;
+
+    while (burst < store->used) {
+        size_t size = stored_frame_size(store->buffer + store->head + burst);
+        size_t record = message_ring_footprint(PACKET_RECORD_SIZE(size));
+
+        if (burst && footprint + record > BLYNK_OFFLINE_FLUSH_BURST) break;
+
+        footprint += record;
+        burst += size;
+    }
+
+    if (burst && blynk_commit_frames(device, store->buffer + store->head, burst, NO_WAITING) == BLYNK_EC_OK) {
+        store->head += burst;
+        store->used -= burst;
+        if (!store->used) store->head = 0;
+    }
+
+    mutex_wrapper_give(&wrap);
+}
+
+
+void
+offline_store_salvage(blynk_device_t* device) {
+    blynk_offline_store_t* store = &device->priv_data.offline;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {store->mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+
+    if (!store->capacity) {
+        mutex_wrapper_give(&wrap);
+        return;
+    }
+
+    // Only the bulk lane is kept, the store is replayed through it and control writes would lose their precedence
+    uint8_t lane = BLYNK_PRIORITY_BULK;
+    size_t total = 0;
+
+    for (blynk_queued_packet_t* packet = blynk_first_packet(device, lane); packet;
+         packet = blynk_next_packet(device, lane, packet)) {
+        if (salvageable(packet)) total += packet->frame_size;
+    }
+
+    // The overflow policy picks which of the unsent frames are left out when they do not all fit
+    size_t room = store->capacity - store->used;
+    size_t skipped = 0;
+    size_t kept = 0;
+
+    for (blynk_queued_packet_t* packet = total > room ? blynk_first_packet(device, lane) : NULL; packet;
+         packet = blynk_next_packet(device, lane, packet)) {
+        if (!salvageable(packet)) continue;
+
+        if (store->policy == BLYNK_OVERFLOW_DROP_OLDEST ? total - skipped > room
+                                                        : kept + packet->frame_size > room) {
+            skipped += packet->frame_size;
+            store->dropped++;
+        } else {
+            kept += packet->frame_size;
+        }
+    }
+
+    if (total <= room) kept = total;
+
+    // Stored frames move to the end of the buffer, the unsent ones go right in front of them
+    memmove(store->buffer + store->capacity - store->used, store->buffer + store->head, store->used);
+    store->head = store->capacity - store->used;
+
+    uint8_t* out = store->buffer + store->head - kept;
+    size_t seen = 0;
+    size_t copied = 0;
+
+    for (blynk_queued_packet_t* packet = blynk_first_packet(device, lane); packet && copied < kept;
+         packet = blynk_next_packet(device, lane, packet)) {
+        if (!salvageable(packet)) continue;
+
+        bool keep = store->policy == BLYNK_OVERFLOW_DROP_OLDEST ? seen >= skipped
+                                                                : copied + packet->frame_size <= kept;
+        seen += packet->frame_size;
+        if (!keep) continue;
+
+        memcpy(out + copied, packet->frame, packet->frame_size);
+        out[copied + 1] = 0;
+        out[copied + 2] = 0;
+        copied += packet->frame_size;
+    }
+
+    store->head -= kept;
+    store->used += kept;
+
+    mutex_wrapper_give(&wrap);
+}
+
+
+static bool
+device_authenticated(blynk_device_t* device) {
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    bool authenticated = device->control.state == BLYNK_STATE_AUTHENTICATED;
+    mutex_wrapper_give(&wrap);
+
+    return authenticated;
+}
+
+
+static bool
+salvageable(const blynk_queued_packet_t* packet) {
+    // Coalesced frames have a size of 0, a frame waiting for a response cannot outlive its connection,
+    // and a stream lives in memory of the caller, which gets it back once the lanes are reset
+    return packet->frame_size && packet->frame[0] == BLYNK_CMD_HARDWARE && !packet->handler &&
+           !blynk_packet_stream(packet);
+}
+
+
+static size_t
+stored_frame_size(const uint8_t* frame) {
+    return BLYNK_HEADER_SIZE + (frame[3] << BYTE_SIZE | frame[4]);
+}
+
+
+static void
+compact(blynk_offline_store_t* store) {
+    memmove(store->buffer, store->buffer + store->head, store->used);
+    store->head = 0;
+}
+
+
+static void
+drop_oldest(blynk_offline_store_t* store) {
+    size_t size = stored_frame_size(store->buffer + store->head);
+
+    store->head += size;
+    store->used -= size;
+    store->dropped++;
+}
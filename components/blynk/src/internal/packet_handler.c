@@ -29,6 +29,7 @@
 #include "stuff/util.h"
 #include "stuff/defines.h"
 #include "internal/internal_comm.h"
+#include "internal/handler_table.h"
 #include "internal/packet_handler.h"
 #include "internal/protocol_stuff.h"
 #include "stuff/blynk_freertos_port.h"
@@ -37,21 +38,24 @@
 
 static void handle_response(blynk_device_t* device);
 
-static void handle_hardware(blynk_device_t* device);
+static void handle_hardware(blynk_device_t* device, uint8_t* payload, uint16_t length);
 
 static blynk_err_t handle_hardware_package(blynk_device_t* device);
 
-static blynk_cmd_handler_t find_handler_for_command(blynk_control_t* ctl, char* command);
+static bool find_handler_for_command(blynk_device_t* device, const uint8_t* command, size_t size,
+                                     blynk_handler_data_t* found);
 
-static int32_t extract_args_from_payload(blynk_private_data_t* private_data, char* args[]);
+static void process_hardware_message(blynk_device_t* device, const blynk_handler_data_t* entry, char* args[],
+                                     const blynk_arg_t views[], int32_t args_num);
 
-static void process_hardware_message(blynk_device_t* device, char* args[], int32_t args_num);
+static void deliver_chunk(blynk_device_t* device, const blynk_inbound_stream_t* stream, const uint8_t* chunk,
+                          uint16_t len);
 
-static int32_t split_payload_into_args(char* payload, uint32_t len, char** args, uint32_t size);
+static int32_t split_payload_into_args(char* payload, uint32_t len, char** args, blynk_arg_t* views, uint32_t size);
 
 
 void
-handle_message_packet(blynk_device_t* device) {
+handle_message_packet(blynk_device_t* device, uint8_t* payload, uint16_t length) {
     blynk_private_data_t* priv_data = &device->priv_data;
 
     switch (priv_data->message.command) {
@@ -59,7 +63,7 @@ handle_message_packet(blynk_device_t* device) {
             handle_response(device);
             break;
         case BLYNK_CMD_HARDWARE:
-            handle_hardware(device);
+            handle_hardware(device, payload, length);
             break;
         default:
             log_error("%s: Function % cannot detect command %d", TAG, __func__, priv_data->message.command);
@@ -85,75 +89,136 @@ handle_response(blynk_device_t* device) {
 
 
 static void
-handle_hardware(blynk_device_t* device) {
-    blynk_private_data_t* priv_data = &device->priv_data;
+handle_hardware(blynk_device_t* device, uint8_t* payload, uint16_t length) {
     char* extracted_args[BLYNK_MAX_ARGS];
+    blynk_arg_t views[BLYNK_MAX_ARGS];
+
+    if (!payload || !length) return;
+
+    // Arguments are read in place; the byte past the payload terminates the last one while the handler runs
+    uint8_t next = payload[length];
+    payload[length] = '\0';
+
+    blynk_handler_data_t entry;
+    bool found = find_handler_for_command(device, payload, length + 1, &entry);
+
+    if (found && entry.chunk_handler) {
+        // A chunk handler gets a command that fits the buffer as a single chunk
+        uint16_t prefix = MIN(strlen((const char*) payload) + 1, length);
+        blynk_inbound_stream_t stream = {
+                .id = device->priv_data.message.id,
+                .offset = 0,
+                .total_len = length - prefix,
+                .handler = entry.chunk_handler,
+                .data = entry.data,
+        };
+        strlcpy(stream.command, (const char*) payload, sizeof(stream.command));
 
-    int32_t arg_count = extract_args_from_payload(priv_data, extracted_args);
-    if (arg_count > 0) {
-        process_hardware_message(device, extracted_args, arg_count);
+        deliver_chunk(device, &stream, payload + prefix, stream.total_len);
+    } else {
+        int32_t arg_count = split_payload_into_args((char*) payload, length, extracted_args, views, BLYNK_MAX_ARGS);
+        process_hardware_message(device, found ? &entry : NULL, extracted_args, views, arg_count);
     }
+
+    payload[length] = next;
 }
 
 
-static int32_t
-extract_args_from_payload(blynk_private_data_t* private_data, char* args[]) {
-    if (private_data->message.length <= 0) return 0;
+bool
+begin_inbound_stream(blynk_device_t* device, const uint8_t* payload, size_t available) {
+    const uint8_t* terminator = memchr(payload, '\0', MIN(available, (size_t) BLYNK_ACTION_SIZE));
+    blynk_handler_data_t entry;
+
+    if (!terminator || !find_handler_for_command(device, payload, available, &entry) || !entry.chunk_handler) {
+        return false;
+    }
+
+    blynk_inbound_stream_t* stream = &device->priv_data.inbound;
+    uint16_t prefix = terminator - payload + 1;
+
+    *stream = (blynk_inbound_stream_t) {
+            .id = device->priv_data.message.id,
+            .offset = 0,
+            .total_len = device->priv_data.message.length - prefix,
+            .handler = entry.chunk_handler,
+            .data = entry.data,
+    };
+    memcpy(stream->command, payload, prefix);
+
+    continue_inbound_stream(device, payload + prefix, available - prefix);
+    return true;
+}
+
+
+void
+continue_inbound_stream(blynk_device_t* device, const uint8_t* chunk, uint16_t len) {
+    blynk_inbound_stream_t* stream = &device->priv_data.inbound;
+    if (!len) return;
 
-    uint32_t len = MIN(private_data->message.length, sizeof(private_data->message.payload) - 1);
-    return split_payload_into_args((char*) private_data->message.payload, len, args, BLYNK_MAX_ARGS);
+    deliver_chunk(device, stream, chunk, len);
+    stream->offset += len;
+}
+
+
+static void
+deliver_chunk(blynk_device_t* device, const blynk_inbound_stream_t* stream, const uint8_t* chunk, uint16_t len) {
+    blynk_chunk_params_t params = {
+            .device = device,
+            .id = stream->id,
+            .command = stream->command,
+            .offset = stream->offset,
+            .chunk = chunk,
+            .len = len,
+            .total_len = stream->total_len,
+            .data = stream->data,
+    };
+
+    stream->handler(&params);
 }
 
 
 static int32_t
-split_payload_into_args(char* payload, uint32_t len, char** args, uint32_t size) {
+split_payload_into_args(char* payload, uint32_t len, char** args, blynk_arg_t* views, uint32_t size) {
     char* p = payload;
-    int32_t arg_count = 0;
+    uint32_t arg_count = 0;
 
     while (arg_count < size && len > 0) {
-        args[arg_count++] = p;
+        args[arg_count] = p;
 
         while (len > 0 && *p != '\0') {
             p++;
             len--;
         }
 
+        views[arg_count] = (blynk_arg_t) {.data = args[arg_count], .len = p - args[arg_count]};
+        arg_count++;
+
         if (len > 0) {
             p++;
             len--;
         }
     }
 
-    return arg_count;
+    return (int32_t) arg_count;
 }
 
 
 static void
-process_hardware_message(blynk_device_t* device, char* args[], int32_t args_num) {
-    blynk_control_t* ctl = &device->control;
-    blynk_private_data_t* private_data = &device->priv_data;
-
-    mutex_wrap_t state_mtx = {
-            .type = MUTEX_TYPE_FREERTOS,
-            .mutex = {.freertosMtx = ctl->mtx}
-    };
-
-    mutex_wrapper_take(&state_mtx);
-    blynk_cmd_handler_t handler = find_handler_for_command(ctl, args[0]);
-    mutex_wrapper_give(&state_mtx);
-
-    if (handler != NULL) {
+process_hardware_message(blynk_device_t* device, const blynk_handler_data_t* entry, char* args[],
+                         const blynk_arg_t views[], int32_t args_num) {
+    if (entry && entry->handler) {
         blynk_handler_params_t params = {
                 .device = device,
-                .id = private_data->message.id,
+                .id = device->priv_data.message.id,
                 .argv = args + 1,
+                .args = views + 1,
                 .command = args[0],
                 .argc = args_num - 1,
-                .data = ctl->handlers[0].data
+                .data = entry->data
 
         };
 
-        handler(&params);
+        entry->handler(&params);
         return;
     }
 
@@ -164,15 +229,11 @@ process_hardware_message(blynk_device_t* device, char* args[], int32_t args_num)
 }
 
 
-static blynk_cmd_handler_t
-find_handler_for_command(blynk_control_t* ctl, char* command) {
-    for (uint16_t i = 0; i < BLYNK_MAX_HANDLERS; ++i) {
-        if (!strncmp((const char*) ctl->handlers[i].action, command, sizeof(ctl->handlers[i].action))
-            && ctl->handlers[i].handler != NULL) {
-            return ctl->handlers[i].handler;
-        }
-    }
-    return NULL;
+static bool
+find_handler_for_command(blynk_device_t* device, const uint8_t* command, size_t size, blynk_handler_data_t* found) {
+    // Lock-free, registering a handler never holds up the network task
+    uint32_t tag = command_tag(command, size);
+    return tag && handler_table_find(&device->control.handlers, tag, found);
 }
 
 
@@ -187,6 +248,7 @@ handle_hardware_package(blynk_device_t* device) {
             .handler = NULL,
             .data = NULL,
             .wait = 0,
+            .priority = BLYNK_PRIORITY_CONTROL,
     };
 
     return blynk_notify_packet_ready(&packet);
@@ -25,44 +25,72 @@
 #include <sys/unistd.h>
 #include <memory.h>
 #include <errno.h>
+#include <sys/socket.h>
+
+#if POSIX
+#include <poll.h>
+#include <sys/uio.h>
+#endif
 
 #include "stuff/log.h"
 #include "stuff/util.h"
 #include "stuff/types.h"
 #include "internal/protocol.h"
 #include "stuff/communication.h"
+#include "internal/deadlines.h"
+#include "internal/coalescing.h"
+#include "internal/rate_limiter.h"
+#include "internal/message_ring.h"
 #include "internal/internal_comm.h"
+#include "internal/journal.h"
+#include "internal/offline_store.h"
 #include "internal/protocol_stuff.h"
 #include "internal/protocol_parser.h"
 #include "stuff/blynk_freertos_port.h"
 
 #define TAG "[PROTOCOL]"
 
+// Header and first payload piece of a stream
+#define STREAM_MIN_VECTORS              2
 
-static blynk_err_t send_heartbit(blynk_device_t* device);
 
-static blynk_err_t blynk_busy_loop(blynk_device_t* device);
+typedef struct {
+    int communication_socket;
+    int ctl_socket;
+    bool write_pending;
+    bool socket_readable;
+    bool socket_writable;
+    bool ctl_readable;
+} socket_activity_t;
 
-static blynk_err_t authorize_device(blynk_device_t* device);
 
-static void update_heartbeat_deadline(blynk_device_t* device);
+typedef struct {
+    uint8_t lane;
+    blynk_queued_packet_t* packet;
+} write_entry_t;
 
-static void prepare_device_communication(blynk_device_t* device);
 
-static blynk_err_t handle_read_from_ctl_socket(blynk_device_t* device);
+typedef struct {
+    struct iovec* vector;
+    write_entry_t* entries;
+    uint8_t* chunk;
+    int vector_size;
+    int entry_count;
+    bool closed;
+    bool stalled;
+} write_batch_t;
+
+
+static blynk_err_t blynk_busy_loop(blynk_device_t* device);
 
-static blynk_err_t manage_communication_deadlines(blynk_device_t* device);
+static blynk_err_t authorize_device(blynk_device_t* device);
 
-static inline bool
-has_deadline_passed(tick_t
-deadline,
-tick_t current_time
-);
+static void prepare_device_communication(blynk_device_t* device);
 
-static bool determined_closest_deadline(blynk_device_t* device, tick_t* deadline);
+static blynk_err_t handle_read_from_ctl_socket(blynk_device_t* device);
 
-static void setup_fd_sets(fd_set* rdset, fd_set* wrset, int communication_socket,
-                          const blynk_private_data_t* priv_data);
+static void setup_socket_activity(socket_activity_t* activity, int communication_socket,
+                                  const blynk_private_data_t* priv_data);
 
 static void process_device_communication(blynk_device_t* device, int communication_socket);
 
@@ -70,17 +98,20 @@ static blynk_err_t handle_write_to_main_socket(blynk_device_t* device, int commu
 
 static blynk_err_t handle_read_from_main_socket(blynk_device_t* device, int communication_socket);
 
-static void authentication_handler(blynk_device_t* device, blynk_status_t status, void* data);
+static void add_write_entry(write_batch_t* batch, uint8_t lane, blynk_queued_packet_t* packet, size_t offset);
 
-static void heartbit_callback(blynk_device_t* device, blynk_status_t status, UNUSED void* data);
+static void add_stream_vectors(write_batch_t* batch, const blynk_queued_packet_t* packet,
+                               const blynk_stream_t* stream, size_t offset);
 
-static void handle_awaiting_timer(blynk_device_t* device, tick_t now, blynk_awaiting_t* awaiting);
+static void abort_streams(blynk_device_t* device);
 
-static blynk_err_t prepare_blynk_request(blynk_device_t* device, blynk_request_info_t* request_ptr,
-                                         int socket_fd, fd_set* write_set);
+static void authentication_handler(blynk_device_t* device, blynk_status_t status, void* data);
 
-static int wait_for_fd_activity(fd_set* read_fds, fd_set* write_fds, struct timeval* timeout_value,
-                                blynk_device_t* device);
+static blynk_err_t prepare_blynk_request(blynk_device_t* device, socket_activity_t* activity);
+
+static bool packet_prepared(const blynk_queued_packet_t* packet);
+
+static int wait_for_fd_activity(socket_activity_t* activity, const tick_t* timeout, blynk_device_t* device);
 
 
 void
@@ -142,11 +173,21 @@ prepare_device_communication(blynk_device_t* device) {
 
     memset(device->priv_data.awaiting, 0, sizeof(device->priv_data.awaiting));
 
-    queue_reset(device->priv_data.ctl_queue);
+    // Hardware writes the last connection did not get out are sent again after the login
+    if (!journal_rewind(device)) offline_store_salvage(device);
+    abort_streams(device);
+
+    for (uint8_t lane = 0; lane < BLYNK_PRIORITY_LANES; ++lane) {
+        message_ring_reset(&device->priv_data.lanes[lane].ring);
+        device->priv_data.lanes[lane].last_prepared = NULL;
+        device->priv_data.lanes[lane].last_seen = NULL;
+    }
 
-    device->priv_data.parser = message_payload_parser;
+    reset_blynk_decoder(device);
     device->priv_data.request_id = 1;
-    device->priv_data.buf_size = 0;
+    device->priv_data.bytes_written = 0;
+    device->priv_data.coalesced_count = 0;
+    rate_limiter_reset(device);
 
     update_heartbeat_deadline(device);
 }
@@ -163,24 +204,15 @@ process_device_communication(blynk_device_t* device, int communication_socket) {
     }
 
     while (true) {
-        fd_set rdset;
-        fd_set wrset;
-        setup_fd_sets(&rdset, &wrset, communication_socket, &device->priv_data);
+        socket_activity_t activity;
+        setup_socket_activity(&activity, communication_socket, &device->priv_data);
 
-        blynk_request_info_t request;
-        if (prepare_blynk_request(device, &request, communication_socket, &wrset)) break;
+        if (prepare_blynk_request(device, &activity)) break;
 
         tick_t deadline;
-        struct timeval timeval;
         bool deadline_detected = determined_closest_deadline(device, &deadline);
 
-        if (deadline_detected) {
-            const time_t total_microseconds = (time_t) deadline * custom_port_tick_max_rate;
-            timeval.tv_sec = total_microseconds / MS_TO_SEC;
-            timeval.tv_usec = (total_microseconds % MS_TO_SEC) * MS_TO_USEC;
-        }
-
-        int active_fd_count = wait_for_fd_activity(&rdset, NULL, deadline_detected ? &timeval : NULL, device);
+        int active_fd_count = wait_for_fd_activity(&activity, deadline_detected ? &deadline : NULL, device);
         if (active_fd_count < 0) break;
 
 
@@ -198,17 +230,17 @@ process_device_communication(blynk_device_t* device, int communication_socket) {
 
         if (active_fd_count == 0) continue;
 
-        if (FD_ISSET(device->priv_data.ctl_sockets[READ_SOCK_ID], &rdset)) {
+        if (activity.ctl_readable) {
             if (handle_read_from_ctl_socket(device) != BLYNK_EC_OK) break;
 
         }
 
-        if (FD_ISSET(communication_socket, &rdset)) {
+        if (activity.socket_readable) {
             if (handle_read_from_main_socket(device, communication_socket) != BLYNK_EC_OK) break;
 
         }
 
-        if (device->priv_data.buf_size && FD_ISSET(communication_socket, &wrset)) {
+        if (activity.write_pending && activity.socket_writable) {
             if (handle_write_to_main_socket(device, communication_socket) != BLYNK_EC_OK) break;
         }
 
@@ -229,7 +261,7 @@ authorize_device(blynk_device_t* device) {
             .handler = authentication_handler,
             .data = NO_CALLBACK_DATA,
             .wait = 0,
-
+            .priority = BLYNK_PRIORITY_CONTROL,
     };
 
     return blynk_notify_packet_ready(&packet);
@@ -252,99 +284,125 @@ authentication_handler(blynk_device_t* device, blynk_status_t status, UNUSED voi
 
 
 static void
-setup_fd_sets(fd_set* rdset, fd_set* wrset, int communication_socket, const blynk_private_data_t* priv_data) {
-    FD_ZERO(rdset);
-    FD_ZERO(wrset);
-
-    FD_SET(communication_socket, rdset);
-    FD_SET(priv_data->ctl_sockets[READ_SOCK_ID], rdset);
+setup_socket_activity(socket_activity_t* activity, int communication_socket, const blynk_private_data_t* priv_data) {
+    activity->communication_socket = communication_socket;
+    activity->ctl_socket = priv_data->ctl_sockets[READ_SOCK_ID];
+    activity->write_pending = false;
+    activity->socket_readable = false;
+    activity->socket_writable = false;
+    activity->ctl_readable = false;
 }
 
 
 static blynk_err_t
-prepare_blynk_request(blynk_device_t* device, blynk_request_info_t* request_ptr, int socket_fd, fd_set* write_set) {
+prepare_blynk_request(blynk_device_t* device, socket_activity_t* activity) {
     blynk_private_data_t* device_data = &device->priv_data;
+    bool settings_loaded = false;
+    bool coalesce = false;
 
-    if (device_data->buf_size != 0) {
-        FD_SET(socket_fd, write_set);
-        return BLYNK_EC_OK;
+    // Writes kept while offline go first, starting right after the login succeeded
+    if (device->control.state == BLYNK_STATE_AUTHENTICATED) {
+        journal_replay(device);
+        offline_store_flush(device);
     }
 
+    // Frames stay in their lane until they are written, only their request ids are filled in here
+    for (uint8_t lane = 0; lane < BLYNK_PRIORITY_LANES; ++lane) {
+        blynk_lane_t* lane_data = &device_data->lanes[lane];
+        blynk_queued_packet_t* packet = lane_data->last_prepared ?
+                                        blynk_next_packet(device, lane, lane_data->last_prepared) :
+                                        blynk_first_packet(device, lane);
+
+        if (packet && !settings_loaded) {
+            coalesce = virtual_write_coalescing_enabled(device);
+            rate_limiter_refill(device);
+            settings_loaded = true;
+        }
 
-    bool is_received = queue_receive(device_data->ctl_queue, request_ptr, NO_WAITING);
-
-    if (!is_received) return BLYNK_EC_OK;
+        // Writes are coalesced as soon as they are queued, a replaced one never waits for a token
+        blynk_queued_packet_t* seen = lane_data->last_seen ? blynk_next_packet(device, lane, lane_data->last_seen) :
+                                      blynk_first_packet(device, lane);
 
-    if (!request_ptr->message.id) {
-        uint16_t msg_id = allocate_request_id(device,
-                                              request_ptr->deadline,
-                                              request_ptr->handler,
-                                              request_ptr->data);
+        for (; seen; seen = blynk_next_packet(device, lane, seen)) {
+            blynk_queued_packet_t* dropped = coalesce ? coalesce_virtual_write(device, lane, seen) : NULL;
+            if (dropped && packet_prepared(dropped)) rate_limiter_refund(device);
 
-        if (!msg_id) {
-            log_error("%s: %s failed to generate message ID", TAG, __func__);
-            disconnect_device(device, BLYNK_EC_MEM, 0);
-            return BLYNK_EC_MEM;
+            lane_data->last_seen = seen;
         }
 
-        request_ptr->message.id = msg_id;
-    }
+        for (; packet && rate_limiter_admit(device, packet); packet = blynk_next_packet(device, lane, packet)) {
+            if (!packet_prepared(packet)) {
+                uint16_t msg_id = allocate_request_id(device, packet->deadline, packet->handler, packet->data);
 
-    device_data->buf_size = compose_blynk_message(device_data->write_buffer, BLYNK_MAX_PAYLOAD_LEN,
-                                                  &request_ptr->message);
-    device_data->total_byte_send = 0;
+                if (!msg_id) {
+                    log_error("%s: %s failed to generate message ID", TAG, __func__);
+                    disconnect_device(device, BLYNK_EC_MEM, 0);
+                    return BLYNK_EC_MEM;
+                }
 
-    FD_SET(socket_fd, write_set);
+                packet->frame[1] = (msg_id >> BYTE_SIZE) & BYTE_MASK;
+                packet->frame[2] = msg_id & BYTE_MASK;
+            }
+
+            lane_data->last_prepared = packet;
+        }
+
+        activity->write_pending |= lane_data->last_prepared != NULL;
+    }
 
     return BLYNK_EC_OK;
 }
 
 
 static bool
-determined_closest_deadline(blynk_device_t* device, tick_t* deadline) {
-    bool deadline_found = false;
-    tick_t closest_deadline = 0;
-    tick_t current_time = get_tick_count();
-
-    for (uint16_t i = 0; i < BLYNK_MAX_AWAITING; ++i) {
-        if (!device->priv_data.awaiting[i].id || !device->priv_data.awaiting[i].deadline) continue;
+packet_prepared(const blynk_queued_packet_t* packet) {
+    // A request id is filled in once the packet passed the rate limiter
+    return packet->frame[1] || packet->frame[2];
+}
 
-        if (has_deadline_passed(device->priv_data.awaiting[i].deadline, current_time)) {
-            *deadline = 0;
-            return true;
-        }
 
-        tick_t time_left = device->priv_data.awaiting[i].deadline - current_time;
-        if (!deadline_found || time_left < closest_deadline) {
-            closest_deadline = time_left;
-            deadline_found = true;
-        }
-    }
+static int
+wait_for_fd_activity(socket_activity_t* activity, const tick_t* timeout, blynk_device_t* device) {
+#if POSIX
+    // poll() does not limit descriptor values to FD_SETSIZE, so many devices can share one host process
+    struct pollfd fds[] = {
+            {.fd = activity->ctl_socket, .events = POLLIN},
+            {.fd = activity->communication_socket, .events = POLLIN | (activity->write_pending ? POLLOUT : 0)},
+    };
 
-    if (device->priv_data.heartbit_deadline) {
-        if (has_deadline_passed(device->priv_data.heartbit_deadline, current_time)) {
-            *deadline = 0;
-            return true;
-        }
+    int timeout_ms = timeout ? (int) MIN(*timeout * custom_port_tick_max_rate, (tick_t) INT32_MAX) : -1;
+    int active_fd_count = poll(fds, ARRAY_SIZE(fds), timeout_ms);
 
-        tick_t time_left_for_sending_heartbit = device->priv_data.heartbit_deadline - current_time;
-        if (!deadline_found || time_left_for_sending_heartbit < closest_deadline) {
-            closest_deadline = time_left_for_sending_heartbit;
-            deadline_found = true;
-        }
+    if (active_fd_count > 0) {
+        activity->ctl_readable = fds[0].revents != 0;
+        activity->socket_readable = (fds[1].revents & ~POLLOUT) != 0;
+        activity->socket_writable = (fds[1].revents & POLLOUT) != 0;
+    }
+#else
+    fd_set read_fds;
+    fd_set write_fds;
+    FD_ZERO(&read_fds);
+    FD_ZERO(&write_fds);
+    FD_SET(activity->communication_socket, &read_fds);
+    FD_SET(activity->ctl_socket, &read_fds);
+    if (activity->write_pending) FD_SET(activity->communication_socket, &write_fds);
+
+    struct timeval timeval;
+    if (timeout) {
+        const time_t total_milliseconds = (time_t) *timeout * custom_port_tick_max_rate;
+        timeval.tv_sec = total_milliseconds / MS_TO_SEC;
+        timeval.tv_usec = (total_milliseconds % MS_TO_SEC) * MS_TO_USEC;
     }
 
+    int active_fd_count = select(FD_SETSIZE, &read_fds, &write_fds, NULL, timeout ? &timeval : NULL);
 
-    if (deadline_found) *deadline = closest_deadline;
-
-    return deadline_found;
-}
-
+    if (active_fd_count > 0) {
+        activity->ctl_readable = FD_ISSET(activity->ctl_socket, &read_fds);
+        activity->socket_readable = FD_ISSET(activity->communication_socket, &read_fds);
+        activity->socket_writable = FD_ISSET(activity->communication_socket, &write_fds);
+    }
+#endif
 
-static int
-wait_for_fd_activity(fd_set* read_fds, fd_set* write_fds, struct timeval* timeout_value,
-                     blynk_device_t* device) {
-    int active_fd_count = select(FD_SETSIZE, read_fds, write_fds, NULL, timeout_value);
     if (active_fd_count < 0) {
         disconnect_device(device, BLYNK_EC_SYSTEM, errno);
     }
@@ -353,144 +411,221 @@ wait_for_fd_activity(fd_set* read_fds, fd_set* write_fds, struct timeval* timeou
 
 
 static blynk_err_t
-manage_communication_deadlines(blynk_device_t* device) {
-    tick_t current_time = get_tick_count();
+handle_read_from_ctl_socket(blynk_device_t* device) {
+    // Every queued request leaves one wakeup datagram; the whole queue is drained at once, so are the wakeups
+    uint8_t dummy;
+    int32_t read_descriptor;
 
-    for (uint16_t i = 0; i < BLYNK_MAX_AWAITING; ++i) {
-        handle_awaiting_timer(device, current_time, &device->priv_data.awaiting[i]);
-    }
+    do {
+        read_descriptor = recv(device->priv_data.ctl_sockets[READ_SOCK_ID], &dummy, sizeof(dummy), MSG_DONTWAIT);
+    } while (read_descriptor >= 0);
 
-    if (device->priv_data.heartbit_deadline && has_deadline_passed(device->priv_data.heartbit_deadline, current_time)) {
-        update_heartbeat_deadline(device);
-        return send_heartbit(device);
+    if (errno != EAGAIN && errno != EINTR) {
+        log_error("%s: Error %s while reading from ctl socket", TAG, __func__, strerror(errno));
+        disconnect_device(device, BLYNK_EC_ERRNO, errno);
+        return BLYNK_EC_FAILED_TO_READ;
     }
 
     return BLYNK_EC_OK;
 }
 
 
-static void
-handle_awaiting_timer(blynk_device_t* device, tick_t now, blynk_awaiting_t* awaiting) {
-    if (!awaiting->id || !awaiting->deadline) return;
+static blynk_err_t
+handle_read_from_main_socket(blynk_device_t* device, int communication_socket) {
+    // The socket is drained before select is called again; a short read means it is empty already
+    while (true) {
+        size_t room;
+        uint8_t* space = get_blynk_decoder_space(device, &room);
+        ssize_t read_bytes_num = read(communication_socket, space, room);
+
+        if (read_bytes_num < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN) return BLYNK_EC_OK;
+
+            log_error("%s: Error %s while reading from main socket", TAG, __func__, strerror(errno));
+            disconnect_device(device, BLYNK_EC_ERRNO, errno);
+            return BLYNK_EC_FAILED_TO_READ;
+        } else if (read_bytes_num == 0) {
+            log_error("%s: Unable to read from socket", TAG, __func__);
+            disconnect_device(device, BLYNK_EC_CLOSED, 0);
+            return BLYNK_EC_FAILED_TO_READ;
+        }
 
-    if (has_deadline_passed(awaiting->deadline, now)) {
-        if (awaiting->handler) {
-            awaiting->handler(device, BLYNK_STATUS_TIMEOUT, awaiting->data);
+        if (decode_blynk_frames(device, read_bytes_num) != BLYNK_EC_OK) {
+            log_error("%s: Detected device disconnection", TAG, __func__);
+            return BLYNK_EC_DEVICE_DISCONNECT;
         }
-        awaiting->id = 0;
+
+        if ((size_t) read_bytes_num < room) return BLYNK_EC_OK;
     }
 }
 
 
 static blynk_err_t
-send_heartbit(blynk_device_t* device) {
-    blynk_packet_t heartbit_packet = {
-            .device = device,
-            .cmd = BLYNK_CMD_PING,
-            .id = 0,
-            .len = 0,
-            .payload = NULL,
-            .handler = heartbit_callback,
-            .data = NO_CALLBACK_DATA,
-            .wait = NO_WAITING,
-    };
+handle_write_to_main_socket(blynk_device_t* device, int communication_socket) {
+    blynk_private_data_t* device_data = &device->priv_data;
+    struct iovec vector[BLYNK_WRITE_IOV_COUNT];
+    write_entry_t entries[BLYNK_WRITE_IOV_COUNT];
+    write_batch_t batch = {.vector = vector, .entries = entries, .chunk = device_data->stream_chunk};
+
+    // A frame that is partly on the wire is finished first, then the lanes are served in priority order
+    if (device_data->bytes_written) {
+        add_write_entry(&batch, device_data->partial_lane, blynk_first_packet(device, device_data->partial_lane),
+                        device_data->bytes_written);
+    }
 
-    return blynk_notify_packet_ready(&heartbit_packet);
-}
+    for (uint8_t lane = 0; lane < BLYNK_PRIORITY_LANES && !batch.closed; ++lane) {
+        blynk_queued_packet_t* last = device_data->lanes[lane].last_prepared;
+        blynk_queued_packet_t* packet = last ? blynk_first_packet(device, lane) : NULL;
 
+        if (packet && device_data->bytes_written && lane == device_data->partial_lane) {
+            packet = packet != last ? blynk_next_packet(device, lane, packet) : NULL;
+        }
 
-static inline bool
-has_deadline_passed(tick_t
-deadline,
-tick_t current_time
-) {
-return (int32_t) ((uint32_t) deadline - (uint32_t) current_time) <= 0;
-}
+        for (; packet && batch.entry_count < BLYNK_WRITE_IOV_COUNT && !batch.closed;
+               packet = packet != last ? blynk_next_packet(device, lane, packet) : NULL) {
+            add_write_entry(&batch, lane, packet, 0);
+        }
+    }
 
+    if (batch.stalled) {
+        log_error("%s: Function %s got no bytes from a stream producer", TAG, __func__);
+        disconnect_device(device, BLYNK_EC_FAILED_TO_WRITE, 0);
+        return BLYNK_EC_FAILED_TO_WRITE;
+    }
 
-static void
-heartbit_callback(blynk_device_t* device, blynk_status_t status, UNUSED void* data) {
-    if (status != BLYNK_STATUS_SUCCESS) {
-        if (status == BLYNK_STATUS_TIMEOUT) {
-            disconnect_device(device, BLYNK_EC_TIMEOUT, 0);
-        } else {
-            disconnect_device(device, BLYNK_EC_STATUS, status);
-        }
+    ssize_t length = batch.vector_size ? writev(communication_socket, vector, batch.vector_size) : 0;
+
+    if (length < 0) {
+        if (errno == EAGAIN || errno == EINTR) return BLYNK_EC_OK;
+
+        log_error("%s: Error %s while writing to main socket", TAG, __func__, strerror(errno));
+        disconnect_device(device, BLYNK_EC_ERRNO, errno);
+        return BLYNK_EC_FAILED_TO_WRITE;
     }
-}
 
+    // Release the packets that left completely, remember how far the next one got
+    size_t written = device_data->bytes_written + length;
+    size_t released[BLYNK_PRIORITY_LANES] = {0};
+    device_data->bytes_written = 0;
 
-static void
-update_heartbeat_deadline(blynk_device_t* device) {
-    mutex_wrap_t wrap = {
-            .type = MUTEX_TYPE_FREERTOS,
-            .mutex = {device->control.mtx},
-    };
+    for (int i = 0; i < batch.entry_count; ++i) {
+        blynk_queued_packet_t* packet = entries[i].packet;
+        uint8_t lane = entries[i].lane;
 
-    mutex_wrapper_take(&wrap);
-    TickType_t heartbeat_interval_ticks = device->control.connection_config.connection.heartbeat_interval_ms;
-    mutex_wrapper_give(&wrap);
+        size_t wire_size = blynk_packet_wire_size(packet);
 
-    device->priv_data.heartbit_deadline = get_tick_count() + heartbeat_interval_ticks / custom_port_tick_max_rate;
-}
+        if (written < wire_size) {
+            device_data->partial_lane = lane;
+            device_data->bytes_written = written;
+            break;
+        }
 
+        written -= wire_size;
+        released[lane]++;
 
-static blynk_err_t
-handle_read_from_ctl_socket(blynk_device_t* device) {
-    uint8_t dummy;
-    int32_t read_descriptor = read(device->priv_data.ctl_sockets[READ_SOCK_ID], &dummy, sizeof(dummy));
-    if (read_descriptor < 0 && errno != EAGAIN) {
-        log_error("%s: Error %s while reading from ctl socket", TAG, __func__, strerror(errno));
-        disconnect_device(device, BLYNK_EC_ERRNO, errno);
-        return BLYNK_EC_FAILED_TO_READ;
+        blynk_stream_t* stream = blynk_packet_stream(packet);
+        if (stream && stream->done) stream->done(device, BLYNK_EC_OK, stream->context);
+
+        if (device_data->coalesced_count) forget_coalesced_write(device, packet);
+        if (packet == device_data->lanes[lane].last_prepared) device_data->lanes[lane].last_prepared = NULL;
+        if (packet == device_data->lanes[lane].last_seen) device_data->lanes[lane].last_seen = NULL;
+    }
+
+    for (uint8_t lane = 0; lane < BLYNK_PRIORITY_LANES; ++lane) {
+        if (released[lane]) blynk_release_packets(device, lane, released[lane]);
     }
 
     return BLYNK_EC_OK;
 }
 
 
-static blynk_err_t
-handle_read_from_main_socket(blynk_device_t* device, int communication_socket) {
-    int read_bytes_num = read(communication_socket, device->priv_data.read_buffer, BLYNK_MAX_PAYLOAD_LEN);
+static void
+add_write_entry(write_batch_t* batch, uint8_t lane, blynk_queued_packet_t* packet, size_t offset) {
+    blynk_stream_t* stream = blynk_packet_stream(packet);
 
-    if (read_bytes_num < 0 && errno != EAGAIN) {
-        log_error("%s: Error %s while reading from main socket", TAG, __func__, strerror(errno));
-        disconnect_device(device, BLYNK_EC_ERRNO, errno);
-        return BLYNK_EC_FAILED_TO_READ;
-    } else if (read_bytes_num == 0) {
-        log_error("%s: Unable to read from socket", TAG, __func__);
-        disconnect_device(device, BLYNK_EC_CLOSED, 0);
-        return BLYNK_EC_FAILED_TO_READ;
+    // A stream needs a vector for its header and at least one for its payload, otherwise it waits for the next write
+    if (stream && batch->vector_size > BLYNK_WRITE_IOV_COUNT - STREAM_MIN_VECTORS) {
+        batch->closed = true;
+        return;
     }
 
-    uint8_t* data = device->priv_data.read_buffer;
-    while (read_bytes_num--) {
-        device->priv_data.parser(device, *(data++));
-        if (device->control.state == BLYNK_STATE_DISCONNECTED) {
-            log_error("%s: Detected device disconnection", TAG, __func__);
-            return BLYNK_EC_DEVICE_DISCONNECT;
-        }
+    batch->entries[batch->entry_count++] = (write_entry_t) {
+            .lane = lane,
+            .packet = packet,
+    };
+
+    if (stream) {
+        add_stream_vectors(batch, packet, stream, offset);
+        return;
     }
 
-    return BLYNK_EC_OK;
+    // Coalesced packets are left in place with an empty frame
+    if (packet->frame_size > offset) {
+        batch->vector[batch->vector_size++] = (struct iovec) {
+                .iov_base = packet->frame + offset,
+                .iov_len = packet->frame_size - offset,
+        };
+    }
 }
 
 
-static blynk_err_t
-handle_write_to_main_socket(blynk_device_t* device, int communication_socket) {
-    ssize_t length = write(communication_socket,
-                           device->priv_data.write_buffer + device->priv_data.total_byte_send,
-                           device->priv_data.buf_size - device->priv_data.total_byte_send);
+static void
+add_stream_vectors(write_batch_t* batch, const blynk_queued_packet_t* packet, const blynk_stream_t* stream,
+                   size_t offset) {
+    // The payload comes from the caller a piece at a time, nothing else is written behind it
+    batch->closed = true;
+
+    if (offset < BLYNK_HEADER_SIZE) {
+        batch->vector[batch->vector_size++] = (struct iovec) {
+                .iov_base = (uint8_t*) packet->frame + offset,
+                .iov_len = BLYNK_HEADER_SIZE - offset,
+        };
+        offset = BLYNK_HEADER_SIZE;
+    }
 
-    if (length < 0 && errno != EAGAIN) {
-        log_error("%s: Error %s while writing to main socket", TAG, __func__, strerror(errno));
-        disconnect_device(device, BLYNK_EC_ERRNO, errno);
-        return BLYNK_EC_FAILED_TO_WRITE;
+    size_t position = offset - BLYNK_HEADER_SIZE;
+    size_t remaining = blynk_packet_wire_size(packet) - offset;
+
+    if (!stream->iov) {
+        size_t produced = stream->producer(stream->context, position, batch->chunk,
+                                           MIN(BLYNK_STREAM_CHUNK_SIZE, remaining));
+        if (!produced) batch->stalled = true;
+
+        batch->vector[batch->vector_size++] = (struct iovec) {
+                .iov_base = batch->chunk,
+                .iov_len = MIN(produced, MIN(BLYNK_STREAM_CHUNK_SIZE, remaining)),
+        };
+        return;
     }
 
-    device->priv_data.total_byte_send += length;
+    // Segments of an iovec are written in place, without a copy
+    for (size_t i = 0; i < stream->iov_count && remaining && batch->vector_size < BLYNK_WRITE_IOV_COUNT; ++i) {
+        if (position >= stream->iov[i].len) {
+            position -= stream->iov[i].len;
+            continue;
+        }
 
-    if (device->priv_data.total_byte_send >= device->priv_data.buf_size) device->priv_data.buf_size = 0;
+        size_t len = MIN(stream->iov[i].len - position, remaining);
+        batch->vector[batch->vector_size++] = (struct iovec) {
+                .iov_base = (uint8_t*) stream->iov[i].base + position,
+                .iov_len = len,
+        };
 
-    return BLYNK_EC_OK;
+        remaining -= len;
+        position = 0;
+    }
+}
+
+
+static void
+abort_streams(blynk_device_t* device) {
+    // Streams still queued are dropped with the lanes, their owners get their memory back
+    for (uint8_t lane = 0; lane < BLYNK_PRIORITY_LANES; ++lane) {
+        for (blynk_queued_packet_t* packet = blynk_first_packet(device, lane); packet;
+             packet = blynk_next_packet(device, lane, packet)) {
+            blynk_stream_t* stream = blynk_packet_stream(packet);
+            if (stream && stream->done) stream->done(device, BLYNK_EC_DEVICE_DISCONNECT, stream->context);
+        }
+    }
 }
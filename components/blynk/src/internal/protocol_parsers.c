@@ -22,6 +22,8 @@
  * SOFTWARE.
  */
 
+#include <string.h>
+
 #include "stuff/util.h"
 #include "internal/packet_handler.h"
 #include "internal/protocol_parser.h"
@@ -29,92 +31,91 @@
 #define TAG "[PROTOCOL PARSER]"
 
 
-typedef void (* parser_func_t)(blynk_device_t*, uint8_t);
-
-typedef enum {
-    PARSE_CMD, PARSE_ID, PARSE_LEN, PARSE_PAYLOAD
-} parser_state_t;
-
-
-static void parse_msg_id(blynk_device_t* device, uint8_t message_frame);
-
-static void parse_msg_cmd(blynk_device_t* device, uint8_t message_frame);
-
-static void parse_msg_len(blynk_device_t* device, uint8_t message_frame);
-
-static void parse_msg_payload(blynk_device_t* device, uint8_t message_frame);
+static void decode_header(blynk_message_t* message, const uint8_t* header);
 
-
-static parser_state_t next_state = PARSE_CMD;
-
-static parser_func_t parsers[] = {
-        parse_msg_cmd,
-        parse_msg_id,
-        parse_msg_len,
-        parse_msg_payload
-};
+static uint16_t payload_size(const blynk_message_t* message);
 
 
 void
-message_payload_parser(blynk_device_t* device, uint8_t message_frame) {
-    if (CHECK_PTR(TAG, device)) return;
-    parsers[next_state](device, message_frame);
-}
-
-
-static void
-parse_msg_cmd(blynk_device_t* device, uint8_t message_frame) {
-    device->priv_data.message.command = message_frame;
+reset_blynk_decoder(blynk_device_t* device) {
+    device->priv_data.parser_state = BLYNK_PARSE_FRAME;
     device->priv_data.byte_count = 0;
-    next_state = PARSE_ID;
+    device->priv_data.held_bytes = 0;
 }
 
 
-static void
-parse_msg_id(blynk_device_t* device, uint8_t message_frame) {
-    device->priv_data.message.id = (device->priv_data.message.id << 8) | message_frame;
-    device->priv_data.byte_count++;
-    if (device->priv_data.byte_count >= 2) {
-        device->priv_data.byte_count = 0;
-        next_state = PARSE_LEN;
-    }
+uint8_t*
+get_blynk_decoder_space(blynk_device_t* device, size_t* room) {
+    // The last byte of the buffer is kept for the terminator of the last argument
+    *room = BLYNK_MAX_FRAME_SIZE - device->priv_data.held_bytes;
+    return device->priv_data.read_buffer + device->priv_data.held_bytes;
 }
 
-static void
-parse_msg_len(blynk_device_t* device, uint8_t message_frame) {
-    blynk_message_t* message = &device->priv_data.message;
-
-    message->length = (message->length << 8) | message_frame;
-    device->priv_data.byte_count++;
 
-    if (device->priv_data.byte_count < 2) return;
+blynk_err_t
+decode_blynk_frames(blynk_device_t* device, size_t size) {
+    blynk_private_data_t* priv_data = &device->priv_data;
+    blynk_message_t* message = &priv_data->message;
+    uint8_t* data = priv_data->read_buffer;
+    uint8_t* end = data + priv_data->held_bytes + size;
+
+    while (data < end) {
+        if (priv_data->parser_state != BLYNK_PARSE_FRAME) {
+            size_t count = MIN((size_t) (end - data), (size_t) priv_data->byte_count);
+            if (priv_data->parser_state == BLYNK_PARSE_STREAM) continue_inbound_stream(device, data, count);
+
+            data += count;
+            priv_data->byte_count -= count;
+            if (!priv_data->byte_count) priv_data->parser_state = BLYNK_PARSE_FRAME;
+        } else {
+            if (end - data < BLYNK_HEADER_SIZE) break;
+
+            decode_header(message, data);
+            uint16_t length = payload_size(message);
+            uint16_t kept = MIN(length, BLYNK_MAX_PAYLOAD_LEN);
+            size_t available = end - data - BLYNK_HEADER_SIZE;
+
+            if (kept < length && message->command == BLYNK_CMD_HARDWARE &&
+                begin_inbound_stream(device, data + BLYNK_HEADER_SIZE, available)) {
+                // A command that never fits the buffer goes to its chunk handler as it arrives
+                priv_data->byte_count = length - available;
+                priv_data->parser_state = BLYNK_PARSE_STREAM;
+                data = end;
+            } else if (available < kept) {
+                // A cut frame waits at the front of the buffer for the rest of its bytes
+                break;
+            } else {
+                handle_message_packet(device, data + BLYNK_HEADER_SIZE, kept);
+                data += BLYNK_HEADER_SIZE + kept;
+
+                // Without a chunk handler, bytes beyond BLYNK_MAX_PAYLOAD_LEN are dropped
+                if (kept < length) {
+                    priv_data->byte_count = length - kept;
+                    priv_data->parser_state = BLYNK_PARSE_DISCARD;
+                }
+            }
+        }
 
-    if (message->command != BLYNK_CMD_RESPONSE && message->length > 0) {
-        device->priv_data.byte_count = 0;
-        next_state = PARSE_PAYLOAD;
-    } else {
-        handle_message_packet(device);
-        next_state =  PARSE_CMD;
+        if (device->control.state == BLYNK_STATE_DISCONNECTED) return BLYNK_EC_DEVICE_DISCONNECT;
     }
+
+    priv_data->held_bytes = end - data;
+    if (data != priv_data->read_buffer) memmove(priv_data->read_buffer, data, priv_data->held_bytes);
+
+    return BLYNK_EC_OK;
 }
 
 
 static void
-parse_msg_payload(blynk_device_t* device, uint8_t message_frame) {
-    blynk_private_data_t* priv_data = &device->priv_data;
-    uint8_t* payload = priv_data->message.payload;
-
-    if (priv_data->byte_count < sizeof(priv_data->message.payload)) {
-        payload[priv_data->byte_count] = message_frame;
-    }
+decode_header(blynk_message_t* message, const uint8_t* header) {
+    message->command = header[0];
+    message->id = header[1] << BYTE_SIZE | header[2];
+    message->length = header[3] << BYTE_SIZE | header[4];
+}
 
-    priv_data->byte_count++;
 
-    if (priv_data->byte_count >= priv_data->message.length) {
-        if (priv_data->byte_count > sizeof(priv_data->message.payload)) {
-            priv_data->message.length = sizeof(priv_data->message.payload);
-        }
-        handle_message_packet(device);
-        next_state = PARSE_CMD;
-    }
+static uint16_t
+payload_size(const blynk_message_t* message) {
+    // A response carries its status in the length field
+    return message->command != BLYNK_CMD_RESPONSE ? message->length : 0;
 }
@@ -79,36 +79,21 @@ disconnect_device(blynk_device_t* device, blynk_err_t reason, int code) {
 }
 
 
-uint64_t
-compose_blynk_message(uint8_t* output_buffer, uint64_t max_size, const blynk_message_t* message) {
+void
+compose_blynk_header(uint8_t* output_buffer, uint8_t command, uint16_t id, uint16_t length) {
     // | command 1 byte | message_id 2 bytes | length 2 bytes |
-    output_buffer[0] = message->command;
-    output_buffer[1] = (message->id >> BYTE_SIZE) & BYTE_MASK;
-    output_buffer[2] = message->id & BYTE_MASK;
-    output_buffer[3] = (message->length >> BYTE_SIZE) & BYTE_MASK;
-    output_buffer[4] = message->length & BYTE_MASK;
-
-    uint64_t header_size = BLYNK_HEADER_SIZE;
-
-    if (message->length && message->command != BLYNK_CMD_RESPONSE) {
-        uint64_t payload_size = message->length;
-
-        if (payload_size > max_size - header_size) {
-            payload_size = max_size - header_size;
-        }
-
-        memcpy(output_buffer + header_size, message->payload, payload_size);
-        header_size += payload_size;
-    }
-
-    return header_size;
+    output_buffer[0] = command;
+    output_buffer[1] = (id >> BYTE_SIZE) & BYTE_MASK;
+    output_buffer[2] = id & BYTE_MASK;
+    output_buffer[3] = (length >> BYTE_SIZE) & BYTE_MASK;
+    output_buffer[4] = length & BYTE_MASK;
 }
 
 
 uint16_t
 allocate_request_id(blynk_device_t* device, tick_t deadline, blynk_response_handler_t handler, void* context) {
     if (device->priv_data.request_id == UINT16_MAX) {
-        device->priv_data.request_id = 0;
+        device->priv_data.request_id = 1;
         memset(device->priv_data.awaiting, 0, sizeof(device->priv_data.awaiting));
     }
 
@@ -0,0 +1,101 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include "internal/deadlines.h"
+#include "internal/rate_limiter.h"
+#include "stuff/blynk_freertos_port.h"
+
+// Tokens are counted in thousandths, a message per second then earns exactly one unit per millisecond
+#define TOKEN                           1000
+
+
+static bool is_control_packet(const blynk_queued_packet_t* packet);
+
+
+void
+rate_limiter_reset(blynk_device_t* device) {
+    blynk_rate_limiter_t* limiter = &device->priv_data.limiter;
+
+    rate_limiter_refill(device);
+    limiter->tokens = limiter->burst * TOKEN;
+    limiter->next_token = 0;
+}
+
+
+void
+rate_limiter_refill(blynk_device_t* device) {
+    blynk_rate_limiter_t* limiter = &device->priv_data.limiter;
+    mutex_wrap_t wrap = {
+            .type = MUTEX_TYPE_FREERTOS,
+            .mutex = {device->control.mtx},
+    };
+
+    mutex_wrapper_take(&wrap);
+    limiter->rate = device->control.connection_config.connection.rate_limit;
+    limiter->burst = device->control.connection_config.connection.rate_burst;
+    mutex_wrapper_give(&wrap);
+
+    tick_t now = get_tick_count();
+    uint64_t earned = (uint64_t) (tick_t) (now - limiter->refilled_at) * custom_port_tick_max_rate * limiter->rate;
+    uint64_t tokens = limiter->tokens + earned;
+
+    limiter->tokens = tokens < (uint64_t) limiter->burst * TOKEN ? (uint32_t) tokens : limiter->burst * TOKEN;
+    limiter->refilled_at = now;
+}
+
+
+bool
+rate_limiter_admit(blynk_device_t* device, const blynk_queued_packet_t* packet) {
+    blynk_rate_limiter_t* limiter = &device->priv_data.limiter;
+    limiter->next_token = 0;
+
+    // A coalesced packet is never written, it does not take a token either
+    if (!limiter->rate || is_control_packet(packet) || !packet->frame_size) return true;
+
+    if (limiter->tokens >= TOKEN) {
+        limiter->tokens -= TOKEN;
+        return true;
+    }
+
+    uint32_t wait_ms = (TOKEN - limiter->tokens + limiter->rate - 1) / limiter->rate;
+    tick_t wait_ticks = (wait_ms + custom_port_tick_max_rate - 1) / custom_port_tick_max_rate;
+
+    limiter->next_token = deadline_after(wait_ticks ? wait_ticks : 1);
+    return false;
+}
+
+
+void
+rate_limiter_refund(blynk_device_t* device) {
+    blynk_rate_limiter_t* limiter = &device->priv_data.limiter;
+
+    if (limiter->rate && limiter->tokens + TOKEN <= limiter->burst * TOKEN) limiter->tokens += TOKEN;
+}
+
+
+static bool
+is_control_packet(const blynk_queued_packet_t* packet) {
+    uint8_t command = packet->frame[0];
+    return command == BLYNK_CMD_LOGIN || command == BLYNK_CMD_PING || command == BLYNK_CMD_RESPONSE;
+}
@@ -0,0 +1,597 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#include <math.h>
+#include <stdio.h>
+#include <stdbool.h>
+#include <string.h>
+
+#include "stuff/defines.h"
+#include "internal/value_encoding.h"
+
+#define TWO_TO_64                       18446744073709551616.0
+#define VELTKAMP_SPLITTER               134217729.0
+#define EIGHT_DIGITS                    100000000u
+
+#define FLOAT_MANTISSA_BITS             23
+#define FLOAT_EXPONENT_BITS             8
+#define FLOAT_EXPONENT_MASK             ((1u << FLOAT_EXPONENT_BITS) - 1)
+#define FLOAT_BIAS                      127
+#define FLOAT_POW5_INV_BITCOUNT         59
+#define FLOAT_POW5_BITCOUNT             61
+#define SHORTEST_PLAIN_MIN_POINT        (-4)
+#define SHORTEST_PLAIN_MAX_POINT        9
+
+
+static const char digit_pairs[] =
+        "00010203040506070809"
+        "10111213141516171819"
+        "20212223242526272829"
+        "30313233343536373839"
+        "40414243444546474849"
+        "50515253545556575859"
+        "60616263646566676869"
+        "70717273747576777879"
+        "80818283848586878889"
+        "90919293949596979899";
+
+
+static const uint32_t powers_of_ten[BLYNK_MAX_FLOAT_PRECISION + 1] = {
+        1, 10, 100, 1000, 10000, 100000, 1000000, 10000000,
+};
+
+
+// ceil(2^(pow5bits(i) - 1 + 59) / 5^i) and the top 61 bits of 5^i, see the Ryu paper
+static const uint64_t POW5_INV_SPLIT[31] = {
+        UINT64_C(576460752303423489), UINT64_C(461168601842738791), UINT64_C(368934881474191033),
+        UINT64_C(295147905179352826), UINT64_C(472236648286964522), UINT64_C(377789318629571618),
+        UINT64_C(302231454903657294), UINT64_C(483570327845851670), UINT64_C(386856262276681336),
+        UINT64_C(309485009821345069), UINT64_C(495176015714152110), UINT64_C(396140812571321688),
+        UINT64_C(316912650057057351), UINT64_C(507060240091291761), UINT64_C(405648192073033409),
+        UINT64_C(324518553658426727), UINT64_C(519229685853482763), UINT64_C(415383748682786211),
+        UINT64_C(332306998946228969), UINT64_C(531691198313966350), UINT64_C(425352958651173080),
+        UINT64_C(340282366920938464), UINT64_C(544451787073501542), UINT64_C(435561429658801234),
+        UINT64_C(348449143727040987), UINT64_C(557518629963265579), UINT64_C(446014903970612463),
+        UINT64_C(356811923176489971), UINT64_C(570899077082383953), UINT64_C(456719261665907162),
+        UINT64_C(365375409332725730),
+};
+
+static const uint64_t POW5_SPLIT[48] = {
+        UINT64_C(1152921504606846976), UINT64_C(1441151880758558720), UINT64_C(1801439850948198400),
+        UINT64_C(2251799813685248000), UINT64_C(1407374883553280000), UINT64_C(1759218604441600000),
+        UINT64_C(2199023255552000000), UINT64_C(1374389534720000000), UINT64_C(1717986918400000000),
+        UINT64_C(2147483648000000000), UINT64_C(1342177280000000000), UINT64_C(1677721600000000000),
+        UINT64_C(2097152000000000000), UINT64_C(1310720000000000000), UINT64_C(1638400000000000000),
+        UINT64_C(2048000000000000000), UINT64_C(1280000000000000000), UINT64_C(1600000000000000000),
+        UINT64_C(2000000000000000000), UINT64_C(1250000000000000000), UINT64_C(1562500000000000000),
+        UINT64_C(1953125000000000000), UINT64_C(1220703125000000000), UINT64_C(1525878906250000000),
+        UINT64_C(1907348632812500000), UINT64_C(1192092895507812500), UINT64_C(1490116119384765625),
+        UINT64_C(1862645149230957031), UINT64_C(1164153218269348144), UINT64_C(1455191522836685180),
+        UINT64_C(1818989403545856475), UINT64_C(2273736754432320594), UINT64_C(1421085471520200371),
+        UINT64_C(1776356839400250464), UINT64_C(2220446049250313080), UINT64_C(1387778780781445675),
+        UINT64_C(1734723475976807094), UINT64_C(2168404344971008868), UINT64_C(1355252715606880542),
+        UINT64_C(1694065894508600678), UINT64_C(2117582368135750847), UINT64_C(1323488980084844279),
+        UINT64_C(1654361225106055349), UINT64_C(2067951531382569187), UINT64_C(1292469707114105741),
+        UINT64_C(1615587133892632177), UINT64_C(2019483917365790221), UINT64_C(1262177448353618888),
+};
+
+
+static uint8_t count_digits(uint32_t value);
+
+static void encode_fixed_width(char* out, uint32_t value, uint8_t digits);
+
+static uint32_t scale_fraction(double fraction, uint32_t scale, bool odd, bool* carry);
+
+static uint8_t encode_special(char* out, bool negative, bool nan);
+
+static uint32_t shortest_digits(uint32_t ieee_mantissa, uint32_t ieee_exponent, int32_t* exponent);
+
+static uint8_t format_shortest(char* out, uint32_t digits, int32_t exponent);
+
+
+uint8_t
+encode_uint32(char* out, uint32_t value) {
+    uint8_t len = count_digits(value);
+    char* pos = out + len;
+
+    while (value >= 100) {
+        pos -= 2;
+        memcpy(pos, digit_pairs + 2 * (value % 100), 2);
+        value /= 100;
+    }
+
+    if (value >= 10) {
+        memcpy(pos - 2, digit_pairs + 2 * value, 2);
+    } else {
+        pos[-1] = (char) ('0' + value);
+    }
+
+    return len;
+}
+
+
+uint8_t
+encode_int32(char* out, int32_t value) {
+    if (value >= 0) return encode_uint32(out, (uint32_t) value);
+
+    *out = '-';
+    return 1 + encode_uint32(out + 1, 0u - (uint32_t) value);
+}
+
+
+uint8_t
+encode_uint64(char* out, uint64_t value) {
+    if (value <= UINT32_MAX) return encode_uint32(out, (uint32_t) value);
+
+    // Peel off eight digits at a time so that the rest runs on 32-bit arithmetic
+    uint8_t len = encode_uint64(out, value / EIGHT_DIGITS);
+    encode_fixed_width(out + len, (uint32_t) (value % EIGHT_DIGITS), 8);
+
+    return len + 8;
+}
+
+
+uint8_t
+encode_int64(char* out, int64_t value) {
+    if (value >= 0) return encode_uint64(out, (uint64_t) value);
+
+    *out = '-';
+    return 1 + encode_uint64(out + 1, 0u - (uint64_t) value);
+}
+
+
+uint8_t
+encode_float(char* out, float value, uint8_t precision) {
+    precision = MIN(precision, BLYNK_MAX_FLOAT_PRECISION);
+
+    if (isnan(value) || isinf(value)) return encode_special(out, signbit(value), isnan(value));
+
+    // A float has at most 24 significant bits, so its product with 10^7 is exact in a double
+    double scaled = fabs((double) value) * powers_of_ten[precision];
+
+    if (scaled >= TWO_TO_64) {
+        uint8_t len = encode_double(out, value, precision);
+        if (len) return len;
+
+        // Larger floats are whole numbers of up to 39 digits, rare enough to leave to printf
+        char text[ENCODED_FLOAT_MAX(BLYNK_MAX_FLOAT_PRECISION) + 1];
+        int written = snprintf(text, sizeof(text), "%.*f", precision, (double) value);
+        memcpy(out, text, written);
+        return written;
+    }
+
+    uint8_t len = 0;
+    if (signbit(value)) out[len++] = '-';
+
+    // Round half to even on the exact value, which is what printf does
+    uint64_t units = (uint64_t) scaled;
+    double remainder = scaled - (double) units;
+    if (remainder > 0.5 || (remainder == 0.5 && (units & 1))) units++;
+
+    len += encode_uint64(out + len, units / powers_of_ten[precision]);
+
+    if (precision) {
+        out[len++] = '.';
+        encode_fixed_width(out + len, (uint32_t) (units % powers_of_ten[precision]), precision);
+        len += precision;
+    }
+
+    return len;
+}
+
+
+uint8_t
+encode_double(char* out, double value, uint8_t precision) {
+    precision = MIN(precision, BLYNK_MAX_FLOAT_PRECISION);
+
+    if (isnan(value) || isinf(value)) return encode_special(out, signbit(value), isnan(value));
+
+    double magnitude = fabs(value);
+    if (magnitude >= TWO_TO_64) return 0;
+
+    uint8_t len = 0;
+    if (signbit(value)) out[len++] = '-';
+
+    // Both parts are exact: a double of 2^53 or more has no fraction
+    uint64_t whole = (uint64_t) magnitude;
+    double fraction = magnitude - (double) whole;
+
+    bool carry = false;
+    uint32_t units = scale_fraction(fraction, powers_of_ten[precision], precision ? false : whole & 1, &carry);
+    whole += carry;
+
+    len += encode_uint64(out + len, whole);
+
+    if (precision) {
+        out[len++] = '.';
+        encode_fixed_width(out + len, units, precision);
+        len += precision;
+    }
+
+    return len;
+}
+
+
+uint8_t
+encode_float_shortest(char* out, float value) {
+    uint32_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    uint32_t ieee_mantissa = bits & ((1u << FLOAT_MANTISSA_BITS) - 1);
+    uint32_t ieee_exponent = (bits >> FLOAT_MANTISSA_BITS) & FLOAT_EXPONENT_MASK;
+    bool negative = bits >> (FLOAT_MANTISSA_BITS + FLOAT_EXPONENT_BITS);
+
+    if (ieee_exponent == FLOAT_EXPONENT_MASK) return encode_special(out, negative, ieee_mantissa);
+
+    uint8_t len = 0;
+    if (negative) out[len++] = '-';
+
+    if (!ieee_exponent && !ieee_mantissa) {
+        out[len++] = '0';
+        return len;
+    }
+
+    int32_t exponent;
+    uint32_t digits = shortest_digits(ieee_mantissa, ieee_exponent, &exponent);
+
+    return len + format_shortest(out + len, digits, exponent);
+}
+
+
+uint8_t
+encode_double_compact(char* out, double value) {
+    uint8_t len = encode_double(out, value, BLYNK_MAX_FLOAT_PRECISION);
+
+    // Beyond 2^64 the decimals carry no information, 17 significant digits still read back exactly
+    if (!len) {
+        char text[ENCODED_DOUBLE_COMPACT_MAX + 1];
+        len = snprintf(text, sizeof(text), "%.17g", value);
+        memcpy(out, text, len);
+        return len;
+    }
+
+    return trim_decimal_zeros(out, len);
+}
+
+
+uint8_t
+trim_decimal_zeros(const char* text, uint8_t len) {
+    if (!memchr(text, '.', len)) return len;
+
+    while (text[len - 1] == '0') len--;
+    if (text[len - 1] == '.') len--;
+
+    return len;
+}
+
+
+static uint8_t
+count_digits(uint32_t value) {
+    uint8_t count = 1;
+
+    while (true) {
+        if (value < 10) return count;
+        if (value < 100) return count + 1;
+        if (value < 1000) return count + 2;
+        if (value < 10000) return count + 3;
+        value /= 10000;
+        count += 4;
+    }
+}
+
+
+static void
+encode_fixed_width(char* out, uint32_t value, uint8_t digits) {
+    char* pos = out + digits;
+
+    for (; digits >= 2; digits -= 2) {
+        pos -= 2;
+        memcpy(pos, digit_pairs + 2 * (value % 100), 2);
+        value /= 100;
+    }
+
+    if (digits) pos[-1] = (char) ('0' + value % 10);
+}
+
+
+/**
+ * Rounds fraction * scale to an integer, half to even like printf. The exact product does
+ * not fit in a double, so the fraction is split into a high part of 26 bits and a small
+ * low part, whose products with a scale of at most 24 bits are exact. The remainder of the
+ * high product and the low product are then added without error. odd tells the parity of
+ * the integer in front when scale is 1.
+ */
+static uint32_t
+scale_fraction(double fraction, uint32_t scale, bool odd, bool* carry) {
+    double split = fraction * VELTKAMP_SPLITTER;
+    double high = split - (split - fraction);
+    double low = fraction - high;
+
+    double high_product = high * scale;
+    double low_product = low * scale;
+    double high_units = floor(high_product);
+    double high_rest = high_product - high_units;
+
+    // sum + error == high_rest + low_product exactly, and the sum stays within (-1, 2)
+    double sum = high_rest + low_product;
+    double virtual_low = sum - high_rest;
+    double error = (high_rest - (sum - virtual_low)) + (low_product - virtual_low);
+
+    uint32_t units = (uint32_t) high_units;
+
+    if (sum < 0) {
+        // Just below a whole unit, which rounds up to it
+    } else {
+        double sum_units = floor(sum);
+        double rest = sum - sum_units;
+
+        units += (uint32_t) sum_units;
+
+        // A rest of zero with a negative error is also just below a whole unit. Otherwise the
+        // error is too small to move the rest across 0.5 and only breaks exact ties.
+        if (rest > 0.5 || (rest == 0.5 && (error > 0 || (error == 0 && (scale == 1 ? odd : units & 1))))) {
+            units++;
+        }
+    }
+
+    *carry = scale == 1 ? units : units == scale;
+    return *carry ? 0 : units;
+}
+
+
+static uint8_t
+encode_special(char* out, bool negative, bool nan) {
+    if (nan) {
+        memcpy(out, "nan", 3);
+        return 3;
+    }
+
+    uint8_t len = 0;
+    if (negative) out[len++] = '-';
+    memcpy(out + len, "inf", 3);
+
+    return len + 3;
+}
+
+
+static inline uint32_t
+pow5bits(int32_t e) {
+    return (uint32_t) (((e * 1217359) >> 19) + 1);
+}
+
+
+static inline uint32_t
+log10_pow2(int32_t e) {
+    return (uint32_t) ((e * 78913) >> 18);
+}
+
+
+static inline uint32_t
+log10_pow5(int32_t e) {
+    return (uint32_t) ((e * 732923) >> 20);
+}
+
+
+static inline bool
+multiple_of_pow5(uint32_t value, uint32_t p) {
+    uint32_t count = 0;
+
+    while (value && value % 5 == 0) {
+        value /= 5;
+        count++;
+    }
+
+    return count >= p;
+}
+
+
+static inline bool
+multiple_of_pow2(uint32_t value, uint32_t p) {
+    return (value & ((1u << p) - 1)) == 0;
+}
+
+
+static inline uint32_t
+mul_shift(uint32_t m, uint64_t factor, int32_t shift) {
+    uint64_t low_bits = (uint64_t) m * (uint32_t) factor;
+    uint64_t high_bits = (uint64_t) m * (uint32_t) (factor >> 32);
+
+    return (uint32_t) (((low_bits >> 32) + high_bits) >> (shift - 32));
+}
+
+
+/**
+ * Ryu for binary32, see Ulf Adams, "Ryu: fast float-to-string conversion", PLDI 2018.
+ * Returns the shortest decimal digits that round-trip and their power of ten.
+ */
+static uint32_t
+shortest_digits(uint32_t ieee_mantissa, uint32_t ieee_exponent, int32_t* exponent) {
+    int32_t e2;
+    uint32_t m2;
+
+    if (!ieee_exponent) {
+        e2 = 1 - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = ieee_mantissa;
+    } else {
+        e2 = (int32_t) ieee_exponent - FLOAT_BIAS - FLOAT_MANTISSA_BITS - 2;
+        m2 = (1u << FLOAT_MANTISSA_BITS) | ieee_mantissa;
+    }
+
+    bool accept_bounds = !(m2 & 1);
+
+    // Interval of decimal values that still round to this float, scaled by 4
+    uint32_t mv = 4 * m2;
+    uint32_t mp = 4 * m2 + 2;
+    uint32_t mm_shift = ieee_mantissa || ieee_exponent <= 1;
+    uint32_t mm = 4 * m2 - 1 - mm_shift;
+
+    uint32_t vr, vp, vm;
+    int32_t e10;
+    bool vm_trailing_zeros = false;
+    bool vr_trailing_zeros = false;
+    uint8_t last_removed = 0;
+
+    if (e2 >= 0) {
+        uint32_t q = log10_pow2(e2);
+        int32_t k = FLOAT_POW5_INV_BITCOUNT + (int32_t) pow5bits((int32_t) q) - 1;
+        int32_t i = -e2 + (int32_t) q + k;
+
+        e10 = (int32_t) q;
+        vr = mul_shift(mv, POW5_INV_SPLIT[q], i);
+        vp = mul_shift(mp, POW5_INV_SPLIT[q], i);
+        vm = mul_shift(mm, POW5_INV_SPLIT[q], i);
+
+        if (q && (vp - 1) / 10 <= vm / 10) {
+            int32_t l = FLOAT_POW5_INV_BITCOUNT + (int32_t) pow5bits((int32_t) q - 1) - 1;
+            last_removed = (uint8_t) (mul_shift(mv, POW5_INV_SPLIT[q - 1], -e2 + (int32_t) q - 1 + l) % 10);
+        }
+
+        if (q <= 9) {
+            if (mv % 5 == 0) {
+                vr_trailing_zeros = multiple_of_pow5(mv, q);
+            } else if (accept_bounds) {
+                vm_trailing_zeros = multiple_of_pow5(mm, q);
+            } else {
+                vp -= multiple_of_pow5(mp, q);
+            }
+        }
+    } else {
+        uint32_t q = log10_pow5(-e2);
+        int32_t i = -e2 - (int32_t) q;
+        int32_t k = (int32_t) pow5bits(i) - FLOAT_POW5_BITCOUNT;
+        int32_t j = (int32_t) q - k;
+
+        e10 = (int32_t) q + e2;
+        vr = mul_shift(mv, POW5_SPLIT[i], j);
+        vp = mul_shift(mp, POW5_SPLIT[i], j);
+        vm = mul_shift(mm, POW5_SPLIT[i], j);
+
+        if (q && (vp - 1) / 10 <= vm / 10) {
+            j = (int32_t) q - 1 - ((int32_t) pow5bits(i + 1) - FLOAT_POW5_BITCOUNT);
+            last_removed = (uint8_t) (mul_shift(mv, POW5_SPLIT[i + 1], j) % 10);
+        }
+
+        if (q <= 1) {
+            vr_trailing_zeros = true;
+            if (accept_bounds) {
+                vm_trailing_zeros = mm_shift == 1;
+            } else {
+                --vp;
+            }
+        } else if (q < 31) {
+            vr_trailing_zeros = multiple_of_pow2(mv, q - 1);
+        }
+    }
+
+    // Drop digits while the interval still holds a shorter number
+    int32_t removed = 0;
+    uint32_t output;
+
+    if (vm_trailing_zeros || vr_trailing_zeros) {
+        while (vp / 10 > vm / 10) {
+            vm_trailing_zeros &= vm % 10 == 0;
+            vr_trailing_zeros &= last_removed == 0;
+            last_removed = (uint8_t) (vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+
+        if (vm_trailing_zeros) {
+            while (vm % 10 == 0) {
+                vr_trailing_zeros &= last_removed == 0;
+                last_removed = (uint8_t) (vr % 10);
+                vr /= 10;
+                vp /= 10;
+                vm /= 10;
+                ++removed;
+            }
+        }
+
+        if (vr_trailing_zeros && last_removed == 5 && vr % 2 == 0) {
+            last_removed = 4;
+        }
+
+        output = vr + ((vr == vm && (!accept_bounds || !vm_trailing_zeros)) || last_removed >= 5);
+    } else {
+        while (vp / 10 > vm / 10) {
+            last_removed = (uint8_t) (vr % 10);
+            vr /= 10;
+            vp /= 10;
+            vm /= 10;
+            ++removed;
+        }
+
+        output = vr + (vr == vm || last_removed >= 5);
+    }
+
+    *exponent = e10 + removed;
+    return output;
+}
+
+
+static uint8_t
+format_shortest(char* out, uint32_t digits, int32_t exponent) {
+    char text[ENCODED_UINT32_MAX];
+    int32_t count = encode_uint32(text, digits);
+    int32_t point = count + exponent;
+    uint8_t len = 0;
+
+    if (point < SHORTEST_PLAIN_MIN_POINT || point > SHORTEST_PLAIN_MAX_POINT) {
+        int32_t scientific = point - 1;
+
+        out[len++] = text[0];
+        if (count > 1) {
+            out[len++] = '.';
+            memcpy(out + len, text + 1, count - 1);
+            len += count - 1;
+        }
+
+        out[len++] = 'e';
+        if (scientific < 0) out[len++] = '-';
+        return len + encode_uint32(out + len, scientific < 0 ? -scientific : scientific);
+    }
+
+    if (exponent >= 0) {
+        memcpy(out, text, count);
+        memset(out + count, '0', exponent);
+        return count + exponent;
+    }
+
+    if (point > 0) {
+        memcpy(out, text, point);
+        out[point] = '.';
+        memcpy(out + point + 1, text + point, count - point);
+        return count + 1;
+    }
+
+    out[len++] = '0';
+    out[len++] = '.';
+    memset(out + len, '0', -point);
+    len += -point;
+    memcpy(out + len, text, count);
+
+    return len + count;
+}
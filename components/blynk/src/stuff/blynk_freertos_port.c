@@ -22,6 +22,14 @@
  * SOFTWARE.
  */
 
+#if POSIX
+#include <time.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#endif
+
 #include "defines.h"
 #include "stuff/util.h"
 #include "stuff/blynk_freertos_port.h"
@@ -31,11 +39,66 @@
 
 #if FREERTOS
 const tick_t custom_port_tick_max_rate = 1000 / configTICK_RATE_HZ;
+#elif POSIX
+const tick_t custom_port_tick_max_rate = 1000 / POSIX_TICK_RATE_HZ;
 #else
 // Replace with your non-FreeRTOS implementation
 #endif
 
 
+#if POSIX
+typedef struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+    size_t length;
+    size_t element_size;
+    size_t head;
+    size_t count;
+    uint8_t storage[];
+} posix_queue_t;
+
+
+typedef struct {
+    pthread_mutex_t mtx;
+    pthread_cond_t cond;
+    bool raised;
+} posix_signal_t;
+
+
+typedef struct {
+    pthread_t thread;
+    uint8_t references;
+    bool finished;
+} posix_task_t;
+
+
+typedef struct {
+    task_func_t function;
+    void* parameters;
+    posix_task_t* task;
+} posix_task_args_t;
+
+
+// Guards the bookkeeping of every task handle
+static pthread_mutex_t task_mtx = PTHREAD_MUTEX_INITIALIZER;
+
+
+static void* posix_task_trampoline(void* args);
+
+static void posix_task_finished(void* task);
+
+static void posix_task_release(posix_task_t* task);
+
+static void posix_deadline_after(tick_t ticks, struct timespec* deadline);
+
+static bool posix_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mtx, tick_t ticks, const struct timespec* deadline);
+#endif
+
+
+static tick_source_t tick_source = NULL;
+
+
 static bool mutex_operation(mutex_wrap_t* wrap, bool is_take_operation);
 
 static bool handle_freertos_mutex(mutex_wrap_t* wrap, bool is_take_operation);
@@ -75,13 +138,37 @@ handle_freertos_mutex(mutex_wrap_t* wrap, bool is_take_operation) {
         return xSemaphoreGive(wrap->mutex.freertosMtx) == pdTRUE;
     }
 }
+#elif POSIX
+static bool
+handle_freertos_mutex(mutex_wrap_t* wrap, bool is_take_operation) {
+    pthread_mutex_t* mtx = (pthread_mutex_t*) wrap->mutex.freertosMtx;
+
+    if (is_take_operation) {
+        return pthread_mutex_lock(mtx) == 0;
+    } else {
+        return pthread_mutex_unlock(mtx) == 0;
+    }
+}
 #endif
 
 
+void
+set_tick_source(tick_source_t source) {
+    tick_source = source;
+}
+
+
 tick_t
 get_tick_count(void) {
+    if (tick_source) return tick_source();
+
 #if defined(FREERTOS)
     return xTaskGetTickCount();
+#elif POSIX
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    uint64_t milliseconds = (uint64_t) now.tv_sec * MS_TO_SEC + (uint64_t) now.tv_nsec / NSEC_TO_MS;
+    return (tick_t) (milliseconds / custom_port_tick_max_rate);
 #else
     return 0; // Replace with your non-FreeRTOS implementation
 #endif
@@ -92,6 +179,8 @@ tick_t
 ms_to_ticks(uint32_t milliseconds) {
 #if defined(FREERTOS)
     return pdMS_TO_TICKS(milliseconds);
+#elif POSIX
+    return milliseconds / custom_port_tick_max_rate;
 #else
     return 0; // Replace with your non-FreeRTOS implementation
 #endif
@@ -102,6 +191,26 @@ bool
 queue_send(queue_t queue, const void* item, tick_t timeout_ms) {
 #if defined(FREERTOS)
     return xQueueSend(queue, item, timeout_ms) == pdTRUE;
+#elif POSIX
+    posix_queue_t* q = (posix_queue_t*) queue;
+    struct timespec deadline;
+    posix_deadline_after(timeout_ms, &deadline);
+
+    pthread_mutex_lock(&q->mtx);
+    while (q->count == q->length) {
+        if (!posix_cond_wait(&q->not_full, &q->mtx, timeout_ms, &deadline)) {
+            pthread_mutex_unlock(&q->mtx);
+            return false;
+        }
+    }
+
+    size_t tail = (q->head + q->count) % q->length;
+    memcpy(q->storage + tail * q->element_size, item, q->element_size);
+    q->count++;
+
+    pthread_cond_signal(&q->not_empty);
+    pthread_mutex_unlock(&q->mtx);
+    return true;
 #else
     return 0; // Replace with your non-FreeRTOS implementation
 #endif
@@ -112,6 +221,15 @@ bool
 queue_reset(queue_t queue) {
 #ifdef FREERTOS
     return xQueueReset((QueueHandle_t) queue) == pdPASS;
+#elif POSIX
+    posix_queue_t* q = (posix_queue_t*) queue;
+
+    pthread_mutex_lock(&q->mtx);
+    q->head = 0;
+    q->count = 0;
+    pthread_cond_broadcast(&q->not_full);
+    pthread_mutex_unlock(&q->mtx);
+    return true;
 #else
     // Replace with your non-FreeRTOS implementation
     return false;
@@ -123,6 +241,27 @@ bool
 queue_receive(queue_t queue, void* item, tick_t timeout_ms) {
 #ifdef FREERTOS
     return xQueueReceive(queue, item, pdMS_TO_TICKS(timeout_ms)) == pdPASS;
+#elif POSIX
+    posix_queue_t* q = (posix_queue_t*) queue;
+    tick_t ticks = ms_to_ticks(timeout_ms);
+    struct timespec deadline;
+    posix_deadline_after(ticks, &deadline);
+
+    pthread_mutex_lock(&q->mtx);
+    while (q->count == 0) {
+        if (!posix_cond_wait(&q->not_empty, &q->mtx, ticks, &deadline)) {
+            pthread_mutex_unlock(&q->mtx);
+            return false;
+        }
+    }
+
+    memcpy(item, q->storage + q->head * q->element_size, q->element_size);
+    q->head = (q->head + 1) % q->length;
+    q->count--;
+
+    pthread_cond_signal(&q->not_full);
+    pthread_mutex_unlock(&q->mtx);
+    return true;
 #else
     // Replace with your non-FreeRTOS implementation
     return false;
@@ -134,8 +273,20 @@ void
 task_delete(task_handle_t task) {
 #if defined(FREERTOS)
     return vTaskDelete(task);
+#elif POSIX
+    // The task lets go of its handle in posix_task_finished, on exit and on cancellation alike
+    if (task == CURRENT_TASK_HANDLE) pthread_exit(NULL);
+
+    posix_task_t* handle = task;
+
+    // A thread that did not finish yet cannot pass posix_task_finished while the lock is held, so its id is valid
+    pthread_mutex_lock(&task_mtx);
+    if (!handle->finished) pthread_cancel(handle->thread);
+    pthread_mutex_unlock(&task_mtx);
+
+    posix_task_release(handle);
 #else
-    return 0; // Replace with your non-FreeRTOS implementation
+    // Replace with your non-FreeRTOS implementation
 #endif
 }
 
@@ -144,8 +295,16 @@ void
 task_delay(tick_t ticks) {
 #if defined(FREERTOS)
     return vTaskDelay(ticks);
+#elif POSIX
+    uint64_t milliseconds = (uint64_t) ticks * custom_port_tick_max_rate;
+    struct timespec delay = {
+            .tv_sec = (time_t) (milliseconds / MS_TO_SEC),
+            .tv_nsec = (long) (milliseconds % MS_TO_SEC) * NSEC_TO_MS,
+    };
+
+    while (nanosleep(&delay, &delay) && errno == EINTR);
 #else
-    return 0; // Replace with your non-FreeRTOS implementation
+    // Replace with your non-FreeRTOS implementation
 #endif
 }
 
@@ -156,6 +315,13 @@ create_semaphore(void) {
 
 #ifdef FREERTOS
     semaphore = xSemaphoreCreateMutex();
+#elif POSIX
+    pthread_mutex_t* mtx = malloc(sizeof(pthread_mutex_t));
+    if (mtx && pthread_mutex_init(mtx, NULL) != 0) {
+        free(mtx);
+        mtx = NULL;
+    }
+    semaphore = mtx;
 #elif defined(USING_OTHEROS)
     // Replace with your non-FreeRTOS implementation
     semaphore = OtherOS_CreateMutex();
@@ -173,6 +339,52 @@ create_task(const char* task_name, task_func_t task_function, void* task_paramet
 #ifdef FREERTOS
     return xTaskCreate(task_function, task_name, stack_size, task_parameters, BLYNK_TASK_PRIORITY, task_handle) ==
            pdPASS;
+#elif POSIX
+    (void) task_name;
+
+    posix_task_t* task = malloc(sizeof(posix_task_t));
+    posix_task_args_t* args = malloc(sizeof(posix_task_args_t));
+    if (!task || !args) {
+        free(task);
+        free(args);
+        return false;
+    }
+
+    // The handle is shared by the task and the caller if it asks for one, the last of them frees it
+    task->references = task_handle ? 2 : 1;
+    task->finished = false;
+
+    args->function = task_function;
+    args->parameters = task_parameters;
+    args->task = task;
+
+    // A FreeRTOS stack depth is far below what a host thread needs
+    size_t stack = stack_size;
+    if (stack < (size_t) POSIX_MIN_STACK_SIZE) stack = POSIX_MIN_STACK_SIZE;
+    if (stack < (size_t) PTHREAD_STACK_MIN) stack = PTHREAD_STACK_MIN;
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    pthread_attr_setstacksize(&attr, stack);
+
+    // A task without a caller reference may be gone before pthread_create returns, so the id goes through a local
+    pthread_t thread;
+    bool created = pthread_create(&thread, &attr, posix_task_trampoline, args) == 0;
+    pthread_attr_destroy(&attr);
+
+    if (!created) {
+        free(task);
+        free(args);
+        return false;
+    }
+
+    if (task_handle) {
+        task->thread = thread;
+        *task_handle = task;
+    }
+
+    return true;
 #elif defined(USING_OTHEROS)
     // Replace with your non-FreeRTOS implementation
     semaphore = OtherOS_CreateMutex();
@@ -186,10 +398,178 @@ queue_t
 create_queue(size_t queue_length, size_t element_size) {
 #ifdef FREERTOS
     return xQueueCreate(queue_length, element_size);
+#elif POSIX
+    if (!queue_length || !element_size) return NULL;
+
+    posix_queue_t* q = malloc(sizeof(posix_queue_t) + queue_length * element_size);
+    if (!q) return NULL;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&q->mtx, NULL);
+    pthread_cond_init(&q->not_empty, &attr);
+    pthread_cond_init(&q->not_full, &attr);
+    pthread_condattr_destroy(&attr);
+
+    q->length = queue_length;
+    q->element_size = element_size;
+    q->head = 0;
+    q->count = 0;
+
+    return q;
 #elif defined(USING_OTHEROS)
     // Replace with your non-FreeRTOS implementation
     semaphore = OtherOS_CreateMutex();
 #else
 #error "OS not supported!"
 #endif
-}
\ No newline at end of file
+}
+
+
+signal_t
+create_signal(void) {
+#ifdef FREERTOS
+    return xSemaphoreCreateBinary();
+#elif POSIX
+    posix_signal_t* signal = malloc(sizeof(posix_signal_t));
+    if (!signal) return NULL;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+
+    pthread_mutex_init(&signal->mtx, NULL);
+    pthread_cond_init(&signal->cond, &attr);
+    pthread_condattr_destroy(&attr);
+    signal->raised = false;
+
+    return signal;
+#else
+    // Replace with your non-FreeRTOS implementation
+    return NULL;
+#endif
+}
+
+
+bool
+signal_wait(signal_t signal, tick_t ticks) {
+#ifdef FREERTOS
+    return xSemaphoreTake((SemaphoreHandle_t) signal, ticks) == pdTRUE;
+#elif POSIX
+    posix_signal_t* s = (posix_signal_t*) signal;
+    struct timespec deadline;
+    posix_deadline_after(ticks, &deadline);
+
+    pthread_mutex_lock(&s->mtx);
+    while (!s->raised) {
+        if (!posix_cond_wait(&s->cond, &s->mtx, ticks, &deadline)) {
+            pthread_mutex_unlock(&s->mtx);
+            return false;
+        }
+    }
+
+    s->raised = false;
+    pthread_mutex_unlock(&s->mtx);
+    return true;
+#else
+    // Replace with your non-FreeRTOS implementation
+    return false;
+#endif
+}
+
+
+void
+signal_notify(signal_t signal) {
+#ifdef FREERTOS
+    xSemaphoreGive((SemaphoreHandle_t) signal);
+#elif POSIX
+    posix_signal_t* s = (posix_signal_t*) signal;
+
+    pthread_mutex_lock(&s->mtx);
+    s->raised = true;
+    pthread_cond_signal(&s->cond);
+    pthread_mutex_unlock(&s->mtx);
+#else
+    // Replace with your non-FreeRTOS implementation
+#endif
+}
+
+
+#if POSIX
+static void*
+posix_task_trampoline(void* args) {
+    posix_task_args_t task = *(posix_task_args_t*) args;
+    free(args);
+
+    pthread_cleanup_push(posix_task_finished, task.task);
+    task.function(task.parameters);
+    pthread_cleanup_pop(true);
+
+    return NULL;
+}
+
+
+static void
+posix_task_finished(void* task) {
+    posix_task_t* handle = task;
+
+    pthread_mutex_lock(&task_mtx);
+    handle->finished = true;
+    pthread_mutex_unlock(&task_mtx);
+
+    posix_task_release(handle);
+}
+
+
+static void
+posix_task_release(posix_task_t* task) {
+    pthread_mutex_lock(&task_mtx);
+    bool last = !--task->references;
+    pthread_mutex_unlock(&task_mtx);
+
+    if (last) free(task);
+}
+
+
+static void
+posix_deadline_after(tick_t ticks, struct timespec* deadline) {
+    uint64_t milliseconds = (uint64_t) ticks * custom_port_tick_max_rate;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += (time_t) (milliseconds / MS_TO_SEC);
+    deadline->tv_nsec += (long) (milliseconds % MS_TO_SEC) * NSEC_TO_MS;
+
+    if (deadline->tv_nsec >= NSEC_PER_SEC) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= NSEC_PER_SEC;
+    }
+}
+
+
+static bool
+posix_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mtx, tick_t ticks, const struct timespec* deadline) {
+    if (ticks == NO_WAITING) return false;
+
+    if (ticks == POSIX_MAX_DELAY) return pthread_cond_wait(cond, mtx) == 0;
+
+    return pthread_cond_timedwait(cond, mtx, deadline) != ETIMEDOUT;
+}
+
+
+#if !HAVE_STRLCPY
+size_t
+strlcpy(char* dst, const char* src, size_t size) {
+    size_t length = strlen(src);
+
+    if (size) {
+        size_t copy = length >= size ? size - 1 : length;
+        memcpy(dst, src, copy);
+        dst[copy] = '\0';
+    }
+
+    return length;
+}
+#endif
+#endif
@@ -22,7 +22,17 @@
  * SOFTWARE.
  */
 
+#if FREERTOS
 #include <lwip/netdb.h>
+#include <lwip/tcp.h>
+#elif POSIX
+#include <netdb.h>
+#include <fcntl.h>
+#include <netinet/tcp.h>
+#include <unistd.h>
+#include <string.h>
+#include <arpa/inet.h>
+#endif
 
 #include "stuff/util.h"
 #include "stuff/defines.h"
@@ -38,6 +48,8 @@ static void close_sockets(int* fds, int count);
 
 static void set_socket_nonblocking_opt(int socket);
 
+static void set_socket_nodelay_opt(int socket);
+
 static conn_err_t establish_socket_connection(int* conn_socket, addrinfo_t* addrinfo);
 
 static conn_err_t get_hostname_and_port(const char* server_url, char* hostname, char** port);
@@ -66,6 +78,7 @@ setup_cloud_connection(const char* server_url, int* communication_socket) {
         return CONN_EC_FAILED_ESTALE_CONN;
     }
     set_socket_nonblocking_opt(*communication_socket);
+    set_socket_nodelay_opt(*communication_socket);
 
     return CONN_EC_OK;
 }
@@ -115,7 +128,10 @@ establish_socket_connection(int* conn_socket, addrinfo_t* addrinfo) {
             continue;
         }
 
-        if (!SYSCALL_FAILED(connect(*conn_socket, cur_addr->ai_addr, cur_addr->ai_addrlen))) return CONN_EC_OK;
+        if (!SYSCALL_FAILED(connect(*conn_socket, cur_addr->ai_addr, cur_addr->ai_addrlen))) {
+            freeaddrinfo(addrinfo);
+            return CONN_EC_OK;
+        }
 
         close(*conn_socket);
     }
@@ -141,6 +157,16 @@ set_socket_nonblocking_opt(int socket) {
 }
 
 
+static void
+set_socket_nodelay_opt(int socket) {
+    // Frames are gathered into one write already, Nagle would only hold a write back until the last one is acked
+    int flag = 1;
+    if (SYSCALL_FAILED(setsockopt(socket, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)))) {
+        log_error("Error setting socket to no-delay");
+    }
+}
+
+
 conn_err_t
 configure_internal_communication(int* fds) {
     struct sockaddr_in addr;
@@ -0,0 +1,193 @@
+/*
+ * MIT License
+ *
+ * Copyright (c) 2023 CaCuCkA
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in all
+ * copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+ * SOFTWARE.
+ */
+
+#if FREERTOS
+#include <esp_partition.h>
+#include <esp_spi_flash.h>
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/stat.h>
+#endif
+
+#include "blynk.h"
+#include "stuff/log.h"
+#include "stuff/defines.h"
+
+#define TAG "[JOURNAL STORAGE]"
+
+#if FREERTOS
+
+static blynk_err_t partition_read(void* context, size_t offset, void* buffer, size_t size);
+
+static blynk_err_t partition_write(void* context, size_t offset, const void* data, size_t size);
+
+static blynk_err_t partition_erase(void* context, size_t offset, size_t size);
+
+#else
+#define ERASED_CHUNK_SIZE               256
+
+static blynk_err_t file_read(void* context, size_t offset, void* buffer, size_t size);
+
+static blynk_err_t file_write(void* context, size_t offset, const void* data, size_t size);
+
+static blynk_err_t file_erase(void* context, size_t offset, size_t size);
+
+static blynk_err_t file_sync(void* context);
+
+#endif
+
+
+blynk_err_t
+blynk_journal_partition_storage(blynk_journal_storage_t* storage, const char* label) {
+#if FREERTOS
+    const esp_partition_t* partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY,
+                                                                label);
+    if (!partition) {
+        log_error("%s: Function %s cannot find the data partition %s", TAG, __func__, label);
+        return BLYNK_EC_INVALID_OPTION;
+    }
+
+    *storage = (blynk_journal_storage_t) {
+            .context = (void*) partition,
+            .size = partition->size,
+            .sector_size = SPI_FLASH_SEC_SIZE,
+            .read = partition_read,
+            .write = partition_write,
+            .erase = partition_erase,
+            .sync = NULL,
+    };
+
+    return BLYNK_EC_OK;
+#else
+    (void) storage;
+    (void) label;
+    log_error("%s: Function %s needs the flash of an ESP8266", TAG, __func__);
+    return BLYNK_EC_INVALID_OPTION;
+#endif
+}
+
+
+blynk_err_t
+blynk_journal_file_storage(blynk_journal_storage_t* storage, const char* path, size_t size) {
+#if FREERTOS
+    (void) storage;
+    (void) path;
+    (void) size;
+    log_error("%s: Function %s needs a POSIX file system", TAG, __func__);
+    return BLYNK_EC_INVALID_OPTION;
+#else
+    size = size / BLYNK_JOURNAL_FILE_SECTOR_SIZE * BLYNK_JOURNAL_FILE_SECTOR_SIZE;
+
+    int fd = open(path, O_RDWR | O_CREAT, 0644);
+    if (SYSCALL_FAILED(fd)) {
+        log_error("%s: Function %s cannot open %s", TAG, __func__, path);
+        return BLYNK_EC_ERRNO;
+    }
+
+    // A new file reads like erased flash, so it holds no records
+    struct stat file_stat;
+    blynk_err_t err = SYSCALL_FAILED(fstat(fd, &file_stat)) ? BLYNK_EC_ERRNO : BLYNK_EC_OK;
+    size_t existing = err == BLYNK_EC_OK ? (size_t) file_stat.st_size : 0;
+
+    if (err == BLYNK_EC_OK && existing < size) {
+        err = file_erase((void*) (intptr_t) fd, existing, size - existing);
+    }
+
+    if (err != BLYNK_EC_OK) {
+        log_error("%s: Function %s cannot prepare %s", TAG, __func__, path);
+        close(fd);
+        return err;
+    }
+
+    *storage = (blynk_journal_storage_t) {
+            .context = (void*) (intptr_t) fd,
+            .size = size,
+            .sector_size = BLYNK_JOURNAL_FILE_SECTOR_SIZE,
+            .read = file_read,
+            .write = file_write,
+            .erase = file_erase,
+            .sync = file_sync,
+    };
+
+    return BLYNK_EC_OK;
+#endif
+}
+
+#if FREERTOS
+
+static blynk_err_t
+partition_read(void* context, size_t offset, void* buffer, size_t size) {
+    return esp_partition_read(context, offset, buffer, size) == ESP_OK ? BLYNK_EC_OK : BLYNK_EC_FAILED_TO_READ;
+}
+
+
+static blynk_err_t
+partition_write(void* context, size_t offset, const void* data, size_t size) {
+    return esp_partition_write(context, offset, data, size) == ESP_OK ? BLYNK_EC_OK : BLYNK_EC_FAILED_TO_WRITE;
+}
+
+
+static blynk_err_t
+partition_erase(void* context, size_t offset, size_t size) {
+    return esp_partition_erase_range(context, offset, size) == ESP_OK ? BLYNK_EC_OK : BLYNK_EC_FAILED_TO_WRITE;
+}
+
+#else
+
+static blynk_err_t
+file_read(void* context, size_t offset, void* buffer, size_t size) {
+    ssize_t count = pread((int) (intptr_t) context, buffer, size, (off_t) offset);
+    return count == (ssize_t) size ? BLYNK_EC_OK : BLYNK_EC_FAILED_TO_READ;
+}
+
+
+static blynk_err_t
+file_write(void* context, size_t offset, const void* data, size_t size) {
+    ssize_t count = pwrite((int) (intptr_t) context, data, size, (off_t) offset);
+    return count == (ssize_t) size ? BLYNK_EC_OK : BLYNK_EC_FAILED_TO_WRITE;
+}
+
+
+static blynk_err_t
+file_erase(void* context, size_t offset, size_t size) {
+    uint8_t erased[ERASED_CHUNK_SIZE];
+    memset(erased, 0xFF, sizeof(erased));
+
+    for (size_t done = 0; done < size; done += sizeof(erased)) {
+        blynk_err_t err = file_write(context, offset + done, erased, MIN(sizeof(erased), size - done));
+        if (err != BLYNK_EC_OK) return err;
+    }
+
+    return BLYNK_EC_OK;
+}
+
+
+static blynk_err_t
+file_sync(void* context) {
+    return SYSCALL_FAILED(fsync((int) (intptr_t) context)) ? BLYNK_EC_FAILED_TO_WRITE : BLYNK_EC_OK;
+}
+
+#endif
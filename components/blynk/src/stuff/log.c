@@ -132,8 +132,9 @@ stdout_callback_function(log_event_t* event) {
 static void
 init_event_function(log_event_t* event, void* user_data) {
     if (!event->timestamp) {
+        // localtime shares one static struct tm between every task that logs
         time_t t = time(NULL);
-        event->timestamp = localtime(&t);
+        event->timestamp = localtime_r(&t, &event->time);
     }
     event->userdata = user_data;
 }